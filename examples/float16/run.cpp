@@ -40,10 +40,12 @@ int main(int argc, char **argv) {
           .requiredFeatures = std::array{WGPUFeatureName_ShaderF16}.data(),
       });
   static constexpr size_t N = 10000;
-  std::array<half, N> inputArr, outputArr;
+  std::array<float, N> inputArr, outputArr;
+  std::array<half, N> outputHalf;
   for (int i = 0; i < N; ++i) {
-    inputArr[i] = half(static_cast<float>(i) / 10.0f); // dummy input data
+    inputArr[i] = static_cast<float>(i) / 10.0f; // dummy input data
   }
+  // float data is converted to f16 in bulk on upload
   Tensor input = createTensor(ctx, Shape{N}, kf16, inputArr.data());
   Tensor output = createTensor(ctx, Shape{N}, kf16);
   std::promise<void> promise;
@@ -52,12 +54,12 @@ int main(int argc, char **argv) {
                            {cdiv(N, 256), 1, 1});
   dispatchKernel(ctx, op, promise);
   wait(ctx, future);
-  toCPU(ctx, output, outputArr.data(), sizeof(outputArr));
+  toCPU(ctx, output, outputHalf.data(), sizeof(outputHalf));
+  // Convert back to float32 for printing to the screen
+  halfToFloat(outputHalf.data(), outputArr.data(), N);
 
   for (int i = 0; i < 12; ++i) {
-    // Cast to float32 for printing to the screen
-    printf("  gelu(%.2f) = %.2f\n", static_cast<float>(inputArr[i]),
-           static_cast<float>(outputArr[i]));
+    printf("  gelu(%.2f) = %.2f\n", inputArr[i], outputArr[i]);
   }
 
   printf("  ...\n\n");
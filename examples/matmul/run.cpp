@@ -3,6 +3,8 @@
 #include <future>
 #include <random>
 #include <cstdlib>
+#include <string>
+#include <vector>
 
 #include "gpu.h" // createContext, createTensor, createKernel, dispatchKernel,
                  // wait, resetCommandBuffer, toCPU
@@ -10,10 +12,92 @@
 #include "llmc/reference_impls.h" // for CPU reference implementation
 #include "utils/array_utils.h"    // show, isclose, randn, randint
 #include "utils/logging.h"        // LOG
+#include "experimental/analysis.h" // analyzeKernel, measureRoofline
 #include "experimental/wgsl.h"    // loopUnrolling
 
 using namespace gpu;
 
+/**
+ * @brief Activation functions which can be fused into a matmul epilogue.
+ */
+enum Activation { kIdentity, kGelu, kRelu, kSilu };
+
+/**
+ * @brief Elementwise epilogue fused into the output write of the tiled matmul
+ * kernels, applied while the output tile is still in registers:
+ *
+ *   C = alpha * activation(A * B^T + bias) + residual
+ *
+ * When enabled, bias (N) and residual (M, N) are bound after A, B and C, in
+ * that order.
+ *
+ * @code
+ * Epilogue epilogue = {.bias = true, .activation = kGelu, .residual = true};
+ * @endcode
+ */
+struct Epilogue {
+  bool bias = false;
+  Activation activation = kIdentity;
+  float alpha = 1.0f;
+  bool residual = false;
+};
+
+/**
+ * @brief Generates the WGSL bindings and `epilogue(outIdx, outCol, value)`
+ * function for an epilogue spec. outIdx and outCol index the output and bias
+ * arrays in units of storageType.
+ *
+ * @param[in] epilogue Epilogue spec
+ * @param[in] type Type of the values computed by the kernel, e.g. vec4<f32>
+ * @param[in] storageType Element type of the output, bias and residual arrays
+ */
+inline std::string epilogueCode(const Epilogue &epilogue,
+                                const std::string &type,
+                                const std::string &storageType) {
+  std::string code;
+  size_t binding = 3;
+  if (epilogue.bias) {
+    code += "@group(0) @binding(" + toString(binding++) +
+            ") var<storage, read_write> bias: array<" + storageType + ">;\n";
+  }
+  if (epilogue.residual) {
+    code += "@group(0) @binding(" + toString(binding++) +
+            ") var<storage, read_write> residual: array<" + storageType +
+            ">;\n";
+  }
+  code += "fn epilogue(outIdx: u32, outCol: u32, value: " + type + ") -> " +
+          type + " {\n  var result = value;\n";
+  if (epilogue.bias) {
+    code += "  result += " + type + "(bias[outCol]);\n";
+  }
+  switch (epilogue.activation) {
+  case kGelu:
+    // Same formulation as kShaderGelu
+    code += "  result = select(0.5 * result * (1.0 + tanh(0.7978845608028654 "
+            "* (result + 0.044715 * result * result * result))), result, "
+            "result > " + type + "(10.0));\n";
+    break;
+  case kRelu:
+    code += "  result = max(result, " + type + "(0.0));\n";
+    break;
+  case kSilu:
+    code += "  result = result / (1.0 + exp(-result));\n";
+    break;
+  default:
+    break;
+  }
+  if (epilogue.alpha != 1.0f) {
+    char alpha[32];
+    snprintf(alpha, sizeof(alpha), "%.9g", epilogue.alpha);
+    code += "  result = " + type + "(" + alpha + ") * result;\n";
+  }
+  if (epilogue.residual) {
+    code += "  result += " + type + "(residual[outIdx]);\n";
+  }
+  code += "  return result;\n}\n";
+  return code;
+}
+
 static const char *kShaderMatmul1 = R"(
 @group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
 @group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
@@ -39,13 +123,55 @@ inline KernelCode createMatmul1(const char *shaderTemplate, const size_t M,
                                 const size_t K, const size_t N,
                                 const Shape &workgroupSize = {256, 1, 1},
                                 NumType precision = kf32) {
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)}});
-  return {codeString, workgroupSize};
+  TemplateValues values = {{"M", toString(M)},
+                           {"K", toString(K)},
+                           {"N", toString(N)}};
+  return {cachedTemplate(shaderTemplate), std::move(values), workgroupSize,
+          precision};
+}
+
+/* Naive matmul with the shape as override constants
+ * - Same computation as kShaderMatmul1 with M, K and N declared as WGSL
+ *   override constants, set per pipeline through KernelCode::constants.
+ * - The code text is the same for every shape, so all shapes share one
+ *   shader module in the context and only the pipeline is specialized.
+ */
+static const char *kShaderMatmul1Override = R"(
+override M: u32;
+override K: u32;
+override N: u32;
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(global_invocation_id) globalID : vec3<u32>) {
+    let row = globalID.x;
+    let col = globalID.y;
+    if (row >= M || col >= N) {
+        return;
+    }
+    var total: {{precision}} = A[row * K] * B[col * K]; // assumes size >= 1
+    for (var k = 1u; k < K; k = k + 1u) {
+        // B is stored as B^T, effectively column-major
+        total += A[row * K + k] * B[col * K + k];
+    }
+    C[row * N + col] = total;
+}
+)";
+
+inline KernelCode createMatmul1Override(const char *shaderTemplate,
+                                        const size_t M, const size_t K,
+                                        const size_t N,
+                                        const Shape &workgroupSize = {256, 1,
+                                                                      1},
+                                        NumType precision = kf32) {
+  KernelCode code = {cachedTemplate(shaderTemplate), {}, workgroupSize,
+                     precision};
+  code.constants = {{"M", static_cast<double>(M)},
+                    {"K", static_cast<double>(K)},
+                    {"N", static_cast<double>(N)}};
+  return code;
 }
 
 // Shared memory cache-blocking
@@ -97,16 +223,13 @@ inline KernelCode createMatmul2(const char *shaderTemplate, const size_t M,
                                 const size_t K, const size_t N,
                                 const Shape &workgroupSize = {256, 1, 1},
                                 NumType precision = kf32) {
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString,
-             {{"{{workgroupSize}}", toString(workgroupSize)},
-              {"{{precision}}", toString(precision)},
-              {"{{M}}", toString(M)},
-              {"{{K}}", toString(K)},
-              {"{{N}}", toString(N)},
-              {"{{tileSize}}",
-               toString(static_cast<size_t>(sqrt(workgroupSize[0])))}});
-  return {codeString, workgroupSize};
+  TemplateValues values = {
+      {"M", toString(M)},
+      {"K", toString(K)},
+      {"N", toString(N)},
+      {"tileSize", toString(static_cast<size_t>(sqrt(workgroupSize[0])))}};
+  return {cachedTemplate(shaderTemplate), std::move(values), workgroupSize,
+          precision};
 }
 
 /* 1D block-tiling
@@ -209,23 +332,19 @@ inline KernelCode createMatmul3(const char *shaderTemplate, const size_t M,
   // # threads = tile A size == tile B size == # threads for computing C
   assert(/* tile A size */ BM * BK == /* tile B size */ BK * BN);
   assert(/* tile A size */ BM * BK == /* # of threads for C */ BM * BN / TM);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)}});
+  TemplateValues values = {{"M", toString(M)},
+                           {"K", toString(K)},
+                           {"N", toString(N)},
+                           {"BM", toString(BM)},
+                           {"BK", toString(BK)},
+                           {"BN", toString(BN)},
+                           {"TM", toString(TM)}};
+  KernelCode code = {cachedTemplate(shaderTemplate), std::move(values),
+                     workgroupSize, precision};
   if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    // LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
+    code.data = loopUnrolling(code.data);
   }
+  return code;
 }
 
 /* 2D block-tiling
@@ -238,6 +357,8 @@ static const char *kShaderMatmul4 = R"(
 var<workgroup> tileA: array<{{precision}}, {{BM}} * {{BK}}>;
 var<workgroup> tileB: array<{{precision}}, {{BN}} * {{BK}}>;
 
+{{EPILOGUE}}
+
 @compute @workgroup_size({{workgroupSize}})
 fn main(
     @builtin(global_invocation_id) globalID : vec3<u32>,
@@ -301,7 +422,10 @@ fn main(
 
     for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
       for (var resIdxN: u32 = 0; resIdxN < {{TN}}; resIdxN++) {
-        c[cPtr + (threadRow + resIdxM) * {{N}} + threadCol + resIdxN] = threadResults[resIdxM * {{TN}} + resIdxN];
+        c[cPtr + (threadRow + resIdxM) * {{N}} + threadCol + resIdxN] = epilogue(
+            cPtr + (threadRow + resIdxM) * {{N}} + threadCol + resIdxN,
+            cCol * {{BN}} + threadCol + resIdxN,
+            threadResults[resIdxM * {{TN}} + resIdxN]);
       }
     }
 }
@@ -313,7 +437,8 @@ inline KernelCode createMatmul4(const char *shaderTemplate, const size_t M,
                                 const size_t TM, const size_t TN,
                                 const Shape &workgroupSize = {256, 1, 1},
                                 NumType precision = kf32,
-                                bool unrolling = false) {
+                                bool unrolling = false,
+                                const Epilogue &epilogue = {}) {
   assert(BM % TM == 0);
   assert(BN % TN == 0);
   assert(K % BK == 0);
@@ -321,27 +446,24 @@ inline KernelCode createMatmul4(const char *shaderTemplate, const size_t M,
   assert(N % BN == 0);
   // # threads = tile A size == tile B size == # threads for computing C
   int num_threads = BM * BN / (TM * TN);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)},
-                          {"{{TN}}", toString(TN)},
-                          {"{{NUM_TILEA}}", toString(BM * BK / num_threads)},
-                          {"{{NUM_TILEB}}", toString(BN * BK / num_threads)}
-                          });
+  TemplateValues values = {{"M", toString(M)},
+                           {"K", toString(K)},
+                           {"N", toString(N)},
+                           {"BM", toString(BM)},
+                           {"BK", toString(BK)},
+                           {"BN", toString(BN)},
+                           {"TM", toString(TM)},
+                           {"TN", toString(TN)},
+                           {"NUM_TILEA", toString(BM * BK / num_threads)},
+                           {"NUM_TILEB", toString(BN * BK / num_threads)}};
+  values["EPILOGUE"] =
+      epilogueCode(epilogue, toString(precision), toString(precision));
+  KernelCode code = {cachedTemplate(shaderTemplate), std::move(values),
+                     workgroupSize, precision};
   if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    // LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
+    code.data = loopUnrolling(code.data);
   }
+  return code;
 }
 
 /* 2D block-tiling with vectorization
@@ -354,6 +476,8 @@ static const char *kShaderMatmulWithVectorization = R"(
 var<workgroup> tileA: array<{{precision}}, {{BM}} * {{BK}}>;
 var<workgroup> tileB: array<{{precision}}, {{BN}} * {{BK}}>;
 
+{{EPILOGUE}}
+
 @compute @workgroup_size({{workgroupSize}})
 fn main(
     @builtin(global_invocation_id) globalID : vec3<u32>,
@@ -420,7 +544,10 @@ fn main(
 
     for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
       for (var resIdxN: u32 = 0; resIdxN < {{TN4}}; resIdxN++) {
-        c[cPtr + (threadRow + resIdxM) * {{N4}} + (threadCol/4) + resIdxN] = threadResults[resIdxM * {{TN4}} + resIdxN];
+        c[cPtr + (threadRow + resIdxM) * {{N4}} + (threadCol/4) + resIdxN] = epilogue(
+            cPtr + (threadRow + resIdxM) * {{N4}} + (threadCol/4) + resIdxN,
+            cCol * {{BN4}} + (threadCol/4) + resIdxN,
+            threadResults[resIdxM * {{TN4}} + resIdxN]);
       }
     }
 }
@@ -432,7 +559,8 @@ inline KernelCode createMatmulWithVectorization(const char *shaderTemplate, cons
                                                 const size_t TM, const size_t TN,
                                                 const Shape &workgroupSize = {256, 1, 1},
                                                 NumType precision = kf32,
-                                                bool unrolling = false) {
+                                                bool unrolling = false,
+                                                const Epilogue &epilogue = {}) {
   assert(BM % TM == 0);
   assert(BN % TN == 0);
   assert(K % BK == 0);
@@ -440,30 +568,158 @@ inline KernelCode createMatmulWithVectorization(const char *shaderTemplate, cons
   assert(N % BN == 0);
   // # threads = tile A size == tile B size == # threads for computing C
   int num_threads = BM * BN / (TM * TN);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)},
-                          {"{{TN}}", toString(TN)},
-                          {"{{NUM_TILEA}}", toString(BM * BK / num_threads)},
-                          {"{{NUM_TILEB}}", toString(BN * BK / num_threads)},
-                          {"{{TN4}}", toString(TN / 4)},
-                          {"{{N4}}", toString(N / 4)},
-                          {"{{BN4}}", toString(BN / 4)},
-                          });
+  const std::string vec4Type = "vec4<" + toString(precision) + ">";
+  TemplateValues values = {{"M", toString(M)},
+                           {"K", toString(K)},
+                           {"N", toString(N)},
+                           {"BM", toString(BM)},
+                           {"BK", toString(BK)},
+                           {"BN", toString(BN)},
+                           {"TM", toString(TM)},
+                           {"TN", toString(TN)},
+                           {"NUM_TILEA", toString(BM * BK / num_threads)},
+                           {"NUM_TILEB", toString(BN * BK / num_threads)},
+                           {"TN4", toString(TN / 4)},
+                           {"N4", toString(N / 4)},
+                           {"BN4", toString(BN / 4)}};
+  values["EPILOGUE"] = epilogueCode(epilogue, vec4Type, vec4Type);
+  KernelCode code = {cachedTemplate(shaderTemplate), std::move(values),
+                     workgroupSize, precision};
   if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    // LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
+    code.data = loopUnrolling(code.data);
   }
+  return code;
+}
+
+/* 2D block-tiling with vectorization, f16 storage and f32 accumulation
+ *
+ * A, B and the workgroup tiles are stored as f16 and loaded four elements at
+ * a time along K as vec4<f16>, halving memory traffic compared to the f32
+ * kernel. Products are accumulated in f32 and the output is written as
+ * {{outPrecision}} (f16 or f32). Requires the shader-f16 feature.
+ */
+static const char *kShaderMatmulF16 = R"(
+enable f16;
+
+@group(0) @binding(0) var<storage, read_write> a: array<vec4<f16>>;
+@group(0) @binding(1) var<storage, read_write> b: array<vec4<f16>>;
+@group(0) @binding(2) var<storage, read_write> c: array<vec4<{{outPrecision}}>>;
+var<workgroup> tileA: array<vec4<f16>, {{BM}} * {{BK4}}>;
+var<workgroup> tileB: array<vec4<f16>, {{BN}} * {{BK4}}>;
+
+{{EPILOGUE}}
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupid : vec3<u32>) {
+
+    var threadResults: array<f32, {{TM}} * {{TN}}>;
+    var localM: array<vec4<f32>, {{TM}}>;
+    var localN: array<vec4<f32>, {{TN}}>;
+
+    let cRow: u32 = groupid.x;
+    let cCol: u32 = groupid.y;
+    let numThread: u32 = ({{BM}} * {{BN}}) / ({{TM}} * {{TN}});
+
+    // position of the first c element computed by the thread
+    let threadRow: u32 = (localID.x / ({{BN}} / {{TN}})) * {{TM}};
+    let threadCol: u32 = (localID.x % ({{BN}} / {{TN}})) * {{TN}};
+
+    // aPtr and bPtr are the starting positions of the tiles in a and b in
+    // units of vec4<f16>, incremented in the bkidx loop.
+    // cPtr is the starting position of the tile in c which is fixed.
+
+    var aPtr = cRow * {{BM}} * {{K4}};
+    var bPtr = cCol * {{BN}} * {{K4}};
+    let cPtr = cRow * {{BM}} * {{N4}} + cCol * {{BN4}};
+
+    for (var bkidx: u32 = 0; bkidx < {{K4}}; bkidx += {{BK4}}) {
+
+      // Load BM x BK tile of a as BM x BK4 vec4<f16>
+      for (var idx: u32 = 0; idx < {{NUM_TILEA}}; idx++) {
+        tileA[localID.x + idx * numThread] = a[aPtr + ((localID.x + idx * numThread) / {{BK4}}) * {{K4}} + (localID.x + idx * numThread) % {{BK4}}];
+      }
+      // Load BN x BK tile of b as BN x BK4 vec4<f16>
+      for (var idx: u32 = 0; idx < {{NUM_TILEB}}; idx++) {
+        tileB[localID.x + idx * numThread] = b[bPtr + ((localID.x + idx * numThread) / {{BK4}}) * {{K4}} + (localID.x + idx * numThread) % {{BK4}}];
+      }
+
+      aPtr += {{BK4}};
+      bPtr += {{BK4}};
+
+      workgroupBarrier();
+      // Compute tile, widening to f32 before the products
+      for (var dotIdx: u32 = 0; dotIdx < {{BK4}}; dotIdx = dotIdx + 1) {
+        for (var idx: u32 = 0; idx < {{TM}}; idx++) {
+          localM[idx] = vec4<f32>(tileA[(threadRow + idx) * {{BK4}} + dotIdx]);
+        }
+        for (var idx: u32 = 0; idx < {{TN}}; idx++) {
+          localN[idx] = vec4<f32>(tileB[(threadCol + idx) * {{BK4}} + dotIdx]);
+        }
+        for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
+          for (var resIdxN: u32 = 0; resIdxN < {{TN}}; resIdxN++) {
+            threadResults[resIdxM * {{TN}} + resIdxN] += dot(localM[resIdxM], localN[resIdxN]);
+          }
+        }
+      }
+      workgroupBarrier();
+    }
+
+    for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
+      for (var resIdxN: u32 = 0; resIdxN < {{TN4}}; resIdxN++) {
+        c[cPtr + (threadRow + resIdxM) * {{N4}} + (threadCol/4) + resIdxN] = vec4<{{outPrecision}}>(epilogue(
+            cPtr + (threadRow + resIdxM) * {{N4}} + (threadCol/4) + resIdxN,
+            cCol * {{BN4}} + (threadCol/4) + resIdxN,
+            vec4<f32>(threadResults[resIdxM * {{TN}} + resIdxN * 4],
+                      threadResults[resIdxM * {{TN}} + resIdxN * 4 + 1],
+                      threadResults[resIdxM * {{TN}} + resIdxN * 4 + 2],
+                      threadResults[resIdxM * {{TN}} + resIdxN * 4 + 3])));
+      }
+    }
+}
+)";
+
+inline KernelCode createMatmulF16(const char *shaderTemplate, const size_t M,
+                                  const size_t K, const size_t N, const size_t BM,
+                                  const size_t BK, const size_t BN,
+                                  const size_t TM, const size_t TN,
+                                  const Shape &workgroupSize = {256, 1, 1},
+                                  NumType outPrecision = kf16,
+                                  bool unrolling = false,
+                                  const Epilogue &epilogue = {}) {
+  assert(BM % TM == 0);
+  assert(BN % TN == 0);
+  assert(BK % 4 == 0);
+  assert(TN % 4 == 0);
+  assert(K % BK == 0);
+  assert(M % BM == 0);
+  assert(N % BN == 0);
+  int num_threads = BM * BN / (TM * TN);
+  assert((BM * BK / 4) % num_threads == 0);
+  assert((BN * BK / 4) % num_threads == 0);
+  TemplateValues values = {{"outPrecision", toString(outPrecision)},
+                           {"BM", toString(BM)},
+                           {"BN", toString(BN)},
+                           {"TM", toString(TM)},
+                           {"TN", toString(TN)},
+                           {"NUM_TILEA", toString(BM * BK / 4 / num_threads)},
+                           {"NUM_TILEB", toString(BN * BK / 4 / num_threads)},
+                           {"TN4", toString(TN / 4)},
+                           {"K4", toString(K / 4)},
+                           {"BK4", toString(BK / 4)},
+                           {"N4", toString(N / 4)},
+                           {"BN4", toString(BN / 4)}};
+  // Epilogue math is done in f32 before the conversion to the output type
+  values["EPILOGUE"] = epilogueCode(epilogue, "vec4<f32>",
+                                    "vec4<" + toString(outPrecision) + ">");
+  // enable f16 is in the template, storage types are set explicitly
+  KernelCode code = {cachedTemplate(shaderTemplate), std::move(values),
+                     workgroupSize};
+  if (unrolling) {
+    code.data = loopUnrolling(code.data);
+  }
+  return code;
 }
 
 /**
@@ -482,10 +738,7 @@ fn main(
 inline KernelCode createNoOp(const char *shaderTemplate,
                              const Shape &workgroupSize = {256, 1, 1},
                              NumType precision = kf32) {
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)}});
-  return {codeString, workgroupSize};
+  return {cachedTemplate(shaderTemplate), {}, workgroupSize, precision};
 }
 
 void initData(size_t M, size_t K, size_t N, std::unique_ptr<float[]> &inputPtr,
@@ -502,7 +755,7 @@ void initData(size_t M, size_t K, size_t N, std::unique_ptr<float[]> &inputPtr,
 
 void checkCPU(size_t M, size_t K, size_t N, std::unique_ptr<float[]> &inputPtr,
               std::unique_ptr<float[]> &weightsPtr,
-              std::unique_ptr<float[]> &outputPtr) {
+              std::unique_ptr<float[]> &outputPtr, float tol = 1e-3) {
   LOG(kDefLog, kInfo, "Computing CPU reference implementation");
   std::unique_ptr<float[]> outputRefPtr = std::make_unique<float[]>(M * N);
   ref::matmul_forward_cpu(outputRefPtr.get(), inputPtr.get(), weightsPtr.get(),
@@ -510,28 +763,37 @@ void checkCPU(size_t M, size_t K, size_t N, std::unique_ptr<float[]> &inputPtr,
   LOG(kDefLog, kInfo, "Reference Output: %s",
       show<float>(outputRefPtr.get(), M, N, "Output (Reference)").c_str());
   LOG(kDefLog, kInfo,
-      isclose(outputPtr.get(), outputRefPtr.get(), M * N) ? "CPU Check: PASS"
+      isclose(outputPtr.get(), outputRefPtr.get(), M * N, tol) ? "CPU Check: PASS"
                                                           : "CPU Check: FAIL");
 }
 
-Kernel selectMatmul(Context &ctx, int version,
-                    const Bindings</* input, weights, output */ 3> &bindings,
-                    size_t M, size_t K, size_t N) {
-  Kernel kernel;
+/**
+ * @brief Generates the code and dispatch size of a matmul version, without
+ * creating the kernel, e.g. for analyzeKernel(). Versions 4, 6, 7, 9 and 10
+ * support a fused epilogue.
+ */
+KernelCode selectMatmulCode(int version, size_t M, size_t K, size_t N,
+                            const Epilogue &epilogue, Shape &nWorkgroups) {
+  const bool hasEpilogue = epilogue.bias || epilogue.residual ||
+                           epilogue.activation != kIdentity ||
+                           epilogue.alpha != 1.0f;
+  check(!hasEpilogue || version == 4 || version == 6 || version == 7 ||
+            version == 9 || version == 10,
+        "Matmul version supports epilogues", __FILE__, __LINE__);
+  KernelCode code;
   if (version == 1) {
     Shape wgSize = {16, 16, 1};
     LOG(kDefLog, kInfo, "wgSize: %s", toString(wgSize).c_str());
     KernelCode matmul =
         createMatmul1(kShaderMatmul1, M, K, N, /*wgsize*/ wgSize);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ cdiv({M, N, 1}, wgSize));
+    nWorkgroups = cdiv({M, N, 1}, wgSize);
+    code = matmul;
   } else if (version == 2) {
     static constexpr size_t tileSize = 16;
     KernelCode matmul = createMatmul2(kShaderMatmul2, M, K, N,
                                       /*wgSize*/ {tileSize * tileSize, 1, 1});
-    kernel =
-        createKernel(ctx, matmul, bindings,
-                     /* nWorkgroups*/ cdiv({M, N, 1}, {tileSize, tileSize, 1}));
+    nWorkgroups = cdiv({M, N, 1}, {tileSize, tileSize, 1});
+    code = matmul;
   } else if (version == 3 || version == 5) {
     static constexpr size_t BM = 64;
     static constexpr size_t BK = 4;
@@ -540,17 +802,16 @@ Kernel selectMatmul(Context &ctx, int version,
         BN / BK; //  BM * BN / TM == BM * BK, therefore TM == BN / BK
     Shape wgSize = {BM * BN / TM, 1,
                     1}; // BM * BN values per workgroup, TM values per thread
-    Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
-    LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d", BM, BK, BN, TM);
+    nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
+    LOG(kDefLog, kInfo, "M: %zu, K: %zu, N: %zu", M, K, N);
+    LOG(kDefLog, kInfo, "BM: %zu, BK: %zu, BN: %zu, TM: %zu", BM, BK, BN, TM);
     LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
     LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
     KernelCode matmul = createMatmul3(kShaderMatmul3, M, K, N, BM, BK, BN, TM,
                                       /*wgSize*/ wgSize,
 				      kf32,
 				      /*Loop unrolling*/ version == 5 ? true: false);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
+    code = matmul;
   } else if (version == 4 || version == 6) {
     static constexpr size_t BM = 64;
     static constexpr size_t BK = 8;
@@ -558,17 +819,17 @@ Kernel selectMatmul(Context &ctx, int version,
     static constexpr size_t TM = BM / BK;
     static constexpr size_t TN = BN / BK;
     Shape wgSize = {(BM / TM) * (BN / TN), 1, 1}; // This is the same as BK * BK.
-    Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
-    LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
+    nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
+    LOG(kDefLog, kInfo, "M: %zu, K: %zu, N: %zu", M, K, N);
+    LOG(kDefLog, kInfo, "BM: %zu, BK: %zu, BN: %zu, TM: %zu, TN: %zu", BM, BK, BN, TM, TN);
     LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
     LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
     KernelCode matmul = createMatmul4(kShaderMatmul4, M, K, N, BM, BK, BN, TM, TN,
                                       /*wgSize*/ wgSize,
 				      kf32,
-				      /*Loop unrolling*/ version == 6 ? true: false);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
+				      /*Loop unrolling*/ version == 6 ? true: false,
+				      epilogue);
+    code = matmul;
   } else if (version == 7) {
     static constexpr size_t BM = 64;
     static constexpr size_t BK = 8;
@@ -576,25 +837,111 @@ Kernel selectMatmul(Context &ctx, int version,
     static constexpr size_t TM = BM / BK;
     static constexpr size_t TN = BN / BK;
     Shape wgSize = {(BM / TM) * (BN / TN), 1, 1}; // This is the same as BK * BK.
-    Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
-    LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
+    nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
+    LOG(kDefLog, kInfo, "M: %zu, K: %zu, N: %zu", M, K, N);
+    LOG(kDefLog, kInfo, "BM: %zu, BK: %zu, BN: %zu, TM: %zu, TN: %zu", BM, BK, BN, TM, TN);
     LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
     LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
     KernelCode matmul = createMatmulWithVectorization(kShaderMatmulWithVectorization, M, K, N, BM, BK, BN, TM, TN,
                                                       /*wgSize*/ wgSize,
 						      kf32,
-						      /*Loop unrolling*/ true);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
+						      /*Loop unrolling*/ true,
+						      epilogue);
+    code = matmul;
+  } else if (version == 9 || version == 10) {
+    // Tuned separately from version 7: f16 tiles take half the workgroup
+    // memory, so the tile is doubled along M and K.
+    static constexpr size_t BM = 128;
+    static constexpr size_t BK = 32;
+    static constexpr size_t BN = 64;
+    static constexpr size_t TM = 8;
+    static constexpr size_t TN = 8;
+    Shape wgSize = {(BM / TM) * (BN / TN), 1, 1};
+    nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
+    LOG(kDefLog, kInfo, "M: %zu, K: %zu, N: %zu", M, K, N);
+    LOG(kDefLog, kInfo, "BM: %zu, BK: %zu, BN: %zu, TM: %zu, TN: %zu", BM, BK, BN, TM, TN);
+    LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
+    LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
+    KernelCode matmul = createMatmulF16(kShaderMatmulF16, M, K, N, BM, BK, BN, TM, TN,
+                                        /*wgSize*/ wgSize,
+                                        /*outPrecision*/ version == 9 ? kf16 : kf32,
+                                        /*Loop unrolling*/ true,
+                                        epilogue);
+    code = matmul;
   } else if (version == 8) {
     Shape wgSize = {256, 1, 1};
-    Shape nWorkgroups = cdiv({M, N, 1}, {16, 16, 1});
+    nWorkgroups = cdiv({M, N, 1}, {16, 16, 1});
     KernelCode matmul = createNoOp(kShaderNoOp, /*wgsize*/ wgSize);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
+    code = matmul;
+  }
+  return code;
+}
+
+/**
+ * @brief Creates the kernel for a matmul version. Versions 4, 6, 7, 9 and 10
+ * support a fused epilogue, whose bias and residual tensors follow the
+ * input, weights and output bindings.
+ */
+template <size_t nBindings>
+Kernel selectMatmul(Context &ctx, int version,
+                    const Bindings</* input, weights, output, [bias],
+                                     [residual] */ nBindings> &bindings,
+                    size_t M, size_t K, size_t N,
+                    const Epilogue &epilogue = {}) {
+  check(nBindings == 3 + epilogue.bias + epilogue.residual,
+        "Bindings match the epilogue", __FILE__, __LINE__);
+  check((version != 9 && version != 10) ||
+            wgpuDeviceHasFeature(ctx.device, WGPUFeatureName_ShaderF16),
+        "Device supports shader-f16", __FILE__, __LINE__);
+  Shape nWorkgroups;
+  KernelCode code = selectMatmulCode(version, M, K, N, epilogue, nWorkgroups);
+  return createKernel(ctx, code, bindings, nWorkgroups);
+}
+
+/**
+ * @brief Creates the context for a matmul version, with the adapter's maximum
+ * limits so that large weights fit in a single storage binding, requesting
+ * shader-f16 for the f16 storage versions.
+ */
+Context createMatmulContext(int version) {
+  ContextOptions options;
+  if (version == 9 || version == 10) {
+    options.features = {WGPUFeatureName_ShaderF16};
+  }
+  return createContext(options);
+}
+
+/**
+ * @brief Creates a kf32 or kf16 tensor from float data, converting to half on
+ * the host for kf16.
+ */
+Tensor createTensorFromFloat(Context &ctx, const Shape &shape, NumType dtype,
+                             float *data) {
+  if (dtype == kf32) {
+    return createTensor(ctx, shape, kf32, data);
+  }
+  std::unique_ptr<half[]> dataHalf = std::make_unique<half[]>(size(shape));
+  for (size_t i = 0; i < size(shape); ++i) {
+    dataHalf[i] = halfFromFloat(data[i]);
+  }
+  return createTensor(ctx, shape, kf16, dataHalf.get());
+}
+
+/**
+ * @brief Copies a kf32 or kf16 tensor to float data, converting from half on
+ * the host for kf16.
+ */
+void toCPUAsFloat(Context &ctx, Tensor &tensor, NumType dtype, float *data) {
+  if (dtype == kf32) {
+    toCPU(ctx, tensor, data, size(tensor.shape) * sizeof(float));
+    return;
+  }
+  std::unique_ptr<half[]> dataHalf =
+      std::make_unique<half[]>(size(tensor.shape));
+  toCPU(ctx, tensor, dataHalf.get(), size(tensor.shape) * sizeof(half));
+  for (size_t i = 0; i < size(tensor.shape); ++i) {
+    data[i] = halfToFloat(dataHalf[i]);
   }
-  return kernel;
 }
 
 void runTest(int version, size_t M, size_t K, size_t N,
@@ -602,14 +949,31 @@ void runTest(int version, size_t M, size_t K, size_t N,
              std::unique_ptr<float[]> &weightsPtr,
              std::unique_ptr<float[]> &outputPtr) {
 
+  // f16 storage versions read f16 inputs and write f16 (9) or f32 (10) output
+  const bool isF16 = version == 9 || version == 10;
+  const NumType outputType = version == 9 ? kf16 : kf32;
+
   // Allocate GPU buffers and copy data
-  Context ctx = createContext();
-  Tensor input = createTensor(ctx, Shape{M, K}, kf32, inputPtr.get());
-  Tensor weights =
-      createTensor(ctx, Shape{N, K}, kf32, weightsPtr.get()); // column-major
+  Context ctx = createMatmulContext(version);
+  const NumType inputType = isF16 ? kf16 : kf32;
+  Tensor input = createTensorFromFloat(ctx, Shape{M, K}, inputType, inputPtr.get());
+  Tensor weights = createTensorFromFloat(ctx, Shape{N, K}, inputType,
+                                         weightsPtr.get()); // column-major
+  const size_t largest = std::max(N * K, M * N) * sizeof(float);
+  check(largest <= ctx.limits.maxStorageBufferBindingSize,
+        "Matmul operands fit the storage buffer binding size limit", __FILE__,
+        __LINE__);
 
   constexpr size_t nIter = 30;
 
+  // Check the kernel's resources against the device limits before creating it
+  Shape nWorkgroups;
+  KernelReport report = analyzeKernel(
+      ctx, selectMatmulCode(version, M, K, N, {}, nWorkgroups), nWorkgroups);
+  LOG(kDefLog, kInfo, "Kernel resources:\n%s", toString(report).c_str());
+  check(report.issues.empty(), "Kernel fits the device limits", __FILE__,
+        __LINE__);
+
   // Initialize Kernel and bind GPU buffers
 
 
@@ -620,13 +984,13 @@ void runTest(int version, size_t M, size_t K, size_t N,
   std::array<Tensor, nIter> outputs;
   for (int i = 0; i < nIter; i++) {
     futures[i] = promises[i].get_future();
-    outputs[i] = createTensor(ctx, Shape{M, N}, kf32);
-    kernels[i] = selectMatmul(ctx, version, {input, weights, outputs[i]}, M, K, N);
+    outputs[i] = createTensor(ctx, Shape{M, N}, outputType);
+    kernels[i] = selectMatmul(ctx, version, Bindings{input, weights, outputs[i]}, M, K, N);
   }
 
   printf("[ Press enter to start tests ... ]\n");
   getchar();
-  LOG(kDefLog, kInfo, "Dispatching Kernel version %d, %d iterations ...",
+  LOG(kDefLog, kInfo, "Dispatching Kernel version %d, %zu iterations ...",
       version, nIter);
 
   // Dispatch kernel nIter times
@@ -649,20 +1013,196 @@ void runTest(int version, size_t M, size_t K, size_t N,
                  1000000000.0 * static_cast<float>(nIter);
 
   LOG(kDefLog, kInfo, "Copying result to CPU");
-  toCPU(ctx, outputs[0], outputPtr.get(), M * N * sizeof(float));
+  toCPUAsFloat(ctx, outputs[0], outputType, outputPtr.get());
   LOG(kDefLog, kInfo, "%s",
       show<float>(outputPtr.get(), M, N, "Output[0]").c_str());
 
   LOG(kDefLog, kInfo, "\n\n===================================================================="
-      "============\nExecution Time: (M = %d, K = %d, N = %d) x %d iterations "
+      "============\nExecution Time: (M = %zu, K = %zu, N = %zu) x %zu iterations "
       ":\n%.1f "
       "milliseconds / dispatch ~ %.2f "
       "GFLOPS\n================================================================"
       "================\n\n",
       M, K, N, nIter, duration.count() / static_cast<double>(nIter) / 1000.0 /* us -> ms */, gflops);
+
+  // Minimum traffic: operands read once, output written once
+  const double inputBytes = isF16 ? sizeof(half) : sizeof(float);
+  const double outputBytes = outputType == kf16 ? sizeof(half) : sizeof(float);
+  const KernelCost cost = {2.0 * M * N * K,
+                           (M * K + N * K) * inputBytes + M * N * outputBytes};
+  addTimings(report, cost, duration.count() / 1e6 / nIter,
+             measureRoofline(ctx));
+  LOG(kDefLog, kInfo, "Roofline:\n%s", toString(report).c_str());
+}
+
+/**
+ * @brief Reports the resources of every matmul version against the device
+ * limits, without running them.
+ */
+void analyzeVersions(size_t M, size_t K, size_t N) {
+  Context ctx = createMatmulContext(7);
+  for (int version = 1; version <= 10; ++version) {
+    Shape nWorkgroups;
+    KernelCode code = selectMatmulCode(version, M, K, N, {}, nWorkgroups);
+    KernelReport report = analyzeKernel(ctx, code, nWorkgroups);
+    LOG(kDefLog, kInfo, "Version %d (M = %zu, K = %zu, N = %zu):\n%s",
+        version, M, K, N, toString(report).c_str());
+  }
+}
+
+/**
+ * @brief Checks a fused bias + activation + alpha + residual epilogue against
+ * the llmc CPU reference functions chained one after another.
+ */
+void checkEpilogue(int version, Activation activation) {
+  static constexpr size_t M = 256;
+  static constexpr size_t K = 128;
+  static constexpr size_t N = 512;
+  const NumType inputType = version == 9 || version == 10 ? kf16 : kf32;
+  const NumType outputType = version == 9 ? kf16 : kf32;
+  const Epilogue epilogue = {.bias = true,
+                             .activation = activation,
+                             .alpha = 0.5f,
+                             .residual = true};
+  std::mt19937 gen(271828);
+  std::vector<float> inputArr(M * K), weightsArr(N * K), biasArr(N),
+      residualArr(M * N);
+  randn(inputArr.data(), inputArr.size(), gen);
+  randn(weightsArr.data(), weightsArr.size(), gen);
+  randn(biasArr.data(), biasArr.size(), gen);
+  randn(residualArr.data(), residualArr.size(), gen);
+  // Round to the storage precision so the reference sees the same values
+  auto roundToType = [](std::vector<float> &arr, NumType dtype) {
+    if (dtype == kf16) {
+      for (float &value : arr) {
+        value = halfToFloat(halfFromFloat(value));
+      }
+    }
+  };
+  roundToType(inputArr, inputType);
+  roundToType(weightsArr, inputType);
+  roundToType(biasArr, outputType);
+  roundToType(residualArr, outputType);
+
+  Context ctx = createMatmulContext(version);
+  Tensor input =
+      createTensorFromFloat(ctx, Shape{M, K}, inputType, inputArr.data());
+  Tensor weights =
+      createTensorFromFloat(ctx, Shape{N, K}, inputType, weightsArr.data());
+  Tensor bias = createTensorFromFloat(ctx, Shape{N}, outputType, biasArr.data());
+  Tensor residual =
+      createTensorFromFloat(ctx, Shape{M, N}, outputType, residualArr.data());
+  Tensor output = createTensor(ctx, Shape{M, N}, outputType);
+  Kernel kernel =
+      selectMatmul(ctx, version, Bindings{input, weights, output, bias, residual},
+                   M, K, N, epilogue);
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, kernel, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(M * N);
+  toCPUAsFloat(ctx, output, outputType, outputArr.data());
+
+  // Unfused reference: matmul + bias -> activation -> alpha -> residual
+  std::vector<float> matmulRef(M * N), activationRef(M * N), outputRef(M * N);
+  ref::matmul_forward_cpu(matmulRef.data(), inputArr.data(), weightsArr.data(),
+                          biasArr.data(), 1, M, K, N);
+  for (size_t i = 0; i < M * N; ++i) {
+    const float x = matmulRef[i];
+    activationRef[i] = activation == kRelu ? std::max(x, 0.0f)
+                       : activation == kSilu ? x / (1.0f + expf(-x))
+                                             : x;
+  }
+  if (activation == kGelu) {
+    ref::gelu_forward_cpu(activationRef.data(), matmulRef.data(), M * N);
+  }
+  for (size_t i = 0; i < M * N; ++i) {
+    activationRef[i] *= epilogue.alpha;
+  }
+  ref::residual_forward_cpu(outputRef.data(), activationRef.data(),
+                            residualArr.data(), M * N);
+
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), M, N, "Output (Fused)").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputRef.data(), M, N, "Output (Reference)").c_str());
+  LOG(kDefLog, kInfo,
+      isclose(outputArr.data(), outputRef.data(), M * N,
+              outputType == kf16 ? 5e-2 : 1e-3)
+          ? "Epilogue CPU Check: PASS"
+          : "Epilogue CPU Check: FAIL");
+}
+
+/**
+ * @brief Compares the naive matmul with the shape substituted into the WGSL
+ * text (one shader module per shape) against the shape passed as override
+ * constants (one shader module for all shapes), reporting kernel creation
+ * time, which includes shader compilation, and dispatch time per shape.
+ */
+void sweepShapes() {
+  static constexpr size_t nIter = 10;
+  static const Shape kShapes[] = {{64, 64, 64},     {128, 256, 128},
+                                  {256, 128, 512},  {384, 768, 384},
+                                  {512, 512, 512},  {768, 256, 1024},
+                                  {1024, 512, 256}, {1024, 1024, 1024}};
+  const Shape wgSize = {16, 16, 1};
+  Context ctx = createContext();
+  LOG(kDefLog, kInfo,
+      "Shape sweep, naive matmul (create = kernel creation incl. compile)");
+  double totalCreate[2] = {0.0, 0.0};
+  for (const Shape &shape : kShapes) {
+    const size_t M = shape[0], K = shape[1], N = shape[2];
+    std::unique_ptr<float[]> inputPtr = std::make_unique<float[]>(M * K);
+    std::unique_ptr<float[]> weightsPtr = std::make_unique<float[]>(N * K);
+    initData(M, K, N, inputPtr, weightsPtr);
+    Tensor input = createTensor(ctx, Shape{M, K}, kf32, inputPtr.get());
+    Tensor weights = createTensor(ctx, Shape{N, K}, kf32, weightsPtr.get());
+    Tensor output = createTensor(ctx, Shape{M, N}, kf32);
+    double createMs[2], runMs[2];
+    for (int useOverrides = 0; useOverrides < 2; ++useOverrides) {
+      auto start = std::chrono::high_resolution_clock::now();
+      KernelCode code =
+          useOverrides
+              ? createMatmul1Override(kShaderMatmul1Override, M, K, N, wgSize)
+              : createMatmul1(kShaderMatmul1, M, K, N, wgSize);
+      Kernel kernel = createKernel(ctx, code, Bindings{input, weights, output},
+                                   cdiv({M, N, 1}, wgSize));
+      auto created = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < nIter; ++i) {
+        std::promise<void> promise;
+        std::future<void> future = promise.get_future();
+        dispatchKernel(ctx, kernel, promise);
+        wait(ctx, future);
+        resetCommandBuffer(ctx.device, kernel);
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      createMs[useOverrides] =
+          std::chrono::duration<double, std::milli>(created - start).count();
+      runMs[useOverrides] =
+          std::chrono::duration<double, std::milli>(end - created).count() /
+          nIter;
+      totalCreate[useOverrides] += createMs[useOverrides];
+    }
+    LOG(kDefLog, kInfo,
+        "(M = %4zu, K = %4zu, N = %4zu) text: create %7.2f ms, run %7.3f ms"
+        " | overrides: create %7.2f ms, run %7.3f ms",
+        M, K, N, createMs[0], runMs[0], createMs[1], runMs[1]);
+  }
+  LOG(kDefLog, kInfo,
+      "Total kernel creation: text %.2f ms, overrides %.2f ms (%zu shader "
+      "modules in the context)",
+      totalCreate[0], totalCreate[1], ctx.modulePool.data.size());
 }
 
 int main() {
+  // MATMUL_SWEEP=1 compares text substitution of the shape against override
+  // constants across a sweep of shapes instead
+  if (getenv("MATMUL_SWEEP") != NULL) {
+    sweepShapes();
+    LOG(kDefLog, kInfo, "Done.");
+    return 0;
+  }
+
   char* version_str = getenv("MATMUL_VERSION");
   int version = version_str == NULL ? 7 : atoi(version_str);
     // 1 == naive matmul
@@ -673,6 +1213,22 @@ int main() {
     // 6 == 2D blocktiling with loop unrolling
     // 7 == 2D blocktiling with loop unrolling and vectorization
     // 8 == No-Op
+    // 9 == 2D blocktiling with vectorization, f16 storage, f32 accumulation
+    // 10 == same as 9 with f32 output
+
+  // MATMUL_EPILOGUE=none|gelu|relu|silu checks a fused bias, activation,
+  // alpha and residual epilogue against the chained CPU reference instead
+  char* epilogue_str = getenv("MATMUL_EPILOGUE");
+  if (epilogue_str != NULL) {
+    std::string name(epilogue_str);
+    Activation activation = name == "gelu"   ? kGelu
+                            : name == "relu" ? kRelu
+                            : name == "silu" ? kSilu
+                                             : kIdentity;
+    checkEpilogue(version, activation);
+    LOG(kDefLog, kInfo, "Done.");
+    return 0;
+  }
 
   size_t M, K, N;  // Matrix dimensions
   static constexpr int kTestSize = 2;
@@ -693,16 +1249,35 @@ int main() {
     N = 2 * 4096;
   }
 
+  // MATMUL_ANALYZE=1 reports the resources of all versions against the device
+  // limits instead
+  if (getenv("MATMUL_ANALYZE") != NULL) {
+    analyzeVersions(M, K, N);
+    LOG(kDefLog, kInfo, "Done.");
+    return 0;
+  }
+
   std::unique_ptr<float[]> inputPtr = std::make_unique<float[]>(M * K);
   std::unique_ptr<float[]> weightsPtr = std::make_unique<float[]>(N * K);
   std::unique_ptr<float[]> outputPtr = std::make_unique<float[]>(M * N);
 
   initData(M, K, N, inputPtr, weightsPtr);
+  if (version == 9 || version == 10) {
+    // Round inputs to f16 so the CPU reference sees the same values
+    for (size_t i = 0; i < M * K; ++i) {
+      inputPtr[i] = halfToFloat(halfFromFloat(inputPtr[i]));
+    }
+    for (size_t i = 0; i < N * K; ++i) {
+      weightsPtr[i] = halfToFloat(halfFromFloat(weightsPtr[i]));
+    }
+  }
   runTest(version, M, K, N, inputPtr, weightsPtr, outputPtr);
 
   if constexpr (kTestSize <= 1) {
-    // Check result with CPU reference implementation for tiny/small tests
-    checkCPU(M, K, N, inputPtr, weightsPtr, outputPtr);
+    // Check result with CPU reference implementation for tiny/small tests.
+    // f16 output is compared with a tolerance matching its rounding error.
+    checkCPU(M, K, N, inputPtr, weightsPtr, outputPtr,
+             version == 9 ? 5e-2 : 1e-3);
   }
 
   LOG(kDefLog, kInfo, "Done.");
@@ -0,0 +1,368 @@
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "gpu.h" // createContext, createTensor, createKernel, dispatchKernel,
+                 // wait, resetCommandBuffer, toCPU
+
+#include "llmc/reference_impls.h"  // for CPU reference implementation
+#include "numeric_types/quantize.h" // quantizeInt8, quantizeInt4
+#include "utils/array_utils.h"      // show, isclose, randn
+#include "utils/logging.h"          // LOG
+
+using namespace gpu;
+
+/* Dequantization of int8 weights with per-channel scales
+ *
+ * Each u32 word holds 4 consecutive weights of a row, returned as one vec4.
+ */
+static const char *kDequantInt8 = R"(
+fn dequantWord(n: u32, i: u32) -> array<vec4<f32>, 1> {
+  let word = bitcast<i32>(w[n * {{KW}} + i]);
+  return array<vec4<f32>, 1>(scales[n] * vec4<f32>(
+      f32(extractBits(word, 0u, 8u)), f32(extractBits(word, 8u, 8u)),
+      f32(extractBits(word, 16u, 8u)), f32(extractBits(word, 24u, 8u))));
+}
+)";
+
+/* Dequantization of int4 weights with group-wise scales and zero points
+ *
+ * Each u32 word holds 8 consecutive weights of a row, returned as two vec4.
+ * Groups are a multiple of 8 values so a word never straddles two groups.
+ */
+static const char *kDequantInt4 = R"(
+fn dequantWord(n: u32, i: u32) -> array<vec4<f32>, 2> {
+  let word = w[n * {{KW}} + i];
+  let g = (n * {{K}} + i * 8u) / {{GROUP_SIZE}};
+  let scale = scales[g];
+  let zero = f32(extractBits(zeros[g / 8u], 4u * (g % 8u), 4u));
+  let lo = vec4<f32>(f32(extractBits(word, 0u, 4u)), f32(extractBits(word, 4u, 4u)),
+                     f32(extractBits(word, 8u, 4u)), f32(extractBits(word, 12u, 4u)));
+  let hi = vec4<f32>(f32(extractBits(word, 16u, 4u)), f32(extractBits(word, 20u, 4u)),
+                     f32(extractBits(word, 24u, 4u)), f32(extractBits(word, 28u, 4u)));
+  return array<vec4<f32>, 2>(scale * (lo - zero), scale * (hi - zero));
+}
+)";
+
+/* Matrix-vector product with quantized weights for small batch sizes
+ *
+ * One workgroup per (output column, batch row). Threads stride over the
+ * packed words of a weight row, dequantizing in registers, followed by a tree
+ * reduction in workgroup memory.
+ */
+static const char *kShaderQuantizedGemv = R"(
+@group(0) @binding(0) var<storage, read_write> x: array<vec4<f32>>;
+@group(0) @binding(1) var<storage, read_write> w: array<u32>;
+@group(0) @binding(2) var<storage, read_write> scales: array<f32>;
+@group(0) @binding(3) var<storage, read_write> zeros: array<u32>;
+@group(0) @binding(4) var<storage, read_write> out: array<f32>;
+var<workgroup> partial: array<f32, {{WG}}>;
+
+{{DEQUANT}}
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    let n = groupID.x;
+    let m = groupID.y;
+    var acc: f32 = 0.0;
+    for (var i: u32 = localID.x; i < {{KW}}; i = i + {{WG}}) {
+      var v = dequantWord(n, i);
+      for (var j: u32 = 0; j < {{VEC_PER_WORD}}; j++) {
+        acc += dot(x[m * {{K4}} + i * {{VEC_PER_WORD}} + j], v[j]);
+      }
+    }
+    partial[localID.x] = acc;
+    workgroupBarrier();
+    for (var stride: u32 = {{WG}} / 2; stride > 0; stride = stride / 2) {
+      if (localID.x < stride) {
+        partial[localID.x] += partial[localID.x + stride];
+      }
+      workgroupBarrier();
+    }
+    if (localID.x == 0) {
+      out[m * {{N}} + n] = partial[0];
+    }
+}
+)";
+
+/* 2D block-tiling matmul with quantized weights for larger batch sizes
+ *
+ * Packed weight words are dequantized while loading the weight tile, so
+ * workgroup memory and the inner loop only see f32.
+ */
+static const char *kShaderQuantizedMatmul = R"(
+@group(0) @binding(0) var<storage, read_write> x: array<vec4<f32>>;
+@group(0) @binding(1) var<storage, read_write> w: array<u32>;
+@group(0) @binding(2) var<storage, read_write> scales: array<f32>;
+@group(0) @binding(3) var<storage, read_write> zeros: array<u32>;
+@group(0) @binding(4) var<storage, read_write> out: array<f32>;
+var<workgroup> tileA: array<vec4<f32>, {{BM}} * {{BK4}}>;
+var<workgroup> tileB: array<vec4<f32>, {{BN}} * {{BK4}}>;
+
+{{DEQUANT}}
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    var threadResults: array<f32, {{TM}} * {{TN}}>;
+
+    let cRow: u32 = groupID.x;
+    let cCol: u32 = groupID.y;
+    let numThread: u32 = ({{BM}} * {{BN}}) / ({{TM}} * {{TN}});
+
+    // position of the first output element computed by the thread
+    let threadRow: u32 = (localID.x / ({{BN}} / {{TN}})) * {{TM}};
+    let threadCol: u32 = (localID.x % ({{BN}} / {{TN}})) * {{TN}};
+
+    for (var bk: u32 = 0; bk < {{K}}; bk = bk + {{BK}}) {
+      // Load BM x BK tile of x as BM x BK4 vec4
+      for (var idx: u32 = 0; idx < {{NUM_TILEA}}; idx++) {
+        let t = localID.x + idx * numThread;
+        tileA[t] = x[(cRow * {{BM}} + t / {{BK4}}) * {{K4}} + bk / 4 + t % {{BK4}}];
+      }
+      // Load BN x BK tile of w as BN x BKW packed words, dequantized on the fly
+      for (var idx: u32 = 0; idx < {{NUM_TILEB}}; idx++) {
+        let t = localID.x + idx * numThread;
+        let row = t / {{BKW}};
+        let col = t % {{BKW}};
+        var v = dequantWord(cCol * {{BN}} + row, bk / {{VALUES_PER_WORD}} + col);
+        for (var j: u32 = 0; j < {{VEC_PER_WORD}}; j++) {
+          tileB[row * {{BK4}} + col * {{VEC_PER_WORD}} + j] = v[j];
+        }
+      }
+      workgroupBarrier();
+      for (var dotIdx: u32 = 0; dotIdx < {{BK4}}; dotIdx++) {
+        for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
+          for (var resIdxN: u32 = 0; resIdxN < {{TN}}; resIdxN++) {
+            threadResults[resIdxM * {{TN}} + resIdxN] +=
+                dot(tileA[(threadRow + resIdxM) * {{BK4}} + dotIdx],
+                    tileB[(threadCol + resIdxN) * {{BK4}} + dotIdx]);
+          }
+        }
+      }
+      workgroupBarrier();
+    }
+
+    for (var resIdxM: u32 = 0; resIdxM < {{TM}}; resIdxM++) {
+      for (var resIdxN: u32 = 0; resIdxN < {{TN}}; resIdxN++) {
+        out[(cRow * {{BM}} + threadRow + resIdxM) * {{N}} + cCol * {{BN}} + threadCol + resIdxN] =
+            threadResults[resIdxM * {{TN}} + resIdxN];
+      }
+    }
+}
+)";
+
+/**
+ * @brief Number of weights packed in each u32 word of a quantized type.
+ */
+inline size_t valuesPerWord(NumType weightType) {
+  assert(weightType == kq8 || weightType == kq4);
+  return weightType == kq8 ? 4 : 8;
+}
+
+/**
+ * @brief Substitutes the dequantization function for the weight type and the
+ * placeholders shared by the quantized kernels.
+ */
+inline std::string quantizedShader(const char *shaderTemplate,
+                                   NumType weightType, size_t K, size_t N,
+                                   size_t groupSize) {
+  const size_t vpw = valuesPerWord(weightType);
+  std::string codeString(shaderTemplate);
+  replaceAll(codeString, "{{DEQUANT}}",
+             weightType == kq8 ? kDequantInt8 : kDequantInt4);
+  replaceAll(codeString, {{"{{K}}", toString(K)},
+                          {"{{N}}", toString(N)},
+                          {"{{K4}}", toString(K / 4)},
+                          {"{{KW}}", toString(K / vpw)},
+                          {"{{GROUP_SIZE}}", toString(groupSize)},
+                          {"{{VALUES_PER_WORD}}", toString(vpw)},
+                          {"{{VEC_PER_WORD}}", toString(vpw / 4)}});
+  return codeString;
+}
+
+inline KernelCode createQuantizedGemv(const char *shaderTemplate,
+                                      NumType weightType, size_t K, size_t N,
+                                      size_t groupSize,
+                                      const Shape &workgroupSize = {128, 1, 1}) {
+  assert(K % valuesPerWord(weightType) == 0);
+  std::string codeString =
+      quantizedShader(shaderTemplate, weightType, K, N, groupSize);
+  replaceAll(codeString, "{{WG}}", toString(workgroupSize[0]));
+  return {codeString, workgroupSize};
+}
+
+inline KernelCode createQuantizedMatmul(const char *shaderTemplate,
+                                        NumType weightType, size_t M, size_t K,
+                                        size_t N, size_t BM, size_t BK,
+                                        size_t BN, size_t TM, size_t TN,
+                                        size_t groupSize,
+                                        const Shape &workgroupSize) {
+  const size_t vpw = valuesPerWord(weightType);
+  assert(BM % TM == 0);
+  assert(BN % TN == 0);
+  assert(BK % vpw == 0);
+  assert(K % BK == 0);
+  assert(M % BM == 0);
+  assert(N % BN == 0);
+  const size_t numThreads = BM * BN / (TM * TN);
+  assert((BM * BK / 4) % numThreads == 0);
+  assert((BN * BK / vpw) % numThreads == 0);
+  std::string codeString =
+      quantizedShader(shaderTemplate, weightType, K, N, groupSize);
+  replaceAll(codeString, {{"{{BM}}", toString(BM)},
+                          {"{{BN}}", toString(BN)},
+                          {"{{BK}}", toString(BK)},
+                          {"{{TM}}", toString(TM)},
+                          {"{{TN}}", toString(TN)},
+                          {"{{BK4}}", toString(BK / 4)},
+                          {"{{BKW}}", toString(BK / vpw)},
+                          {"{{NUM_TILEA}}", toString(BM * BK / 4 / numThreads)},
+                          {"{{NUM_TILEB}}", toString(BN * BK / vpw / numThreads)}});
+  return {codeString, workgroupSize};
+}
+
+/**
+ * @brief GEMV for batch sizes that do not fill a tile, tiled matmul otherwise.
+ */
+Kernel selectQuantizedMatmul(Context &ctx, NumType weightType,
+                             const Bindings</* x, w, scales, zeros, out */ 5>
+                                 &bindings,
+                             size_t M, size_t K, size_t N, size_t groupSize) {
+  static constexpr size_t BM = 32;
+  if (M % BM != 0) {
+    Shape wgSize = {128, 1, 1};
+    KernelCode gemv = createQuantizedGemv(kShaderQuantizedGemv, weightType, K,
+                                          N, groupSize, wgSize);
+    return createKernel(ctx, gemv, bindings, /*nWorkgroups*/ {N, M, 1});
+  }
+  static constexpr size_t BK = 32;
+  static constexpr size_t BN = 64;
+  static constexpr size_t TM = 4;
+  static constexpr size_t TN = 4;
+  Shape wgSize = {(BM / TM) * (BN / TN), 1, 1};
+  KernelCode matmul =
+      createQuantizedMatmul(kShaderQuantizedMatmul, weightType, M, K, N, BM,
+                            BK, BN, TM, TN, groupSize, wgSize);
+  return createKernel(ctx, matmul, bindings,
+                      /*nWorkgroups*/ {cdiv(M, BM), cdiv(N, BN), 1});
+}
+
+void runTest(Context &ctx, NumType weightType, size_t M, size_t K, size_t N,
+             size_t groupSize, const std::vector<float> &weights) {
+  const size_t vpw = valuesPerWord(weightType);
+  const size_t nGroups = weightType == kq8 ? N : N * K / groupSize;
+  const size_t nZeros = weightType == kq8 ? 1 : cdiv(nGroups, 8);
+  std::vector<uint32_t> packed(N * K / vpw);
+  std::vector<float> scales(nGroups);
+  std::vector<uint32_t> zeros(nZeros, 0);
+  std::vector<float> dequantized(N * K);
+  if (weightType == kq8) {
+    quantizeInt8(weights.data(), N, K, packed.data(), scales.data());
+    dequantizeInt8(packed.data(), scales.data(), N, K, dequantized.data());
+  } else {
+    quantizeInt4(weights.data(), N, K, groupSize, packed.data(), scales.data(),
+                 zeros.data());
+    dequantizeInt4(packed.data(), scales.data(), zeros.data(), N, K,
+                   groupSize, dequantized.data());
+  }
+
+  std::mt19937 gen(314159);
+  std::vector<float> inputArr(M * K);
+  randn(inputArr.data(), inputArr.size(), gen);
+  Tensor input = createTensor(ctx, Shape{M, K}, kf32, inputArr.data());
+  Tensor w = createTensor(ctx, Shape{N, K}, weightType, packed.data());
+  Tensor scaleTensor = createTensor(ctx, Shape{nGroups}, kf32, scales.data());
+  Tensor zeroTensor =
+      createTensor(ctx, Shape{nZeros * 8}, kq4, zeros.data()); // unused by kq8
+  Tensor output = createTensor(ctx, Shape{M, N}, kf32);
+  Kernel kernel = selectQuantizedMatmul(
+      ctx, weightType, {input, w, scaleTensor, zeroTensor, output}, M, K, N,
+      groupSize);
+
+  constexpr size_t nIter = 30;
+  std::array<std::promise<void>, nIter> promises;
+  std::array<std::future<void>, nIter> futures;
+  for (size_t i = 0; i < nIter; i++) {
+    futures[i] = promises[i].get_future();
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < nIter; i++) {
+    dispatchKernel(ctx, kernel, promises[i]);
+    wait(ctx, futures[i]);
+    resetCommandBuffer(ctx.device, kernel);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto duration =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  const double seconds =
+      static_cast<double>(duration.count()) / 1000000.0 / nIter;
+  const size_t weightBytes =
+      w.data.size + scaleTensor.data.size +
+      (weightType == kq8 ? 0 : zeroTensor.data.size);
+  const double gflops = 2.0 * M * N * K / seconds / 1000000000.0;
+  const double gbps = static_cast<double>(weightBytes) / seconds / 1000000000.0;
+
+  std::vector<float> outputArr(M * N);
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  // Kernel check against the CPU matmul on the dequantized weights, and
+  // quantization error against the CPU matmul on the original weights
+  std::vector<float> refDequantized(M * N);
+  std::vector<float> ref(M * N);
+  ref::matmul_forward_cpu(refDequantized.data(), inputArr.data(),
+                          dequantized.data(), nullptr, 1, M, K, N);
+  ref::matmul_forward_cpu(ref.data(), inputArr.data(), weights.data(), nullptr,
+                          1, M, K, N);
+  bool passed = isclose(outputArr.data(), refDequantized.data(), M * N, 1e-2);
+  double maxErr = 0.0, errSq = 0.0, refSq = 0.0;
+  for (size_t i = 0; i < M * N; ++i) {
+    const double err = outputArr[i] - ref[i];
+    maxErr = std::max(maxErr, std::abs(err));
+    errSq += err * err;
+    refSq += static_cast<double>(ref[i]) * ref[i];
+  }
+
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), M, N, "Output").c_str());
+  LOG(kDefLog, kInfo,
+      "\n\n===================================================================="
+      "============\n%s weights, batch %zu (M = %zu, K = %zu, N = %zu), %s:\n"
+      "Weights: %.1f MB (%.1fx smaller than f32)\n"
+      "Dequantized CPU Check: %s\n"
+      "Error vs f32 matmul_forward_cpu: max abs %.4f, relative RMS %.4f\n"
+      "%.3f milliseconds / dispatch ~ %.2f GFLOPS ~ %.2f GB/s weights\n"
+      "================================================================"
+      "================\n\n",
+      weightType == kq8 ? "int8 per-channel" : "int4 group-wise", M, M, K, N,
+      M % 32 == 0 ? "tiled matmul" : "GEMV", weightBytes / 1e6,
+      sizeof(float) * N * K / static_cast<double>(weightBytes),
+      passed ? "PASS" : "FAIL", maxErr, std::sqrt(errSq / refSq),
+      seconds * 1000.0, gflops, gbps);
+}
+
+int main() {
+  static constexpr size_t K = 4096;
+  static constexpr size_t N = 4096;
+  static constexpr size_t kGroupSize = 128;
+  std::mt19937 gen(271828);
+  std::vector<float> weights(N * K);
+  randn(weights.data(), weights.size(), gen);
+
+  Context ctx = createContext();
+  for (NumType weightType : {kq8, kq4}) {
+    for (size_t batch : {1, 32}) {
+      runTest(ctx, weightType, batch, K, N, kGroupSize, weights);
+    }
+  }
+
+  LOG(kDefLog, kInfo, "Done.");
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <future>
 #include <random>
 #include <cstdlib>
+#include <vector>
 
 #include "gpu.h" // createContext, createTensor, createKernel, dispatchKernel,
                  // wait, resetCommandBuffer, toCPU
@@ -11,6 +12,7 @@
 #include "utils/array_utils.h"    // show, isclose, randn, randint
 #include "utils/logging.h"        // LOG
 #include "experimental/wgsl.h"    // loopUnrolling
+#include "experimental/permute.h"  // createPermute
 
 using namespace gpu;
 
@@ -102,6 +104,126 @@ inline KernelCode createTranspose2(const char *shaderTemplate,
   return {unrolledCode, workgroupSize};
 }
 
+/**
+ * @brief Device-to-device buffer copy, the bandwidth baseline for the
+ * transpose kernels.
+ */
+void copyBuffer(Context &ctx, Tensor &src, Tensor &dst,
+                std::promise<void> &promise) {
+  WGPUCommandEncoder commandEncoder =
+      wgpuDeviceCreateCommandEncoder(ctx.device, nullptr);
+  wgpuCommandEncoderCopyBufferToBuffer(commandEncoder, src.data.buffer, 0,
+                                       dst.data.buffer, 0, src.data.size);
+  WGPUCommandBuffer commandBuffer =
+      wgpuCommandEncoderFinish(commandEncoder, nullptr);
+  check(commandBuffer, "Create command buffer", __FILE__, __LINE__);
+  wgpuCommandEncoderRelease(commandEncoder);
+  wgpuQueueSubmit(ctx.queue, 1, &commandBuffer);
+  wgpuCommandBufferRelease(commandBuffer);
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *data) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        static_cast<std::promise<void> *>(data)->set_value();
+      },
+      &promise);
+}
+
+/**
+ * @brief CPU reference for an N-d permute, out dimension i is in dimension
+ * perm[i].
+ */
+void permuteCPU(const float *in, float *out, const std::vector<size_t> &shape,
+                const std::vector<size_t> &perm) {
+  const size_t rank = shape.size();
+  std::vector<size_t> inStride(rank, 1);
+  for (size_t d = rank; d-- > 1;) {
+    inStride[d - 1] = inStride[d] * shape[d];
+  }
+  size_t numel = 1;
+  for (size_t d : shape) {
+    numel *= d;
+  }
+  for (size_t idx = 0; idx < numel; ++idx) {
+    size_t rem = idx, inIdx = 0;
+    for (size_t i = rank; i-- > 0;) {
+      inIdx += (rem % shape[perm[i]]) * inStride[perm[i]];
+      rem /= shape[perm[i]];
+    }
+    out[idx] = in[inIdx];
+  }
+}
+
+/**
+ * @brief Checks createPermute() against the CPU reference for permutations
+ * which exercise both the tiled and the copy kernel, and reports GB/s for
+ * the multi-head (B, T, NH, HS) <-> (B, NH, T, HS) reorders.
+ */
+void checkPermute(Context &ctx) {
+  struct Case {
+    std::vector<size_t> shape;
+    std::vector<size_t> perm;
+  };
+  const std::vector<Case> cases = {
+      {{7}, {0}},                             // identity
+      {{33, 65}, {1, 0}},                     // 2D transpose, partial tiles
+      {{2, 3, 4, 5}, {0, 2, 1, 3}},           // row gather
+      {{2, 3, 4, 5}, {3, 2, 1, 0}},           // full reversal
+      {{4, 1, 6, 8}, {2, 1, 0, 3}},           // size-1 dims, vec4 copy
+      {{3, 4, 5, 6}, {2, 3, 0, 1}},           // collapses to 2D transpose
+      {{2, 2, 3, 2, 5, 2}, {5, 1, 3, 0, 4, 2}}, // rank 6
+      {{4, 256, 12, 64}, {0, 2, 1, 3}},       // (B, T, NH, HS) -> heads
+      {{4, 12, 256, 64}, {0, 1, 3, 2}},       // K^T per head
+  };
+  std::mt19937 gen(314159);
+  for (const Case &c : cases) {
+    Shape shape, permShape;
+    shape.rank = c.shape.size();
+    permShape.rank = c.shape.size();
+    for (size_t d = 0; d < c.shape.size(); ++d) {
+      shape[d] = c.shape[d];
+      permShape[d] = c.shape[c.perm[d]];
+    }
+    std::vector<float> inArr(size(shape)), outArr(size(shape)),
+        refArr(size(shape));
+    randn(inArr.data(), inArr.size(), gen);
+    Tensor in = createTensor(ctx, shape, kf32, inArr.data());
+    Tensor out = createTensor(ctx, permShape, kf32);
+    Kernel op = createPermute(ctx, in, out, c.perm);
+
+    constexpr size_t nIter = 20;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nIter; i++) {
+      std::promise<void> promise;
+      std::future<void> future = promise.get_future();
+      dispatchKernel(ctx, op, promise);
+      wait(ctx, future);
+      resetCommandBuffer(ctx.device, op);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    float gbps = sizeof(float) * size(shape) /
+                 (static_cast<double>(duration.count()) / 1000000.0) /
+                 1000000000.0 * static_cast<float>(nIter);
+
+    toCPU(ctx, out, outArr.data(), outArr.size() * sizeof(float));
+    permuteCPU(inArr.data(), refArr.data(), c.shape, c.perm);
+    const PermutePlan plan = collapsePermutation(shape, c.perm);
+    LOG(kDefLog, kInfo,
+        "Permute (%s) perm (%s), collapsed rank %zu, %s kernel: %s, %.2f GB/s",
+        toString(shape).c_str(), toString(permShape).c_str(),
+        plan.shape.size(),
+        plan.shape.size() <= 1 || plan.perm.back() == plan.shape.size() - 1
+            ? "copy"
+            : "tiled",
+        isclose(outArr.data(), refArr.data(), outArr.size(), 0.0f) ? "PASS"
+                                                                   : "FAIL",
+        gbps);
+  }
+}
+
 void initData(size_t M, size_t N, std::unique_ptr<float[]> &inputPtr) {
   std::mt19937 gen(314159);
   randn(inputPtr.get(), M * N, gen);
@@ -127,8 +249,8 @@ Kernel selectTranspose(Context &ctx, int version,
     static constexpr size_t TN = BN / BK;
     Shape wgSize = {(BM / TM) * (BN / TN), 1, 1}; // This is the same as BK * BK.
     Shape nWorkgroups = {cdiv(N, BN), cdiv(M, BM), 1};
-    LOG(kDefLog, kInfo, "M: %d, N: %d", M, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
+    LOG(kDefLog, kInfo, "M: %zu, N: %zu", M, N);
+    LOG(kDefLog, kInfo, "BM: %zu, BK: %zu, BN: %zu, TM: %zu, TN: %zu", BM, BK, BN, TM, TN);
     LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
     LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
     KernelCode transpose = createTranspose2(kShaderTranspose2, M, N, BM, BN, TM, TN,
@@ -136,8 +258,12 @@ Kernel selectTranspose(Context &ctx, int version,
 					    kf32);
     kernel = createKernel(ctx, transpose, bindings,
                           /*nWorkgroups*/ nWorkgroups);
-  } else if (version == 0) {
-    LOG(kDefLog, kInfo, "Skip Creating Kernel", M, N);
+  } else if (version == 3) {
+    Tensor input = bindings.data[0];
+    Tensor output = bindings.data[1];
+    kernel = createPermute(ctx, input, output, {1, 0});
+  } else if (version == 0 || version == 4) {
+    LOG(kDefLog, kInfo, "Skip Creating Kernel");
   }
   return kernel;
 }
@@ -146,7 +272,8 @@ void runTest(int version, size_t M, size_t N,
              std::unique_ptr<float[]> &inputPtr,
              std::unique_ptr<float[]> &outputPtr) {
   bool isCPU = version == 0;
-  
+  bool isCopy = version == 4;
+
   // Allocate GPU buffers and copy data
   Context ctx = createContext();
   Tensor input = createTensor(ctx, Shape{M, N}, kf32, inputPtr.get());
@@ -159,7 +286,7 @@ void runTest(int version, size_t M, size_t N,
   Kernel kernel = selectTranspose(ctx, version, {input, output}, M, N);
 
   // Dispatch kernel execution
-  LOG(kDefLog, kInfo, "Dispatching Kernel version %d, %d iterations ...",
+  LOG(kDefLog, kInfo, "Dispatching Kernel version %d, %zu iterations ...",
       version, nIter);
 
   // pre-allocate promises and futures for async dispatch
@@ -173,7 +300,10 @@ void runTest(int version, size_t M, size_t N,
   // Dispatch kernel nIter times
   auto start = std::chrono::high_resolution_clock::now();
   for (int i = 0; i < nIter; i++) {
-    if (!isCPU) {
+    if (isCopy) {
+      copyBuffer(ctx, input, output, promises[i]);
+      wait(ctx, futures[i]);
+    } else if (!isCPU) {
       dispatchKernel(ctx, kernel, promises[i]);
       wait(ctx, futures[i]);
       resetCommandBuffer(ctx.device, kernel);
@@ -199,7 +329,7 @@ void runTest(int version, size_t M, size_t N,
       show<float>(outputPtr.get(), N, M, "Output").c_str());
 
   LOG(kDefLog, kInfo, "\n\n===================================================================="
-      "============\nExecution Time: (M = %d, N = %d) x %d iterations "
+      "============\nExecution Time: (M = %zu, N = %zu) x %zu iterations "
       ":\n%.3f "
       "milliseconds / dispatch ~ %.2f "
       "GB/s\n================================================================"
@@ -213,6 +343,16 @@ int main() {
     // 0 == cpu
     // 1 == naive transpose
     // 2 == tiling with shared memory
+    // 3 == generated N-d permute kernel (createPermute)
+    // 4 == device-to-device copy (bandwidth baseline)
+    // 5 == N-d permute correctness and bandwidth checks
+
+  if (version == 5) {
+    Context ctx = createContext();
+    checkPermute(ctx);
+    LOG(kDefLog, kInfo, "Done.");
+    return 0;
+  }
 
   size_t M, N;  // Matrix dimensions
   static constexpr int kTestSize = 2;
@@ -0,0 +1,704 @@
+#ifndef GPU_CPP_ANALYSIS_H
+#define GPU_CPP_ANALYSIS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gpu.h"
+#include "experimental/wgsl.h" // tokenizeWgsl, parseWgslInt
+
+namespace gpu {
+
+/**
+ * Static resource analysis and roofline reports for kernels.
+ *
+ * analyzeKernel() reads the WGSL of a KernelCode and reports what a dispatch
+ * needs from the device, i.e. the workgroup memory of the var<workgroup>
+ * declarations (e.g. the As / Bs tiles of a tiled matmul), the workgroup size
+ * and the storage and uniform bindings. It checks them against the device
+ * limits before any pipeline is created. addTimings() adds a measured
+ * dispatch time and the FLOPs and bytes a dispatch moves, and compares the
+ * achieved GFLOPS and GB/s with the roofline of the adapter, as estimated by
+ * measureRoofline():
+ *
+ * @code
+ * KernelReport report = analyzeKernel(ctx, code, nWorkgroups);
+ * // ... time the kernel
+ * addTimings(report, {2.0 * M * N * K, 4.0 * (M * K + N * K + M * N)},
+ *            seconds, measureRoofline(ctx));
+ * LOG(kDefLog, kInfo, "%s", toString(report).c_str());
+ * if (!report.issues.empty()) { ... } // over a limit or far below roofline
+ * @endcode
+ */
+
+/**
+ * @brief Workgroup memory of one var<workgroup> declaration.
+ */
+struct WorkgroupVar {
+  std::string name;
+  size_t bytes = 0;
+};
+
+/**
+ * @brief Resources a kernel uses per workgroup and per dispatch.
+ */
+struct KernelResources {
+  Shape workgroupSize;
+  size_t invocations = 0;    // per workgroup
+  size_t workgroupBytes = 0; // sum of the workgroup variables
+  std::vector<WorkgroupVar> workgroupVars;
+  size_t storageBindings = 0;
+  size_t uniformBindings = 0;
+  // Workgroup variables whose type could not be sized, e.g. sized by an
+  // override without a value. Their memory is not in workgroupBytes.
+  std::vector<std::string> unresolved;
+};
+
+/**
+ * @brief Size and alignment in bytes of a WGSL type, following the WGSL
+ * memory layout rules.
+ */
+struct WgslLayout {
+  size_t size = 0;
+  size_t align = 1;
+};
+
+/**
+ * @brief Module-scope names the analysis resolves: integer constants
+ * (const, override with defaults or KernelCode::constants), type aliases
+ * and structs.
+ */
+struct WgslScope {
+  std::map<std::string, int64_t> values;
+  std::map<std::string, WgslLayout> types;
+};
+
+/**
+ * @brief Parser over the tokens of a WGSL source without spaces and comments.
+ */
+struct WgslParser {
+  std::vector<std::string> tokens;
+  size_t pos = 0;
+
+  inline bool done() const { return pos >= tokens.size(); }
+  inline const std::string &peek() const {
+    static const std::string kEnd;
+    return done() ? kEnd : tokens[pos];
+  }
+  inline bool accept(const std::string &token) {
+    if (peek() == token) {
+      ++pos;
+      return true;
+    }
+    // Closing two template lists at once, e.g. array<vec4<f32>>
+    if (token == ">" && peek() == ">>") {
+      tokens[pos] = ">";
+      return true;
+    }
+    return false;
+  }
+  inline void skipAttributes() {
+    while (accept("@")) {
+      ++pos; // attribute name
+      if (accept("(")) {
+        for (int depth = 1; !done() && depth > 0; ++pos) {
+          depth += peek() == "(" ? 1 : peek() == ")" ? -1 : 0;
+        }
+      }
+    }
+  }
+};
+
+/**
+ * @brief Evaluates an integer constant expression with + - * / % and
+ * parentheses over literals, resolved names and u32() / i32() conversions.
+ */
+inline bool parseWgslExpr(WgslParser &p, const WgslScope &scope,
+                          int64_t &value);
+
+inline bool parseWgslPrimary(WgslParser &p, const WgslScope &scope,
+                             int64_t &value) {
+  if (p.accept("(")) {
+    return parseWgslExpr(p, scope, value) && p.accept(")");
+  }
+  if (p.accept("-")) {
+    if (!parseWgslPrimary(p, scope, value)) {
+      return false;
+    }
+    value = -value;
+    return true;
+  }
+  const std::string token = p.peek();
+  ++p.pos;
+  if (parseWgslInt(token, value)) {
+    return true;
+  }
+  if ((token == "u32" || token == "i32") && p.accept("(")) {
+    return parseWgslExpr(p, scope, value) && p.accept(")");
+  }
+  auto found = scope.values.find(token);
+  if (found == scope.values.end()) {
+    return false;
+  }
+  value = found->second;
+  return true;
+}
+
+inline bool parseWgslTerm(WgslParser &p, const WgslScope &scope,
+                          int64_t &value) {
+  if (!parseWgslPrimary(p, scope, value)) {
+    return false;
+  }
+  while (p.peek() == "*" || p.peek() == "/" || p.peek() == "%") {
+    const std::string op = p.peek();
+    ++p.pos;
+    int64_t rhs;
+    if (!parseWgslPrimary(p, scope, rhs) || (op != "*" && rhs == 0)) {
+      return false;
+    }
+    value = op == "*" ? value * rhs : op == "/" ? value / rhs : value % rhs;
+  }
+  return true;
+}
+
+inline bool parseWgslExpr(WgslParser &p, const WgslScope &scope,
+                          int64_t &value) {
+  if (!parseWgslTerm(p, scope, value)) {
+    return false;
+  }
+  while (p.peek() == "+" || p.peek() == "-") {
+    const bool add = p.peek() == "+";
+    ++p.pos;
+    int64_t rhs;
+    if (!parseWgslTerm(p, scope, rhs)) {
+      return false;
+    }
+    value = add ? value + rhs : value - rhs;
+  }
+  return true;
+}
+
+inline size_t wgslRoundUp(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+/**
+ * @brief Layout of the type at the parser position: scalars, vectors,
+ * matrices (also with the f / h / i / u shorthands), atomics, fixed-size
+ * arrays, aliases and structs.
+ */
+inline bool parseWgslType(WgslParser &p, const WgslScope &scope,
+                          WgslLayout &layout) {
+  const std::string name = p.peek();
+  ++p.pos;
+  auto scalar = [](const std::string &s, WgslLayout &l) {
+    if (s == "f32" || s == "i32" || s == "u32" || s == "bool" || s == "f" ||
+        s == "i" || s == "u") {
+      l = {4, 4};
+      return true;
+    }
+    if (s == "f16" || s == "h") {
+      l = {2, 2};
+      return true;
+    }
+    return false;
+  };
+  if (scalar(name, layout)) {
+    return true;
+  }
+  if (name == "atomic") {
+    return p.accept("<") && parseWgslType(p, scope, layout) && p.accept(">");
+  }
+  if (name == "array") {
+    WgslLayout element;
+    int64_t count;
+    if (!p.accept("<") || !parseWgslType(p, scope, element) ||
+        !p.accept(",") || !parseWgslExpr(p, scope, count) || count <= 0) {
+      return false;
+    }
+    p.accept(",");
+    if (!p.accept(">")) {
+      return false;
+    }
+    layout = {static_cast<size_t>(count) *
+                  wgslRoundUp(element.size, element.align),
+              element.align};
+    return true;
+  }
+  const bool vec = name.size() >= 4 && name.compare(0, 3, "vec") == 0;
+  const bool mat = name.size() >= 6 && name.compare(0, 3, "mat") == 0 &&
+                   name[4] == 'x';
+  if (vec || mat) {
+    const size_t cols = mat ? name[3] - '0' : 1;
+    const size_t rows = mat ? name[5] - '0' : name[3] - '0';
+    const std::string suffix = name.substr(mat ? 6 : 4);
+    WgslLayout component;
+    if (suffix.empty()) {
+      if (!p.accept("<") || !parseWgslType(p, scope, component) ||
+          !p.accept(">")) {
+        return false;
+      }
+    } else if (!scalar(suffix, component)) {
+      return false;
+    }
+    if (rows < 2 || rows > 4 || cols < 1 || cols > 4) {
+      return false;
+    }
+    const WgslLayout column = {rows * component.size,
+                               (rows == 2 ? 2 : 4) * component.size};
+    layout = mat ? WgslLayout{cols * wgslRoundUp(column.size, column.align),
+                              column.align}
+                 : column;
+    return true;
+  }
+  auto found = scope.types.find(name);
+  if (found == scope.types.end()) {
+    return false;
+  }
+  layout = found->second;
+  return true;
+}
+
+/**
+ * @brief Parses `{ member: type, ... }` of a struct declaration. Members may
+ * carry @align / @size attributes, which are honored.
+ */
+inline bool parseWgslStruct(WgslParser &p, const WgslScope &scope,
+                            WgslLayout &layout) {
+  if (!p.accept("{")) {
+    return false;
+  }
+  size_t offset = 0;
+  layout = {0, 1};
+  while (!p.accept("}")) {
+    if (p.done()) {
+      return false;
+    }
+    int64_t align = 0, size = 0;
+    while (p.accept("@")) {
+      const std::string attribute = p.peek();
+      ++p.pos;
+      int64_t value = 0;
+      if (!p.accept("(") || !parseWgslExpr(p, scope, value) ||
+          !p.accept(")")) {
+        return false;
+      }
+      (attribute == "align" ? align : size) = value;
+    }
+    ++p.pos; // member name
+    WgslLayout member;
+    if (!p.accept(":") || !parseWgslType(p, scope, member)) {
+      return false;
+    }
+    member.align = align > 0 ? align : member.align;
+    member.size = size > 0 ? size : member.size;
+    offset = wgslRoundUp(offset, member.align) + member.size;
+    layout.align = std::max(layout.align, member.align);
+    p.accept(",");
+  }
+  layout.size = wgslRoundUp(offset, layout.align);
+  return true;
+}
+
+/**
+ * @brief Skips to the token after the end of the current declaration, i.e.
+ * after the next `;` or the closing brace of the next block.
+ */
+inline void skipWgslDeclaration(WgslParser &p) {
+  int depth = 0;
+  while (!p.done()) {
+    const std::string &token = p.peek();
+    ++p.pos;
+    if (token == "{") {
+      ++depth;
+    } else if (token == "}" && --depth == 0) {
+      return;
+    } else if (token == ";" && depth == 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Analyzes the resources of a kernel's WGSL, see KernelResources.
+ * Works on the final code, after placeholder substitution.
+ */
+inline KernelResources analyzeKernel(const KernelCode &code) {
+  KernelResources resources;
+  resources.workgroupSize = code.workgroupSize;
+  resources.invocations = size(code.workgroupSize);
+  WgslParser p;
+  for (const WgslToken &token : tokenizeWgsl(code.data)) {
+    if (token.kind != WgslToken::kSpace && token.kind != WgslToken::kComment) {
+      p.tokens.push_back(token.text);
+    }
+  }
+  WgslScope scope;
+  for (const auto &constant : code.constants) {
+    scope.values[constant.first] = static_cast<int64_t>(constant.second);
+  }
+  // Constants, aliases and structs may be used before their declaration, so
+  // resolve them in passes until no more names resolve
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (p.pos = 0; !p.done();) {
+      p.skipAttributes();
+      if (p.accept(";")) {
+        continue;
+      }
+      const std::string keyword = p.peek();
+      const size_t start = ++p.pos;
+      const std::string name = p.peek();
+      ++p.pos;
+      const bool known =
+          scope.values.count(name) > 0 || scope.types.count(name) > 0;
+      if (!known && (keyword == "const" || keyword == "override")) {
+        WgslLayout ignored;
+        if (p.accept(":")) {
+          parseWgslType(p, scope, ignored);
+        }
+        int64_t value;
+        if (p.accept("=") && parseWgslExpr(p, scope, value)) {
+          scope.values[name] = value;
+          progress = true;
+        }
+      } else if (!known && keyword == "alias") {
+        WgslLayout layout;
+        if (p.accept("=") && parseWgslType(p, scope, layout)) {
+          scope.types[name] = layout;
+          progress = true;
+        }
+      } else if (!known && keyword == "struct") {
+        WgslLayout layout;
+        if (parseWgslStruct(p, scope, layout)) {
+          scope.types[name] = layout;
+          progress = true;
+        }
+      }
+      p.pos = start;
+      skipWgslDeclaration(p);
+    }
+  }
+  for (p.pos = 0; !p.done();) {
+    p.skipAttributes();
+    if (!p.accept("var")) {
+      skipWgslDeclaration(p);
+      continue;
+    }
+    const std::string addressSpace = p.accept("<") ? p.peek() : "";
+    if (addressSpace == "storage") {
+      resources.storageBindings++;
+    } else if (addressSpace == "uniform") {
+      resources.uniformBindings++;
+    } else if (addressSpace == "workgroup") {
+      p.pos += 2; // workgroup >
+      WorkgroupVar var = {p.peek(), 0};
+      ++p.pos;
+      WgslLayout layout;
+      if (p.accept(":") && parseWgslType(p, scope, layout)) {
+        var.bytes = layout.size;
+        resources.workgroupBytes += layout.size;
+        resources.workgroupVars.push_back(var);
+      } else {
+        resources.unresolved.push_back(var.name);
+      }
+    }
+    skipWgslDeclaration(p);
+  }
+  return resources;
+}
+
+/**
+ * @brief A device limit, or the WebGPU default when the limits were not
+ * queried (0).
+ */
+inline uint64_t limitOr(uint64_t limit, uint64_t defaultLimit) {
+  return limit > 0 && limit != WGPU_LIMIT_U32_UNDEFINED ? limit : defaultLimit;
+}
+
+/**
+ * @brief Checks kernel resources, and optionally a dispatch size, against
+ * device limits. Returns a description of every exceeded limit, empty if the
+ * kernel fits.
+ */
+inline std::vector<std::string> checkLimits(const KernelResources &resources,
+                                            const WGPULimits &limits,
+                                            const Shape &nWorkgroups = {1, 1,
+                                                                        1}) {
+  std::vector<std::string> issues;
+  auto over = [&](const char *what, uint64_t value, uint64_t limit) {
+    if (value > limit) {
+      issues.push_back(std::string(what) + " " + std::to_string(value) +
+                       " exceeds the limit of " + std::to_string(limit));
+    }
+  };
+  over("Workgroup memory (bytes)", resources.workgroupBytes,
+       limitOr(limits.maxComputeWorkgroupStorageSize, 16384));
+  over("Invocations per workgroup", resources.invocations,
+       limitOr(limits.maxComputeInvocationsPerWorkgroup, 256));
+  over("Workgroup size x", resources.workgroupSize[0],
+       limitOr(limits.maxComputeWorkgroupSizeX, 256));
+  over("Workgroup size y", resources.workgroupSize[1],
+       limitOr(limits.maxComputeWorkgroupSizeY, 256));
+  over("Workgroup size z", resources.workgroupSize[2],
+       limitOr(limits.maxComputeWorkgroupSizeZ, 64));
+  over("Storage buffers", resources.storageBindings,
+       limitOr(limits.maxStorageBuffersPerShaderStage, 8));
+  over("Uniform buffers", resources.uniformBindings,
+       limitOr(limits.maxUniformBuffersPerShaderStage, 12));
+  for (size_t i = 0; i < nWorkgroups.rank; ++i) {
+    over("Workgroups per dimension", nWorkgroups[i],
+         limitOr(limits.maxComputeWorkgroupsPerDimension, 65535));
+  }
+  for (const std::string &name : resources.unresolved) {
+    issues.push_back("Workgroup memory of " + name + " could not be sized");
+  }
+  return issues;
+}
+
+/**
+ * @brief Peak compute and memory bandwidth of an adapter, the roof of the
+ * roofline model.
+ */
+struct Roofline {
+  double gflops = 0.0; // f32 FMA throughput, 2 FLOPs per FMA
+  double gbps = 0.0;   // device memory bandwidth, reads plus writes
+};
+
+/**
+ * @brief Work of one dispatch: floating point operations and bytes moved
+ * to and from device memory, e.g. 2 * M * N * K and the operand sizes for a
+ * matmul.
+ */
+struct KernelCost {
+  double flops = 0.0;
+  double bytes = 0.0;
+};
+
+/**
+ * @brief Achieved throughput of a dispatch against the roofline.
+ */
+struct RooflineReport {
+  double seconds = 0.0;  // per dispatch
+  double gflops = 0.0;   // achieved
+  double gbps = 0.0;     // achieved
+  double intensity = 0.0; // FLOPs per byte
+  double attainableGflops = 0.0; // min(peak, intensity * bandwidth)
+  double efficiency = 0.0; // achieved over attainable
+  bool memoryBound = false;
+};
+
+/**
+ * @brief Static resources, issues and, once timed, roofline position of a
+ * kernel.
+ */
+struct KernelReport {
+  KernelResources resources;
+  std::vector<std::string> issues; // exceeded limits and performance flags
+  bool timed = false;
+  RooflineReport roofline;
+};
+
+/**
+ * @brief Analyzes a kernel's resources and checks them against the limits
+ * of the context's device, see Context::limits.
+ */
+inline KernelReport analyzeKernel(const Context &ctx, const KernelCode &code,
+                                  const Shape &nWorkgroups = {1, 1, 1}) {
+  KernelReport report;
+  report.resources = analyzeKernel(code);
+  report.issues = checkLimits(report.resources, ctx.limits, nWorkgroups);
+  return report;
+}
+
+/**
+ * @brief Adds the roofline position of a measured dispatch to a report,
+ * flagging kernels below minEfficiency of the attainable throughput.
+ *
+ * @param[in,out] report Report of the timed kernel
+ * @param[in] cost FLOPs and bytes of one dispatch
+ * @param[in] seconds Measured time of one dispatch
+ * @param[in] peak Roofline of the adapter, see measureRoofline()
+ * @param[in] minEfficiency Fraction of the roofline below which the kernel
+ * is flagged
+ */
+inline void addTimings(KernelReport &report, const KernelCost &cost,
+                       double seconds, const Roofline &peak,
+                       double minEfficiency = 0.1) {
+  RooflineReport &r = report.roofline;
+  r.seconds = seconds;
+  r.gflops = cost.flops / seconds / 1e9;
+  r.gbps = cost.bytes / seconds / 1e9;
+  r.intensity = cost.bytes > 0.0 ? cost.flops / cost.bytes : 0.0;
+  r.attainableGflops = std::min(peak.gflops, r.intensity * peak.gbps);
+  r.memoryBound = r.intensity * peak.gbps < peak.gflops;
+  // Kernels without FLOPs are measured against the bandwidth only
+  r.efficiency = cost.flops > 0.0 ? r.gflops / r.attainableGflops
+                                  : r.gbps / peak.gbps;
+  report.timed = true;
+  if (r.efficiency < minEfficiency) {
+    char issue[160];
+    snprintf(issue, sizeof(issue),
+             "%.1f%% of the %s-bound roofline, below %.0f%%",
+             100.0 * r.efficiency, r.memoryBound ? "memory" : "compute",
+             100.0 * minEfficiency);
+    report.issues.push_back(issue);
+  }
+}
+
+/**
+ * @brief Formats a report, one resource or roofline figure per line.
+ */
+inline std::string toString(const KernelReport &report) {
+  const KernelResources &r = report.resources;
+  char line[256];
+  std::string result;
+  snprintf(line, sizeof(line),
+           "workgroup size (%s), %zu invocations\n"
+           "workgroup memory %zu bytes",
+           toString(r.workgroupSize).c_str(), r.invocations, r.workgroupBytes);
+  result += line;
+  for (size_t i = 0; i < r.workgroupVars.size(); ++i) {
+    result += (i == 0 ? " (" : ", ") + r.workgroupVars[i].name + " " +
+              std::to_string(r.workgroupVars[i].bytes) +
+              (i + 1 == r.workgroupVars.size() ? ")" : "");
+  }
+  snprintf(line, sizeof(line), "\nbindings: %zu storage, %zu uniform\n",
+           r.storageBindings, r.uniformBindings);
+  result += line;
+  if (report.timed) {
+    const RooflineReport &t = report.roofline;
+    snprintf(line, sizeof(line),
+             "%.3f ms / dispatch, %.1f GFLOPS, %.1f GB/s, %.2f FLOP/byte\n"
+             "%.1f%% of the attainable %.1f GFLOPS (%s bound)\n",
+             t.seconds * 1e3, t.gflops, t.gbps, t.intensity,
+             100.0 * t.efficiency, t.attainableGflops,
+             t.memoryBound ? "memory" : "compute");
+    result += line;
+  }
+  for (const std::string &issue : report.issues) {
+    result += "FLAG: " + issue + "\n";
+  }
+  return result;
+}
+
+/* Roofline copy
+ * - Streams a buffer of vec4<f32> into another, one vector per thread, to
+ *   measure the memory bandwidth.
+ */
+static const char *kShaderRooflineCopy = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<vec4<f32>>;
+@group(0) @binding(1) var<storage, read_write> out: array<vec4<f32>>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let i: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (i < arrayLength(&inp)) {
+        out[i] = inp[i];
+    }
+}
+)";
+
+/* Roofline FMA
+ * - Four independent chains of vec4 FMAs per thread, enough instruction
+ *   level parallelism to saturate the ALUs, to measure the f32 throughput.
+ * - The result is stored so the loop is not eliminated.
+ */
+static const char *kShaderRooflineFma = R"(
+@group(0) @binding(0) var<storage, read_write> out: array<vec4<f32>>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let x: f32 = f32(globalID.x) * 1e-7;
+    var a = vec4<f32>(x, x + 1.0, x + 2.0, x + 3.0);
+    var b = a + vec4<f32>(0.5);
+    var c = a + vec4<f32>(0.25);
+    var d = a + vec4<f32>(0.125);
+    let m = vec4<f32>(0.999);
+    let s = vec4<f32>(1e-4);
+    for (var i: u32 = 0u; i < {{ITERS}}u; i++) {
+        a = fma(a, m, s);
+        b = fma(b, m, s);
+        c = fma(c, m, s);
+        d = fma(d, m, s);
+    }
+    out[globalID.x] = a + b + c + d;
+}
+)";
+
+/**
+ * @brief Best time of nIter dispatches of a kernel, in seconds.
+ */
+inline double bestDispatchSeconds(Context &ctx, Kernel &kernel,
+                                  size_t nIter) {
+  double best = 0.0;
+  for (size_t i = 0; i < nIter; ++i) {
+    if (i > 0) {
+      resetCommandBuffer(ctx.device, kernel);
+    }
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    const auto start = std::chrono::high_resolution_clock::now();
+    dispatchKernel(ctx, kernel, promise);
+    wait(ctx, future);
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::high_resolution_clock::now() -
+                               start)
+                               .count();
+    best = i == 0 ? seconds : std::min(best, seconds);
+  }
+  return best;
+}
+
+/**
+ * @brief Estimates the roofline of the context's adapter with two
+ * microbenchmarks, a 64 MiB buffer copy and an FMA loop. WebGPU exposes no
+ * peak figures, so these are attainable rather than datasheet peaks, which
+ * is what kernels should be compared with. Takes well under a second, the
+ * result can be reused for all kernels on the adapter.
+ */
+inline Roofline measureRoofline(Context &ctx, size_t nIter = 10) {
+  static constexpr size_t wgSize = 256;
+  Roofline roofline;
+  {
+    const size_t numel = 16 * 1024 * 1024; // 64 MiB of f32
+    Tensor inp = createTensor(ctx, {numel}, kf32);
+    Tensor out = createTensor(ctx, {numel}, kf32);
+    const size_t nWorkgroups = cdiv(numel / 4, wgSize);
+    const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+    std::string code = kShaderRooflineCopy;
+    replaceAll(code, "{{X_THREADS}}", toString(wgX * wgSize));
+    Kernel copy = createKernel(ctx, {code, wgSize, kf32}, Bindings{inp, out},
+                               {wgX, cdiv(nWorkgroups, wgX), 1});
+    const double seconds = bestDispatchSeconds(ctx, copy, nIter);
+    roofline.gbps = 2.0 * numel * sizeof(float) / seconds / 1e9;
+    FreeTensor(ctx.pool, inp);
+    FreeTensor(ctx.pool, out);
+  }
+  {
+    static constexpr size_t nWorkgroups = 1024;
+    static constexpr size_t iters = 4096;
+    Tensor out = createTensor(ctx, {nWorkgroups * wgSize * 4}, kf32);
+    std::string code = kShaderRooflineFma;
+    replaceAll(code, "{{ITERS}}", std::to_string(iters));
+    Kernel fma = createKernel(ctx, {code, wgSize, kf32}, Bindings{out},
+                              {nWorkgroups, 1, 1});
+    const double seconds = bestDispatchSeconds(ctx, fma, nIter);
+    // 4 chains of vec4 FMAs, 2 FLOPs per lane
+    roofline.gflops =
+        double(nWorkgroups * wgSize) * iters * 4 * 4 * 2 / seconds / 1e9;
+    FreeTensor(ctx.pool, out);
+  }
+  LOG(kDefLog, kInfo, "Roofline: %.1f GFLOPS, %.1f GB/s", roofline.gflops,
+      roofline.gbps);
+  return roofline;
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_ANALYSIS_H
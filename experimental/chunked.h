@@ -0,0 +1,238 @@
+#ifndef GPU_CPP_CHUNKED_H
+#define GPU_CPP_CHUNKED_H
+
+#include <algorithm>
+#include <future>
+#include <map>
+#include <vector>
+
+#include "experimental/fusion.h"
+#include "experimental/transformer/shaders.h"
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * Kernels over chunked tensors. createTensor() backs a tensor larger than
+ * maxBindingBytes() with several buffers of whole rows (see tensorChunks()),
+ * and a storage binding only reaches one of them. The builders here record
+ * one launch per chunk (or per pair of chunks for a matmul) and submit them
+ * together:
+ *
+ * @code
+ * Tensor x = createTensor(ctx, {1 << 20, 1024}, kf32); // 4 GiB, chunked
+ * Tensor y = createTensor(ctx, {1 << 20, 1024}, kf32);
+ * ChunkedKernel op = fusion::fuseChunked(ctx, gelu(fusion::input(x)), y);
+ * dispatchKernel(ctx, op, promise);
+ * wait(ctx, future);
+ * @endcode
+ *
+ * Unchunked tensors are a single chunk, so the builders also accept them.
+ */
+struct ChunkedKernel {
+  std::vector<Kernel> kernels; // one launch per chunk, in submission order
+};
+
+/**
+ * @brief Re-records the command buffers of all launches, see
+ * resetCommandBuffer(WGPUDevice &, Kernel &).
+ */
+inline void resetCommandBuffer(WGPUDevice &device, ChunkedKernel &op) {
+  for (Kernel &kernel : op.kernels) {
+    resetCommandBuffer(device, kernel);
+  }
+}
+
+/**
+ * @brief Submits the launches of all chunks in a single queue submission and
+ * sets the promise once they are all done.
+ */
+inline void dispatchKernel(Context &ctx, ChunkedKernel &op,
+                           std::promise<void> &promise) {
+  GPU_TRACE_SCOPE("dispatchKernel");
+  std::vector<WGPUCommandBuffer> commandBuffers;
+  commandBuffers.reserve(op.kernels.size());
+  for (Kernel &kernel : op.kernels) {
+    commandBuffers.push_back(kernel.commandBuffer);
+  }
+  wgpuQueueSubmit(ctx.queue, commandBuffers.size(), commandBuffers.data());
+  GPU_TRACE_ASYNC_BEGIN("kernel", &promise);
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *data) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        auto *promise = static_cast<std::promise<void> *>(data);
+        GPU_TRACE_ASYNC_END("kernel", promise);
+        promise->set_value();
+      },
+      &promise);
+}
+
+/**
+ * @brief The chunks of tensors which are processed chunk by chunk together,
+ * checking that they are split at the same elements.
+ */
+inline std::vector<std::vector<TensorChunk>>
+alignedChunks(const Context &ctx, const std::vector<Tensor> &tensors) {
+  std::vector<std::vector<TensorChunk>> chunks;
+  for (const Tensor &t : tensors) {
+    chunks.push_back(tensorChunks(ctx, t));
+    check(chunks.back().size() == chunks[0].size(),
+          "Chunked operands have the same number of chunks", __FILE__,
+          __LINE__);
+    for (size_t c = 0; c < chunks[0].size(); ++c) {
+      check(chunks.back()[c].offset == chunks[0][c].offset &&
+                size(chunks.back()[c].tensor.shape) ==
+                    size(chunks[0][c].tensor.shape),
+            "Chunked operands are split at the same elements", __FILE__,
+            __LINE__);
+    }
+  }
+  return chunks;
+}
+
+/**
+ * @brief Creates one launch of an elementwise kernel per chunk. The shader
+ * must size itself from its bindings (e.g. arrayLength(), as kShaderGelu
+ * does), since each launch sees one chunk of every tensor.
+ *
+ * @param[in] ctx Context instance to manage the kernels
+ * @param[in] code Elementwise kernel code, one thread per element
+ * @param[in] bindings Tensors of the same number of elements, chunked alike
+ * @return ChunkedKernel, dispatched with dispatchKernel()
+ *
+ * @code
+ * ChunkedKernel op = createChunkedKernel(ctx, {kShaderGelu, 256, kf32},
+ *                                        {input, output});
+ * @endcode
+ */
+inline ChunkedKernel createChunkedKernel(Context &ctx, const KernelCode &code,
+                                         const std::vector<Tensor> &bindings) {
+  const std::vector<std::vector<TensorChunk>> chunks =
+      alignedChunks(ctx, bindings);
+  ChunkedKernel op;
+  for (size_t c = 0; c < chunks[0].size(); ++c) {
+    std::vector<Tensor> chunkBindings;
+    for (const std::vector<TensorChunk> &tensorChunk : chunks) {
+      chunkBindings.push_back(tensorChunk[c].tensor);
+    }
+    std::vector<size_t> viewOffsets(chunkBindings.size(), 0);
+    const size_t nWorkgroups =
+        cdiv(size(chunks[0][c].tensor.shape), code.workgroupSize[0]);
+    check(nWorkgroups <= 65535, "Chunk dispatch fits a 1D grid", __FILE__,
+          __LINE__);
+    op.kernels.push_back(createKernel(ctx, code, chunkBindings.data(),
+                                      chunkBindings.size(), viewOffsets.data(),
+                                      {nWorkgroups, 1, 1}));
+  }
+  return op;
+}
+
+namespace fusion {
+
+/**
+ * @brief Chunked variant of fuse(): evaluates expr into out one chunk at a
+ * time. Every input of expr is chunked like out, i.e. has its number of
+ * elements and rows. Strided views are not supported, since their elements do
+ * not follow the chunks. Chunks of the same size share their generated code.
+ */
+inline ChunkedKernel fuseChunked(Context &ctx, const Expr &expr, Tensor &out,
+                                 NumType precision = kf32) {
+  const std::vector<TensorChunk> outChunks = tensorChunks(ctx, out);
+  std::map<size_t, std::pair<KernelCode, FusedExpr>> codes; // by chunk size
+  std::vector<std::vector<TensorChunk>> chunks;
+  ChunkedKernel op;
+  for (size_t c = 0; c < outChunks.size(); ++c) {
+    TensorChunk outChunk = outChunks[c];
+    const size_t numel = size(outChunk.tensor.shape);
+    auto code = codes.find(numel);
+    if (code == codes.end()) {
+      FusedExpr fused;
+      KernelCode kernelCode = fusedCode(expr, numel, precision, fused);
+      check(fused.views.empty(), "Chunked fusion of contiguous inputs",
+            __FILE__, __LINE__);
+      code = codes.emplace(numel, std::make_pair(kernelCode, fused)).first;
+    }
+    const std::vector<Tensor> &inputs = code->second.second.inputs;
+    if (c == 0) {
+      // Inputs are numbered by first use, the same for every chunk size
+      std::vector<Tensor> operands = inputs;
+      operands.push_back(out);
+      chunks = alignedChunks(ctx, operands);
+    }
+    std::vector<Tensor> chunkInputs;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      chunkInputs.push_back(chunks[i][c].tensor);
+    }
+    op.kernels.push_back(createFusedKernel(ctx, code->second.first,
+                                           chunkInputs, outChunk.tensor));
+  }
+  return op;
+}
+
+} // namespace fusion
+
+/**
+ * @brief Creates c = a * b^T for chunked operands, with a (M, K), b (N, K)
+ * in the weight layout of matmul_forward_cpu and c (M, N), all kf32. Each
+ * launch multiplies the rows of a and c in one chunk of each with the rows of
+ * one chunk of b, so that chunk boundaries of a, b and c may all differ.
+ *
+ * @code
+ * // Vocabulary projection with a 3 GiB embedding table
+ * ChunkedKernel op = createChunkedMatmul(ctx, activations, wte, logits);
+ * @endcode
+ */
+inline ChunkedKernel createChunkedMatmul(Context &ctx, const Tensor &a,
+                                         const Tensor &b, Tensor &c) {
+  check(a.shape.rank == 2 && b.shape.rank == 2 && c.shape.rank == 2 &&
+            a.shape[1] == b.shape[1] && c.shape[0] == a.shape[0] &&
+            c.shape[1] == b.shape[0],
+        "Chunked matmul of a (M, K), b (N, K) and c (M, N)", __FILE__,
+        __LINE__);
+  check(a.data.buffer != b.data.buffer, "Matmul operands are different tensors",
+        __FILE__, __LINE__);
+  const size_t K = a.shape[1];
+  const size_t N = b.shape[0];
+  const std::vector<TensorChunk> aChunks = tensorChunks(ctx, a);
+  const std::vector<TensorChunk> bChunks = tensorChunks(ctx, b);
+  const std::vector<TensorChunk> cChunks = tensorChunks(ctx, c);
+  ChunkedKernel op;
+  for (const TensorChunk &aChunk : aChunks) {
+    const size_t aStart = aChunk.offset / K;
+    const size_t aEnd = aStart + aChunk.tensor.shape[0];
+    for (const TensorChunk &cChunk : cChunks) {
+      const size_t cStart = cChunk.offset / N;
+      const size_t m0 = std::max(aStart, cStart);
+      const size_t m1 = std::min(aEnd, cStart + cChunk.tensor.shape[0]);
+      if (m0 >= m1) {
+        continue;
+      }
+      for (const TensorChunk &bChunk : bChunks) {
+        const size_t n0 = bChunk.offset / K;
+        BatchedMatmulParams params = {
+            static_cast<uint32_t>(m1 - m0),
+            static_cast<uint32_t>(K),
+            static_cast<uint32_t>(bChunk.tensor.shape[0]),
+            /*lda*/ static_cast<uint32_t>(K),
+            /*ldbK*/ 1,
+            /*ldbN*/ static_cast<uint32_t>(K),
+            /*ldc*/ static_cast<uint32_t>(N),
+            0,
+            0,
+            0};
+        params.offsetA = static_cast<uint32_t>((m0 - aStart) * K);
+        params.offsetC = static_cast<uint32_t>((m0 - cStart) * N + n0);
+        op.kernels.push_back(createBatchedMatmul(
+            ctx, Bindings{aChunk.tensor, bChunk.tensor, cChunk.tensor}, 1,
+            params));
+      }
+    }
+  }
+  return op;
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_CHUNKED_H
@@ -0,0 +1,316 @@
+#ifndef GPU_CPP_CONVERT_H
+#define GPU_CPP_CONVERT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <string>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * On-GPU dtype conversion. Host transfers move data in a compact type (f16,
+ * bf16 or u8) through a staging tensor, and a conversion kernel expands it
+ * into the tensor's dtype on the GPU, or compresses it for readback. Uploading
+ * f32 activations as f16 halves the bus traffic, and 8-bit image data as u8
+ * quarters it.
+ *
+ * @code
+ * Tensor image = createTensor(ctx, {H, W, 3}, kf32);
+ * CompactTransfer transfer =
+ *     createCompactTransfer(ctx, image, kf32, ku8, 1.0f / 255.0f);
+ * toGPU(ctx, pixels, transfer); // u8 over the bus, f32 in [0, 1] on the GPU
+ * @endcode
+ */
+
+/* Elementwise dtype conversion
+ * - Each thread converts 4 consecutive elements so that it owns whole u32
+ *   words of packed outputs (2 f16 / bf16 or 4 u8 values per word).
+ * - f16 storage is accessed as u32 words with unpack2x16float and
+ *   pack2x16float, so the shader-f16 feature is not required.
+ * - out = in * {{SCALE}} + {{OFFSET}}, rounded and clamped for integer outputs.
+ * - 2D grid so that large tensors are not limited by 65535 workgroups in x.
+ */
+static const char *kShaderConvert = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{IN_TYPE}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{OUT_TYPE}}>;
+{{HELPERS}}
+fn load(i: u32) -> f32 {
+    {{LOAD}}
+}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let g: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (4u * g >= {{N}}) {
+        return;
+    }
+    var v: vec4<f32> = vec4<f32>(0.0);
+    for (var k: u32 = 0u; k < 4u; k = k + 1u) {
+        if (4u * g + k < {{N}}) {
+            v[k] = load(4u * g + k) * {{SCALE}} + {{OFFSET}};
+        }
+    }
+{{STORE}}
+}
+)";
+
+/**
+ * @brief Returns a WGSL f32 expression with exactly the bits of value.
+ */
+inline std::string wgslFloat(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return "bitcast<f32>(" + std::to_string(bits) + "u)";
+}
+
+/**
+ * @brief Generates the conversion kernel code, see kShaderConvert.
+ *
+ * @param[in] inType Source dtype
+ * @param[in] outType Destination dtype
+ * @param[in] numel Number of elements
+ * @param[in] scale Multiplier applied to the source values
+ * @param[in] offset Added to the source values after scaling
+ * @return KernelCode for createConvert()
+ */
+inline KernelCode convertCode(NumType inType, NumType outType, size_t numel,
+                              float scale = 1.0f, float offset = 0.0f,
+                              size_t workgroupSize = 256) {
+  std::string load;
+  switch (inType) {
+  case kf32:
+    load = "return inp[i];";
+    break;
+  case ki32:
+  case ku32:
+    load = "return f32(inp[i]);";
+    break;
+  case kf16:
+    load = "return unpack2x16float(inp[i / 2u])[i % 2u];";
+    break;
+  case kbf16:
+    load = "return unpackBf16(inp[i / 2u])[i % 2u];";
+    break;
+  case ku8:
+    load = "return f32(unpackU8(inp[i / 4u])[i % 4u]);";
+    break;
+  default:
+    check(false, "Supported conversion source type", __FILE__, __LINE__);
+  }
+
+  std::string store;
+  switch (outType) {
+  case kf32:
+  case ki32:
+  case ku32: {
+    const std::string value = outType == kf32   ? "v[k]"
+                              : outType == ki32 ? "i32(round(v[k]))"
+                                                : "u32(max(round(v[k]), 0.0))";
+    store = "    for (var k: u32 = 0u; k < 4u; k = k + 1u) {\n"
+            "        if (4u * g + k < {{N}}) {\n"
+            "            out[4u * g + k] = " +
+            value +
+            ";\n"
+            "        }\n"
+            "    }";
+    break;
+  }
+  case kf16:
+  case kbf16: {
+    const std::string pack =
+        outType == kf16 ? "pack2x16float" : "packBf16";
+    store = "    out[2u * g] = " + pack +
+            "(v.xy);\n"
+            "    if (4u * g + 2u < {{N}}) {\n"
+            "        out[2u * g + 1u] = " +
+            pack +
+            "(v.zw);\n"
+            "    }";
+    break;
+  }
+  case ku8:
+    store = "    out[g] = packU8(vec4<u32>(clamp(round(v), vec4<f32>(0.0), "
+            "vec4<f32>(255.0))));";
+    break;
+  default:
+    check(false, "Supported conversion destination type", __FILE__,
+          __LINE__);
+  }
+
+  // f16 goes through unpack2x16float / pack2x16float on u32 words like the
+  // other packed types, so it is never bound as array<f16>
+  auto storageType = [](NumType type) {
+    return type == kf16 ? std::string("u32") : toString(type);
+  };
+  const size_t nThreads = cdiv(numel, 4);
+  const size_t nWorkgroups = cdiv(nThreads, workgroupSize);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  std::string codeString(kShaderConvert);
+  replaceAll(codeString, {{"{{LOAD}}", load}, {"{{STORE}}", store}});
+  replaceAll(codeString,
+             {{"{{IN_TYPE}}", storageType(inType)},
+              {"{{OUT_TYPE}}", storageType(outType)},
+              {"{{HELPERS}}", kPackedTypeHelpers},
+              {"{{SCALE}}", wgslFloat(scale)},
+              {"{{OFFSET}}", wgslFloat(offset)},
+              {"{{X_THREADS}}", toString(wgX * workgroupSize)},
+              {"{{N}}", toString(numel) + "u"}});
+  return {codeString, workgroupSize};
+}
+
+/**
+ * @brief Creates a kernel converting in (of dtype inType) to out (of dtype
+ * outType), computing out = in * scale + offset.
+ *
+ * Supported dtypes are kf32, kf16, kbf16, ku8, ki32 and ku32. Integer outputs
+ * are rounded to nearest even and u8 outputs clamped to [0, 255].
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] in Source tensor
+ * @param[in] inType Source dtype
+ * @param[out] out Destination tensor, same number of elements as in
+ * @param[in] outType Destination dtype
+ * @param[in] scale Multiplier applied to the source values
+ * @param[in] offset Added to the source values after scaling
+ * @return Kernel instance, dispatched with dispatchKernel()
+ *
+ * @code
+ * Kernel op = createConvert(ctx, staging, kf16, activations, kf32);
+ * @endcode
+ */
+inline Kernel createConvert(Context &ctx, Tensor &in, NumType inType,
+                            Tensor &out, NumType outType, float scale = 1.0f,
+                            float offset = 0.0f) {
+  const size_t numel = size(out.shape);
+  check(size(in.shape) == numel, "Conversion input and output sizes match",
+        __FILE__, __LINE__);
+  const KernelCode code = convertCode(inType, outType, numel, scale, offset);
+  const size_t nWorkgroups = cdiv(cdiv(numel, 4), code.workgroupSize[0]);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  return createKernel(ctx, code, Bindings{in, out},
+                      {wgX, cdiv(nWorkgroups, wgX), 1});
+}
+
+/**
+ * @brief A tensor paired with a compact staging tensor and the kernels
+ * converting between them, for uploads and readbacks in transferType.
+ */
+struct CompactTransfer {
+  Tensor tensor;  // destination, of dtype
+  Tensor staging; // same shape, of transferType
+  NumType dtype;
+  NumType transferType;
+  Kernel expand;   // staging -> tensor
+  Kernel compress; // tensor -> staging
+};
+
+/**
+ * @brief Creates the staging tensor and conversion kernels for transfers of
+ * tensor in transferType.
+ *
+ * Uploads compute tensor = staging * scale + offset, readbacks the inverse
+ * staging = (tensor - offset) / scale, so that e.g. u8 image data with scale
+ * 1 / 255 maps to [0, 1] on the GPU and back.
+ *
+ * @param[in] ctx Context instance to manage the transfer
+ * @param[in] tensor Destination tensor
+ * @param[in] dtype Dtype of tensor
+ * @param[in] transferType Compact type crossing the bus (kf16, kbf16, ku8)
+ * @param[in] scale Scale of the transfer type values
+ * @param[in] offset Offset of the transfer type values
+ * @return CompactTransfer used with toGPU() and toCPU()
+ */
+inline CompactTransfer createCompactTransfer(Context &ctx, Tensor &tensor,
+                                             NumType dtype,
+                                             NumType transferType,
+                                             float scale = 1.0f,
+                                             float offset = 0.0f) {
+  CompactTransfer transfer;
+  transfer.tensor = tensor;
+  transfer.staging = createTensor(ctx, tensor.shape, transferType);
+  transfer.dtype = dtype;
+  transfer.transferType = transferType;
+  transfer.expand = createConvert(ctx, transfer.staging, transferType,
+                                  transfer.tensor, dtype, scale, offset);
+  transfer.compress =
+      createConvert(ctx, transfer.tensor, dtype, transfer.staging,
+                    transferType, 1.0f / scale, -offset / scale);
+  return transfer;
+}
+
+/**
+ * @brief Runs a conversion kernel of a transfer and prepares it for reuse.
+ */
+inline void runConversion(Context &ctx, Kernel &op) {
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  resetCommandBuffer(ctx.device, op);
+}
+
+/**
+ * @brief Uploads data of the transfer type to the staging tensor and expands
+ * it into the destination tensor.
+ *
+ * @code
+ * toGPU(ctx, halves.data(), transfer);
+ * @endcode
+ */
+inline void toGPU(Context &ctx, const half *data, CompactTransfer &transfer) {
+  check(transfer.transferType == kf16, "Transfer type is kf16", __FILE__,
+        __LINE__);
+  toGPU(ctx, data, transfer.staging);
+  runConversion(ctx, transfer.expand);
+}
+
+inline void toGPU(Context &ctx, const bf16 *data, CompactTransfer &transfer) {
+  check(transfer.transferType == kbf16, "Transfer type is kbf16", __FILE__,
+        __LINE__);
+  toGPU(ctx, data, transfer.staging);
+  runConversion(ctx, transfer.expand);
+}
+
+inline void toGPU(Context &ctx, const uint8_t *data,
+                  CompactTransfer &transfer) {
+  check(transfer.transferType == ku8, "Transfer type is ku8", __FILE__,
+        __LINE__);
+  toGPU(ctx, data, transfer.staging);
+  runConversion(ctx, transfer.expand);
+}
+
+/**
+ * @brief Compresses the destination tensor into the staging tensor and reads
+ * it back in the transfer type.
+ *
+ * @code
+ * toCPU(ctx, transfer, halves.data());
+ * @endcode
+ */
+inline void toCPU(Context &ctx, CompactTransfer &transfer, half *data) {
+  check(transfer.transferType == kf16, "Transfer type is kf16", __FILE__,
+        __LINE__);
+  runConversion(ctx, transfer.compress);
+  toCPU(ctx, transfer.staging, data);
+}
+
+inline void toCPU(Context &ctx, CompactTransfer &transfer, bf16 *data) {
+  check(transfer.transferType == kbf16, "Transfer type is kbf16", __FILE__,
+        __LINE__);
+  runConversion(ctx, transfer.compress);
+  toCPU(ctx, transfer.staging, data);
+}
+
+inline void toCPU(Context &ctx, CompactTransfer &transfer, uint8_t *data) {
+  check(transfer.transferType == ku8, "Transfer type is ku8", __FILE__,
+        __LINE__);
+  runConversion(ctx, transfer.compress);
+  toCPU(ctx, transfer.staging, data);
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_CONVERT_H
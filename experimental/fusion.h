@@ -0,0 +1,543 @@
+#ifndef GPU_CPP_FUSION_H
+#define GPU_CPP_FUSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gpu.h"
+#include "experimental/views.h"
+
+namespace gpu {
+
+/**
+ * Elementwise fusion DSL. Expressions are built from tensors with the usual
+ * arithmetic operators and pointwise functions, and fuse() turns a whole
+ * expression into a single kernel which reads each input once, evaluates the
+ * expression in registers and writes the output once:
+ *
+ * @code
+ * using namespace gpu::fusion;
+ * Expr a = input(tA), b = input(tB), c = input(tC);
+ * Kernel op = fuse(ctx, gelu(a) * b + c, out);
+ * @endcode
+ *
+ * The functions live in their own namespace so that names like exp or tanh do
+ * not hide the scalar math functions inside namespace gpu, they are found by
+ * argument dependent lookup on Expr.
+ */
+namespace fusion {
+
+enum Op {
+  kInput,
+  kConst,
+  kAdd,
+  kSub,
+  kMul,
+  kDiv,
+  kMax,
+  kMin,
+  kNeg,
+  kExp,
+  kTanh,
+  kSigmoid,
+  kRelu,
+  kSilu,
+  kGelu,
+};
+
+/**
+ * @brief Node of an expression DAG. Subexpressions used more than once are
+ * shared nodes and are evaluated once by the generated kernel.
+ */
+struct ExprNode {
+  Op op;
+  Tensor tensor;        // kInput only
+  StridedView view;     // kInput read through a non-contiguous view only
+  bool strided = false; // whether view is used
+  float value = 0;      // kConst only
+  std::vector<std::shared_ptr<const ExprNode>> args;
+};
+
+/**
+ * @brief Handle to an expression, cheap to copy.
+ */
+struct Expr {
+  std::shared_ptr<const ExprNode> node;
+};
+
+/**
+ * @brief Leaf expression reading tensor t elementwise.
+ */
+inline Expr input(const Tensor &t) {
+  auto node = std::make_shared<ExprNode>();
+  node->op = kInput;
+  node->tensor = t;
+  return Expr{node};
+}
+
+/**
+ * @brief Leaf expression reading a strided view elementwise, in row-major
+ * order over the view shape, e.g. a transposed, sliced or broadcast tensor.
+ * Non-contiguous views are read through a generated index function, without
+ * vec4 loads.
+ *
+ * @code
+ * Kernel op = fuse(ctx, input(view(x)) + input(broadcastTo(view(b), {T, C})),
+ *                  out);
+ * @endcode
+ */
+inline Expr input(const StridedView &v) {
+  if (isContiguous(v)) {
+    return input(Tensor{v.data.data, v.shape});
+  }
+  auto node = std::make_shared<ExprNode>();
+  node->op = kInput;
+  node->tensor = v.data;
+  node->view = v;
+  node->strided = true;
+  return Expr{node};
+}
+
+/**
+ * @brief Leaf expression broadcasting a scalar constant, which is baked into
+ * the generated WGSL.
+ */
+inline Expr constant(float value) {
+  check(std::isfinite(value), "Fusion constant is finite", __FILE__, __LINE__);
+  auto node = std::make_shared<ExprNode>();
+  node->op = kConst;
+  node->value = value;
+  return Expr{node};
+}
+
+inline Expr apply(Op op, const Expr &x) {
+  auto node = std::make_shared<ExprNode>();
+  node->op = op;
+  node->args = {x.node};
+  return Expr{node};
+}
+
+inline Expr apply(Op op, const Expr &x, const Expr &y) {
+  auto node = std::make_shared<ExprNode>();
+  node->op = op;
+  node->args = {x.node, y.node};
+  return Expr{node};
+}
+
+inline Expr operator+(const Expr &x, const Expr &y) { return apply(kAdd, x, y); }
+inline Expr operator-(const Expr &x, const Expr &y) { return apply(kSub, x, y); }
+inline Expr operator*(const Expr &x, const Expr &y) { return apply(kMul, x, y); }
+inline Expr operator/(const Expr &x, const Expr &y) { return apply(kDiv, x, y); }
+inline Expr operator+(const Expr &x, float y) { return x + constant(y); }
+inline Expr operator-(const Expr &x, float y) { return x - constant(y); }
+inline Expr operator*(const Expr &x, float y) { return x * constant(y); }
+inline Expr operator/(const Expr &x, float y) { return x / constant(y); }
+inline Expr operator+(float x, const Expr &y) { return constant(x) + y; }
+inline Expr operator-(float x, const Expr &y) { return constant(x) - y; }
+inline Expr operator*(float x, const Expr &y) { return constant(x) * y; }
+inline Expr operator/(float x, const Expr &y) { return constant(x) / y; }
+inline Expr operator-(const Expr &x) { return apply(kNeg, x); }
+inline Expr max(const Expr &x, const Expr &y) { return apply(kMax, x, y); }
+inline Expr min(const Expr &x, const Expr &y) { return apply(kMin, x, y); }
+inline Expr exp(const Expr &x) { return apply(kExp, x); }
+inline Expr tanh(const Expr &x) { return apply(kTanh, x); }
+inline Expr sigmoid(const Expr &x) { return apply(kSigmoid, x); }
+inline Expr relu(const Expr &x) { return apply(kRelu, x); }
+inline Expr silu(const Expr &x) { return apply(kSilu, x); }
+inline Expr gelu(const Expr &x) { return apply(kGelu, x); }
+
+/**
+ * @brief Result of lowering an expression: the distinct input tensors in
+ * binding order, the WGSL statements evaluating the expression and a
+ * signature which identifies the generated code independently of which
+ * buffers are bound.
+ *
+ * Views of the same buffer share its binding, since WebGPU does not allow
+ * a buffer to be bound twice for writable storage. Each distinct view gets
+ * an index function viewN.
+ */
+struct FusedExpr {
+  std::vector<Tensor> inputs;
+  std::string body;
+  std::string result;
+  std::string signature;
+  std::vector<StridedView> views;
+  std::vector<size_t> leafSizes; // elements of every leaf read
+};
+
+/**
+ * @brief Lowers an expression DAG to WGSL statements over values of type T
+ * (f32 or vec4<f32>). Inputs are numbered by first use, shared nodes get a
+ * single temporary.
+ */
+inline std::string lower(const std::shared_ptr<const ExprNode> &node,
+                         const std::string &T, FusedExpr &fused,
+                         std::map<const ExprNode *, std::string> &names,
+                         std::map<const ExprNode *, std::string> &signatures) {
+  auto found = names.find(node.get());
+  if (found != names.end()) {
+    fused.signature += signatures[node.get()];
+    return found->second;
+  }
+  const size_t sigStart = fused.signature.size();
+  std::string expr;
+  if (node->op == kInput) {
+    size_t idx = 0;
+    while (idx < fused.inputs.size() &&
+           fused.inputs[idx].data.buffer != node->tensor.data.buffer) {
+      ++idx;
+    }
+    if (idx == fused.inputs.size()) {
+      fused.inputs.push_back(node->tensor);
+    }
+    fused.signature += "in" + std::to_string(idx);
+    if (node->strided) {
+      const std::string signature = viewSignature(node->view);
+      size_t viewIdx = 0;
+      while (viewIdx < fused.views.size() &&
+             (fused.views[viewIdx].data.data.buffer !=
+                  node->tensor.data.buffer ||
+              viewSignature(fused.views[viewIdx]) != signature)) {
+        ++viewIdx;
+      }
+      if (viewIdx == fused.views.size()) {
+        fused.views.push_back(node->view);
+      }
+      fused.signature += signature;
+      fused.leafSizes.push_back(size(node->view.shape));
+      expr = T + "(in" + std::to_string(idx) + "[view" +
+             std::to_string(viewIdx) + "(idx)])";
+    } else {
+      fused.leafSizes.push_back(size(node->tensor.shape));
+      expr = T + "(in" + std::to_string(idx) + "[idx])";
+    }
+  } else if (node->op == kConst) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", node->value);
+    fused.signature += buf;
+    expr = T + "(" + std::string(buf) + ")";
+  } else {
+    static const char *kOpNames[] = {"in",  "const", "add",     "sub",
+                                     "mul", "div",   "max",     "min",
+                                     "neg", "exp",   "tanh",    "sigmoid",
+                                     "relu", "silu", "gelu"};
+    fused.signature += std::string(kOpNames[node->op]) + "(";
+    std::vector<std::string> args;
+    for (size_t i = 0; i < node->args.size(); ++i) {
+      if (i > 0) {
+        fused.signature += ",";
+      }
+      args.push_back(lower(node->args[i], T, fused, names, signatures));
+    }
+    fused.signature += ")";
+    switch (node->op) {
+    case kAdd:
+      expr = args[0] + " + " + args[1];
+      break;
+    case kSub:
+      expr = args[0] + " - " + args[1];
+      break;
+    case kMul:
+      expr = args[0] + " * " + args[1];
+      break;
+    case kDiv:
+      expr = args[0] + " / " + args[1];
+      break;
+    case kMax:
+      expr = "max(" + args[0] + ", " + args[1] + ")";
+      break;
+    case kMin:
+      expr = "min(" + args[0] + ", " + args[1] + ")";
+      break;
+    case kNeg:
+      expr = "-" + args[0];
+      break;
+    case kExp:
+      expr = "exp(" + args[0] + ")";
+      break;
+    case kTanh:
+      expr = "tanh(" + args[0] + ")";
+      break;
+    case kSigmoid:
+      expr = "1.0 / (1.0 + exp(-" + args[0] + "))";
+      break;
+    case kRelu:
+      expr = "max(" + args[0] + ", " + T + "(0.0))";
+      break;
+    case kSilu:
+      expr = args[0] + " / (1.0 + exp(-" + args[0] + "))";
+      break;
+    case kGelu:
+      // select is more stable for larger values of x, as in kShaderGelu
+      expr = "select(0.5 * " + args[0] + " * (1.0 + tanh(GELU_SCALING_FACTOR * (" +
+             args[0] + " + 0.044715 * " + args[0] + " * " + args[0] + " * " +
+             args[0] + "))), " + args[0] + ", " + args[0] + " > " + T +
+             "(10.0))";
+      break;
+    default:
+      break;
+    }
+  }
+  const std::string name = "t" + std::to_string(names.size());
+  fused.body += "    let " + name + ": " + T + " = " + expr + ";\n";
+  names[node.get()] = name;
+  signatures[node.get()] = fused.signature.substr(sigStart);
+  return name;
+}
+
+/**
+ * @brief Lowers an expression, see FusedExpr.
+ */
+inline FusedExpr lower(const Expr &expr, const std::string &T) {
+  FusedExpr fused;
+  std::map<const ExprNode *, std::string> names, signatures;
+  fused.result = lower(expr.node, T, fused, names, signatures);
+  return fused;
+}
+
+/* Fused elementwise kernel
+ * - One thread per vec{{V}} of the output, inputs are read once and all
+ *   intermediate values stay in registers.
+ * - 2D grid so that large tensors are not limited by 65535 workgroups in x.
+ */
+static const char *kShaderFused = R"(
+const GELU_SCALING_FACTOR: f32 = 0.7978845608028654; // sqrt(2.0 / PI)
+{{BINDINGS}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let idx: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (idx >= {{NUM_VECS}}) {
+        return;
+    }
+{{BODY}}
+    out[idx] = {{STORE}};
+}
+)";
+
+/**
+ * @brief Caches fused kernels by expression signature, size, precision and
+ * the sizes of the bound tensors, so that re-fusing the same expression, e.g.
+ * once per step of a training or decoding loop, costs neither code generation
+ * nor pipeline creation. Buffers are not part of the key: a hit binds the
+ * current tensors with a new bind group, so kernels never refer to buffers
+ * freed since they were created.
+ */
+struct FusionCache {
+  std::unordered_map<std::string, Kernel> kernels;
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+/**
+ * @brief Generates the WGSL for an expression written to a tensor of numel
+ * elements.
+ *
+ * @param[in] expr Expression to evaluate
+ * @param[in] numel Number of elements of the output and of every input
+ * @param[in] precision Storage type of the tensors, arithmetic is in f32
+ * @param[out] fused Lowered expression with the inputs in binding order
+ * @return KernelCode of the fused kernel
+ */
+inline KernelCode fusedCode(const Expr &expr, size_t numel, NumType precision,
+                            FusedExpr &fused) {
+  check(precision == kf32 || precision == kf16,
+        "Fused kernels store kf32 or kf16", __FILE__, __LINE__);
+  size_t V = numel % 4 == 0 ? 4 : 1;
+  fused = lower(expr, V == 4 ? "vec4<f32>" : "f32");
+  if (V == 4 && !fused.views.empty()) {
+    // Views are read one element at a time
+    V = 1;
+    fused = lower(expr, "f32");
+  }
+  const std::string storage =
+      V == 4 ? "vec4<{{precision}}>" : "{{precision}}";
+  std::string bindings;
+  for (size_t i = 0; i <= fused.inputs.size(); ++i) {
+    const std::string name =
+        i < fused.inputs.size() ? "in" + std::to_string(i) : "out";
+    bindings += "@group(0) @binding(" + std::to_string(i) +
+                ") var<storage, read_write> " + name + ": array<" + storage +
+                ">;\n";
+  }
+  for (size_t i = 0; i < fused.views.size(); ++i) {
+    bindings += viewIndexFunction("view" + std::to_string(i), fused.views[i]);
+  }
+  static constexpr size_t wgSize = 256;
+  const size_t numVecs = numel / V;
+  const size_t nWorkgroups = cdiv(numVecs, wgSize);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  std::string code = kShaderFused;
+  replaceAll(code, {{"{{BINDINGS}}", bindings},
+                    {"{{BODY}}", fused.body},
+                    {"{{STORE}}", storage + "(" + fused.result + ")"},
+                    {"{{X_THREADS}}", toString(wgX * wgSize)},
+                    {"{{NUM_VECS}}", toString(numVecs)}});
+  if (precision == kf16) {
+    code = "enable f16;\n" + code;
+  }
+  return KernelCode{code, Shape{wgSize, 1, 1}, precision};
+}
+
+/**
+ * @brief Creates the kernel for generated code, binding the lowered inputs
+ * followed by the output.
+ */
+inline Kernel createFusedKernel(Context &ctx, const KernelCode &code,
+                                const std::vector<Tensor> &inputs,
+                                Tensor &out) {
+  const size_t numel = size(out.shape);
+  std::vector<Tensor> bindings = inputs;
+  for (const Tensor &t : inputs) {
+    check(size(t.shape) == numel, "Fused inputs match the output size",
+          __FILE__, __LINE__);
+    check(t.data.buffer != out.data.buffer, "Fused output is not an input",
+          __FILE__, __LINE__);
+  }
+  bindings.push_back(out);
+  std::vector<size_t> viewOffsets(bindings.size(), 0);
+  const size_t numVecs = numel % 4 == 0 ? numel / 4 : numel;
+  const size_t nWorkgroups = cdiv(numVecs, code.workgroupSize[0]);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  return createKernel(ctx, code, bindings.data(), bindings.size(),
+                      viewOffsets.data(), {wgX, cdiv(nWorkgroups, wgX), 1});
+}
+
+/**
+ * @brief Overload for a lowered expression, whose inputs may be read through
+ * views of a different size than the bound tensors.
+ */
+inline Kernel createFusedKernel(Context &ctx, const KernelCode &code,
+                                const FusedExpr &fused, Tensor &out) {
+  const size_t numel = size(out.shape);
+  for (size_t leafSize : fused.leafSizes) {
+    check(leafSize == numel, "Fused inputs match the output size", __FILE__,
+          __LINE__);
+  }
+  std::vector<Tensor> bindings = fused.inputs;
+  for (const Tensor &t : fused.inputs) {
+    check(t.data.buffer != out.data.buffer, "Fused output is not an input",
+          __FILE__, __LINE__);
+  }
+  bindings.push_back(out);
+  std::vector<size_t> viewOffsets(bindings.size(), 0);
+  const size_t numVecs =
+      numel % 4 == 0 && fused.views.empty() ? numel / 4 : numel;
+  const size_t nWorkgroups = cdiv(numVecs, code.workgroupSize[0]);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  return createKernel(ctx, code, bindings.data(), bindings.size(),
+                      viewOffsets.data(), {wgX, cdiv(nWorkgroups, wgX), 1});
+}
+
+/**
+ * @brief Binds a fused kernel to other tensors of the same sizes as the ones
+ * it was created with, replacing its bind group, and re-records its command
+ * buffer.
+ */
+inline void rebindFusedKernel(Context &ctx, Kernel &op,
+                              const std::vector<Tensor> &inputs,
+                              const Tensor &out) {
+  check(inputs.size() + 1 == op.numBindings,
+        "Rebound fused kernel has the same number of bindings", __FILE__,
+        __LINE__);
+  std::vector<WGPUBindGroupEntry> entries(op.numBindings);
+  for (size_t i = 0; i < op.numBindings; ++i) {
+    const Tensor &t = i < inputs.size() ? inputs[i] : out;
+    check(t.data.size == op.bufferSizes[i],
+          "Rebound tensors have the sizes of the bound ones", __FILE__,
+          __LINE__);
+    check(i == inputs.size() || t.data.buffer != out.data.buffer,
+          "Fused output is not an input", __FILE__, __LINE__);
+    op.buffers[i] = t.data.buffer;
+    entries[i] = WGPUBindGroupEntry{
+        .binding = static_cast<uint32_t>(i),
+        .buffer = t.data.buffer,
+        .offset = 0,
+        .size = t.data.size,
+    };
+  }
+  WGPUBindGroupLayout layout =
+      wgpuComputePipelineGetBindGroupLayout(op.computePipeline, 0);
+  WGPUBindGroupDescriptor bindGroupDesc = {
+      .layout = layout,
+      .entryCount = static_cast<uint32_t>(entries.size()),
+      .entries = entries.data(),
+  };
+  WGPUBindGroup bindGroup =
+      wgpuDeviceCreateBindGroup(ctx.device, &bindGroupDesc);
+  wgpuBindGroupLayoutRelease(layout);
+  wgpuBindGroupRelease(op.bindGroup);
+  op.bindGroup = bindGroup;
+  resetCommandBuffer(ctx.device, op);
+}
+
+/**
+ * @brief Creates a single kernel evaluating expr elementwise into out.
+ *
+ * All inputs must have the same number of elements as out. When that number
+ * is a multiple of 4 the kernel loads and stores vec4 values.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] expr Expression over input() tensors
+ * @param[out] out Output tensor, must not be an input of expr
+ * @param[in] precision Storage type of the tensors
+ * @return Kernel instance, dispatched with dispatchKernel()
+ *
+ * @code
+ * Kernel op = fuse(ctx, gelu(a) * b + c, out);
+ * @endcode
+ */
+inline Kernel fuse(Context &ctx, const Expr &expr, Tensor &out,
+                   NumType precision = kf32) {
+  FusedExpr fused;
+  KernelCode code = fusedCode(expr, size(out.shape), precision, fused);
+  return createFusedKernel(ctx, code, fused, out);
+}
+
+/**
+ * @brief Cached overload of fuse(). Returns a kernel owned by the cache with
+ * a freshly recorded command buffer, ready for dispatchKernel().
+ *
+ * @code
+ * FusionCache cache;
+ * for (...) {
+ *   Kernel &op = fuse(ctx, cache, gelu(a) * b + c, out);
+ *   dispatchKernel(ctx, op, promise);
+ * }
+ * @endcode
+ */
+inline Kernel &fuse(Context &ctx, FusionCache &cache, const Expr &expr,
+                    Tensor &out, NumType precision = kf32) {
+  const size_t numel = size(out.shape);
+  // Only the signature and inputs are needed for the lookup, lowering is
+  // cheap compared to compiling the pipeline
+  FusedExpr fused = lower(expr, "T");
+  std::string key = fused.signature + ":" + toString(numel) + ":" +
+                    toString(precision);
+  for (const Tensor &t : fused.inputs) {
+    key += ":" + std::to_string(t.data.size);
+  }
+  auto kernel = cache.kernels.find(key);
+  if (kernel != cache.kernels.end()) {
+    ++cache.hits;
+    rebindFusedKernel(ctx, kernel->second, fused.inputs, out);
+    return kernel->second;
+  }
+  ++cache.misses;
+  KernelCode code = fusedCode(expr, numel, precision, fused);
+  return cache.kernels.emplace(key, createFusedKernel(ctx, code, fused, out))
+      .first->second;
+}
+
+} // namespace fusion
+
+} // namespace gpu
+
+#endif // GPU_CPP_FUSION_H
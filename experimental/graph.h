@@ -0,0 +1,483 @@
+#ifndef GPU_CPP_GRAPH_H
+#define GPU_CPP_GRAPH_H
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+#include "experimental/fusion.h"
+
+namespace gpu {
+
+/**
+ * Opt-in lazy execution. Instead of creating, dispatching and waiting on one
+ * kernel per operation, operations on LazyTensor handles record nodes in a
+ * Graph and nothing runs until evaluate(), which optimizes the whole graph:
+ *
+ * 1. Dead node elimination: only nodes the requested outputs depend on run.
+ * 2. Elementwise fusion: chains of pointwise ops with a single consumer are
+ *    inlined into one fused kernel (see experimental/fusion.h).
+ * 3. Topological ordering: kernels are scheduled depth first from the
+ *    outputs so producers run right before their consumers.
+ * 4. Buffer reuse: intermediates whose last consumer has run hand their GPU
+ *    buffer to later intermediates of the same size.
+ * 5. Batched submission: all command buffers go to the queue in one submit
+ *    with a single wait.
+ *
+ * @code
+ * Graph graph;
+ * LazyTensor x = lazy(graph, input);
+ * LazyTensor h = customOp(graph, {x, w}, Shape{T, H}, matmulBuilder);
+ * Tensor y = evaluate(ctx, graph, gelu(h) * 0.5f + x2);
+ * @endcode
+ */
+
+struct Graph;
+
+/**
+ * @brief Handle to a node of a Graph.
+ */
+struct LazyTensor {
+  Graph *graph;
+  size_t id;
+};
+
+/**
+ * @brief Creates the kernel of a custom op given the materialized input
+ * tensors and the output tensor.
+ */
+using KernelBuilder =
+    std::function<Kernel(Context &, std::vector<Tensor> &, Tensor &)>;
+
+struct GraphNode {
+  enum Kind { kLeaf, kConstant, kElementwise, kOp };
+  Kind kind;
+  Shape shape;
+  NumType dtype = kf32;
+  std::vector<size_t> inputs;
+  fusion::Op op = fusion::kInput; // kElementwise only
+  float value = 0.0f;             // kConstant only
+  KernelBuilder build;            // kOp only
+  std::string label;
+  Tensor tensor{}; // leaf tensor, or the buffer assigned by evaluate()
+};
+
+/**
+ * @brief What the passes of the last evaluate() did.
+ */
+struct GraphStats {
+  size_t numNodes = 0;         // nodes recorded
+  size_t numLive = 0;          // nodes left after dead node elimination
+  size_t numKernels = 0;       // kernels dispatched
+  size_t numFused = 0;         // elementwise nodes inlined into a consumer
+  size_t numIntermediates = 0; // materialized nodes which are not outputs
+  size_t numBuffers = 0;       // buffers allocated for the intermediates
+  size_t intermediateBytes = 0;
+  size_t allocatedBytes = 0;
+};
+
+struct Graph {
+  std::vector<GraphNode> nodes;
+  GraphStats stats;
+  // Plan of the last evaluate(), re-run as is while the graph and requested
+  // outputs are unchanged
+  std::vector<size_t> planOutputs;
+  size_t planNumNodes = 0;
+  std::vector<Kernel> kernels;
+  // Buffers allocated by the last plan, recycled or freed by the next one
+  std::vector<Tensor> buffers;
+};
+
+/**
+ * @brief Records an existing tensor as a leaf of the graph.
+ */
+inline LazyTensor lazy(Graph &graph, const Tensor &tensor) {
+  GraphNode node{.kind = GraphNode::kLeaf, .shape = tensor.shape};
+  node.tensor = tensor;
+  node.label = "leaf";
+  graph.nodes.push_back(node);
+  return LazyTensor{&graph, graph.nodes.size() - 1};
+}
+
+/**
+ * @brief Records an op with a custom kernel, e.g. a matmul or attention.
+ *
+ * @param[in] graph Graph to record into
+ * @param[in] inputs Input nodes, materialized before the op runs
+ * @param[in] shape Output shape
+ * @param[in] build Creates the kernel from the input and output tensors
+ * @param[in] label Name used in logs
+ * @param[in] dtype Output element type
+ * @return Handle to the output
+ */
+inline LazyTensor customOp(Graph &graph, const std::vector<LazyTensor> &inputs,
+                           const Shape &shape, KernelBuilder build,
+                           const std::string &label = "op",
+                           NumType dtype = kf32) {
+  GraphNode node{.kind = GraphNode::kOp, .shape = shape, .dtype = dtype};
+  for (const LazyTensor &t : inputs) {
+    check(t.graph == &graph &&
+              graph.nodes[t.id].kind != GraphNode::kConstant,
+          "Op inputs are tensors of the graph", __FILE__, __LINE__);
+    node.inputs.push_back(t.id);
+  }
+  node.build = std::move(build);
+  node.label = label;
+  graph.nodes.push_back(std::move(node));
+  return LazyTensor{&graph, graph.nodes.size() - 1};
+}
+
+inline LazyTensor elementwise(fusion::Op op, const LazyTensor &x) {
+  Graph &graph = *x.graph;
+  GraphNode node{.kind = GraphNode::kElementwise,
+                 .shape = graph.nodes[x.id].shape,
+                 .dtype = graph.nodes[x.id].dtype,
+                 .inputs = {x.id},
+                 .op = op};
+  node.label = "elementwise";
+  graph.nodes.push_back(node);
+  return LazyTensor{&graph, graph.nodes.size() - 1};
+}
+
+inline LazyTensor elementwise(fusion::Op op, const LazyTensor &x,
+                              const LazyTensor &y) {
+  check(x.graph == y.graph, "Operands belong to the same graph", __FILE__,
+        __LINE__);
+  Graph &graph = *x.graph;
+  const GraphNode &a = graph.nodes[x.id];
+  const GraphNode &b = graph.nodes[y.id];
+  // Constants broadcast, everything else is strictly elementwise
+  check(a.kind == GraphNode::kConstant || b.kind == GraphNode::kConstant ||
+            size(a.shape) == size(b.shape),
+        "Elementwise operand sizes match", __FILE__, __LINE__);
+  GraphNode node{.kind = GraphNode::kElementwise,
+                 .shape = a.kind == GraphNode::kConstant ? b.shape : a.shape,
+                 .dtype = a.kind == GraphNode::kConstant ? b.dtype : a.dtype,
+                 .inputs = {x.id, y.id},
+                 .op = op};
+  node.label = "elementwise";
+  graph.nodes.push_back(node);
+  return LazyTensor{&graph, graph.nodes.size() - 1};
+}
+
+inline LazyTensor constant(Graph &graph, float value) {
+  GraphNode node{.kind = GraphNode::kConstant, .shape = Shape{1}};
+  node.value = value;
+  node.label = "constant";
+  graph.nodes.push_back(node);
+  return LazyTensor{&graph, graph.nodes.size() - 1};
+}
+
+inline LazyTensor operator+(const LazyTensor &x, const LazyTensor &y) {
+  return elementwise(fusion::kAdd, x, y);
+}
+inline LazyTensor operator-(const LazyTensor &x, const LazyTensor &y) {
+  return elementwise(fusion::kSub, x, y);
+}
+inline LazyTensor operator*(const LazyTensor &x, const LazyTensor &y) {
+  return elementwise(fusion::kMul, x, y);
+}
+inline LazyTensor operator/(const LazyTensor &x, const LazyTensor &y) {
+  return elementwise(fusion::kDiv, x, y);
+}
+inline LazyTensor operator+(const LazyTensor &x, float y) {
+  return x + constant(*x.graph, y);
+}
+inline LazyTensor operator*(const LazyTensor &x, float y) {
+  return x * constant(*x.graph, y);
+}
+inline LazyTensor operator*(float x, const LazyTensor &y) {
+  return constant(*y.graph, x) * y;
+}
+inline LazyTensor operator-(const LazyTensor &x) {
+  return elementwise(fusion::kNeg, x);
+}
+inline LazyTensor gelu(const LazyTensor &x) {
+  return elementwise(fusion::kGelu, x);
+}
+inline LazyTensor relu(const LazyTensor &x) {
+  return elementwise(fusion::kRelu, x);
+}
+inline LazyTensor silu(const LazyTensor &x) {
+  return elementwise(fusion::kSilu, x);
+}
+inline LazyTensor sigmoid(const LazyTensor &x) {
+  return elementwise(fusion::kSigmoid, x);
+}
+
+/**
+ * @brief Builds the fused expression of an elementwise node, inlining
+ * producers which are not materialized.
+ */
+inline fusion::Expr fusedExpr(const Graph &graph, size_t id, size_t root,
+                              const std::vector<bool> &materialized) {
+  const GraphNode &node = graph.nodes[id];
+  if (node.kind == GraphNode::kConstant) {
+    return fusion::constant(node.value);
+  }
+  if (id != root && materialized[id]) {
+    return fusion::input(node.tensor);
+  }
+  if (node.inputs.size() == 1) {
+    return fusion::apply(node.op,
+                         fusedExpr(graph, node.inputs[0], root, materialized));
+  }
+  return fusion::apply(node.op,
+                       fusedExpr(graph, node.inputs[0], root, materialized),
+                       fusedExpr(graph, node.inputs[1], root, materialized));
+}
+
+/**
+ * @brief Materialized nodes a kernel reads: the inputs of an op, or the
+ * leaves of the inlined expression tree of a fused elementwise node.
+ */
+inline void kernelDeps(const Graph &graph, size_t id, size_t root,
+                       const std::vector<bool> &materialized,
+                       std::vector<size_t> &deps) {
+  const GraphNode &node = graph.nodes[id];
+  if (node.kind == GraphNode::kConstant) {
+    return;
+  }
+  if (id != root && materialized[id]) {
+    if (std::find(deps.begin(), deps.end(), id) == deps.end()) {
+      deps.push_back(id);
+    }
+    return;
+  }
+  for (size_t input : node.inputs) {
+    kernelDeps(graph, input, root, materialized, deps);
+  }
+}
+
+inline void scheduleNode(const Graph &graph, size_t id,
+                         const std::vector<bool> &materialized,
+                         std::vector<bool> &visited,
+                         std::vector<size_t> &order) {
+  if (visited[id]) {
+    return;
+  }
+  visited[id] = true;
+  std::vector<size_t> deps;
+  kernelDeps(graph, id, id, materialized, deps);
+  for (size_t d : deps) {
+    if (graph.nodes[d].kind != GraphNode::kLeaf) {
+      scheduleNode(graph, d, materialized, visited, order);
+    }
+  }
+  order.push_back(id);
+}
+
+inline void submitGraph(Context &ctx, Graph &graph) {
+  std::vector<WGPUCommandBuffer> commandBuffers;
+  for (Kernel &kernel : graph.kernels) {
+    commandBuffers.push_back(kernel.commandBuffer);
+  }
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  wgpuQueueSubmit(ctx.queue, commandBuffers.size(), commandBuffers.data());
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *data) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        auto *promise = static_cast<std::promise<void> *>(data);
+        promise->set_value();
+      },
+      &promise);
+  wait(ctx, future);
+}
+
+/**
+ * @brief Optimizes and runs the part of the graph the outputs depend on and
+ * waits for completion.
+ *
+ * Calling evaluate() again with the same outputs and no new nodes re-submits
+ * the kernels of the previous call, so leaf tensors can be updated with
+ * toGPU() between calls. Otherwise the graph is replanned, recycling the
+ * previous plan's buffers where the sizes match and freeing the rest, so
+ * output tensors stay valid only until the next replan.
+ *
+ * @param[in] ctx Context instance to manage the kernels and buffers
+ * @param[in] graph Graph to evaluate
+ * @param[in] outputs Nodes to compute
+ * @return Output tensors, in the order of outputs
+ */
+inline std::vector<Tensor> evaluate(Context &ctx, Graph &graph,
+                                    const std::vector<LazyTensor> &outputs) {
+  const size_t n = graph.nodes.size();
+  std::vector<size_t> outputIds;
+  for (const LazyTensor &t : outputs) {
+    check(t.graph == &graph, "Outputs belong to the graph", __FILE__,
+          __LINE__);
+    outputIds.push_back(t.id);
+  }
+  auto results = [&]() {
+    std::vector<Tensor> tensors;
+    for (size_t id : outputIds) {
+      tensors.push_back(graph.nodes[id].tensor);
+    }
+    return tensors;
+  };
+  if (outputIds == graph.planOutputs && n == graph.planNumNodes) {
+    for (Kernel &kernel : graph.kernels) {
+      resetCommandBuffer(ctx.device, kernel);
+    }
+    submitGraph(ctx, graph);
+    return results();
+  }
+
+  // Dead node elimination
+  std::vector<bool> live(n, false), isOutput(n, false);
+  std::vector<size_t> stack = outputIds;
+  for (size_t id : outputIds) {
+    isOutput[id] = true;
+  }
+  while (!stack.empty()) {
+    const size_t id = stack.back();
+    stack.pop_back();
+    if (live[id]) {
+      continue;
+    }
+    live[id] = true;
+    for (size_t input : graph.nodes[id].inputs) {
+      stack.push_back(input);
+    }
+  }
+
+  // Elementwise fusion: an elementwise node is inlined into its consumer if
+  // that is its only use and the consumer is elementwise as well
+  std::vector<size_t> uses(n, 0);
+  std::vector<bool> elementwiseUse(n, true);
+  GraphStats stats;
+  stats.numNodes = n;
+  for (size_t id = 0; id < n; ++id) {
+    if (!live[id]) {
+      continue;
+    }
+    ++stats.numLive;
+    for (size_t input : graph.nodes[id].inputs) {
+      ++uses[input];
+      elementwiseUse[input] = elementwiseUse[input] &&
+                              graph.nodes[id].kind == GraphNode::kElementwise;
+    }
+  }
+  std::vector<bool> materialized(n, false);
+  for (size_t id = 0; id < n; ++id) {
+    const GraphNode &node = graph.nodes[id];
+    if (!live[id] || node.kind == GraphNode::kConstant) {
+      continue;
+    }
+    materialized[id] = node.kind != GraphNode::kElementwise || isOutput[id] ||
+                       uses[id] != 1 || !elementwiseUse[id];
+    stats.numFused += node.kind == GraphNode::kElementwise && !materialized[id];
+  }
+
+  // Topological order of the kernels, depth first from the outputs
+  std::vector<bool> visited(n, false);
+  std::vector<size_t> order;
+  for (size_t id : outputIds) {
+    if (graph.nodes[id].kind != GraphNode::kLeaf) {
+      scheduleNode(graph, id, materialized, visited, order);
+    }
+  }
+  std::vector<std::vector<size_t>> deps(order.size());
+  std::vector<size_t> lastUse(n, 0);
+  for (size_t step = 0; step < order.size(); ++step) {
+    kernelDeps(graph, order[step], order[step], materialized, deps[step]);
+    for (size_t d : deps[step]) {
+      lastUse[d] = step;
+    }
+  }
+
+  // Buffer reuse: an intermediate's buffer is released after its last
+  // consumer, and only after that consumer's output was assigned so that no
+  // kernel binds the same buffer for reading and writing
+  std::vector<Tensor> freeBuffers;
+  std::vector<Tensor> previous = std::move(graph.buffers);
+  graph.buffers.clear();
+  for (size_t step = 0; step < order.size(); ++step) {
+    GraphNode &node = graph.nodes[order[step]];
+    const size_t bytes = sizeBytes(node.dtype, size(node.shape));
+    auto reuse = isOutput[order[step]]
+                     ? freeBuffers.end()
+                     : std::find_if(freeBuffers.begin(), freeBuffers.end(),
+                                    [&](const Tensor &t) {
+                                      return t.data.size == bytes;
+                                    });
+    if (reuse != freeBuffers.end()) {
+      node.tensor = Tensor{reuse->data, node.shape};
+      freeBuffers.erase(reuse);
+    } else {
+      auto recycled = std::find_if(
+          previous.begin(), previous.end(),
+          [&](const Tensor &t) { return t.data.size == bytes; });
+      if (recycled != previous.end()) {
+        node.tensor = Tensor{recycled->data, node.shape};
+        previous.erase(recycled);
+      } else {
+        node.tensor = createTensor(ctx, node.shape, node.dtype);
+      }
+      graph.buffers.push_back(node.tensor);
+      if (!isOutput[order[step]]) {
+        ++stats.numBuffers;
+        stats.allocatedBytes += bytes;
+      }
+    }
+    if (!isOutput[order[step]]) {
+      ++stats.numIntermediates;
+      stats.intermediateBytes += bytes;
+    }
+    for (size_t d : deps[step]) {
+      if (lastUse[d] == step && !isOutput[d] &&
+          graph.nodes[d].kind != GraphNode::kLeaf) {
+        freeBuffers.push_back(graph.nodes[d].tensor);
+      }
+    }
+  }
+  for (const Tensor &t : previous) {
+    FreeTensor(ctx.pool, t);
+  }
+
+  // Lowering
+  graph.kernels.clear();
+  for (size_t step = 0; step < order.size(); ++step) {
+    GraphNode &node = graph.nodes[order[step]];
+    if (node.kind == GraphNode::kOp) {
+      std::vector<Tensor> inputs;
+      for (size_t input : node.inputs) {
+        inputs.push_back(graph.nodes[input].tensor);
+      }
+      graph.kernels.push_back(node.build(ctx, inputs, node.tensor));
+    } else {
+      graph.kernels.push_back(fusion::fuse(
+          ctx, fusedExpr(graph, order[step], order[step], materialized),
+          node.tensor, node.dtype));
+    }
+  }
+  stats.numKernels = graph.kernels.size();
+  graph.stats = stats;
+  graph.planOutputs = outputIds;
+  graph.planNumNodes = n;
+  LOG(kDefLog, kInfo,
+      "Graph: %zu nodes, %zu live, %zu kernels, %zu fused, %zu intermediates "
+      "in %zu buffers (%zu of %zu bytes)",
+      stats.numNodes, stats.numLive, stats.numKernels, stats.numFused,
+      stats.numIntermediates, stats.numBuffers, stats.allocatedBytes,
+      stats.intermediateBytes);
+  submitGraph(ctx, graph);
+  return results();
+}
+
+/**
+ * @brief Single output overload of evaluate().
+ */
+inline Tensor evaluate(Context &ctx, Graph &graph, const LazyTensor &output) {
+  return evaluate(ctx, graph, std::vector<LazyTensor>{output})[0];
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_GRAPH_H
@@ -0,0 +1,273 @@
+#ifndef GPU_CPP_PERMUTE_H
+#define GPU_CPP_PERMUTE_H
+
+#include <algorithm>
+#include <cassert>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * @brief Permutation reduced to its minimal form: size-1 dimensions are
+ * dropped and runs of input dimensions which stay adjacent and in order in
+ * the output are merged into a single dimension.
+ *
+ * For example permuting (B, T, NH, HS) with {0, 2, 1, 3} leaves B, T, NH and
+ * HS separate, whereas (B, NH, T, HS) with {1, 0, 2, 3} collapses to a
+ * (NH, B, T * HS) problem with perm {1, 0, 2}.
+ */
+struct PermutePlan {
+  std::vector<size_t> shape; // collapsed input shape
+  std::vector<size_t> perm;  // out dim i <- in dim perm[i]
+};
+
+/**
+ * @brief Collapses a permutation of a tensor shape, see PermutePlan.
+ *
+ * @param[in] shape Input shape
+ * @param[in] perm Permutation, output dimension i is input dimension perm[i]
+ * @return PermutePlan with the collapsed shape and permutation
+ */
+inline PermutePlan collapsePermutation(const Shape &shape,
+                                       const std::vector<size_t> &perm) {
+  check(perm.size() == shape.rank, "Permutation rank matches tensor rank",
+        __FILE__, __LINE__);
+  std::vector<bool> seen(shape.rank, false);
+  for (size_t d : perm) {
+    check(d < shape.rank && !seen[d], "Permutation is valid", __FILE__,
+          __LINE__);
+    seen[d] = true;
+  }
+  // Drop size-1 dimensions, renumbering the remaining ones
+  std::vector<size_t> newIndex(shape.rank, 0);
+  std::vector<size_t> keptShape;
+  for (size_t d = 0; d < shape.rank; ++d) {
+    newIndex[d] = keptShape.size();
+    if (shape[d] != 1) {
+      keptShape.push_back(shape[d]);
+    }
+  }
+  std::vector<size_t> keptPerm;
+  for (size_t d : perm) {
+    if (shape[d] != 1) {
+      keptPerm.push_back(newIndex[d]);
+    }
+  }
+  // Merge input dimensions d, d + 1 which are consecutive in the output
+  PermutePlan plan;
+  std::vector<size_t> group(keptShape.size(), 0); // in dim -> merged dim
+  std::vector<bool> mergesWithPrev(keptShape.size(), false);
+  for (size_t i = 1; i < keptPerm.size(); ++i) {
+    if (keptPerm[i] == keptPerm[i - 1] + 1) {
+      mergesWithPrev[keptPerm[i]] = true;
+    }
+  }
+  for (size_t d = 0; d < keptShape.size(); ++d) {
+    if (d > 0 && mergesWithPrev[d]) {
+      plan.shape.back() *= keptShape[d];
+    } else {
+      plan.shape.push_back(keptShape[d]);
+    }
+    group[d] = plan.shape.size() - 1;
+  }
+  for (size_t i = 0; i < keptPerm.size(); ++i) {
+    if (i == 0 || !mergesWithPrev[keptPerm[i]]) {
+      plan.perm.push_back(group[keptPerm[i]]);
+    }
+  }
+  return plan;
+}
+
+/* Permute when the innermost dimension does not move
+ * - Each output row of the innermost dimension is a contiguous run of the
+ *   input, so this is a gather of rows copied with vec{{V}} loads / stores.
+ * - {{ROW_OFFSET}} maps the output row index to the input offset (in vectors).
+ */
+static const char *kShaderPermuteCopy = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{VTYPE}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{VTYPE}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let idx: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (idx >= {{NUM_VECS}}) {
+        return;
+    }
+    var row: u32 = idx / {{ROW_VECS}};
+    var inOffset: u32 = idx % {{ROW_VECS}};
+{{ROW_OFFSET}}
+    out[idx] = inp[inOffset];
+}
+)";
+
+/* Permute when the innermost dimension moves
+ * - Batched 2D transpose of the input innermost dimension (x) against the
+ *   input dimension which becomes the output innermost dimension (y), all
+ *   other dimensions are batch dimensions mapped to the z workgroup index.
+ * - A TILE x TILE tile is read with coalesced loads along x and written with
+ *   coalesced stores along y through workgroup memory, padded by one column
+ *   to avoid bank conflicts.
+ */
+static const char *kShaderPermuteTiled = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{precision}}>;
+var<workgroup> tile: array<{{precision}}, {{TILE}} * ({{TILE}} + 1)>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    var batch: u32 = groupID.z;
+    var inBase: u32 = 0;
+    var outBase: u32 = 0;
+{{BATCH_OFFSET}}
+    let x0: u32 = groupID.x * {{TILE}};
+    let y0: u32 = groupID.y * {{TILE}};
+    for (var j: u32 = localID.y; j < {{TILE}}; j = j + {{ROWS}}) {
+        let x: u32 = x0 + localID.x;
+        let y: u32 = y0 + j;
+        if (x < {{SX}} && y < {{SY}}) {
+            tile[j * ({{TILE}} + 1) + localID.x] = inp[inBase + y * {{IN_STRIDE_Y}} + x];
+        }
+    }
+    workgroupBarrier();
+    for (var j: u32 = localID.y; j < {{TILE}}; j = j + {{ROWS}}) {
+        let x: u32 = x0 + j;
+        let y: u32 = y0 + localID.x;
+        if (x < {{SX}} && y < {{SY}}) {
+            out[outBase + x * {{OUT_STRIDE_X}} + y] = tile[localID.x * ({{TILE}} + 1) + j];
+        }
+    }
+}
+)";
+
+/**
+ * @brief Creates a kernel writing the permutation of tensor in to tensor out,
+ * i.e. out dimension i is in dimension perm[i], for tensors of rank up to
+ * Shape::kMaxRank.
+ *
+ * The permutation is first collapsed (see collapsePermutation()). If the
+ * innermost dimension stays in place the kernel is a vectorized row copy,
+ * otherwise a tiled shared-memory transpose batched over the remaining
+ * dimensions. Shapes are baked into the generated WGSL.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] in Input tensor
+ * @param[out] out Output tensor, shape in.shape permuted by perm
+ * @param[in] perm Permutation of 0 .. rank - 1
+ * @param[in] precision Element type of the tensors
+ * @return Kernel instance, dispatched with dispatchKernel()
+ *
+ * @code
+ * Kernel op = createPermute(ctx, qkv, heads, {0, 2, 1, 3});
+ * @endcode
+ */
+inline Kernel createPermute(Context &ctx, Tensor &in, Tensor &out,
+                            const std::vector<size_t> &perm,
+                            NumType precision = kf32) {
+  check(in.shape.rank == out.shape.rank, "Permute input and output rank",
+        __FILE__, __LINE__);
+  for (size_t i = 0; i < perm.size() && i < out.shape.rank; ++i) {
+    check(perm[i] < in.shape.rank && out.shape[i] == in.shape[perm[i]],
+          "Permute output shape", __FILE__, __LINE__);
+  }
+  const PermutePlan plan = collapsePermutation(in.shape, perm);
+  const size_t rank = plan.shape.size();
+  const size_t numel = size(in.shape);
+  // Strides of the collapsed input, and of each input dimension in the output
+  std::vector<size_t> inStride(rank, 1), outStrideOfIn(rank, 1);
+  for (size_t d = rank; d-- > 1;) {
+    inStride[d - 1] = inStride[d] * plan.shape[d];
+  }
+  size_t stride = 1;
+  for (size_t i = rank; i-- > 0;) {
+    outStrideOfIn[plan.perm[i]] = stride;
+    stride *= plan.shape[plan.perm[i]];
+  }
+  const std::string enableF16 = precision == kf16 ? "enable f16;\n" : "";
+
+  if (rank <= 1 || plan.perm.back() == rank - 1) {
+    // Innermost dimension does not move: vectorized row copy
+    const size_t rowSize = rank == 0 ? numel : plan.shape.back();
+    const size_t V = rowSize % 4 == 0 ? 4 : 1;
+    const size_t numVecs = numel / V;
+    std::string rowOffset;
+    for (size_t i = rank > 0 ? rank - 1 : 0; i-- > 0;) {
+      const size_t d = plan.perm[i];
+      rowOffset += "    inOffset += (row % " + toString(plan.shape[d]) +
+                   ") * " + toString(inStride[d] / V) + ";\n";
+      rowOffset += "    row = row / " + toString(plan.shape[d]) + ";\n";
+    }
+    static constexpr size_t wgSize = 256;
+    const size_t nWorkgroups = cdiv(numVecs, wgSize);
+    const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+    std::string code = enableF16 + kShaderPermuteCopy;
+    replaceAll(code, {{"{{VTYPE}}", V == 4 ? "vec4<{{precision}}>"
+                                           : "{{precision}}"},
+                      {"{{ROW_OFFSET}}", rowOffset},
+                      {"{{X_THREADS}}", toString(wgX * wgSize)},
+                      {"{{NUM_VECS}}", toString(numVecs)},
+                      {"{{ROW_VECS}}", toString(rowSize / V)}});
+    return createKernel(ctx, KernelCode{code, Shape{wgSize, 1, 1}, precision},
+                        Bindings{in, out}, {wgX, cdiv(nWorkgroups, wgX), 1});
+  }
+
+  // Innermost dimension moves: tiled transpose of x = in dim rank - 1 against
+  // y = in dim perm.back(), batched over all other dimensions
+  static constexpr size_t kTile = 32;
+  static constexpr size_t kRows = 8;
+  const size_t dx = rank - 1;
+  const size_t dy = plan.perm.back();
+  std::string batchOffset;
+  size_t nBatch = 1;
+  for (size_t d = rank; d-- > 0;) {
+    if (d == dx || d == dy) {
+      continue;
+    }
+    batchOffset += "    inBase += (batch % " + toString(plan.shape[d]) +
+                   ") * " + toString(inStride[d]) + ";\n";
+    batchOffset += "    outBase += (batch % " + toString(plan.shape[d]) +
+                   ") * " + toString(outStrideOfIn[d]) + ";\n";
+    batchOffset += "    batch = batch / " + toString(plan.shape[d]) + ";\n";
+    nBatch *= plan.shape[d];
+  }
+  check(nBatch <= 65535, "Permute batch fits in the z workgroup dimension",
+        __FILE__, __LINE__);
+  std::string code = enableF16 + kShaderPermuteTiled;
+  replaceAll(code, {{"{{BATCH_OFFSET}}", batchOffset},
+                    {"{{TILE}}", toString(kTile)},
+                    {"{{ROWS}}", toString(kRows)},
+                    {"{{SX}}", toString(plan.shape[dx])},
+                    {"{{SY}}", toString(plan.shape[dy])},
+                    {"{{IN_STRIDE_Y}}", toString(inStride[dy])},
+                    {"{{OUT_STRIDE_X}}", toString(outStrideOfIn[dx])}});
+  return createKernel(
+      ctx, KernelCode{code, Shape{kTile, kRows, 1}, precision},
+      Bindings{in, out},
+      {cdiv(plan.shape[dx], kTile), cdiv(plan.shape[dy], kTile), nBatch});
+}
+
+/**
+ * @brief Permutes tensor in into tensor out and waits for completion, see
+ * createPermute(). For repeated permutes of the same shapes create the kernel
+ * once with createPermute() instead.
+ *
+ * @code
+ * permute(ctx, input, output, {1, 0}); // 2D transpose
+ * @endcode
+ */
+inline void permute(Context &ctx, Tensor &in, Tensor &out,
+                    const std::vector<size_t> &perm,
+                    NumType precision = kf32) {
+  Kernel op = createPermute(ctx, in, out, perm, precision);
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_PERMUTE_H
@@ -0,0 +1,219 @@
+#ifndef GPU_CPP_PLANNER_H
+#define GPU_CPP_PLANNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * Activation memory planning. Rather than allocating a dedicated buffer for
+ * every intermediate tensor, so that peak memory is the sum of all
+ * activations, the planner records the sequence of kernels with the
+ * intermediates they read and write, computes the lifetime of each
+ * intermediate and packs them into a single arena buffer, letting tensors
+ * whose lifetimes do not overlap share memory.
+ *
+ * @code
+ * MemoryPlanner planner;
+ * size_t h = addTensor(planner, {T, 4 * C});
+ * size_t y = addTensor(planner, {T, C});
+ * addKernel(planner, {}, {h});  // h = x W1
+ * addKernel(planner, {h}, {y}); // y = gelu(h) W2
+ * MemoryPlan plan = planMemory(planner);
+ * std::vector<TensorView> views = createArena(ctx, planner, plan);
+ * Kernel op = createKernel(ctx, code, Bindings{views[h], views[y]}, ...);
+ * @endcode
+ */
+
+/**
+ * @brief An intermediate tensor and the kernel steps it is live in.
+ */
+struct PlannedTensor {
+  Shape shape;
+  NumType dtype = kf32;
+  size_t bytes = 0;
+  size_t firstStep = 0;
+  size_t lastStep = 0;
+  bool used = false;
+};
+
+/**
+ * @brief Records intermediates and the kernels using them, in execution
+ * order.
+ */
+struct MemoryPlanner {
+  std::vector<PlannedTensor> tensors;
+  size_t numSteps = 0;
+};
+
+/**
+ * @brief Packing heuristic used by planMemory().
+ *
+ * kGreedyBySize places tensors largest first, each at the lowest offset
+ * where it does not overlap an already placed tensor with an overlapping
+ * lifetime.
+ *
+ * kBestFit places tensors in order of first use, like a runtime allocator,
+ * each in the smallest gap between placed tensors with overlapping
+ * lifetimes that fits it.
+ */
+enum PackingStrategy { kGreedyBySize, kBestFit };
+
+/**
+ * @brief Offsets of the planned tensors within the arena.
+ */
+struct MemoryPlan {
+  std::vector<size_t> offsets; // bytes, indexed like MemoryPlanner::tensors
+  size_t arenaBytes = 0;       // size of the shared arena
+  size_t totalBytes = 0;       // sum of the tensor sizes, i.e. no sharing
+  size_t lowerBound = 0;       // largest sum of sizes live at one step
+};
+
+/**
+ * @brief Registers an intermediate tensor with the planner.
+ * @return Id of the tensor, used with addKernel() and to index the views
+ * returned by createArena()
+ */
+inline size_t addTensor(MemoryPlanner &planner, const Shape &shape,
+                        NumType dtype = kf32) {
+  planner.tensors.push_back(PlannedTensor{
+      .shape = shape,
+      .dtype = dtype,
+      .bytes = sizeBytes(dtype, size(shape)),
+  });
+  return planner.tensors.size() - 1;
+}
+
+/**
+ * @brief Records the next kernel in execution order with the intermediates it
+ * reads and writes. Tensors which are not planned (weights, model inputs and
+ * outputs) are left out.
+ */
+inline void addKernel(MemoryPlanner &planner, const std::vector<size_t> &inputs,
+                      const std::vector<size_t> &outputs) {
+  const size_t step = planner.numSteps++;
+  for (const std::vector<size_t> *ids : {&inputs, &outputs}) {
+    for (size_t id : *ids) {
+      check(id < planner.tensors.size(), "Planned tensor id", __FILE__,
+            __LINE__);
+      PlannedTensor &t = planner.tensors[id];
+      t.firstStep = t.used ? std::min(t.firstStep, step) : step;
+      t.lastStep = t.used ? std::max(t.lastStep, step) : step;
+      t.used = true;
+    }
+  }
+}
+
+/**
+ * @brief Whether two tensors must not share memory. Lifetimes are inclusive
+ * so that a kernel never reads and writes aliasing ranges.
+ */
+inline bool lifetimesOverlap(const PlannedTensor &a, const PlannedTensor &b) {
+  return a.used && b.used && a.firstStep <= b.lastStep &&
+         b.firstStep <= a.lastStep;
+}
+
+/**
+ * @brief Assigns arena offsets to the planned tensors.
+ *
+ * @param[in] planner Recorded tensors and kernels
+ * @param[in] strategy Packing heuristic, see PackingStrategy
+ * @param[in] alignment Offset alignment in bytes, at least the device's
+ * minStorageBufferOffsetAlignment (256 by default)
+ * @return MemoryPlan with the offsets and arena size
+ */
+inline MemoryPlan planMemory(const MemoryPlanner &planner,
+                             PackingStrategy strategy = kGreedyBySize,
+                             size_t alignment = 256) {
+  const std::vector<PlannedTensor> &tensors = planner.tensors;
+  MemoryPlan plan;
+  plan.offsets.assign(tensors.size(), 0);
+  auto aligned = [&](size_t bytes) { return cdiv(bytes, alignment) * alignment; };
+
+  std::vector<size_t> order(tensors.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (strategy == kGreedyBySize) {
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return tensors[a].bytes > tensors[b].bytes;
+    });
+  } else {
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return tensors[a].firstStep < tensors[b].firstStep;
+    });
+  }
+
+  std::vector<size_t> placed;
+  for (size_t id : order) {
+    const PlannedTensor &t = tensors[id];
+    plan.totalBytes += t.bytes;
+    if (!t.used) {
+      continue;
+    }
+    // Ranges occupied by placed tensors live at the same time, by offset
+    std::vector<std::pair<size_t, size_t>> busy;
+    for (size_t other : placed) {
+      if (lifetimesOverlap(t, tensors[other])) {
+        busy.push_back({plan.offsets[other],
+                        plan.offsets[other] + aligned(tensors[other].bytes)});
+      }
+    }
+    std::sort(busy.begin(), busy.end());
+    const size_t need = aligned(t.bytes);
+    size_t best = SIZE_MAX, bestGap = SIZE_MAX, cursor = 0;
+    for (const auto &range : busy) {
+      if (range.first >= cursor + need) {
+        const size_t gap = range.first - cursor;
+        if (strategy == kGreedyBySize) {
+          best = cursor;
+          break;
+        }
+        if (gap < bestGap) {
+          best = cursor;
+          bestGap = gap;
+        }
+      }
+      cursor = std::max(cursor, range.second);
+    }
+    plan.offsets[id] = best != SIZE_MAX ? best : cursor;
+    plan.arenaBytes = std::max(plan.arenaBytes, plan.offsets[id] + need);
+    placed.push_back(id);
+  }
+
+  for (size_t step = 0; step < planner.numSteps; ++step) {
+    size_t live = 0;
+    for (const PlannedTensor &t : tensors) {
+      live += t.used && t.firstStep <= step && step <= t.lastStep ? t.bytes : 0;
+    }
+    plan.lowerBound = std::max(plan.lowerBound, live);
+  }
+  return plan;
+}
+
+/**
+ * @brief Allocates the arena of a plan and returns a view per planned tensor,
+ * with the tensor's shape, for use in Bindings.
+ */
+inline std::vector<TensorView> createArena(Context &ctx,
+                                           const MemoryPlanner &planner,
+                                           const MemoryPlan &plan) {
+  Tensor arena = createTensor(
+      ctx, Shape{std::max<size_t>(plan.arenaBytes, 4) / sizeof(float)}, kf32);
+  std::vector<TensorView> views;
+  for (size_t id = 0; id < planner.tensors.size(); ++id) {
+    const PlannedTensor &t = planner.tensors[id];
+    views.push_back(TensorView{.data = Tensor{arena.data, t.shape},
+                               .offset = plan.offsets[id],
+                               .span = t.bytes});
+  }
+  return views;
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_PLANNER_H
@@ -0,0 +1,294 @@
+#ifndef GPU_CPP_STREAM_H
+#define GPU_CPP_STREAM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <vector>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * Out-of-core streaming. runStream() pushes a host data source of any size
+ * through a kernel in fixed-size blocks and hands each block's result to a
+ * host sink, with a bounded number of device buffers:
+ *
+ * @code
+ * // data is e.g. an mmap'd file of numBytes bytes
+ * StreamConfig config = {.blockElements = 1 << 24};
+ * runStream(ctx, config,
+ *           [](Context &ctx, Tensor &in, Tensor &out) {
+ *             return createKernel(ctx, {kShaderGelu, 256, kf32},
+ *                                 Bindings{in, out}, {cdiv(1 << 24, 256), 1, 1});
+ *           },
+ *           memorySource(data, numBytes),
+ *           [&](const StreamBlock &block) {
+ *             fwrite(block.output, 1, block.inputBytes, out);
+ *           });
+ * @endcode
+ *
+ * Blocks cycle through config.depth slots, each with its own input, output
+ * and readback buffers and its own kernel. A block's upload, kernel and
+ * readback copy are submitted together, so while the host fills the next
+ * block the GPU works on the previous ones. The host only waits when it
+ * reuses a slot, i.e. for the block depth - 1 submissions back, so with
+ * depth >= 2 the GPU has queued work while the host fills blocks. How close
+ * the stream comes to running the kernel alone depends on the transfers;
+ * testStreaming logs both times for comparison.
+ */
+
+/**
+ * @brief Fills up to maxBytes of the next block, returning the number of
+ * bytes written. Returning fewer bytes ends the stream after that block, 0
+ * ends it immediately.
+ */
+using StreamSource = std::function<size_t(void *block, size_t maxBytes)>;
+
+/**
+ * @brief A processed block, passed to the sink.
+ */
+struct StreamBlock {
+  size_t index;       // of the block in the stream
+  size_t inputOffset; // in bytes, of the block's first input byte
+  size_t inputBytes;  // read from the source, less than a block at the end
+  const void *output; // kernel output, valid during the sink call only
+  size_t outputBytes; // of a whole block
+};
+
+/**
+ * @brief Receives the processed blocks in stream order, on the thread which
+ * called runStream().
+ */
+using StreamSink = std::function<void(const StreamBlock &block)>;
+
+/**
+ * @brief Builds the kernel of one slot from the slot's input and output
+ * tensors. Called config.depth times, kernels are reused for every block.
+ */
+using StreamKernel =
+    std::function<Kernel(Context &ctx, Tensor &input, Tensor &output)>;
+
+/**
+ * @brief Block layout of a stream.
+ */
+struct StreamConfig {
+  size_t blockElements;      // input elements per block
+  size_t outputElements = 0; // output elements per block, 0 for blockElements
+  NumType inputType = kf32;
+  NumType outputType = kf32;
+  size_t depth = 3; // blocks in flight, 2 double- and 3 triple-buffers
+};
+
+/**
+ * @brief Totals of a runStream() call. waitSeconds is the time the host was
+ * blocked on the GPU, close to seconds when the stream is compute bound.
+ */
+struct StreamStats {
+  size_t blocks = 0;
+  size_t inputBytes = 0;
+  size_t outputBytes = 0;
+  double seconds = 0.0;
+  double waitSeconds = 0.0;
+};
+
+/**
+ * @brief Source reading a range of host memory, e.g. an mmap'd file.
+ */
+inline StreamSource memorySource(const void *data, size_t numBytes) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  size_t offset = 0;
+  return [bytes, numBytes, offset](void *block, size_t maxBytes) mutable {
+    const size_t n = std::min(maxBytes, numBytes - offset);
+    memcpy(block, bytes + offset, n);
+    offset += n;
+    return n;
+  };
+}
+
+/**
+ * @brief Source reading a file from its current position. The file must
+ * outlive the stream.
+ */
+inline StreamSource fileSource(FILE *file) {
+  return [file](void *block, size_t maxBytes) {
+    return fread(block, 1, maxBytes, file);
+  };
+}
+
+/**
+ * @brief Device buffers, kernel and pending block of one pipeline slot.
+ */
+struct StreamSlot {
+  Tensor input;
+  Tensor output;
+  Kernel kernel;
+  WGPUBuffer readback = nullptr;
+  bool recorded = true; // kernel.commandBuffer not yet submitted
+  bool busy = false;
+  StreamBlock block;
+  std::promise<void> promise;
+  std::future<void> future;
+  CallbackData callbackData;
+};
+
+/**
+ * @brief Submits the upload, kernel and readback of a block in a slot. The
+ * slot's promise is set once the readback buffer is mapped.
+ */
+inline void submitStreamBlock(Context &ctx, StreamSlot &slot,
+                              const void *data) {
+  wgpuQueueWriteBuffer(ctx.queue, slot.input.data.buffer, 0, data,
+                       slot.input.data.size);
+  if (!slot.recorded) {
+    resetCommandBuffer(ctx.device, slot.kernel);
+  }
+  slot.recorded = false;
+  WGPUCommandEncoder commandEncoder =
+      wgpuDeviceCreateCommandEncoder(ctx.device, nullptr);
+  wgpuCommandEncoderCopyBufferToBuffer(commandEncoder, slot.output.data.buffer,
+                                       0, slot.readback, 0,
+                                       slot.output.data.size);
+  WGPUCommandBuffer commandBuffers[2] = {
+      slot.kernel.commandBuffer,
+      wgpuCommandEncoderFinish(commandEncoder, nullptr)};
+  check(commandBuffers[1], "Create command buffer", __FILE__, __LINE__);
+  wgpuCommandEncoderRelease(commandEncoder);
+  wgpuQueueSubmit(ctx.queue, 2, commandBuffers);
+  // The kernel's command buffer is consumed by the submission like in
+  // dispatchKernel(), only the readback copy is owned here
+  wgpuCommandBufferRelease(commandBuffers[1]);
+  slot.promise = std::promise<void>();
+  slot.future = slot.promise.get_future();
+  slot.callbackData = {slot.readback, slot.output.data.size, nullptr,
+                       &slot.promise, &slot.future};
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *callbackData) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        const auto *data = static_cast<CallbackData *>(callbackData);
+        wgpuBufferMapAsync(
+            data->buffer, WGPUMapMode_Read, 0, data->bufferSize,
+            [](WGPUBufferMapAsyncStatus status, void *captureData) {
+              check(status == WGPUBufferMapAsyncStatus_Success,
+                    "Map readbackBuffer", __FILE__, __LINE__);
+              static_cast<CallbackData *>(captureData)->promise->set_value();
+            },
+            callbackData);
+      },
+      &slot.callbackData);
+  slot.busy = true;
+}
+
+/**
+ * @brief Waits for the pending block of a slot and passes its output to the
+ * sink, freeing the slot.
+ */
+inline void drainStreamSlot(Context &ctx, StreamSlot &slot,
+                            const StreamSink &sink, StreamStats &stats) {
+  const auto start = std::chrono::high_resolution_clock::now();
+  wait(ctx, slot.future);
+  stats.waitSeconds += std::chrono::duration<double>(
+                           std::chrono::high_resolution_clock::now() - start)
+                           .count();
+  const void *mapped = wgpuBufferGetConstMappedRange(
+      slot.readback, /*offset=*/0, slot.output.data.size);
+  check(mapped, "Get mapped range", __FILE__, __LINE__);
+  slot.block.output = mapped;
+  sink(slot.block);
+  slot.block.output = nullptr;
+  wgpuBufferUnmap(slot.readback);
+  stats.outputBytes += slot.block.outputBytes;
+  slot.busy = false;
+}
+
+/**
+ * @brief Streams a host data source through a kernel block by block, see the
+ * overview above. Device memory stays at config.depth times one input,
+ * output and readback block, whatever the size of the source. The tail block
+ * is zero-padded to a whole block and the kernel runs on whole blocks.
+ *
+ * @param[in] ctx Context instance to manage the buffers and kernels
+ * @param[in] config Block sizes, element types and pipeline depth
+ * @param[in] build Builds the kernel of each slot, the "kernel template"
+ * @param[in] source Host data, read block by block
+ * @param[in] sink Receives the output of each block in order
+ * @return Block and byte counts and timings of the stream
+ */
+inline StreamStats runStream(Context &ctx, const StreamConfig &config,
+                             const StreamKernel &build, StreamSource source,
+                             const StreamSink &sink) {
+  GPU_TRACE_SCOPE("runStream");
+  check(config.blockElements > 0 && config.depth > 0,
+        "Stream of non-empty blocks", __FILE__, __LINE__);
+  const size_t outputElements = config.outputElements > 0
+                                    ? config.outputElements
+                                    : config.blockElements;
+  const auto start = std::chrono::high_resolution_clock::now();
+  std::vector<StreamSlot> slots(config.depth);
+  for (StreamSlot &slot : slots) {
+    slot.input = createTensor(ctx, {config.blockElements}, config.inputType);
+    slot.output = createTensor(ctx, {outputElements}, config.outputType);
+    check(tensorChunks(ctx, slot.input).size() == 1 &&
+              tensorChunks(ctx, slot.output).size() == 1,
+          "Stream blocks fit in a storage binding", __FILE__, __LINE__);
+    WGPUBufferDescriptor readbackDescriptor = {
+        .usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead,
+        .size = slot.output.data.size,
+    };
+    slot.readback = wgpuDeviceCreateBuffer(ctx.device, &readbackDescriptor);
+    slot.kernel = build(ctx, slot.input, slot.output);
+  }
+  // A single host block, uploads copy it out before submitStreamBlock returns
+  std::vector<uint8_t> host(slots[0].input.data.size);
+  const size_t blockBytes = sizeBytes(config.inputType, config.blockElements);
+  const size_t outputBytes = sizeBytes(config.outputType, outputElements);
+  StreamStats stats;
+  for (size_t index = 0;; ++index) {
+    StreamSlot &slot = slots[index % slots.size()];
+    if (slot.busy) {
+      drainStreamSlot(ctx, slot, sink, stats);
+    }
+    const size_t n = source(host.data(), blockBytes);
+    if (n == 0) {
+      break;
+    }
+    std::fill(host.begin() + n, host.end(), 0);
+    slot.block = {index, stats.inputBytes, n, nullptr, outputBytes};
+    submitStreamBlock(ctx, slot, host.data());
+    stats.inputBytes += n;
+    stats.blocks++;
+    if (n < blockBytes) {
+      break;
+    }
+  }
+  // Drain the blocks still in flight, oldest first
+  for (size_t i = 0; i < slots.size(); ++i) {
+    StreamSlot &slot = slots[(stats.blocks + i) % slots.size()];
+    if (slot.busy) {
+      drainStreamSlot(ctx, slot, sink, stats);
+    }
+  }
+  for (StreamSlot &slot : slots) {
+    wgpuBufferRelease(slot.readback);
+    FreeTensor(ctx.pool, slot.input);
+    FreeTensor(ctx.pool, slot.output);
+  }
+  stats.seconds = std::chrono::duration<double>(
+                      std::chrono::high_resolution_clock::now() - start)
+                      .count();
+  LOG(kDefLog, kInfo,
+      "Streamed %zu blocks, %zu bytes in %.3fs (%.3fs waiting on the GPU)",
+      stats.blocks, stats.inputBytes, stats.seconds, stats.waitSeconds);
+  return stats;
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_STREAM_H
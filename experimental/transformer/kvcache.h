@@ -0,0 +1,241 @@
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+#include "shaders.h"
+
+namespace gpu {
+
+/**
+ * @brief Paged key / value cache for serving many concurrent sequences.
+ *
+ * Keys and values are stored in fixed-size blocks of blockSize tokens carved
+ * out of two large pool tensors. Each sequence owns a list of blocks recorded
+ * in its row of the block table, so GPU memory grows with the number of
+ * tokens actually cached rather than with maxSeqs * worst-case seqLen.
+ *
+ * Block allocation is done on the host with a free list. The block table and
+ * per-sequence lengths are mirrored to the GPU for the append and attention
+ * kernels.
+ *
+ * @code
+ * PagedKVCache cache = createPagedKVCache(ctx, 256, 16, 8, 64, nHeads, hs);
+ * @endcode
+ */
+struct PagedKVCache {
+  size_t numBlocks;       // blocks in each pool
+  size_t blockSize;       // tokens per block
+  size_t maxSeqs;         // rows in the block table
+  size_t maxBlocksPerSeq; // columns in the block table
+  size_t nHeads;
+  size_t headSize;
+  Tensor keyPool;    // numBlocks * blockSize * nHeads * headSize
+  Tensor valuePool;  // numBlocks * blockSize * nHeads * headSize
+  Tensor blockTable; // maxSeqs * maxBlocksPerSeq (u32 physical block ids)
+  Tensor seqLens;    // maxSeqs (u32 cached tokens per sequence)
+  std::vector<uint32_t> freeBlocks;              // host-side free list
+  std::vector<std::vector<uint32_t>> seqBlocks;  // logical -> physical block
+  std::vector<uint32_t> seqLensHost;             // host mirror of seqLens
+};
+
+/**
+ * @brief Factory function for a PagedKVCache. All blocks start out free and
+ * all sequences empty.
+ *
+ * @param[in] ctx Context instance to manage the cache tensors
+ * @param[in] numBlocks Number of blocks in the key and value pools
+ * @param[in] blockSize Number of tokens per block
+ * @param[in] maxSeqs Maximum number of concurrently cached sequences
+ * @param[in] maxBlocksPerSeq Maximum number of blocks a single sequence can
+ * hold, i.e. the maximum sequence length is maxBlocksPerSeq * blockSize
+ * @param[in] nHeads Number of attention heads
+ * @param[in] headSize Size of each head
+ * @return PagedKVCache instance
+ */
+inline PagedKVCache createPagedKVCache(Context &ctx, size_t numBlocks,
+                                       size_t blockSize, size_t maxSeqs,
+                                       size_t maxBlocksPerSeq, size_t nHeads,
+                                       size_t headSize) {
+  PagedKVCache cache;
+  cache.numBlocks = numBlocks;
+  cache.blockSize = blockSize;
+  cache.maxSeqs = maxSeqs;
+  cache.maxBlocksPerSeq = maxBlocksPerSeq;
+  cache.nHeads = nHeads;
+  cache.headSize = headSize;
+  const Shape poolShape = {numBlocks * blockSize, nHeads * headSize};
+  cache.keyPool = createTensor(ctx, poolShape, kf32);
+  cache.valuePool = createTensor(ctx, poolShape, kf32);
+  cache.blockTable = createTensor(ctx, {maxSeqs, maxBlocksPerSeq}, ku32);
+  cache.seqLens = createTensor(ctx, {maxSeqs}, ku32);
+  // Pop from the back so that blocks are handed out in increasing order
+  cache.freeBlocks.resize(numBlocks);
+  for (size_t i = 0; i < numBlocks; ++i) {
+    cache.freeBlocks[i] = static_cast<uint32_t>(numBlocks - 1 - i);
+  }
+  cache.seqBlocks.resize(maxSeqs);
+  cache.seqLensHost.assign(maxSeqs, 0);
+  std::vector<uint32_t> zeros(maxSeqs * maxBlocksPerSeq, 0);
+  toGPU(ctx, zeros.data(), cache.blockTable.data.buffer,
+        cache.blockTable.data.size);
+  toGPU(ctx, cache.seqLensHost.data(), cache.seqLens.data.buffer,
+        cache.seqLens.data.size);
+  return cache;
+}
+
+/**
+ * @brief Reserves a cache slot for each token in a batch of new tokens,
+ * allocating blocks from the free list as sequences cross block boundaries.
+ * The block table and sequence lengths are updated on the GPU.
+ *
+ * Tokens of the same sequence must appear in order within seqIds.
+ *
+ * @param[in] ctx Context instance
+ * @param[in] cache PagedKVCache to allocate from
+ * @param[in] seqIds Sequence id of each new token
+ * @return Physical slot (block * blockSize + offset) for each token, to be
+ * passed to the append kernel
+ *
+ * @code
+ * std::vector<uint32_t> slots = allocateSlots(ctx, cache, {0, 0, 1});
+ * @endcode
+ */
+inline std::vector<uint32_t> allocateSlots(Context &ctx, PagedKVCache &cache,
+                                           const std::vector<uint32_t> &seqIds) {
+  std::vector<uint32_t> slots(seqIds.size());
+  std::vector<bool> touched(cache.maxSeqs, false);
+  for (size_t i = 0; i < seqIds.size(); ++i) {
+    const uint32_t seq = seqIds[i];
+    check(seq < cache.maxSeqs, "Sequence id within KV cache bounds", __FILE__,
+          __LINE__);
+    const uint32_t pos = cache.seqLensHost[seq];
+    std::vector<uint32_t> &blocks = cache.seqBlocks[seq];
+    if (pos % cache.blockSize == 0) {
+      check(!cache.freeBlocks.empty(), "KV cache has a free block", __FILE__,
+            __LINE__);
+      check(blocks.size() < cache.maxBlocksPerSeq,
+            "Sequence within maxBlocksPerSeq", __FILE__, __LINE__);
+      blocks.push_back(cache.freeBlocks.back());
+      cache.freeBlocks.pop_back();
+    }
+    slots[i] = blocks[pos / cache.blockSize] * cache.blockSize +
+               pos % cache.blockSize;
+    cache.seqLensHost[seq] = pos + 1;
+    touched[seq] = true;
+  }
+  // Only rewrite the block table rows of sequences that changed
+  const size_t rowBytes = cache.maxBlocksPerSeq * sizeof(uint32_t);
+  for (size_t seq = 0; seq < cache.maxSeqs; ++seq) {
+    if (touched[seq]) {
+      wgpuQueueWriteBuffer(ctx.queue, cache.blockTable.data.buffer,
+                           seq * rowBytes, cache.seqBlocks[seq].data(),
+                           cache.seqBlocks[seq].size() * sizeof(uint32_t));
+    }
+  }
+  toGPU(ctx, cache.seqLensHost.data(), cache.seqLens.data.buffer,
+        cache.seqLens.data.size);
+  return slots;
+}
+
+/**
+ * @brief Returns the blocks of a finished sequence to the free list and
+ * resets its length so the sequence id can be reused.
+ *
+ * @param[in] ctx Context instance
+ * @param[in] cache PagedKVCache owning the sequence
+ * @param[in] seq Sequence id to free
+ */
+inline void freeSequence(Context &ctx, PagedKVCache &cache, uint32_t seq) {
+  check(seq < cache.maxSeqs, "Sequence id within KV cache bounds", __FILE__,
+        __LINE__);
+  std::vector<uint32_t> &blocks = cache.seqBlocks[seq];
+  cache.freeBlocks.insert(cache.freeBlocks.end(), blocks.rbegin(),
+                          blocks.rend());
+  blocks.clear();
+  cache.seqLensHost[seq] = 0;
+  wgpuQueueWriteBuffer(ctx.queue, cache.seqLens.data.buffer,
+                       seq * sizeof(uint32_t), &cache.seqLensHost[seq],
+                       sizeof(uint32_t));
+}
+
+/**
+ * @brief Creates the kernel which writes the K / V rows of nTokens new tokens
+ * into the cache pools in one dispatch.
+ *
+ * @param[in] ctx Context instance
+ * @param[in] cache PagedKVCache to append to
+ * @param[in] newK Keys of the new tokens, (nTokens, nHeads * headSize)
+ * @param[in] newV Values of the new tokens, (nTokens, nHeads * headSize)
+ * @param[in] slots u32 slot mapping returned by allocateSlots(), (nTokens)
+ * @param[in] nTokens Number of new tokens
+ * @return Kernel instance
+ */
+inline Kernel createKVCacheAppend(Context &ctx, PagedKVCache &cache,
+                                  Tensor &newK, Tensor &newV, Tensor &slots,
+                                  size_t nTokens) {
+  struct AppendParams {
+    uint32_t nTokens;
+    uint32_t rowSize;
+  };
+  const size_t rowSize = cache.nHeads * cache.headSize;
+  static constexpr size_t wgSize = 256;
+  const size_t nWorkgroups = cdiv(nTokens * rowSize, wgSize);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  std::string code = kShaderKVCacheAppend;
+  replaceAll(code, "{{X_THREADS}}", toString(wgX * wgSize));
+  return createKernel(
+      ctx, {code, wgSize, kf32},
+      Bindings{newK, newV, slots, cache.keyPool, cache.valuePool},
+      {wgX, cdiv(nWorkgroups, wgX), 1},
+      AppendParams{static_cast<uint32_t>(nTokens),
+                   static_cast<uint32_t>(rowSize)});
+}
+
+/**
+ * @brief Creates a decode attention kernel over the first numSeqs sequences of
+ * the cache, reading keys and values through the block table.
+ *
+ * @param[in] ctx Context instance
+ * @param[in] cache PagedKVCache to attend over
+ * @param[in] q Queries, one token per sequence, rows qStride elements apart
+ * @param[out] out Output, (numSeqs, nHeads * headSize)
+ * @param[in] numSeqs Number of sequences (== rows of q)
+ * @param[in] qStride Elements between consecutive query rows
+ * @return Kernel instance
+ */
+inline Kernel createPagedAttention(Context &ctx, PagedKVCache &cache,
+                                   Tensor &q, Tensor &out, size_t numSeqs,
+                                   size_t qStride) {
+  struct PagedAttentionParams {
+    uint32_t NH;
+    uint32_t qStride;
+    uint32_t blockSize;
+    uint32_t maxBlocksPerSeq;
+    float scale;
+  };
+  static constexpr size_t wgSize = 64;
+  static constexpr size_t Bc = 16;
+  return createKernel(
+      ctx,
+      FlashAttentionShader(kShaderPagedAttentionDecode, cache.headSize, wgSize,
+                           Bc),
+      Bindings{q, cache.keyPool, cache.valuePool, cache.blockTable,
+               cache.seqLens, out},
+      {1, cache.nHeads, numSeqs},
+      PagedAttentionParams{
+          static_cast<uint32_t>(cache.nHeads),
+          static_cast<uint32_t>(qStride),
+          static_cast<uint32_t>(cache.blockSize),
+          static_cast<uint32_t>(cache.maxBlocksPerSeq),
+          1.0f / sqrtf(static_cast<float>(cache.headSize))});
+}
+
+} // namespace gpu
+
+#endif // KVCACHE_H
@@ -2,8 +2,10 @@
 #include "utils/array_utils.h"
 #include "utils/logging.h"
 #include <array>
+#include <vector>
 
 #include "llmc/reference_impls.h"
+#include "shaders.h" // createFlashAttention
 
 using namespace gpu;
 
@@ -100,13 +102,12 @@ struct Transformer {
 
 struct Activations {
   Tensor qkv; // batchSize * 3 * nHeads * qkvDim
-  Tensor qk;
-  Tensor att;
+  Tensor att; // batchSize * nHeads * qkvDim
 };
 
 struct KVCache {
-  Tensor keyCache;
-  Tensor valueCache;
+  Tensor keyCache;   // seqLen * nHeads * qkvDim
+  Tensor valueCache; // seqLen * nHeads * qkvDim
 };
 
 void createTransformer(Context &ctx, size_t modelDim, size_t qkvDim,
@@ -136,17 +137,16 @@ void createTransformer(Context &ctx, size_t modelDim, size_t qkvDim,
 
   activations = {
       .qkv = createTensor(ctx, Shape{batchSize * 3 * nHeads * qkvDim}, kf32),
-      .qk = createTensor(ctx, Shape{batchSize * nHeads}, kf32),
-      .att = createTensor(ctx, Shape{batchSize * nHeads}, kf32)};
+      .att = createTensor(ctx, Shape{batchSize * nHeads * qkvDim}, kf32)};
 
   kvCache = {
-      .keyCache = createTensor(ctx, Shape{seqLen, qkvDim}, kf32),
-      .valueCache = createTensor(ctx, Shape{seqLen, qkvDim}, kf32),
+      .keyCache = createTensor(ctx, Shape{seqLen, nHeads * qkvDim}, kf32),
+      .valueCache = createTensor(ctx, Shape{seqLen, nHeads * qkvDim}, kf32),
   };
-  std::unique_ptr<float[]> keyCacheInit(new float[seqLen * qkvDim]);
-  std::unique_ptr<float[]> valueCacheInit(new float[seqLen * qkvDim]);
-  range(keyCacheInit.get(), size(kvCache.keyCache.shape), 0.0);
-  range(valueCacheInit.get(), size(kvCache.valueCache.shape), 0.0);
+  std::unique_ptr<float[]> keyCacheInit(new float[seqLen * nHeads * qkvDim]);
+  std::unique_ptr<float[]> valueCacheInit(new float[seqLen * nHeads * qkvDim]);
+  randint(keyCacheInit.get(), size(kvCache.keyCache.shape), gen, -2, 2);
+  randint(valueCacheInit.get(), size(kvCache.valueCache.shape), gen, -2, 2);
   toGPU(ctx, keyCacheInit.get(), kvCache.keyCache);
   toGPU(ctx, valueCacheInit.get(), kvCache.valueCache);
 }
@@ -200,7 +200,7 @@ int main() {
   LOG(kDefLog, kInfo, "QKV Projection");
   {
     KernelCode matmul = createMatmul(kShaderMatmul1, /*M*/ batchSize,
-                                     /*K*/ modelDim, /*N*/ 3 * qkvDim);
+                                     /*K*/ modelDim, /*N*/ 3 * nHeads * qkvDim);
     Kernel qkv = createKernel(
         ctx, matmul, Bindings{input, transformer.qkv, activations.qkv},
         /*nthreads*/ {modelDim, 1, 1});
@@ -208,39 +208,74 @@ int main() {
     std::future<void> future = promise.get_future();
     dispatchKernel(ctx, qkv, promise);
     wait(ctx, future);
-    std::array<float, 3 * qkvDim> outputArr;
+    std::array<float, 3 * nHeads * qkvDim> outputArr;
     toCPU(ctx, activations.qkv, outputArr.data(), sizeof(outputArr));
     LOG(kDefLog, kInfo, "Output: %s",
-        show<float>(outputArr.data(), 1, 3 * qkvDim, "QKV Output").c_str());
-    std::array<float, 3 * qkvDim> outputRefArr;
-    std::array<float, modelDim * 3 * qkvDim> weightsArr;
+        show<float>(outputArr.data(), 1, 3 * nHeads * qkvDim, "QKV Output")
+            .c_str());
+    std::array<float, 3 * nHeads * qkvDim> outputRefArr;
+    std::array<float, modelDim * 3 * nHeads * qkvDim> weightsArr;
     toCPU(ctx, transformer.qkv, weightsArr.data(), sizeof(weightsArr));
-    ref::matmul_forward_cpu(
-        outputRefArr.data(), inputArr.data(), weightsArr.data(), nullptr,
-        /* batch */ 1, /* T */ 1, /* C */ modelDim, /* OC */ 3 * qkvDim);
+    ref::matmul_forward_cpu(outputRefArr.data(), inputArr.data(),
+                            weightsArr.data(), nullptr,
+                            /* batch */ 1, /* T */ 1, /* C */ modelDim,
+                            /* OC */ 3 * nHeads * qkvDim);
     LOG(kDefLog, kInfo, "Reference Output: %s",
-        show<float>(outputRefArr.data(), 1, 3 * qkvDim,
+        show<float>(outputRefArr.data(), 1, 3 * nHeads * qkvDim,
                     "QKV Output (Reference)")
             .c_str());
     LOG(kDefLog, kInfo,
-        isclose(outputArr.data(), outputRefArr.data(), 3 * qkvDim) ? "PASS"
-                                                                   : "FAIL");
+        isclose(outputArr.data(), outputRefArr.data(), 3 * nHeads * qkvDim)
+            ? "PASS"
+            : "FAIL");
   }
 
-  /* QK Dot Products */
+  /* Attention */
 
-  LOG(kDefLog, kInfo, "QK Dot Product");
+  // Decode step: the query of the current token attends to the cached keys /
+  // values of all seqLen positions. Scores are never written to memory.
+  LOG(kDefLog, kInfo, "Attention");
   {
-    KernelCode dot = createMatmul(kShaderMatmul1, /*M*/ batchSize * nHeads,
-                                  /*K*/ qkvDim, /*M*/ 1);
-
-    /*
-    // TODO(avh): need to pass in activation views that don't overlap here
-    Kernel qk = createKernel(
-        ctx, dot, Bindings{activations.qkv, activations.qkv, activations.qk},
-        {batchSize * nHeads, 1, 1});
-    */
-    // TODO(avh): check nThreads
+    static constexpr size_t C = nHeads * qkvDim;
+    Kernel attention = createFlashAttention(
+        ctx, Bindings{activations.qkv, kvcache.keyCache, kvcache.valueCache,
+                      activations.att},
+        /*B*/ batchSize, /*Tq*/ 1, /*Tkv*/ seqLen, nHeads, qkvDim,
+        /*qStride*/ 3 * C, /*kvStride*/ C);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, attention, promise);
+    wait(ctx, future);
+    std::array<float, C> outputArr;
+    toCPU(ctx, activations.att, outputArr.data(), sizeof(outputArr));
+    LOG(kDefLog, kInfo, "%s",
+        show<float>(outputArr.data(), nHeads, qkvDim, "Attention Output")
+            .c_str());
+
+    // Reference: pack (1, seqLen, 3C) with the query at the last position
+    std::array<float, 3 * C> qkvArr;
+    std::array<float, seqLen * C> keyArr;
+    std::array<float, seqLen * C> valueArr;
+    toCPU(ctx, activations.qkv, qkvArr.data(), sizeof(qkvArr));
+    toCPU(ctx, kvcache.keyCache, keyArr.data(), sizeof(keyArr));
+    toCPU(ctx, kvcache.valueCache, valueArr.data(), sizeof(valueArr));
+    std::vector<float> packed(seqLen * 3 * C, 0.0f);
+    for (size_t t = 0; t < seqLen; ++t) {
+      for (size_t c = 0; c < C; ++c) {
+        packed[t * 3 * C + C + c] = keyArr[t * C + c];
+        packed[t * 3 * C + 2 * C + c] = valueArr[t * C + c];
+      }
+    }
+    std::copy(qkvArr.begin(), qkvArr.begin() + C,
+              packed.begin() + (seqLen - 1) * 3 * C);
+    std::vector<float> outRef(seqLen * C), preatt(nHeads * seqLen * seqLen),
+        att(nHeads * seqLen * seqLen);
+    ref::attention_forward_cpu(outRef.data(), preatt.data(), att.data(),
+                               packed.data(), 1, seqLen, C, nHeads);
+    LOG(kDefLog, kInfo,
+        isclose(outputArr.data(), outRef.data() + (seqLen - 1) * C, C)
+            ? "PASS"
+            : "FAIL");
   }
 
   LOG(kDefLog, kInfo, "Done");
@@ -2,6 +2,7 @@
 #define KERNELS_H
 
 #include "gpu.h"
+#include "experimental/views.h"
 
 namespace gpu {
 
@@ -172,6 +173,275 @@ KernelCode MatmulShader(size_t workgroupSize, const char *shaderRaw,
   return shader;
 }
 
+/* matrix multiplication (naive implementation) with the shape as WGSL
+ * override constants
+ * - Same computation as kShaderMatMul1, but M, K and N are set per pipeline
+ *   through KernelCode::constants instead of being substituted in the text,
+ *   so all shapes share one shader module and its compile.
+ */
+static const char *kShaderMatMul1Override = R"(
+override M: u32;
+override K: u32;
+override N: u32;
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(global_invocation_id) GlobalInvocationID: vec3<u32>) {
+    let i: u32 = GlobalInvocationID.x / N;
+    let j: u32 = GlobalInvocationID.x % N;
+    if (i < M && j < N) {
+        var sum: f32 = 0.0;
+        for (var k: u32 = 0; k < K; k = k + 1) {
+            sum = sum + A[i * K + k] * B[k * N + j];
+        }
+        C[i * N + j] = sum;
+    }
+}
+)";
+
+/* Generates KernelCode for matmul kernels declaring M, K and N as override
+ * constants, see kShaderMatMul1Override. Unlike MatmulShader() the code text
+ * does not depend on the shape.
+ * */
+inline KernelCode MatmulOverrideShader(size_t workgroupSize,
+                                       const char *shaderRaw,
+                                       NumType precision, size_t M, size_t K,
+                                       size_t N) {
+  KernelCode shader = {shaderRaw, workgroupSize, precision};
+  shader.constants = {{"M", static_cast<double>(M)},
+                      {"K", static_cast<double>(K)},
+                      {"N", static_cast<double>(N)}};
+  return shader;
+}
+
+/* Batched / strided matmul
+ * - C[b] = A[b] * B[b] for b in [0, batch), one dispatch for all batch
+ *   entries with the batch index on the z workgroup dimension.
+ * - Operand b starts at b * batchStride{A,B,C}. A batch stride of 0
+ *   broadcasts the operand across the batch (e.g. a shared weight matrix).
+ * - A element (m, k) is at offsetA + m * lda + k * ldaK, B element (k, n)
+ *   at offsetB + k * ldbK + n * ldbN, so A and B can be transposed or
+ *   sliced views (see createBatchedMatmul(ctx, StridedView, ...)). C is
+ *   (M, N) with row stride ldc from offsetC.
+ * - 2D block tiling with BM x BN output tiles per workgroup and TM x TN
+ *   outputs per thread, bounds checked for arbitrary M, K, N.
+ */
+static const char *kShaderBatchedMatmul = R"(
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+@group(0) @binding(3) var<uniform> params: Params;
+
+struct Params {
+    M: u32,
+    K: u32,
+    N: u32,
+    lda: u32,
+    ldbK: u32,
+    ldbN: u32,
+    ldc: u32,
+    batchStrideA: u32,
+    batchStrideB: u32,
+    batchStrideC: u32,
+    ldaK: u32,
+    offsetA: u32,
+    offsetB: u32,
+    offsetC: u32,
+};
+
+var<workgroup> tileA: array<{{precision}}, {{BM}} * {{BK}}>; // [m][k]
+var<workgroup> tileB: array<{{precision}}, {{BK}} * {{BN}}>; // [k][n]
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    let aOffset: u32 = params.offsetA + groupID.z * params.batchStrideA;
+    let bOffset: u32 = params.offsetB + groupID.z * params.batchStrideB;
+    let cOffset: u32 = params.offsetC + groupID.z * params.batchStrideC;
+    let rowStart: u32 = groupID.x * {{BM}};
+    let colStart: u32 = groupID.y * {{BN}};
+
+    // position of the first output element computed by the thread in the tile
+    let threadRow: u32 = (localID.x / ({{BN}} / {{TN}})) * {{TM}};
+    let threadCol: u32 = (localID.x % ({{BN}} / {{TN}})) * {{TN}};
+
+    var results: array<{{precision}}, {{TM}} * {{TN}}>;
+    var localM: array<{{precision}}, {{TM}}>;
+    var localN: array<{{precision}}, {{TN}}>;
+
+    for (var k0: u32 = 0; k0 < params.K; k0 = k0 + {{BK}}) {
+      // Load tiles, zero-filling outside of the matrices
+      for (var i: u32 = localID.x; i < {{BM}} * {{BK}}; i = i + {{NUM_THREADS}}) {
+        let m: u32 = rowStart + i / {{BK}};
+        let k: u32 = k0 + i % {{BK}};
+        var a: {{precision}} = 0.0;
+        if (m < params.M && k < params.K) {
+          a = A[aOffset + m * params.lda + k * params.ldaK];
+        }
+        tileA[i] = a;
+      }
+      for (var i: u32 = localID.x; i < {{BK}} * {{BN}}; i = i + {{NUM_THREADS}}) {
+        let k: u32 = k0 + i / {{BN}};
+        let n: u32 = colStart + i % {{BN}};
+        var b: {{precision}} = 0.0;
+        if (k < params.K && n < params.N) {
+          b = B[bOffset + k * params.ldbK + n * params.ldbN];
+        }
+        tileB[i] = b;
+      }
+      workgroupBarrier();
+      for (var k: u32 = 0; k < {{BK}}; k = k + 1) {
+        for (var tm: u32 = 0; tm < {{TM}}; tm = tm + 1) {
+          localM[tm] = tileA[(threadRow + tm) * {{BK}} + k];
+        }
+        for (var tn: u32 = 0; tn < {{TN}}; tn = tn + 1) {
+          localN[tn] = tileB[k * {{BN}} + threadCol + tn];
+        }
+        for (var tm: u32 = 0; tm < {{TM}}; tm = tm + 1) {
+          for (var tn: u32 = 0; tn < {{TN}}; tn = tn + 1) {
+            results[tm * {{TN}} + tn] += localM[tm] * localN[tn];
+          }
+        }
+      }
+      workgroupBarrier();
+    }
+
+    for (var tm: u32 = 0; tm < {{TM}}; tm = tm + 1) {
+      for (var tn: u32 = 0; tn < {{TN}}; tn = tn + 1) {
+        let m: u32 = rowStart + threadRow + tm;
+        let n: u32 = colStart + threadCol + tn;
+        if (m < params.M && n < params.N) {
+          C[cOffset + m * params.ldc + n] = results[tm * {{TN}} + tn];
+        }
+      }
+    }
+}
+)";
+
+struct BatchedMatmulParams {
+  uint32_t M;
+  uint32_t K;
+  uint32_t N;
+  uint32_t lda;
+  uint32_t ldbK;
+  uint32_t ldbN;
+  uint32_t ldc;
+  uint32_t batchStrideA;
+  uint32_t batchStrideB;
+  uint32_t batchStrideC;
+  uint32_t ldaK = 1;
+  uint32_t offsetA = 0;
+  uint32_t offsetB = 0;
+  uint32_t offsetC = 0;
+};
+
+/* Generates KernelCode for the batched matmul kernel. Tile sizes are baked
+ * into the shader, shapes and strides are passed as params so one pipeline
+ * serves any problem size.
+ */
+inline KernelCode BatchedMatmulShader(const char *shaderRaw, size_t BM,
+                                      size_t BK, size_t BN, size_t TM,
+                                      size_t TN, NumType precision = kf32) {
+  assert(BM % TM == 0);
+  assert(BN % TN == 0);
+  const size_t nThreads = (BM / TM) * (BN / TN);
+  KernelCode shader = {shaderRaw, Shape{nThreads, 1, 1}, precision};
+  replaceAll(shader.data, {{"{{BM}}", toString(BM)},
+                           {"{{BK}}", toString(BK)},
+                           {"{{BN}}", toString(BN)},
+                           {"{{TM}}", toString(TM)},
+                           {"{{TN}}", toString(TN)},
+                           {"{{NUM_THREADS}}", toString(nThreads)}});
+  return shader;
+}
+
+/* Creates a batched matmul kernel computing batch products of A, B, C
+ * bindings in a single dispatch, see kShaderBatchedMatmul for the layout.
+ */
+inline Kernel createBatchedMatmul(Context &ctx, const Bindings<3> &bindings,
+                                  size_t batch,
+                                  const BatchedMatmulParams &params) {
+  static constexpr size_t BM = 64;
+  static constexpr size_t BK = 16;
+  static constexpr size_t BN = 64;
+  static constexpr size_t TM = 4;
+  static constexpr size_t TN = 4;
+  return createKernel(ctx, BatchedMatmulShader(kShaderBatchedMatmul, BM, BK,
+                                               BN, TM, TN),
+                      bindings, {cdiv(params.M, BM), cdiv(params.N, BN), batch},
+                      params);
+}
+
+/* Overload for contiguous operands: A is (M, K), C is (M, N) and B is (K, N),
+ * or (N, K) when transposeB is set (the weight layout of matmul_forward_cpu).
+ * Pass a batch stride of 0 to broadcast an operand across the batch.
+ */
+inline Kernel createBatchedMatmul(Context &ctx, const Bindings<3> &bindings,
+                                  size_t batch, size_t M, size_t K, size_t N,
+                                  size_t batchStrideA, size_t batchStrideB,
+                                  size_t batchStrideC,
+                                  bool transposeB = false) {
+  BatchedMatmulParams params = {
+      static_cast<uint32_t>(M),
+      static_cast<uint32_t>(K),
+      static_cast<uint32_t>(N),
+      /*lda*/ static_cast<uint32_t>(K),
+      /*ldbK*/ static_cast<uint32_t>(transposeB ? 1 : N),
+      /*ldbN*/ static_cast<uint32_t>(transposeB ? K : 1),
+      /*ldc*/ static_cast<uint32_t>(N),
+      static_cast<uint32_t>(batchStrideA),
+      static_cast<uint32_t>(batchStrideB),
+      static_cast<uint32_t>(batchStrideC)};
+  return createBatchedMatmul(ctx, bindings, batch, params);
+}
+
+/* Overload reading the operands through strided views, e.g. a column slice
+ * of a fused QKV projection or a transposed matrix, without copies. a is
+ * (M, K) or (batch, M, K), b is (K, N) or (batch, K, N) and c a contiguous
+ * (M, N) or (batch, M, N) tensor. A rank 2 operand is shared across the
+ * batch. a and b must view different buffers, since WebGPU does not allow
+ * one buffer in two writable storage bindings of a dispatch.
+ */
+inline Kernel createBatchedMatmul(Context &ctx, const StridedView &a,
+                                  const StridedView &b, Tensor &c) {
+  const size_t rank = c.shape.rank;
+  check((rank == 2 || rank == 3) && a.shape.rank >= 2 &&
+            a.shape.rank <= rank && b.shape.rank >= 2 && b.shape.rank <= rank,
+        "Matmul views are matrices or batches of matrices", __FILE__,
+        __LINE__);
+  check(a.data.data.buffer != b.data.data.buffer,
+        "Matmul operands view different buffers", __FILE__, __LINE__);
+  const size_t ra = a.shape.rank;
+  const size_t rb = b.shape.rank;
+  const size_t batch = rank == 3 ? c.shape[0] : 1;
+  const size_t M = a.shape[ra - 2];
+  const size_t K = a.shape[ra - 1];
+  const size_t N = b.shape[rb - 1];
+  check(b.shape[rb - 2] == K && c.shape[rank - 2] == M &&
+            c.shape[rank - 1] == N,
+        "Matmul shapes match", __FILE__, __LINE__);
+  check((ra == 2 || a.shape[0] == batch) && (rb == 2 || b.shape[0] == batch),
+        "Matmul batch sizes match", __FILE__, __LINE__);
+  BatchedMatmulParams params = {
+      static_cast<uint32_t>(M),
+      static_cast<uint32_t>(K),
+      static_cast<uint32_t>(N),
+      /*lda*/ static_cast<uint32_t>(a.strides[ra - 2]),
+      /*ldbK*/ static_cast<uint32_t>(b.strides[rb - 2]),
+      /*ldbN*/ static_cast<uint32_t>(b.strides[rb - 1]),
+      /*ldc*/ static_cast<uint32_t>(N),
+      static_cast<uint32_t>(ra == 3 ? a.strides[0] : 0),
+      static_cast<uint32_t>(rb == 3 ? b.strides[0] : 0),
+      static_cast<uint32_t>(M * N)};
+  params.ldaK = static_cast<uint32_t>(a.strides[ra - 1]);
+  params.offsetA = static_cast<uint32_t>(a.offset);
+  params.offsetB = static_cast<uint32_t>(b.offset);
+  return createBatchedMatmul(ctx, Bindings{a.data, b.data, c}, batch, params);
+}
+
 /* Softmax
  * v1:
  * - equivalent to naive softmax with one thread per row
@@ -216,6 +486,785 @@ fn main(@builtin(global_invocation_id) global_id : vec3<u32>) {
 }
 )";
 
+/* Workgroup reductions
+ * - One workgroup of kReductionWorkgroupSize threads per row, each thread
+ *   strides over the row and the partial results are combined with the
+ *   blockSum / blockMax / blockSum4 helpers.
+ * - Two variants of the helpers share the kernels below, selected by
+ *   ReductionShader():
+ *   - Portable: tree reduction in workgroup memory, log2(workgroup size) + 2
+ *     barriers per reduction.
+ *   - Subgroups: subgroupAdd / subgroupMax within each subgroup, then one
+ *     slot per subgroup in workgroup memory, 2 barriers per reduction.
+ *     Subgroups are assumed to cover consecutive local invocation indices.
+ * - {{SUBGROUP_BUILTINS}} and {{SUBGROUP_SETUP}} pass the subgroup builtins to
+ *   the helpers, they are empty for the portable variant.
+ */
+static constexpr size_t kReductionWorkgroupSize = 256;
+
+static const char *kReduceWorkgroup = R"(
+fn {{NAME}}(value: {{TYPE}}, lid: u32) -> {{TYPE}} {
+    {{SCRATCH}}[lid] = value;
+    workgroupBarrier();
+    for (var stride: u32 = {{WG}}u / 2u; stride > 0u; stride = stride / 2u) {
+        if (lid < stride) {
+            let x: {{TYPE}} = {{SCRATCH}}[lid];
+            let y: {{TYPE}} = {{SCRATCH}}[lid + stride];
+            {{SCRATCH}}[lid] = {{COMBINE}};
+        }
+        workgroupBarrier();
+    }
+    let result: {{TYPE}} = {{SCRATCH}}[0];
+    workgroupBarrier();
+    return result;
+}
+)";
+
+static const char *kReduceSubgroup = R"(
+fn {{NAME}}(value: {{TYPE}}, lid: u32) -> {{TYPE}} {
+    let partial: {{TYPE}} = {{SUBGROUP_OP}}(value);
+    if (sgLane == 0u) {
+        {{SCRATCH}}[lid / sgWidth] = partial;
+    }
+    workgroupBarrier();
+    var result: {{TYPE}} = {{SCRATCH}}[0];
+    for (var i: u32 = 1u; i < {{WG}}u / sgWidth; i = i + 1u) {
+        let x: {{TYPE}} = result;
+        let y: {{TYPE}} = {{SCRATCH}}[i];
+        result = {{COMBINE}};
+    }
+    workgroupBarrier();
+    return result;
+}
+)";
+
+/* Row sums
+ * - out[i] = sum of row i of the (N, C) input
+ */
+static const char *kShaderRowSum = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(2) var<uniform> params: Params;
+struct Params {
+    N: u32,
+    C: u32,
+};
+{{REDUCE}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(local_invocation_index) lid: u32,
+        @builtin(workgroup_id) groupID: vec3<u32>{{SUBGROUP_BUILTINS}}) {
+    {{SUBGROUP_SETUP}}
+    let row: u32 = groupID.x + groupID.y * {{X_GROUPS}};
+    if (row >= params.N) {
+        return;
+    }
+    let rowStart: u32 = row * params.C;
+    var sum: f32 = 0.0;
+    for (var j: u32 = lid; j < params.C; j = j + {{WG}}) {
+        sum += f32(inp[rowStart + j]);
+    }
+    sum = blockSum(sum, lid);
+    if (lid == 0u) {
+        out[row] = {{precision}}(sum);
+    }
+}
+)";
+
+/* Softmax
+ * v2:
+ * - One workgroup per row, row max and sum as workgroup reductions
+ */
+static const char *kShaderSoftmax2 = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(2) var<uniform> params: Params;
+struct Params {
+    N: u32,
+    C: u32,
+};
+const NEG_INFINITY: f32 = -3.0e38;
+{{REDUCE}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(local_invocation_index) lid: u32,
+        @builtin(workgroup_id) groupID: vec3<u32>{{SUBGROUP_BUILTINS}}) {
+    {{SUBGROUP_SETUP}}
+    let row: u32 = groupID.x + groupID.y * {{X_GROUPS}};
+    if (row >= params.N) {
+        return;
+    }
+    let rowStart: u32 = row * params.C;
+    var maxval: f32 = NEG_INFINITY;
+    for (var j: u32 = lid; j < params.C; j = j + {{WG}}) {
+        maxval = max(maxval, f32(inp[rowStart + j]));
+    }
+    maxval = blockMax(maxval, lid);
+    var sum: f32 = 0.0;
+    for (var j: u32 = lid; j < params.C; j = j + {{WG}}) {
+        let expVal: f32 = exp(f32(inp[rowStart + j]) - maxval);
+        out[rowStart + j] = {{precision}}(expVal);
+        sum += expVal;
+    }
+    let norm: f32 = 1.0 / blockSum(sum, lid);
+    // Each thread rescales the elements it wrote, no barrier needed
+    for (var j: u32 = lid; j < params.C; j = j + {{WG}}) {
+        out[rowStart + j] = {{precision}}(f32(out[rowStart + j]) * norm);
+    }
+}
+)";
+
+/* LayerNorm
+ * v2:
+ * - One workgroup per row, mean and variance as workgroup reductions
+ */
+static const char *kShaderLayerNorm2 = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> weight: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> bias: array<{{precision}}>;
+@group(0) @binding(3) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(4) var<uniform> params: Params;
+struct Params {
+    N: u32,
+    C: u32,
+};
+{{REDUCE}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(local_invocation_index) lid: u32,
+        @builtin(workgroup_id) groupID: vec3<u32>{{SUBGROUP_BUILTINS}}) {
+    {{SUBGROUP_SETUP}}
+    let row: u32 = groupID.x + groupID.y * {{X_GROUPS}};
+    if (row >= params.N) {
+        return;
+    }
+    let C: u32 = params.C;
+    let rowStart: u32 = row * C;
+    var sum: f32 = 0.0;
+    for (var j: u32 = lid; j < C; j = j + {{WG}}) {
+        sum += f32(inp[rowStart + j]);
+    }
+    let mean: f32 = blockSum(sum, lid) / f32(C);
+    sum = 0.0;
+    for (var j: u32 = lid; j < C; j = j + {{WG}}) {
+        let diff: f32 = f32(inp[rowStart + j]) - mean;
+        sum += diff * diff;
+    }
+    let rstd: f32 = 1.0 / sqrt(blockSum(sum, lid) / f32(C) + 1e-5);
+    for (var j: u32 = lid; j < C; j = j + {{WG}}) {
+        let n: f32 = rstd * (f32(inp[rowStart + j]) - mean);
+        out[rowStart + j] =
+            {{precision}}(n * f32(weight[j]) + f32(bias[j]));
+    }
+}
+)";
+
+/* Matrix-vector products
+ * - c (M, N) = a (M, K) * b^T with b (N, K), the weight layout of
+ *   matmul_forward_cpu, for small M such as single token decoding.
+ * - One workgroup per 8 outputs of a row of c. Threads stride over K and
+ *   accumulate the 8 dot products in two vec4s, which are combined with two
+ *   vec4 workgroup reductions.
+ */
+static const char *kShaderMatvec = R"(
+@group(0) @binding(0) var<storage, read_write> a: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> b: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> c: array<{{precision}}>;
+@group(0) @binding(3) var<uniform> params: Params;
+struct Params {
+    M: u32,
+    K: u32,
+    N: u32,
+};
+{{REDUCE}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(local_invocation_index) lid: u32,
+        @builtin(workgroup_id) groupID: vec3<u32>{{SUBGROUP_BUILTINS}}) {
+    {{SUBGROUP_SETUP}}
+    let m: u32 = groupID.y;
+    let n0: u32 = groupID.x * 8u;
+    let K: u32 = params.K;
+    // Outputs past N recompute the last one and are not written
+    let nLast: u32 = params.N - 1u;
+    var acc: array<vec4<f32>, 2>;
+    for (var k: u32 = lid; k < K; k = k + {{WG}}) {
+        let x: f32 = f32(a[m * K + k]);
+        for (var i: u32 = 0u; i < 8u; i = i + 1u) {
+            acc[i / 4u][i % 4u] += x * f32(b[min(n0 + i, nLast) * K + k]);
+        }
+    }
+    let sum0: vec4<f32> = blockSum4(acc[0], lid);
+    let sum1: vec4<f32> = blockSum4(acc[1], lid);
+    if (lid < 8u && n0 + lid < params.N) {
+        c[m * params.N + n0 + lid] =
+            {{precision}}(select(sum1[lid % 4u], sum0[lid % 4u], lid < 4u));
+    }
+}
+)";
+
+/* Generates KernelCode for the workgroup reduction kernels, with the
+ * subgroup or the portable reduction helpers. Rows are laid out on a 2D
+ * grid of workgroups xGroups wide, so more than 65535 rows can be reduced.
+ */
+inline KernelCode ReductionShader(const char *shaderRaw, bool subgroups,
+                                  size_t xGroups, NumType precision = kf32) {
+  const std::string wg = toString(kReductionWorkgroupSize);
+  struct Helper {
+    const char *name;
+    const char *type;
+    const char *scratch;
+    const char *combine;
+    const char *subgroupOp;
+  };
+  static const Helper kHelpers[] = {
+      {"blockSum", "f32", "partials", "x + y", "subgroupAdd"},
+      {"blockMax", "f32", "partials", "max(x, y)", "subgroupMax"},
+      {"blockSum4", "vec4<f32>", "partials4", "x + y", "subgroupAdd"},
+  };
+  std::string helpers = "var<workgroup> partials: array<f32, " + wg + ">;\n" +
+                        "var<workgroup> partials4: array<vec4<f32>, " + wg +
+                        ">;\n";
+  if (subgroups) {
+    helpers += "var<private> sgLane: u32;\nvar<private> sgWidth: u32;\n";
+  }
+  for (const Helper &helper : kHelpers) {
+    std::string fn = subgroups ? kReduceSubgroup : kReduceWorkgroup;
+    replaceAll(fn, "{{NAME}}", helper.name);
+    replaceAll(fn, "{{TYPE}}", helper.type);
+    replaceAll(fn, "{{SCRATCH}}", helper.scratch);
+    replaceAll(fn, "{{COMBINE}}", helper.combine);
+    replaceAll(fn, "{{SUBGROUP_OP}}", helper.subgroupOp);
+    helpers += fn;
+  }
+  KernelCode shader = {shaderRaw, kReductionWorkgroupSize, precision};
+  replaceAll(shader.data, "{{REDUCE}}", helpers);
+  replaceAll(shader.data, "{{SUBGROUP_BUILTINS}}",
+             subgroups ? ",\n        @builtin(subgroup_invocation_id) "
+                         "sgId: u32,\n        @builtin(subgroup_size) "
+                         "sgSize: u32"
+                       : "");
+  replaceAll(shader.data, "{{SUBGROUP_SETUP}}",
+             subgroups ? "sgLane = sgId;\n    sgWidth = sgSize;" : "");
+  replaceAll(shader.data, "{{WG}}", wg);
+  replaceAll(shader.data, "{{X_GROUPS}}", toString(xGroups));
+  if (subgroups) {
+    shader.data = "enable chromium_experimental_subgroups;\n" + shader.data;
+  }
+  return shader;
+}
+
+struct ReductionParams {
+  uint32_t N;
+  uint32_t C;
+};
+
+/* Creates a row reduction kernel with one workgroup per row of an (N, C)
+ * input, using the subgroup variant when ctx.subgroups is set.
+ */
+template <size_t nBindings>
+inline Kernel createRowKernel(Context &ctx, const char *shaderRaw,
+                              const Bindings<nBindings> &bindings, size_t N,
+                              size_t C) {
+  const size_t wgX = std::min<size_t>(N, 65535);
+  return createKernel(ctx, ReductionShader(shaderRaw, ctx.subgroups, wgX),
+                      bindings, {wgX, cdiv(N, wgX), 1},
+                      ReductionParams{static_cast<uint32_t>(N),
+                                      static_cast<uint32_t>(C)});
+}
+
+/* out (N) = row sums of inp (N, C) */
+inline Kernel createRowSum(Context &ctx, const Tensor &inp, Tensor &out,
+                           size_t N, size_t C) {
+  return createRowKernel(ctx, kShaderRowSum, Bindings{inp, out}, N, C);
+}
+
+/* Softmax over the rows of an (N, C) input */
+inline Kernel createSoftmax(Context &ctx, const Tensor &inp, Tensor &out,
+                            size_t N, size_t C) {
+  return createRowKernel(ctx, kShaderSoftmax2, Bindings{inp, out}, N, C);
+}
+
+/* LayerNorm over the rows of an (N, C) input */
+inline Kernel createLayerNorm(Context &ctx, const Tensor &inp,
+                              const Tensor &weight, const Tensor &bias,
+                              Tensor &out, size_t N, size_t C) {
+  return createRowKernel(ctx, kShaderLayerNorm2,
+                         Bindings{inp, weight, bias, out}, N, C);
+}
+
+struct MatvecParams {
+  uint32_t M;
+  uint32_t K;
+  uint32_t N;
+};
+
+/* c (M, N) = a (M, K) * b^T for b (N, K), see kShaderMatvec */
+inline Kernel createMatvec(Context &ctx, const Tensor &a, const Tensor &b,
+                           Tensor &c, size_t M, size_t K, size_t N) {
+  const size_t nGroups = cdiv(N, 8);
+  check(M <= 65535 && nGroups <= 65535, "Matvec grid fits in 65535 x 65535",
+        __FILE__, __LINE__);
+  return createKernel(ctx, ReductionShader(kShaderMatvec, ctx.subgroups, 1),
+                      Bindings{a, b, c}, {nGroups, M, 1},
+                      MatvecParams{static_cast<uint32_t>(M),
+                                   static_cast<uint32_t>(K),
+                                   static_cast<uint32_t>(N)});
+}
+
+/* Flash attention
+ * v1:
+ * - One workgroup per (query block, head, batch entry), one thread per query
+ *   row within the block
+ * - K / V are streamed through workgroup memory in tiles of Bc rows
+ * - Running max / sum statistics per row (online softmax), so the T x T score
+ *   matrix is never materialized
+ * - Queries are aligned to the end of the key sequence, which makes the
+ *   causal mask correct both for prefill (Tq == Tkv) and for a chunk of new
+ *   queries attending to a longer cached prefix (Tq < Tkv)
+ *
+ * Layout: q is (B, Tq, NH * HS), k and v are (B, Tkv, NH * HS) and out is
+ * (B, Tq, NH * HS). Row strides for q and k / v are given in params so that
+ * wider rows (e.g. a fused QKV projection output) can be read in place.
+ */
+static const char *kShaderFlashAttention = R"(
+@group(0) @binding(0) var<storage, read_write> q: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> k: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> v: array<{{precision}}>;
+@group(0) @binding(3) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(4) var<uniform> params: Params;
+
+struct Params {
+    Tq: u32,       // query tokens per batch entry
+    Tkv: u32,      // key / value tokens per batch entry
+    NH: u32,       // number of heads
+    qStride: u32,  // elements between consecutive query tokens
+    kvStride: u32, // elements between consecutive key / value tokens
+    causal: u32,   // 1 applies the causal mask, 0 attends to all keys
+    scale: f32,    // typically 1 / sqrt(HS)
+};
+
+const NEG_INFINITY: f32 = -3.0e38; // WGSL has problem representing -3.4028235e+38
+
+var<workgroup> kTile: array<f32, {{Bc}} * {{HS}}>;
+var<workgroup> vTile: array<f32, {{Bc}} * {{HS}}>;
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    let head: u32 = groupID.y;
+    let batch: u32 = groupID.z;
+    let row: u32 = groupID.x * {{Br}} + localID.x;
+    let valid: bool = row < params.Tq;
+    let offset: u32 = params.Tkv - params.Tq;
+
+    // Keys at or past kvEnd are masked for every row of the block. kvEnd only
+    // depends on the workgroup id, so the tile loop (and its barriers) stay in
+    // uniform control flow.
+    var kvEnd: u32 = params.Tkv;
+    if (params.causal == 1u) {
+      kvEnd = min(params.Tkv, offset + min(groupID.x * {{Br}} + {{Br}}, params.Tq));
+    }
+    // Last key (exclusive) visible to this thread's query row
+    var limit: u32 = kvEnd;
+    if (params.causal == 1u) {
+      limit = min(kvEnd, offset + row + 1u);
+    }
+
+    let qBase: u32 = (batch * params.Tq + row) * params.qStride + head * {{HS}};
+    let kvBase: u32 = batch * params.Tkv * params.kvStride + head * {{HS}};
+
+    var qRow: array<f32, {{HS}}>;
+    var acc: array<f32, {{HS}}>;
+    var scores: array<f32, {{Bc}}>;
+    if (valid) {
+      for (var d: u32 = 0; d < {{HS}}; d++) {
+        qRow[d] = f32(q[qBase + d]) * params.scale;
+      }
+    }
+    var m: f32 = NEG_INFINITY;
+    var l: f32 = 0.0;
+
+    for (var kvStart: u32 = 0; kvStart < kvEnd; kvStart += {{Bc}}) {
+
+      // Load a Bc x HS tile of K and V shared by all rows of the block
+      for (var idx: u32 = localID.x; idx < {{Bc}} * {{HS}}; idx += {{Br}}) {
+        let t: u32 = kvStart + idx / {{HS}};
+        if (t < params.Tkv) {
+          let src: u32 = kvBase + t * params.kvStride + idx % {{HS}};
+          kTile[idx] = f32(k[src]);
+          vTile[idx] = f32(v[src]);
+        }
+      }
+      workgroupBarrier();
+
+      if (valid) {
+        // Scores for the tile
+        var tileMax: f32 = NEG_INFINITY;
+        for (var j: u32 = 0; j < {{Bc}}; j++) {
+          var score: f32 = NEG_INFINITY;
+          if (kvStart + j < limit) {
+            score = 0.0;
+            for (var d: u32 = 0; d < {{HS}}; d++) {
+              score += qRow[d] * kTile[j * {{HS}} + d];
+            }
+          }
+          scores[j] = score;
+          tileMax = max(tileMax, score);
+        }
+        // Online softmax update, skipped when the whole tile is masked
+        if (tileMax > NEG_INFINITY) {
+          let mNew: f32 = max(m, tileMax);
+          let alpha: f32 = exp(m - mNew);
+          l = l * alpha;
+          for (var d: u32 = 0; d < {{HS}}; d++) {
+            acc[d] = acc[d] * alpha;
+          }
+          for (var j: u32 = 0; j < {{Bc}}; j++) {
+            if (kvStart + j < limit) {
+              let p: f32 = exp(scores[j] - mNew);
+              l += p;
+              for (var d: u32 = 0; d < {{HS}}; d++) {
+                acc[d] += p * vTile[j * {{HS}} + d];
+              }
+            }
+          }
+          m = mNew;
+        }
+      }
+      workgroupBarrier();
+    }
+
+    if (valid) {
+      let outBase: u32 = (batch * params.Tq + row) * params.NH * {{HS}} + head * {{HS}};
+      let norm: f32 = select(0.0, 1.0 / l, l > 0.0);
+      for (var d: u32 = 0; d < {{HS}}; d++) {
+        out[outBase + d] = {{precision}}(acc[d] * norm);
+      }
+    }
+}
+)";
+
+/* Flash attention, decode variant (Tq == 1)
+ * - With a single query row the prefill kernel would leave all but one thread
+ *   of each workgroup idle. Here one workgroup handles one (head, batch entry)
+ *   and its threads split the scores of a tile by key and the accumulation by
+ *   head dimension.
+ * - Same bindings, params and layout as kShaderFlashAttention.
+ */
+static const char *kShaderFlashAttentionDecode = R"(
+@group(0) @binding(0) var<storage, read_write> q: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> k: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> v: array<{{precision}}>;
+@group(0) @binding(3) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(4) var<uniform> params: Params;
+
+struct Params {
+    Tq: u32,
+    Tkv: u32,
+    NH: u32,
+    qStride: u32,
+    kvStride: u32,
+    causal: u32,
+    scale: f32,
+};
+
+const NEG_INFINITY: f32 = -3.0e38;
+
+var<workgroup> qShared: array<f32, {{HS}}>;
+var<workgroup> kTile: array<f32, {{Bc}} * {{HS}}>;
+var<workgroup> vTile: array<f32, {{Bc}} * {{HS}}>;
+var<workgroup> scores: array<f32, {{Bc}}>;
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    let head: u32 = groupID.y;
+    let batch: u32 = groupID.z;
+    let tid: u32 = localID.x;
+    let qBase: u32 = batch * params.qStride + head * {{HS}};
+    let kvBase: u32 = batch * params.Tkv * params.kvStride + head * {{HS}};
+
+    for (var d: u32 = tid; d < {{HS}}; d += {{WG}}) {
+      qShared[d] = f32(q[qBase + d]) * params.scale;
+    }
+
+    // Each thread accumulates head dimensions tid, tid + WG, ...
+    var acc: array<f32, {{HS_PER_THREAD}}>;
+    var m: f32 = NEG_INFINITY;
+    var l: f32 = 0.0;
+
+    for (var kvStart: u32 = 0; kvStart < params.Tkv; kvStart += {{Bc}}) {
+      for (var idx: u32 = tid; idx < {{Bc}} * {{HS}}; idx += {{WG}}) {
+        let t: u32 = kvStart + idx / {{HS}};
+        if (t < params.Tkv) {
+          let src: u32 = kvBase + t * params.kvStride + idx % {{HS}};
+          kTile[idx] = f32(k[src]);
+          vTile[idx] = f32(v[src]);
+        }
+      }
+      workgroupBarrier();
+
+      for (var j: u32 = tid; j < {{Bc}}; j += {{WG}}) {
+        var score: f32 = NEG_INFINITY;
+        if (kvStart + j < params.Tkv) {
+          score = 0.0;
+          for (var d: u32 = 0; d < {{HS}}; d++) {
+            score += qShared[d] * kTile[j * {{HS}} + d];
+          }
+        }
+        scores[j] = score;
+      }
+      workgroupBarrier();
+
+      var tileMax: f32 = NEG_INFINITY;
+      for (var j: u32 = 0; j < {{Bc}}; j++) {
+        tileMax = max(tileMax, scores[j]);
+      }
+      let mNew: f32 = max(m, tileMax);
+      let alpha: f32 = exp(m - mNew);
+      l = l * alpha;
+      for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+        acc[i] = acc[i] * alpha;
+      }
+      for (var j: u32 = 0; j < {{Bc}}; j++) {
+        if (kvStart + j < params.Tkv) {
+          let p: f32 = exp(scores[j] - mNew);
+          l += p;
+          for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+            let d: u32 = tid + i * {{WG}};
+            if (d < {{HS}}) {
+              acc[i] += p * vTile[j * {{HS}} + d];
+            }
+          }
+        }
+      }
+      m = mNew;
+      workgroupBarrier();
+    }
+
+    let outBase: u32 = batch * params.NH * {{HS}} + head * {{HS}};
+    for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+      let d: u32 = tid + i * {{WG}};
+      if (d < {{HS}}) {
+        out[outBase + d] = {{precision}}(acc[i] / l);
+      }
+    }
+}
+)";
+
+/* Uniform parameters shared by both flash attention kernels, must match the
+ * Params struct in the WGSL code.
+ */
+struct FlashAttentionParams {
+  uint32_t Tq;
+  uint32_t Tkv;
+  uint32_t NH;
+  uint32_t qStride;
+  uint32_t kvStride;
+  uint32_t causal;
+  float scale;
+};
+
+/* Generates KernelCode for the flash attention kernels. For prefill, Br is the
+ * number of query rows per workgroup (== workgroup size). For decode, Br is
+ * the workgroup size used to split keys and head dimensions.
+ *
+ * Workgroup memory is 2 * Bc * HS floats (+ HS + Bc for decode), so Bc should
+ * be chosen such that this stays within the 16 KB default limit.
+ */
+inline KernelCode FlashAttentionShader(const char *shaderRaw, size_t HS,
+                                       size_t Br, size_t Bc,
+                                       NumType precision = kf32) {
+  KernelCode shader = {shaderRaw, Shape{Br, 1, 1}, precision};
+  replaceAll(shader.data, {{"{{HS}}", toString(HS)},
+                           {"{{Br}}", toString(Br)},
+                           {"{{Bc}}", toString(Bc)},
+                           {"{{WG}}", toString(Br)},
+                           {"{{HS_PER_THREAD}}", toString(cdiv(HS, Br))}});
+  return shader;
+}
+
+/* Creates a flash attention kernel for q, k, v, out bindings (see
+ * kShaderFlashAttention for the layout). Uses the decode kernel when there is
+ * a single query token per batch entry.
+ *
+ * Memory use is linear in the sequence length: only q, k, v and out are
+ * stored, scores live in registers / workgroup memory.
+ */
+inline Kernel createFlashAttention(Context &ctx, const Bindings<4> &bindings,
+                                   size_t B, size_t Tq, size_t Tkv, size_t NH,
+                                   size_t HS, size_t qStride, size_t kvStride,
+                                   bool causal = true) {
+  assert(Tq <= Tkv);
+  static constexpr size_t Br = 32;
+  static constexpr size_t Bc = 16;
+  FlashAttentionParams params = {
+      static_cast<uint32_t>(Tq),       static_cast<uint32_t>(Tkv),
+      static_cast<uint32_t>(NH),       static_cast<uint32_t>(qStride),
+      static_cast<uint32_t>(kvStride), static_cast<uint32_t>(causal),
+      1.0f / sqrtf(static_cast<float>(HS))};
+  if (Tq == 1) {
+    static constexpr size_t wgSize = 64;
+    return createKernel(
+        ctx, FlashAttentionShader(kShaderFlashAttentionDecode, HS, wgSize, Bc),
+        bindings, {1, NH, B}, params);
+  }
+  return createKernel(ctx,
+                      FlashAttentionShader(kShaderFlashAttention, HS, Br, Bc),
+                      bindings, {cdiv(Tq, Br), NH, B}, params);
+}
+
+/* Paged KV cache append
+ * - Writes the K / V rows of a batch of new tokens into their slots of the
+ *   block pools in a single dispatch, one thread per element.
+ * - slots[i] is the physical row (block * blockSize + offset) of token i,
+ *   see allocateSlots() in kvcache.h.
+ * - 2D grid so that large batches are not limited by 65535 workgroups in x.
+ */
+static const char *kShaderKVCacheAppend = R"(
+@group(0) @binding(0) var<storage, read_write> newK: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> newV: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> slots: array<u32>;
+@group(0) @binding(3) var<storage, read_write> keyPool: array<{{precision}}>;
+@group(0) @binding(4) var<storage, read_write> valuePool: array<{{precision}}>;
+@group(0) @binding(5) var<uniform> params: Params;
+
+struct Params {
+    nTokens: u32,
+    rowSize: u32, // NH * HS
+};
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let idx: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (idx >= params.nTokens * params.rowSize) {
+      return;
+    }
+    let dst: u32 = slots[idx / params.rowSize] * params.rowSize
+                   + idx % params.rowSize;
+    keyPool[dst] = newK[idx];
+    valuePool[dst] = newV[idx];
+}
+)";
+
+/* Paged attention, decode variant
+ * - Same work split as kShaderFlashAttentionDecode, one workgroup per
+ *   (head, sequence).
+ * - Key / value rows are gathered through the block table of the sequence
+ *   instead of a contiguous (Tkv, NH * HS) buffer.
+ * - The sequence length is read from storage, workgroupUniformLoad makes it
+ *   uniform so it can bound the tile loop.
+ */
+static const char *kShaderPagedAttentionDecode = R"(
+@group(0) @binding(0) var<storage, read_write> q: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> keyPool: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> valuePool: array<{{precision}}>;
+@group(0) @binding(3) var<storage, read_write> blockTable: array<u32>;
+@group(0) @binding(4) var<storage, read_write> seqLens: array<u32>;
+@group(0) @binding(5) var<storage, read_write> out: array<{{precision}}>;
+@group(0) @binding(6) var<uniform> params: Params;
+
+struct Params {
+    NH: u32,
+    qStride: u32,
+    blockSize: u32,
+    maxBlocksPerSeq: u32,
+    scale: f32,
+};
+
+const NEG_INFINITY: f32 = -3.0e38;
+
+var<workgroup> seqLen: u32;
+var<workgroup> qShared: array<f32, {{HS}}>;
+var<workgroup> kTile: array<f32, {{Bc}} * {{HS}}>;
+var<workgroup> vTile: array<f32, {{Bc}} * {{HS}}>;
+var<workgroup> scores: array<f32, {{Bc}}>;
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID : vec3<u32>,
+    @builtin(workgroup_id) groupID : vec3<u32>) {
+    let head: u32 = groupID.y;
+    let seq: u32 = groupID.z;
+    let tid: u32 = localID.x;
+    let rowSize: u32 = params.NH * {{HS}};
+    let tableBase: u32 = seq * params.maxBlocksPerSeq;
+
+    if (tid == 0u) {
+      seqLen = seqLens[seq];
+    }
+    let Tkv: u32 = workgroupUniformLoad(&seqLen);
+
+    let qBase: u32 = seq * params.qStride + head * {{HS}};
+    for (var d: u32 = tid; d < {{HS}}; d += {{WG}}) {
+      qShared[d] = f32(q[qBase + d]) * params.scale;
+    }
+
+    var acc: array<f32, {{HS_PER_THREAD}}>;
+    var m: f32 = NEG_INFINITY;
+    var l: f32 = 0.0;
+
+    for (var kvStart: u32 = 0; kvStart < Tkv; kvStart += {{Bc}}) {
+      for (var idx: u32 = tid; idx < {{Bc}} * {{HS}}; idx += {{WG}}) {
+        let t: u32 = kvStart + idx / {{HS}};
+        if (t < Tkv) {
+          let block: u32 = blockTable[tableBase + t / params.blockSize];
+          let slot: u32 = block * params.blockSize + t % params.blockSize;
+          let src: u32 = slot * rowSize + head * {{HS}} + idx % {{HS}};
+          kTile[idx] = f32(keyPool[src]);
+          vTile[idx] = f32(valuePool[src]);
+        }
+      }
+      workgroupBarrier();
+
+      for (var j: u32 = tid; j < {{Bc}}; j += {{WG}}) {
+        var score: f32 = NEG_INFINITY;
+        if (kvStart + j < Tkv) {
+          score = 0.0;
+          for (var d: u32 = 0; d < {{HS}}; d++) {
+            score += qShared[d] * kTile[j * {{HS}} + d];
+          }
+        }
+        scores[j] = score;
+      }
+      workgroupBarrier();
+
+      var tileMax: f32 = NEG_INFINITY;
+      for (var j: u32 = 0; j < {{Bc}}; j++) {
+        tileMax = max(tileMax, scores[j]);
+      }
+      let mNew: f32 = max(m, tileMax);
+      let alpha: f32 = exp(m - mNew);
+      l = l * alpha;
+      for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+        acc[i] = acc[i] * alpha;
+      }
+      for (var j: u32 = 0; j < {{Bc}}; j++) {
+        if (kvStart + j < Tkv) {
+          let p: f32 = exp(scores[j] - mNew);
+          l += p;
+          for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+            let d: u32 = tid + i * {{WG}};
+            if (d < {{HS}}) {
+              acc[i] += p * vTile[j * {{HS}} + d];
+            }
+          }
+        }
+      }
+      m = mNew;
+      workgroupBarrier();
+    }
+
+    let outBase: u32 = seq * rowSize + head * {{HS}};
+    let norm: f32 = select(0.0, 1.0 / l, l > 0.0);
+    for (var i: u32 = 0; i < {{HS_PER_THREAD}}; i++) {
+      let d: u32 = tid + i * {{WG}};
+      if (d < {{HS}}) {
+        out[outBase + d] = {{precision}}(acc[i] * norm);
+      }
+    }
+}
+)";
+
 } // namespace gpu
 
 #endif // KERNELS_H
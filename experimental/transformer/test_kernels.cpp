@@ -1,13 +1,27 @@
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
 #include <future>
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "gpu.h"
 #include "utils/array_utils.h"
 #include "utils/logging.h"
 
+#include "experimental/analysis.h"
+#include "experimental/chunked.h"
+#include "experimental/convert.h"
+#include "experimental/fusion.h"
+#include "experimental/graph.h"
+#include "experimental/planner.h"
+#include "experimental/stream.h"
+#include "experimental/typed.h"
+#include "experimental/wgsl.h"
 #include "llmc/reference_impls.h"
+#include "kvcache.h"
 #include "shaders.h"
 
 using namespace gpu;
@@ -101,9 +115,85 @@ void testMatmul(Context &ctx) {
                           input2ArrT.data(), nullptr, 1, M, K, N);
   LOG(kDefLog, kInfo, show<float, M, N>(refOutputArr, "C (reference)").c_str());
 
-  LOG(kDefLog, kInfo, "Done with Matmul Test");
   bool passed = isclose(outputArr.data(), refOutputArr.data(), N);
   assert(passed);
+
+  // The shape as override constants gives the same result, and a second
+  // shape reuses the shader module
+  std::array<float, M * N> overrideOutputArr;
+  Tensor overrideOutput = createTensor(ctx, {M, N}, kf32);
+  const size_t numModules = ctx.modulePool.data.size();
+  Kernel overrideOp = createKernel(
+      ctx, MatmulOverrideShader(256, kShaderMatMul1Override, kf32, M, K, N),
+      Bindings{input1, input2, overrideOutput}, {cdiv(M * N, 256), 1, 1});
+  Kernel narrowOp = createKernel(
+      ctx,
+      MatmulOverrideShader(256, kShaderMatMul1Override, kf32, M, K, N / 2),
+      Bindings{input1, input2, overrideOutput}, {cdiv(M * N, 256), 1, 1});
+  assert(ctx.modulePool.data.size() == numModules + 1);
+  std::promise<void> overridePromise;
+  std::future<void> overrideFuture = overridePromise.get_future();
+  dispatchKernel(ctx, overrideOp, overridePromise);
+  wait(ctx, overrideFuture);
+  toCPU(ctx, overrideOutput, overrideOutputArr.data(),
+        sizeof(overrideOutputArr));
+  assert(isclose(overrideOutputArr.data(), refOutputArr.data(), M * N));
+  LOG(kDefLog, kInfo, "Done with Matmul Test");
+}
+
+void testBatchedMatmul(Context &ctx) {
+  // Sizes that are not multiples of the tile sizes
+  static constexpr size_t BATCH = 6;
+  static constexpr size_t M = 37;
+  static constexpr size_t K = 20;
+  static constexpr size_t N = 45;
+  std::mt19937 gen(31415);
+  std::vector<float> aArr(BATCH * M * K), bArr(BATCH * K * N),
+      outputArr(BATCH * M * N), refOutputArr(BATCH * M * N);
+  randn(aArr.data(), aArr.size(), gen);
+  randn(bArr.data(), bArr.size(), gen);
+  Tensor a = createTensor(ctx, {BATCH, M, K}, kf32, aArr.data());
+  Tensor b = createTensor(ctx, {BATCH, K, N}, kf32, bArr.data());
+  Tensor output = createTensor(ctx, {BATCH, M, N}, kf32);
+
+  auto run = [&](Kernel op) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+  };
+
+  // Per-batch (K, N) B operands
+  run(createBatchedMatmul(ctx, Bindings{a, b, output}, BATCH, M, K, N, M * K,
+                          K * N, M * N));
+  std::vector<float> bT(N * K);
+  for (size_t i = 0; i < BATCH; ++i) {
+    transpose(&bArr[i * K * N], bT.data(), K, N);
+    ref::matmul_forward_cpu(&refOutputArr[i * M * N], &aArr[i * M * K],
+                            bT.data(), nullptr, 1, M, K, N);
+  }
+  bool passed =
+      isclose(outputArr.data(), refOutputArr.data(), outputArr.size());
+  assert(passed);
+  LOG(kDefLog, kInfo, "Batched matmul passed? %d", passed);
+
+  // Broadcast (N, K) B operand (batch stride 0), e.g. a shared weight matrix
+  run(createBatchedMatmul(ctx, Bindings{a, b, output}, BATCH, M, K, N, M * K,
+                          0, M * N, /*transposeB*/ true));
+  for (size_t i = 0; i < BATCH; ++i) {
+    ref::matmul_forward_cpu(&refOutputArr[i * M * N], &aArr[i * M * K],
+                            bArr.data(), nullptr, 1, M, K, N);
+  }
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), M, N, "Broadcast Output[0]").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), M, N, "Broadcast Reference[0]")
+          .c_str());
+  passed = isclose(outputArr.data(), refOutputArr.data(), outputArr.size());
+  assert(passed);
+  LOG(kDefLog, kInfo, "Broadcast batched matmul passed? %d", passed);
+  LOG(kDefLog, kInfo, "Done with Batched Matmul Test");
 }
 
 void testTensorPool(Context &ctx) {
@@ -165,6 +255,625 @@ void testGelu(Context &ctx) {
   LOG(kDefLog, kInfo, "Done with Gelu Test");
 }
 
+static const char *kShaderPackedTypes = R"(
+@group(0) @binding(0) var<storage, read_write> halves: array<u32>;
+@group(0) @binding(1) var<storage, read_write> bytes: array<u32>;
+@group(0) @binding(2) var<storage, read_write> ints: array<i32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) GlobalInvocationID: vec3<u32>) {
+  let i: u32 = GlobalInvocationID.x;
+  if (i < arrayLength(&halves)) {
+    halves[i] = packBf16(2.0 * unpackBf16(halves[i]));
+  }
+  if (i < arrayLength(&bytes)) {
+    bytes[i] = packU8(unpackU8(bytes[i]) + vec4<u32>(1u));
+  }
+  if (i < arrayLength(&ints)) {
+    ints[i] = -ints[i];
+  }
+}
+)";
+
+void testShaderTemplate(Context &ctx) {
+  const std::string source = "var<storage> a: array<{{precision}}, {{N}}>;\n"
+                             "let x = {{N}} * {{SCALE}}; // {{ not a key }}\n"
+                             "{{UNSET}}{{}}{";
+  const ShaderTemplate tmpl = parseTemplate(source);
+  assert(tmpl.placeholders.size() == 5);
+  std::string code;
+  std::vector<std::string> unfilled, unknown;
+  const bool filled = renderTemplate(
+      tmpl, {{"precision", "f32"}, {"N", "64"}, {"SCALE", "0.5"}, {"M", "1"}},
+      code, &unfilled, &unknown);
+  assert(!filled);
+  assert(unfilled == std::vector<std::string>{"UNSET"});
+  assert(unknown == std::vector<std::string>{"M"});
+  std::string expected = source;
+  replaceAll(expected, {{"{{precision}}", "f32"},
+                        {"{{N}}", "64"},
+                        {"{{SCALE}}", "0.5"}});
+  assert(code == expected);
+  // Rendering again reuses the buffer
+  const size_t capacity = code.capacity();
+  renderTemplate(tmpl, {{"precision", "f16"}, {"N", "8"}, {"SCALE", "2.0"}},
+                 code);
+  assert(code.capacity() == capacity);
+  assert(code.find("array<f16, 8>") != std::string::npos);
+  // KernelCode fills workgroupSize and precision in the same pass
+  KernelCode kernelCode = {cachedTemplate(kShaderResidual), {}, {128, 1, 1}};
+  assert(kernelCode.data ==
+         KernelCode(kShaderResidual, Shape{128, 1, 1}, kf32).data);
+  LOG(kDefLog, kInfo, "Done with Shader Template Test");
+}
+
+void testLoopUnrolling(Context &ctx) {
+  const std::string source =
+      "// for (var c: u32 = 0; c < 2; c++) { c; }\n"
+      "for (var row: u32 = 0; row < 2; row = row + 1) {\n"
+      "  for (var i = 0; i <= 1; i++) {\n"
+      "    x[row * 2u + u32(i)] = s.i + rowi; /* i */\n"
+      "  }\n"
+      "}\n"
+      "for (var k: u32 = 0; k < 8; k += 4) { if (k == 4) { break; } }\n"
+      "for (var k: u32 = 0; k < 9; k++) { y[k] = 0.0; }\n";
+  const std::string unrolled = loopUnrolling(source, 8);
+  // Comments are skipped, the nest is unrolled with typed literals on
+  // identifier boundaries, loops with break or above threshold are kept
+  assert(unrolled.find("// for (var c: u32") == 0);
+  assert(unrolled.find("x[0u * 2u + u32(0i)] = s.i + rowi; /* i */") !=
+         std::string::npos);
+  assert(unrolled.find("x[1u * 2u + u32(1i)] = s.i + rowi; /* i */") !=
+         std::string::npos);
+  assert(unrolled.find("for (var row") == std::string::npos);
+  assert(unrolled.find("for (var k: u32 = 0; k < 8; k += 4)") !=
+         std::string::npos);
+  assert(unrolled.find("for (var k: u32 = 0; k < 9; k++)") !=
+         std::string::npos);
+  // The threshold bounds the copies of the innermost body of a nest
+  const std::string partial = loopUnrolling(source, 2);
+  assert(partial.find("for (var row") != std::string::npos);
+  assert(partial.find("x[row * 2u + u32(1i)] = s.i + rowi;") !=
+         std::string::npos);
+  LOG(kDefLog, kInfo, "Done with Loop Unrolling Test");
+}
+
+void testPackedTypes(Context &ctx) {
+  // Odd sizes exercise the padding of the last packed word
+  constexpr size_t N = 1001;
+  constexpr size_t workgroupSize = 256;
+  std::vector<bf16> halves(N);
+  std::vector<uint8_t> bytes(N);
+  std::vector<int32_t> ints(N);
+  for (size_t i = 0; i < N; ++i) {
+    halves[i] = bf16(static_cast<float>(i) * 0.25f - 100.0f);
+    bytes[i] = static_cast<uint8_t>(i % 255);
+    ints[i] = static_cast<int32_t>(i) - 500;
+  }
+  Tensor halvesGPU = createTensor(ctx, {N}, kbf16, halves.data());
+  Tensor bytesGPU = createTensor(ctx, {N}, ku8, bytes.data());
+  Tensor intsGPU = createTensor(ctx, {N}, ki32, ints.data());
+  std::string code = std::string(kPackedTypeHelpers) + kShaderPackedTypes;
+  Kernel op = createKernel(ctx, {code, workgroupSize, kf32},
+                           Bindings{halvesGPU, bytesGPU, intsGPU},
+                           {cdiv(N, workgroupSize), 1, 1});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<bf16> halvesOut(N);
+  std::vector<uint8_t> bytesOut(N);
+  std::vector<int32_t> intsOut(N);
+  toCPU(ctx, halvesGPU, halvesOut.data());
+  toCPU(ctx, bytesGPU, bytesOut.data());
+  toCPU(ctx, intsGPU, intsOut.data());
+  for (size_t i = 0; i < N; ++i) {
+    // Doubling a bf16 is exact
+    assert(halvesOut[i].data == bf16(2.0f * halves[i]).data);
+    assert(bytesOut[i] == bytes[i] + 1);
+    assert(intsOut[i] == -ints[i]);
+  }
+  LOG(kDefLog, kInfo, "Done with Packed Types Test");
+}
+
+void testCompactTransfer(Context &ctx) {
+  // Odd size exercises the partial last word of the packed types
+  constexpr size_t N = 3001;
+  std::vector<float> ref(N), out(N);
+  std::vector<half> halves(N), halvesOut(N);
+  std::vector<bf16> bf16s(N), bf16sOut(N);
+  std::vector<uint8_t> bytes(N), bytesOut(N);
+  for (size_t i = 0; i < N; ++i) {
+    bytes[i] = static_cast<uint8_t>(i % 256);
+    halves[i] = halfFromFloat(static_cast<float>(i) * 0.5f - 700.0f);
+    bf16s[i] = bf16(static_cast<float>(i) * 0.25f - 300.0f);
+  }
+  Tensor activations = createTensor(ctx, {N}, kf32);
+
+  // f16 over the bus expands exactly to f32
+  CompactTransfer f16Transfer =
+      createCompactTransfer(ctx, activations, kf32, kf16);
+  toGPU(ctx, halves.data(), f16Transfer);
+  toCPU(ctx, activations, out.data(), N * sizeof(float));
+  halfToFloat(halves.data(), ref.data(), N);
+  assert(isclose(out.data(), ref.data(), N, 0.0f));
+  toCPU(ctx, f16Transfer, halvesOut.data());
+  for (size_t i = 0; i < N; ++i) {
+    assert(halvesOut[i].data == halves[i].data);
+  }
+
+  // bf16 over the bus
+  CompactTransfer bf16Transfer =
+      createCompactTransfer(ctx, activations, kf32, kbf16);
+  toGPU(ctx, bf16s.data(), bf16Transfer);
+  toCPU(ctx, activations, out.data(), N * sizeof(float));
+  for (size_t i = 0; i < N; ++i) {
+    assert(out[i] == static_cast<float>(bf16s[i]));
+  }
+  toCPU(ctx, bf16Transfer, bf16sOut.data());
+  for (size_t i = 0; i < N; ++i) {
+    assert(bf16sOut[i].data == bf16s[i].data);
+  }
+
+  // u8 image data mapped to [-1, 1] on the GPU and back
+  CompactTransfer u8Transfer = createCompactTransfer(
+      ctx, activations, kf32, ku8, 2.0f / 255.0f, -1.0f);
+  toGPU(ctx, bytes.data(), u8Transfer);
+  toCPU(ctx, activations, out.data(), N * sizeof(float));
+  for (size_t i = 0; i < N; ++i) {
+    ref[i] = bytes[i] * (2.0f / 255.0f) - 1.0f;
+  }
+  assert(isclose(out.data(), ref.data(), N, 1e-6f));
+  toCPU(ctx, u8Transfer, bytesOut.data());
+  for (size_t i = 0; i < N; ++i) {
+    assert(bytesOut[i] == bytes[i]);
+  }
+  LOG(kDefLog, kInfo, "Done with Compact Transfer Test");
+}
+
+void testFusion(Context &ctx) {
+  // One size taking the vec4 path and one taking the scalar path
+  for (size_t N : {size_t(4096), size_t(3001)}) {
+    std::vector<float> aArr(N), bArr(N), cArr(N), outArr(N), refArr(N);
+    auto gen = std::mt19937(31415);
+    randint(aArr.data(), N, gen, -5, 5);
+    randn(bArr.data(), N, gen);
+    randn(cArr.data(), N, gen);
+    Tensor aT = createTensor(ctx, {N}, kf32, aArr.data());
+    Tensor bT = createTensor(ctx, {N}, kf32, bArr.data());
+    Tensor cT = createTensor(ctx, {N}, kf32, cArr.data());
+    Tensor outT = createTensor(ctx, {N}, kf32);
+    fusion::Expr a = fusion::input(aT), b = fusion::input(bT),
+                 c = fusion::input(cT);
+
+    // gelu(a) * b + c, with the input read by two nodes bound once
+    fusion::FusionCache cache;
+    for (int iter = 0; iter < 2; ++iter) {
+      Kernel &op = fuse(ctx, cache, gelu(a) * b + c - 0.5f * c, outT);
+      std::promise<void> promise;
+      std::future<void> future = promise.get_future();
+      dispatchKernel(ctx, op, promise);
+      wait(ctx, future);
+    }
+    toCPU(ctx, outT, outArr.data(), N * sizeof(float));
+    ref::gelu_forward_cpu(refArr.data(), aArr.data(), N);
+    for (size_t i = 0; i < N; ++i) {
+      refArr[i] = refArr[i] * bArr[i] + cArr[i] - 0.5f * cArr[i];
+    }
+    bool passed = isclose(outArr.data(), refArr.data(), N);
+    LOG(kDefLog, kInfo, "Fused gelu(a) * b + c - 0.5 * c (N = %zu) passed? %d",
+        N, passed);
+    assert(passed);
+    assert(cache.misses == 1 && cache.hits == 1);
+
+    // A cache hit with other tensors rebinds the cached kernel
+    {
+      Tensor cT2 = createTensor(ctx, {N}, kf32, bArr.data());
+      Tensor outT2 = createTensor(ctx, {N}, kf32);
+      Kernel &op = fuse(ctx, cache,
+                        gelu(a) * b + fusion::input(cT2) -
+                            0.5f * fusion::input(cT2),
+                        outT2);
+      std::promise<void> promise;
+      std::future<void> future = promise.get_future();
+      dispatchKernel(ctx, op, promise);
+      wait(ctx, future);
+      toCPU(ctx, outT2, outArr.data(), N * sizeof(float));
+      ref::gelu_forward_cpu(refArr.data(), aArr.data(), N);
+      for (size_t i = 0; i < N; ++i) {
+        refArr[i] = refArr[i] * bArr[i] + 0.5f * bArr[i];
+      }
+      passed = isclose(outArr.data(), refArr.data(), N);
+      LOG(kDefLog, kInfo, "Fused kernel rebound from the cache passed? %d",
+          passed);
+      assert(passed);
+      assert(cache.misses == 1 && cache.hits == 2);
+      FreeTensor(ctx.pool, cT2);
+      FreeTensor(ctx.pool, outT2);
+    }
+
+    // Shared subexpression and the remaining pointwise functions
+    fusion::Expr s = silu(a - b);
+    Kernel op = fuse(ctx, max(s * s, relu(c)) / (1.0f + sigmoid(-b)), outT);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, outT, outArr.data(), N * sizeof(float));
+    for (size_t i = 0; i < N; ++i) {
+      const float x = aArr[i] - bArr[i];
+      const float si = x / (1.0f + std::exp(-x));
+      refArr[i] = std::max(si * si, std::max(cArr[i], 0.0f)) /
+                  (1.0f + 1.0f / (1.0f + std::exp(bArr[i])));
+    }
+    passed = isclose(outArr.data(), refArr.data(), N);
+    LOG(kDefLog, kInfo, "Fused silu / relu / sigmoid (N = %zu) passed? %d", N,
+        passed);
+    assert(passed);
+  }
+  LOG(kDefLog, kInfo, "Done with Fusion Test");
+}
+
+void testStridedViews(Context &ctx) {
+  // A fused QKV projection output (T, 3C) read through column slices, a
+  // transposed (C, T) input and a broadcast bias, without copies
+  static constexpr size_t T = 37;
+  static constexpr size_t C = 20;
+  static constexpr size_t N = 45;
+  std::mt19937 gen(31415);
+  std::vector<float> qkvArr(T * 3 * C), xArr(C * T), biasArr(C), wArr(N * C);
+  randn(qkvArr.data(), qkvArr.size(), gen);
+  randn(xArr.data(), xArr.size(), gen);
+  randn(biasArr.data(), biasArr.size(), gen);
+  randn(wArr.data(), wArr.size(), gen);
+  Tensor qkvT = createTensor(ctx, {T, 3 * C}, kf32, qkvArr.data());
+  Tensor xT = createTensor(ctx, {C, T}, kf32, xArr.data());
+  Tensor biasT = createTensor(ctx, {C}, kf32, biasArr.data());
+  Tensor wT = createTensor(ctx, {N, C}, kf32, wArr.data());
+  Tensor outT = createTensor(ctx, {T, C}, kf32);
+  Tensor matmulOutT = createTensor(ctx, {T, N}, kf32);
+  std::vector<float> outArr(T * C), refArr(T * C);
+  std::vector<float> matmulOutArr(T * N), matmulRefArr(T * N);
+  StridedView qkv = view(qkvT);
+  StridedView q = slice(qkv, 1, 0, C);
+  StridedView k = slice(qkv, 1, C, 2 * C);
+
+  auto run = [&](Kernel op) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  };
+
+  // Fused elementwise: x^T + bias + 2 q
+  run(fuse(ctx,
+           fusion::input(transpose(view(xT))) +
+               fusion::input(broadcastTo(view(biasT), {T, C})) +
+               2.0f * fusion::input(q),
+           outT));
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+  for (size_t t = 0; t < T; ++t) {
+    for (size_t c = 0; c < C; ++c) {
+      refArr[t * C + c] =
+          xArr[c * T + t] + biasArr[c] + 2.0f * qkvArr[t * 3 * C + c];
+    }
+  }
+  bool passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Fused strided views passed? %d", passed);
+  assert(passed);
+
+  // Materializing a slice
+  run(createCopy(ctx, k, outT));
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+  for (size_t t = 0; t < T; ++t) {
+    for (size_t c = 0; c < C; ++c) {
+      refArr[t * C + c] = qkvArr[t * 3 * C + C + c];
+    }
+  }
+  passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Strided copy passed? %d", passed);
+  assert(passed);
+
+  // Matmul of the q slice with a transposed (N, C) weight
+  run(createBatchedMatmul(ctx, q, transpose(view(wT)), matmulOutT));
+  toCPU(ctx, matmulOutT, matmulOutArr.data(),
+        matmulOutArr.size() * sizeof(float));
+  for (size_t t = 0; t < T; ++t) {
+    for (size_t c = 0; c < C; ++c) {
+      refArr[t * C + c] = qkvArr[t * 3 * C + c];
+    }
+  }
+  ref::matmul_forward_cpu(matmulRefArr.data(), refArr.data(), wArr.data(),
+                          nullptr, 1, T, C, N);
+  passed = isclose(matmulOutArr.data(), matmulRefArr.data(),
+                   matmulOutArr.size());
+  LOG(kDefLog, kInfo, "Strided view matmul passed? %d", passed);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Done with Strided Views Test");
+}
+
+void testTypedTensors(Context &ctx) {
+  static constexpr size_t T = 64;
+  static constexpr size_t C = 48;
+  std::mt19937 gen(31415);
+  std::array<float, T * C> aArr, bArr, outArr, refArr;
+  randn(aArr.data(), aArr.size(), gen);
+  randn(bArr.data(), bArr.size(), gen);
+  StaticTensor<float, T, C> a = createStaticTensor<float, T, C>(ctx, aArr);
+  StaticTensor<float, T, C> b = createStaticTensor<float, T, C>(ctx, bArr);
+  StaticTensor<float, T, C> out = createStaticTensor<float, T, C>(ctx);
+  static_assert(decltype(a)::kNumel == T * C && decltype(a)::rank == 2);
+
+  auto run = [&](Kernel op) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  };
+
+  // The second kernel reuses the code specialized by the first
+  const KernelCode &code =
+      specializedCode<&kShaderHadamard, float, T * C, 256>();
+  run(createElementwise<&kShaderHadamard>(ctx, a, b, out));
+  run(createElementwise<&kShaderHadamard>(ctx, a, b, out));
+  assert((&specializedCode<&kShaderHadamard, float, T * C, 256>() == &code));
+  toCPU(ctx, out, outArr);
+  for (size_t i = 0; i < T * C; ++i) {
+    refArr[i] = aArr[i] * bArr[i];
+  }
+  bool passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Typed hadamard passed? %d", passed);
+  assert(passed);
+
+  run(createElementwise<&kShaderGelu>(ctx, a, out));
+  toCPU(ctx, out, outArr);
+  ref::gelu_forward_cpu(refArr.data(), aArr.data(), T * C);
+  passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Typed gelu passed? %d", passed);
+  assert(passed);
+
+  // Runtime dimensions, typed host transfers
+  std::vector<int32_t> tokens(T * 3), tokensOut(T * 3);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    tokens[i] = static_cast<int32_t>(i * 7 % 50257);
+  }
+  TypedTensor<int32_t, 2> tokensT =
+      createTypedTensor<int32_t, 2>(ctx, {3, T}, tokens.data());
+  toCPU(ctx, tokensT, tokensOut.data());
+  passed = tokens == tokensOut;
+  LOG(kDefLog, kInfo, "Typed int32 round trip passed? %d", passed);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Done with Typed Tensors Test");
+}
+
+void testLazyGraph(Context &ctx) {
+  // Two residual MLP blocks of a transformer layer recorded lazily:
+  // x + W2 gelu(0.5 * W1 x), with a branch the output does not depend on
+  static constexpr size_t T = 40;
+  static constexpr size_t C = 24;
+  static constexpr size_t H = 4 * C;
+  std::mt19937 gen(31415);
+  std::vector<float> xArr(T * C), w1Arr(H * C), w2Arr(C * H);
+  randn(xArr.data(), xArr.size(), gen);
+  randn(w1Arr.data(), w1Arr.size(), gen, 0.0, 0.2);
+  randn(w2Arr.data(), w2Arr.size(), gen, 0.0, 0.2);
+  Tensor xT = createTensor(ctx, {T, C}, kf32, xArr.data());
+  Tensor w1T = createTensor(ctx, {H, C}, kf32, w1Arr.data());
+  Tensor w2T = createTensor(ctx, {C, H}, kf32, w2Arr.data());
+
+  auto linear = [](size_t M, size_t K, size_t N) -> KernelBuilder {
+    return [=](Context &ctx, std::vector<Tensor> &in, Tensor &out) {
+      return createBatchedMatmul(ctx, Bindings{in[0], in[1], out}, 1, M, K,
+                                 N, 0, 0, 0, /*transposeB*/ true);
+    };
+  };
+  Graph graph;
+  LazyTensor x = lazy(graph, xT);
+  LazyTensor w1 = lazy(graph, w1T);
+  LazyTensor w2 = lazy(graph, w2T);
+  LazyTensor residual = x;
+  for (int layer = 0; layer < 2; ++layer) {
+    LazyTensor h = customOp(graph, {residual, w1}, {T, H}, linear(T, C, H),
+                            "mlp1");
+    LazyTensor a = gelu(0.5f * h);
+    relu(h) * 2.0f; // dead
+    LazyTensor y = customOp(graph, {a, w2}, {T, C}, linear(T, H, C), "mlp2");
+    residual = y + residual;
+  }
+  Tensor outT = evaluate(ctx, graph, residual);
+  std::vector<float> outArr(T * C);
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+
+  std::vector<float> refArr(T * C), hArr(T * H), yArr(T * C);
+  auto reference = [&]() {
+    refArr = xArr;
+    for (int layer = 0; layer < 2; ++layer) {
+      ref::matmul_forward_cpu(hArr.data(), refArr.data(), w1Arr.data(),
+                              nullptr, 1, T, C, H);
+      for (float &v : hArr) {
+        v *= 0.5f;
+      }
+      ref::gelu_forward_cpu(hArr.data(), hArr.data(), hArr.size());
+      ref::matmul_forward_cpu(yArr.data(), hArr.data(), w2Arr.data(),
+                              nullptr, 1, T, H, C);
+      ref::residual_forward_cpu(refArr.data(), yArr.data(), refArr.data(),
+                                refArr.size());
+    }
+  };
+  reference();
+  bool passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Lazy graph passed? %d", passed);
+  assert(passed);
+  // Per layer: two matmuls, the fused gelu(0.5 * h) and the residual add.
+  // The dead relu branch is dropped and the second layer reuses the first
+  // layer's buffers.
+  assert(graph.stats.numKernels == 8);
+  assert(graph.stats.numFused == 2);
+  assert(graph.stats.numLive < graph.stats.numNodes);
+  assert(graph.stats.numBuffers < graph.stats.numIntermediates);
+
+  // Re-evaluating re-submits the same plan with new leaf data
+  randn(xArr.data(), xArr.size(), gen);
+  toGPU(ctx, xArr.data(), xT);
+  evaluate(ctx, graph, residual);
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+  reference();
+  passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Lazy graph re-evaluation passed? %d", passed);
+  assert(passed);
+
+  // Replanning for a new output recycles the previous plan's buffers
+  const size_t numPooled = ctx.pool.data.size();
+  outT = evaluate(ctx, graph, 2.0f * residual);
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+  for (float &v : refArr) {
+    v *= 2.0f;
+  }
+  passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Lazy graph replan passed? %d, %zu -> %zu buffers",
+      passed, numPooled, ctx.pool.data.size());
+  assert(passed);
+  assert(ctx.pool.data.size() == numPooled);
+  LOG(kDefLog, kInfo, "Done with Lazy Graph Test");
+}
+
+/* Checks that no two tensors with overlapping lifetimes share arena bytes */
+bool isValidPlan(const MemoryPlanner &planner, const MemoryPlan &plan) {
+  for (size_t a = 0; a < planner.tensors.size(); ++a) {
+    for (size_t b = a + 1; b < planner.tensors.size(); ++b) {
+      if (lifetimesOverlap(planner.tensors[a], planner.tensors[b]) &&
+          plan.offsets[a] < plan.offsets[b] + planner.tensors[b].bytes &&
+          plan.offsets[b] < plan.offsets[a] + planner.tensors[a].bytes) {
+        return false;
+      }
+    }
+  }
+  return plan.arenaBytes >= plan.lowerBound;
+}
+
+void testMemoryPlanner(Context &ctx) {
+  // Peak activation memory of a GPT-2 small forward pass (B = 4, T = 1024,
+  // 12 layers), one arena instead of a buffer per intermediate. Only the
+  // plan is computed, nothing is allocated or run.
+  {
+    static constexpr size_t L = 12, B = 4, T = 1024, C = 768;
+    MemoryPlanner planner;
+    size_t residual = addTensor(planner, {B, T, C});
+    addKernel(planner, {}, {residual}); // embedding
+    for (size_t l = 0; l < L; ++l) {
+      size_t ln1 = addTensor(planner, {B, T, C});
+      size_t qkv = addTensor(planner, {B, T, 3 * C});
+      size_t att = addTensor(planner, {B, T, C});
+      size_t proj = addTensor(planner, {B, T, C});
+      size_t res1 = addTensor(planner, {B, T, C});
+      size_t ln2 = addTensor(planner, {B, T, C});
+      size_t fc = addTensor(planner, {B, T, 4 * C});
+      size_t fcGelu = addTensor(planner, {B, T, 4 * C});
+      size_t fcProj = addTensor(planner, {B, T, C});
+      size_t res2 = addTensor(planner, {B, T, C});
+      addKernel(planner, {residual}, {ln1});
+      addKernel(planner, {ln1}, {qkv});
+      addKernel(planner, {qkv}, {att}); // flash attention, no score matrix
+      addKernel(planner, {att}, {proj});
+      addKernel(planner, {residual, proj}, {res1});
+      addKernel(planner, {res1}, {ln2});
+      addKernel(planner, {ln2}, {fc});
+      addKernel(planner, {fc}, {fcGelu});
+      addKernel(planner, {fcGelu}, {fcProj});
+      addKernel(planner, {res1, fcProj}, {res2});
+      residual = res2;
+    }
+    size_t lnf = addTensor(planner, {B, T, C});
+    addKernel(planner, {residual}, {lnf});
+    for (PackingStrategy strategy : {kGreedyBySize, kBestFit}) {
+      MemoryPlan plan = planMemory(planner, strategy);
+      LOG(kDefLog, kInfo,
+          "%s: %.1f MB dedicated buffers -> %.1f MB planned arena (%.1fx, "
+          "lower bound %.1f MB)",
+          strategy == kGreedyBySize ? "Greedy by size" : "Best fit",
+          plan.totalBytes / 1e6, plan.arenaBytes / 1e6,
+          static_cast<double>(plan.totalBytes) / plan.arenaBytes,
+          plan.lowerBound / 1e6);
+      assert(isValidPlan(planner, plan));
+      assert(plan.arenaBytes < plan.totalBytes / 10);
+    }
+  }
+
+  // Three residual MLP blocks running out of an arena
+  static constexpr size_t L = 3, T = 40, C = 24, H = 4 * C;
+  std::mt19937 gen(31415);
+  std::vector<float> xArr(T * C), w1Arr(H * C), w2Arr(C * H), outArr(T * C);
+  randn(xArr.data(), xArr.size(), gen);
+  randn(w1Arr.data(), w1Arr.size(), gen, 0.0, 0.2);
+  randn(w2Arr.data(), w2Arr.size(), gen, 0.0, 0.2);
+  Tensor xT = createTensor(ctx, {T, C}, kf32, xArr.data());
+  Tensor w1T = createTensor(ctx, {H, C}, kf32, w1Arr.data());
+  Tensor w2T = createTensor(ctx, {C, H}, kf32, w2Arr.data());
+  Tensor outT = createTensor(ctx, {T, C}, kf32);
+  auto whole = [](const Tensor &t) { return TensorView{t, 0, t.data.size}; };
+
+  MemoryPlanner planner;
+  std::vector<std::array<size_t, 4>> ids; // h, gelu(h), y, residual
+  for (size_t l = 0; l < L; ++l) {
+    ids.push_back({addTensor(planner, {T, H}), addTensor(planner, {T, H}),
+                   addTensor(planner, {T, C}), addTensor(planner, {T, C})});
+    const size_t prev = l > 0 ? ids[l - 1][3] : SIZE_MAX;
+    const std::vector<size_t> in =
+        l > 0 ? std::vector<size_t>{prev} : std::vector<size_t>{};
+    addKernel(planner, in, {ids[l][0]});
+    addKernel(planner, {ids[l][0]}, {ids[l][1]});
+    addKernel(planner, {ids[l][1]}, {ids[l][2]});
+    std::vector<size_t> resIn = in;
+    resIn.push_back(ids[l][2]);
+    addKernel(planner, resIn, l + 1 < L ? std::vector<size_t>{ids[l][3]}
+                                        : std::vector<size_t>{});
+  }
+  MemoryPlan plan = planMemory(planner);
+  assert(isValidPlan(planner, plan));
+  std::vector<TensorView> views = createArena(ctx, planner, plan);
+  LOG(kDefLog, kInfo, "MLP arena: %zu bytes for %zu bytes of activations",
+      plan.arenaBytes, plan.totalBytes);
+
+  std::vector<Kernel> kernels;
+  for (size_t l = 0; l < L; ++l) {
+    TensorView in = l > 0 ? views[ids[l - 1][3]] : whole(xT);
+    TensorView out = l + 1 < L ? views[ids[l][3]] : whole(outT);
+    kernels.push_back(createBatchedMatmul(
+        ctx, Bindings{in, whole(w1T), views[ids[l][0]]}, 1, T, C, H, 0, 0, 0,
+        /*transposeB*/ true));
+    kernels.push_back(createKernel(ctx, {kShaderGelu, 256, kf32},
+                                   Bindings{views[ids[l][0]], views[ids[l][1]]},
+                                   {cdiv(T * H, 256), 1, 1}));
+    kernels.push_back(createBatchedMatmul(
+        ctx, Bindings{views[ids[l][1]], whole(w2T), views[ids[l][2]]}, 1, T, H,
+        C, 0, 0, 0, /*transposeB*/ true));
+    kernels.push_back(createKernel(ctx, {kShaderResidual, 256, kf32},
+                                   Bindings{views[ids[l][2]], in, out},
+                                   {cdiv(T * C, 256), 1, 1}));
+  }
+  for (Kernel &op : kernels) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  }
+  toCPU(ctx, outT, outArr.data(), outArr.size() * sizeof(float));
+
+  std::vector<float> refArr = xArr, hArr(T * H), yArr(T * C);
+  for (size_t l = 0; l < L; ++l) {
+    ref::matmul_forward_cpu(hArr.data(), refArr.data(), w1Arr.data(), nullptr,
+                            1, T, C, H);
+    ref::gelu_forward_cpu(hArr.data(), hArr.data(), hArr.size());
+    ref::matmul_forward_cpu(yArr.data(), hArr.data(), w2Arr.data(), nullptr,
+                            1, T, H, C);
+    ref::residual_forward_cpu(refArr.data(), yArr.data(), refArr.data(),
+                              refArr.size());
+  }
+  bool passed = isclose(outArr.data(), refArr.data(), outArr.size());
+  LOG(kDefLog, kInfo, "Arena MLP passed? %d", passed);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Done with Memory Planner Test");
+}
+
 void testLayerNorm(Context &ctx) {
   struct LNParam {
     uint32_t N; // check
@@ -230,7 +939,7 @@ void testSoftmax(Context &ctx) {
   randint(inputArr, gen, 0, 3);
   Tensor input = createTensor(ctx, {B * T, C}, kf32, inputArr.data());
   Tensor output = createTensor(ctx, {B * T, C}, kf32, outputArr.data());
-  LOG(kDefLog, kInfo, "num threads: %d", B * T);
+  LOG(kDefLog, kInfo, "num threads: %zu", B * T);
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
   Kernel op = createKernel(
@@ -248,24 +957,431 @@ void testSoftmax(Context &ctx) {
   LOG(kDefLog, kInfo, "%s",
       show<float, B * T, C>(refOutputArr, "Softmax reference Output").c_str());
 
-  LOG(kDefLog, kInfo, "number of elements: %d", B * T * C);
+  LOG(kDefLog, kInfo, "number of elements: %zu", B * T * C);
   bool passed = isclose(outputArr.data(), refOutputArr.data(), B * T * C);
   assert(passed);
   LOG(kDefLog, kInfo, "Softmax passed? %d", passed);
   LOG(kDefLog, kInfo, "Done with Softmax Test");
 }
 
+void testSubgroupReductions(Context &ctx) {
+  static constexpr size_t N = 70;
+  static constexpr size_t C = 1000; // not a multiple of the workgroup size
+  static constexpr size_t K = 768;
+  static constexpr size_t OC = 203; // not a multiple of 8 outputs
+  std::mt19937 gen(31415);
+  std::vector<float> inputArr(N * C), weightArr(C), biasArr(C);
+  std::vector<float> matA(2 * K), matB(OC * K);
+  randn(inputArr.data(), inputArr.size(), gen);
+  randn(weightArr.data(), weightArr.size(), gen);
+  randn(biasArr.data(), biasArr.size(), gen);
+  randn(matA.data(), matA.size(), gen);
+  randn(matB.data(), matB.size(), gen, 0.0, 0.1);
+  Tensor input = createTensor(ctx, {N, C}, kf32, inputArr.data());
+  Tensor weight = createTensor(ctx, {C}, kf32, weightArr.data());
+  Tensor bias = createTensor(ctx, {C}, kf32, biasArr.data());
+  Tensor output = createTensor(ctx, {N, C}, kf32);
+  Tensor sums = createTensor(ctx, {N}, kf32);
+  Tensor a = createTensor(ctx, {2, K}, kf32, matA.data());
+  Tensor b = createTensor(ctx, {OC, K}, kf32, matB.data());
+  Tensor c = createTensor(ctx, {2, OC}, kf32);
+  std::vector<float> outputArr(N * C), refArr(N * C);
+  std::vector<float> sumsArr(N), refSums(N, 0.0f);
+  std::vector<float> cArr(2 * OC), refC(2 * OC);
+  for (size_t i = 0; i < N; ++i) {
+    for (size_t j = 0; j < C; ++j) {
+      refSums[i] += inputArr[i * C + j];
+    }
+  }
+  ref::matmul_forward_cpu(refC.data(), matA.data(), matB.data(), nullptr, 1, 2,
+                          K, OC);
+
+  auto run = [&](Kernel op) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  };
+
+  // Portable variants, then the subgroup variants where supported
+  const bool subgroups = ctx.subgroups;
+  for (bool useSubgroups : {false, true}) {
+    if (useSubgroups && !subgroups) {
+      LOG(kDefLog, kInfo, "Subgroups not supported, skipping the variants");
+      break;
+    }
+    ctx.subgroups = useSubgroups;
+    const char *variant = useSubgroups ? "subgroup" : "portable";
+
+    run(createRowSum(ctx, input, sums, N, C));
+    toCPU(ctx, sums, sumsArr.data(), sumsArr.size() * sizeof(float));
+    bool passed = isclose(sumsArr.data(), refSums.data(), N, 1e-2);
+    LOG(kDefLog, kInfo, "Row sum (%s) passed? %d", variant, passed);
+    assert(passed);
+
+    run(createSoftmax(ctx, input, output, N, C));
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+    ref::softmax_forward_cpu(refArr.data(), inputArr.data(), N, C);
+    passed = isclose(outputArr.data(), refArr.data(), N * C);
+    LOG(kDefLog, kInfo, "Softmax (%s) passed? %d", variant, passed);
+    assert(passed);
+
+    run(createLayerNorm(ctx, input, weight, bias, output, N, C));
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+    ref::layernorm_forward_cpu(refArr.data(), inputArr.data(),
+                               weightArr.data(), biasArr.data(), N, 1, C);
+    passed = isclose(outputArr.data(), refArr.data(), N * C);
+    LOG(kDefLog, kInfo, "LayerNorm (%s) passed? %d", variant, passed);
+    assert(passed);
+
+    run(createMatvec(ctx, a, b, c, 2, K, OC));
+    toCPU(ctx, c, cArr.data(), cArr.size() * sizeof(float));
+    passed = isclose(cArr.data(), refC.data(), cArr.size());
+    LOG(kDefLog, kInfo, "Matvec (%s) passed? %d", variant, passed);
+    assert(passed);
+  }
+  ctx.subgroups = subgroups;
+  LOG(kDefLog, kInfo, "Done with Subgroup Reductions Test");
+}
+
+void testChunkedTensors(Context &ctx) {
+  static constexpr size_t M = 500;
+  static constexpr size_t K = 100;
+  static constexpr size_t N = 300;
+  // Force small chunks: 160 rows for (., 100) tensors, 48 for (., 300)
+  const uint64_t maxBinding = ctx.limits.maxStorageBufferBindingSize;
+  ctx.limits.maxStorageBufferBindingSize = 64 * 1024;
+  std::mt19937 gen(31415);
+  std::vector<float> xArr(M * K), yArr(M * K), wArr(N * K);
+  randn(xArr.data(), xArr.size(), gen);
+  randn(yArr.data(), yArr.size(), gen);
+  randn(wArr.data(), wArr.size(), gen, 0.0, 0.1);
+  Tensor x = createTensor(ctx, {M, K}, kf32, xArr.data());
+  Tensor y = createTensor(ctx, {M, K}, kf32, yArr.data());
+  Tensor w = createTensor(ctx, {N, K}, kf32, wArr.data());
+  Tensor out = createTensor(ctx, {M, K}, kf32);
+  Tensor c = createTensor(ctx, {M, N}, kf32);
+  ctx.limits.maxStorageBufferBindingSize = maxBinding;
+  assert(tensorChunks(ctx, x).size() == 4);
+  assert(tensorChunks(ctx, w).size() == 2);
+  assert(tensorChunks(ctx, c).size() == 11);
+
+  auto run = [&](ChunkedKernel op) {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  };
+
+  // Round trip through all chunks
+  std::vector<float> outArr(M * K);
+  toCPU(ctx, x, outArr.data(), outArr.size() * sizeof(float));
+  bool passed = isclose(outArr.data(), xArr.data(), M * K);
+  LOG(kDefLog, kInfo, "Chunked round trip passed? %d", passed);
+  assert(passed);
+
+  run(fusion::fuseChunked(ctx, fusion::input(x) * fusion::input(y) + 1.0f,
+                          out));
+  toCPU(ctx, out, outArr.data(), outArr.size() * sizeof(float));
+  std::vector<float> refArr(M * K);
+  for (size_t i = 0; i < M * K; ++i) {
+    refArr[i] = xArr[i] * yArr[i] + 1.0f;
+  }
+  passed = isclose(outArr.data(), refArr.data(), M * K);
+  LOG(kDefLog, kInfo, "Chunked fusion passed? %d", passed);
+  assert(passed);
+
+  // Chunk boundaries of x, w and c all differ
+  run(createChunkedMatmul(ctx, x, w, c));
+  std::vector<float> cArr(M * N), refC(M * N);
+  toCPU(ctx, c, cArr.data(), cArr.size() * sizeof(float));
+  ref::matmul_forward_cpu(refC.data(), xArr.data(), wArr.data(), nullptr, 1, M,
+                          K, N);
+  passed = isclose(cArr.data(), refC.data(), M * N);
+  LOG(kDefLog, kInfo, "Chunked matmul passed? %d", passed);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Done with Chunked Tensors Test");
+}
+
+void testStreaming(Context &ctx) {
+  static constexpr size_t kBlock = 4096;
+  static constexpr size_t N = 10 * kBlock + 1000; // partial tail block
+  std::mt19937 gen(31415);
+  std::vector<float> inputArr(N), outputArr(N, 0.0f), refArr(N);
+  randn(inputArr.data(), N, gen);
+  ref::gelu_forward_cpu(refArr.data(), inputArr.data(), N);
+  size_t nextOffset = 0;
+  StreamConfig config = {.blockElements = kBlock};
+  StreamStats stats = runStream(
+      ctx, config,
+      [](Context &ctx, Tensor &input, Tensor &output) {
+        return createKernel(ctx, {kShaderGelu, 256, kf32},
+                            Bindings{input, output}, {cdiv(kBlock, 256), 1, 1});
+      },
+      memorySource(inputArr.data(), N * sizeof(float)),
+      [&](const StreamBlock &block) {
+        assert(block.inputOffset == nextOffset);
+        memcpy(reinterpret_cast<uint8_t *>(outputArr.data()) +
+                   block.inputOffset,
+               block.output, block.inputBytes);
+        nextOffset += block.inputBytes;
+      });
+  assert(stats.blocks == 11 && stats.inputBytes == N * sizeof(float));
+  bool passed = isclose(outputArr.data(), refArr.data(), N);
+  LOG(kDefLog, kInfo, "Streaming passed? %d", passed);
+  assert(passed);
+
+  // Compute-only baseline: the same launches with the data already resident,
+  // all queued before waiting, which bounds how busy the stream kept the GPU
+  Tensor input = createTensor(ctx, {kBlock}, kf32, inputArr.data());
+  Tensor output = createTensor(ctx, {kBlock}, kf32);
+  Kernel op = createKernel(ctx, {kShaderGelu, 256, kf32},
+                           Bindings{input, output}, {cdiv(kBlock, 256), 1, 1});
+  std::vector<std::promise<void>> promises(stats.blocks);
+  const auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < stats.blocks; ++i) {
+    if (i > 0) {
+      resetCommandBuffer(ctx.device, op);
+    }
+    dispatchKernel(ctx, op, promises[i]);
+  }
+  for (std::promise<void> &promise : promises) {
+    std::future<void> future = promise.get_future();
+    wait(ctx, future);
+  }
+  const double computeSeconds =
+      std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                    start)
+          .count();
+  LOG(kDefLog, kInfo,
+      "Streaming %zu blocks: %.3fs (%.3fs waiting), compute only %.3fs, "
+      "GPU busy at most %.0f%% of the stream",
+      stats.blocks, stats.seconds, stats.waitSeconds, computeSeconds,
+      100.0 * std::min(1.0, computeSeconds / stats.seconds));
+  LOG(kDefLog, kInfo, "Done with Streaming Test");
+}
+
+void testKernelAnalysis(Context &ctx) {
+  // 64 x 16 tiles of A and 16 x 64 tiles of B in f32
+  KernelCode matmul =
+      BatchedMatmulShader(kShaderBatchedMatmul, 64, 16, 64, 4, 4);
+  KernelReport report = analyzeKernel(ctx, matmul, {4, 4, 1});
+  LOG(kDefLog, kInfo, "Batched matmul resources:\n%s",
+      toString(report).c_str());
+  assert(report.resources.workgroupBytes == 2 * 64 * 16 * sizeof(float));
+  assert(report.resources.storageBindings == 3);
+  assert(report.resources.uniformBindings == 1);
+  assert(report.issues.empty());
+
+  // Workgroup memory sized by an override, over the 16 KiB default limit
+  KernelCode large = {R"(
+override TILE: u32 = 64;
+struct Pair { a: vec3<f32>, b: f32, };
+var<workgroup> tile: array<Pair, TILE * TILE>;
+@group(0) @binding(0) var<storage, read_write> out: array<f32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(local_invocation_index) i: u32) {
+    out[i] = tile[i].b;
+}
+)",
+                      256, kf32};
+  WGPULimits defaults = {};
+  KernelResources resources = analyzeKernel(large);
+  assert(resources.workgroupBytes == 64 * 64 * 16);
+  assert(checkLimits(resources, defaults).size() == 1);
+  large.constants = {{"TILE", 16}};
+  assert(checkLimits(analyzeKernel(large), defaults).empty());
+
+  Roofline roofline = measureRoofline(ctx);
+  assert(roofline.gflops > 0.0 && roofline.gbps > 0.0);
+  LOG(kDefLog, kInfo, "Done with Kernel Analysis Test");
+}
+
 void testAttention(Context &ctx) {
-  static constexpr size_t B = 6;
-  static constexpr size_t T = 32;   // token index
-  static constexpr size_t C = 3072; // input channels
-  static constexpr size_t QKV_DIM = 256;
-  static constexpr size_t N_HEADS = 12;
-  static constexpr size_t OC =
-      QKV_DIM * N_HEADS * 3; // output channels, 3 for Q, K, V
-  std::array<float, B * T * C> inputArr;
-  std::array<float, B * OC> outputArr;
-  std::array<float, C * OC> weightArr;
+  static constexpr size_t B = 2;
+  static constexpr size_t T = 70; // not a multiple of the tile sizes
+  static constexpr size_t N_HEADS = 4;
+  static constexpr size_t HEAD_SIZE = 32;
+  static constexpr size_t C = N_HEADS * HEAD_SIZE;
+  std::mt19937 gen(31415);
+  // Reference layout is (B, T, 3C) with Q, K, V concatenated per token
+  std::vector<float> qkvArr(B * T * 3 * C);
+  randn(qkvArr.data(), qkvArr.size(), gen);
+  std::vector<float> qArr(B * T * C), kArr(B * T * C), vArr(B * T * C);
+  for (size_t bt = 0; bt < B * T; ++bt) {
+    for (size_t c = 0; c < C; ++c) {
+      qArr[bt * C + c] = qkvArr[bt * 3 * C + c];
+      kArr[bt * C + c] = qkvArr[bt * 3 * C + C + c];
+      vArr[bt * C + c] = qkvArr[bt * 3 * C + 2 * C + c];
+    }
+  }
+  std::vector<float> refOutputArr(B * T * C);
+  std::vector<float> preatt(B * N_HEADS * T * T);
+  std::vector<float> att(B * N_HEADS * T * T);
+  ref::attention_forward_cpu(refOutputArr.data(), preatt.data(), att.data(),
+                             qkvArr.data(), B, T, C, N_HEADS);
+
+  Tensor q = createTensor(ctx, {B, T, C}, kf32, qArr.data());
+  Tensor k = createTensor(ctx, {B, T, C}, kf32, kArr.data());
+  Tensor v = createTensor(ctx, {B, T, C}, kf32, vArr.data());
+
+  // Prefill: all T queries, causal mask
+  {
+    Tensor output = createTensor(ctx, {B, T, C}, kf32);
+    std::vector<float> outputArr(B * T * C);
+    Kernel op = createFlashAttention(ctx, Bindings{q, k, v, output}, B, T, T,
+                                     N_HEADS, HEAD_SIZE, C, C);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+    LOG(kDefLog, kInfo, "%s",
+        show<float>(outputArr.data(), B * T, C, "Attention Output").c_str());
+    LOG(kDefLog, kInfo, "%s",
+        show<float>(refOutputArr.data(), B * T, C,
+                    "Attention Reference Output")
+            .c_str());
+    bool passed =
+        isclose(outputArr.data(), refOutputArr.data(), outputArr.size());
+    assert(passed);
+    LOG(kDefLog, kInfo, "Attention (prefill) passed? %d", passed);
+  }
+
+  // Decode: a single query (the last token) attending to all T keys
+  {
+    std::vector<float> qLastArr(B * C);
+    std::vector<float> refLastArr(B * C);
+    for (size_t b = 0; b < B; ++b) {
+      for (size_t c = 0; c < C; ++c) {
+        qLastArr[b * C + c] = qArr[(b * T + T - 1) * C + c];
+        refLastArr[b * C + c] = refOutputArr[(b * T + T - 1) * C + c];
+      }
+    }
+    Tensor qLast = createTensor(ctx, {B, 1, C}, kf32, qLastArr.data());
+    Tensor output = createTensor(ctx, {B, 1, C}, kf32);
+    std::vector<float> outputArr(B * C);
+    Kernel op = createFlashAttention(ctx, Bindings{qLast, k, v, output}, B, 1,
+                                     T, N_HEADS, HEAD_SIZE, C, C);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+    bool passed = isclose(outputArr.data(), refLastArr.data(), B * C);
+    assert(passed);
+    LOG(kDefLog, kInfo, "Attention (decode) passed? %d", passed);
+  }
+  LOG(kDefLog, kInfo, "Done with Attention Test");
+}
+
+// Single query attention over T cached rows of (T, NH * HS) keys / values
+void attentionDecodeRef(float *out, const float *q, const float *k,
+                        const float *v, size_t T, size_t NH, size_t HS) {
+  const size_t C = NH * HS;
+  const float scale = 1.0f / sqrtf(static_cast<float>(HS));
+  std::vector<float> scores(T);
+  for (size_t h = 0; h < NH; ++h) {
+    float maxval = -INFINITY;
+    for (size_t t = 0; t < T; ++t) {
+      float val = 0.0f;
+      for (size_t d = 0; d < HS; ++d) {
+        val += q[h * HS + d] * k[t * C + h * HS + d];
+      }
+      scores[t] = val * scale;
+      maxval = std::max(maxval, scores[t]);
+    }
+    float sum = 0.0f;
+    for (size_t t = 0; t < T; ++t) {
+      scores[t] = expf(scores[t] - maxval);
+      sum += scores[t];
+    }
+    for (size_t d = 0; d < HS; ++d) {
+      float acc = 0.0f;
+      for (size_t t = 0; t < T; ++t) {
+        acc += scores[t] * v[t * C + h * HS + d];
+      }
+      out[h * HS + d] = acc / sum;
+    }
+  }
+}
+
+void testPagedKVCache(Context &ctx) {
+  static constexpr size_t N_HEADS = 2;
+  static constexpr size_t HEAD_SIZE = 16;
+  static constexpr size_t C = N_HEADS * HEAD_SIZE;
+  static constexpr size_t N_SEQS = 3;
+  std::mt19937 gen(31415);
+  PagedKVCache cache = createPagedKVCache(
+      ctx, /*numBlocks*/ 16, /*blockSize*/ 4, /*maxSeqs*/ 4,
+      /*maxBlocksPerSeq*/ 8, N_HEADS, HEAD_SIZE);
+  // Host copies of each sequence's contiguous K / V rows for the reference
+  std::vector<std::vector<float>> keysRef(N_SEQS), valuesRef(N_SEQS);
+
+  // Appends a batch of tokens (given by sequence id) in a single dispatch
+  auto append = [&](const std::vector<uint32_t> &seqIds) {
+    const size_t nTokens = seqIds.size();
+    std::vector<float> kArr(nTokens * C), vArr(nTokens * C);
+    randn(kArr.data(), kArr.size(), gen);
+    randn(vArr.data(), vArr.size(), gen);
+    for (size_t i = 0; i < nTokens; ++i) {
+      keysRef[seqIds[i]].insert(keysRef[seqIds[i]].end(), &kArr[i * C],
+                                &kArr[i * C] + C);
+      valuesRef[seqIds[i]].insert(valuesRef[seqIds[i]].end(), &vArr[i * C],
+                                  &vArr[i * C] + C);
+    }
+    std::vector<uint32_t> slotsArr = allocateSlots(ctx, cache, seqIds);
+    Tensor newK = createTensor(ctx, {nTokens, C}, kf32, kArr.data());
+    Tensor newV = createTensor(ctx, {nTokens, C}, kf32, vArr.data());
+    Tensor slots = createTensor(ctx, {nTokens}, ku32, slotsArr.data());
+    Kernel op = createKVCacheAppend(ctx, cache, newK, newV, slots, nTokens);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+  };
+
+  // Interleaved prefill of three sequences
+  append({0, 1, 2, 0, 1, 2, 0, 1, 2, 2, 0, 2, 0, 2});
+  // Sequence 1 ends, its blocks are reused by a new sequence 1
+  freeSequence(ctx, cache, 1);
+  keysRef[1].clear();
+  valuesRef[1].clear();
+  LOG(kDefLog, kInfo, "Free blocks after freeing sequence 1: %zu",
+      cache.freeBlocks.size());
+  append({0, 1, 0, 1, 0, 0, 1});
+
+  std::vector<float> qArr(N_SEQS * C);
+  randn(qArr.data(), qArr.size(), gen);
+  Tensor q = createTensor(ctx, {N_SEQS, C}, kf32, qArr.data());
+  Tensor output = createTensor(ctx, {N_SEQS, C}, kf32);
+  Kernel op = createPagedAttention(ctx, cache, q, output, N_SEQS, C);
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(N_SEQS * C);
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  std::vector<float> refOutputArr(N_SEQS * C);
+  for (size_t seq = 0; seq < N_SEQS; ++seq) {
+    assert(keysRef[seq].size() / C == cache.seqLensHost[seq]);
+    attentionDecodeRef(&refOutputArr[seq * C], &qArr[seq * C],
+                       keysRef[seq].data(), valuesRef[seq].data(),
+                       cache.seqLensHost[seq], N_HEADS, HEAD_SIZE);
+  }
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), N_SEQS, C, "Paged Attention Output")
+          .c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), N_SEQS, C,
+                  "Paged Attention Reference Output")
+          .c_str());
+  bool passed =
+      isclose(outputArr.data(), refOutputArr.data(), outputArr.size());
+  assert(passed);
+  LOG(kDefLog, kInfo, "Paged KV cache passed? %d", passed);
+  LOG(kDefLog, kInfo, "Done with Paged KV Cache Test");
 }
 
 int main(int argc, char **argv) {
@@ -275,9 +1391,25 @@ int main(int argc, char **argv) {
   testResidual(ctx);
   testHadamard(ctx);
   testMatmul(ctx);
+  testBatchedMatmul(ctx);
   testGelu(ctx);
+  testShaderTemplate(ctx);
+  testLoopUnrolling(ctx);
+  testPackedTypes(ctx);
+  testCompactTransfer(ctx);
+  testFusion(ctx);
+  testStridedViews(ctx);
+  testTypedTensors(ctx);
+  testLazyGraph(ctx);
+  testMemoryPlanner(ctx);
   testLayerNorm(ctx);
   testSoftmax(ctx);
+  testSubgroupReductions(ctx);
+  testChunkedTensors(ctx);
+  testStreaming(ctx);
+  testKernelAnalysis(ctx);
+  testAttention(ctx);
+  testPagedKVCache(ctx);
 
   LOG(kDefLog, kInfo, "Done with all tests");
 }
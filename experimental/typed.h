@@ -0,0 +1,236 @@
+#ifndef GPU_CPP_TYPED_H
+#define GPU_CPP_TYPED_H
+
+#include <array>
+#include <cstdint>
+#include <type_traits>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * Typed tensors. Tensor does not record its element type and Shape is a
+ * runtime array, so mismatched host pointers or shapes are only caught at
+ * runtime, if at all. This optional layer carries them in the type:
+ *
+ * - TypedTensor<T, Rank>: element type and rank are static, dimensions are
+ *   runtime values.
+ * - StaticTensor<T, Dims...>: the whole shape is static, e.g. model
+ *   dimensions known at build time.
+ *
+ * toCPU() / toGPU() only accept host data of the element type (and, for
+ * static tensors, a std::array of the exact size), and typed kernel builders
+ * such as createElementwise() build their KernelCode once per template
+ * instantiation instead of on every call.
+ *
+ * @code
+ * StaticTensor<float, 64, 128> x = createStaticTensor<float, 64, 128>(ctx);
+ * StaticTensor<float, 64, 128> y = createStaticTensor<float, 64, 128>(ctx);
+ * Kernel op = createElementwise<&kShaderGelu>(ctx, x, y);
+ * std::array<float, 64 * 128> out;
+ * toCPU(ctx, y, out);  // std::array<half, ...> or <float, 64> fail to compile
+ * @endcode
+ *
+ * Both wrap a plain Tensor, so they bind like one, see binding().
+ */
+
+/**
+ * @brief NumType of a host element type. Only types with a GPU storage
+ * layout are defined, other types fail to compile.
+ */
+template <typename T> struct NumTypeOf;
+template <> struct NumTypeOf<float> {
+  static constexpr NumType value = kf32;
+};
+template <> struct NumTypeOf<half> {
+  static constexpr NumType value = kf16;
+};
+template <> struct NumTypeOf<bf16> {
+  static constexpr NumType value = kbf16;
+};
+template <> struct NumTypeOf<int32_t> {
+  static constexpr NumType value = ki32;
+};
+template <> struct NumTypeOf<uint32_t> {
+  static constexpr NumType value = ku32;
+};
+template <> struct NumTypeOf<uint8_t> {
+  static constexpr NumType value = ku8;
+};
+
+template <typename T>
+constexpr NumType kNumTypeOf = NumTypeOf<T>::value;
+
+/**
+ * @brief Tensor of element type T and static rank. Dimensions are runtime
+ * values.
+ */
+template <typename T, size_t Rank> struct TypedTensor {
+  static_assert(Rank >= 1 && Rank <= Shape::kMaxRank,
+                "TypedTensor rank between 1 and Shape::kMaxRank");
+  using Element = T;
+  static constexpr NumType dtype = kNumTypeOf<T>;
+  static constexpr size_t rank = Rank;
+
+  Tensor tensor;
+
+  inline size_t dim(size_t i) const { return tensor.shape[i]; }
+  inline size_t numel() const { return size(tensor.shape); }
+};
+
+/**
+ * @brief Tensor of element type T with a static shape.
+ */
+template <typename T, size_t... Dims>
+struct StaticTensor : TypedTensor<T, sizeof...(Dims)> {
+  static_assert(((Dims > 0) && ...), "StaticTensor dimensions are positive");
+  static constexpr std::array<size_t, sizeof...(Dims)> kShape = {Dims...};
+  static constexpr size_t kNumel = (Dims * ... * size_t(1));
+
+  inline static Shape shape() { return Shape{Dims...}; }
+  inline constexpr size_t numel() const { return kNumel; }
+};
+
+/**
+ * @brief The untyped tensor of a typed tensor, e.g. to pass it to Bindings
+ * or to the untyped kernel builders.
+ */
+template <typename T, size_t Rank>
+inline Tensor &binding(TypedTensor<T, Rank> &t) {
+  return t.tensor;
+}
+
+template <typename T, size_t Rank>
+inline const Tensor &binding(const TypedTensor<T, Rank> &t) {
+  return t.tensor;
+}
+
+/**
+ * @brief Creates a typed tensor with runtime dimensions, optionally
+ * initialized from host data of the element type.
+ *
+ * @code
+ * TypedTensor<int32_t, 2> tokens = createTypedTensor<int32_t, 2>(ctx, {B, T});
+ * @endcode
+ */
+template <typename T, size_t Rank>
+inline TypedTensor<T, Rank>
+createTypedTensor(Context &ctx, const std::array<size_t, Rank> &dims,
+                  const T *data = nullptr) {
+  Shape shape;
+  shape.rank = Rank;
+  std::copy(dims.begin(), dims.end(), shape.data.begin());
+  if (data == nullptr) {
+    return {createTensor(ctx, shape, kNumTypeOf<T>)};
+  }
+  return {createTensor(ctx, shape, kNumTypeOf<T>, const_cast<T *>(data))};
+}
+
+/**
+ * @brief Creates a tensor of a static shape, optionally initialized from host
+ * data of exactly that size.
+ */
+template <typename T, size_t... Dims>
+inline StaticTensor<T, Dims...> createStaticTensor(Context &ctx) {
+  StaticTensor<T, Dims...> t;
+  t.tensor = createTensor(ctx, StaticTensor<T, Dims...>::shape(),
+                          kNumTypeOf<T>);
+  return t;
+}
+
+template <typename T, size_t... Dims>
+inline StaticTensor<T, Dims...>
+createStaticTensor(Context &ctx,
+                   const std::array<T, StaticTensor<T, Dims...>::kNumel> &data) {
+  StaticTensor<T, Dims...> t;
+  t.tensor = createTensor(ctx, StaticTensor<T, Dims...>::shape(),
+                          kNumTypeOf<T>, const_cast<T *>(data.data()));
+  return t;
+}
+
+/**
+ * @brief Type-checked copy of a typed tensor to host memory of its element
+ * type, numel() values.
+ */
+template <typename T, size_t Rank>
+inline void toCPU(Context &ctx, TypedTensor<T, Rank> &t, T *data) {
+  if constexpr (std::is_same_v<T, float>) {
+    toCPU(ctx, t.tensor, data, t.numel() * sizeof(float));
+  } else {
+    toCPU(ctx, t.tensor, data);
+  }
+}
+
+template <typename T, size_t... Dims>
+inline void
+toCPU(Context &ctx, StaticTensor<T, Dims...> &t,
+      std::array<T, StaticTensor<T, Dims...>::kNumel> &data) {
+  toCPU(ctx, static_cast<TypedTensor<T, sizeof...(Dims)> &>(t), data.data());
+}
+
+/**
+ * @brief Type-checked copy of host memory of the element type to a typed
+ * tensor, numel() values.
+ */
+template <typename T, size_t Rank>
+inline void toGPU(Context &ctx, const T *data, TypedTensor<T, Rank> &t) {
+  toGPU(ctx, data, t.tensor);
+}
+
+template <typename T, size_t... Dims>
+inline void
+toGPU(Context &ctx, const std::array<T, StaticTensor<T, Dims...>::kNumel> &data,
+      StaticTensor<T, Dims...> &t) {
+  toGPU(ctx, data.data(), t.tensor);
+}
+
+/**
+ * @brief KernelCode of an elementwise shader specialized for an element type
+ * and size. Built on the first call of each instantiation, later calls only
+ * return the cached code, with no string work.
+ *
+ * Shader is the address of a shader template variable, e.g. &kShaderGelu,
+ * which may use {{precision}}, {{workgroupSize}} and {{N}} (the number of
+ * elements as a u32 literal).
+ */
+template <const char **Shader, typename T, size_t N, size_t WorkgroupSize>
+inline const KernelCode &specializedCode() {
+  static const KernelCode code = [] {
+    std::string data = *Shader;
+    replaceAll(data, "{{N}}", std::to_string(N) + "u");
+    return KernelCode{data, WorkgroupSize, kNumTypeOf<T>};
+  }();
+  return code;
+}
+
+/**
+ * @brief Creates an elementwise kernel over static tensors of the same type
+ * and shape, bound in argument order (inputs, then the output, as in the
+ * shader). Operands of another type or shape fail to compile, and the
+ * dispatch size is a compile-time constant.
+ *
+ * @code
+ * Kernel op = createElementwise<&kShaderHadamard>(ctx, a, b, c); // c = a * b
+ * @endcode
+ */
+template <const char **Shader, size_t WorkgroupSize = 256, typename T,
+          size_t... Dims, typename... Rest>
+inline Kernel createElementwise(Context &ctx, StaticTensor<T, Dims...> &first,
+                                Rest &...rest) {
+  using Operand = StaticTensor<T, Dims...>;
+  static_assert((std::is_same_v<Rest, Operand> && ...),
+                "Elementwise operands have the same element type and shape");
+  static_assert(!std::is_same_v<T, bf16> && !std::is_same_v<T, uint8_t>,
+                "Elementwise shaders index unpacked elements");
+  static constexpr size_t nWorkgroups = cdiv(Operand::kNumel, WorkgroupSize);
+  static_assert(nWorkgroups <= 65535,
+                "Elementwise dispatch fits a 1D grid of workgroups");
+  return createKernel(
+      ctx, specializedCode<Shader, T, Operand::kNumel, WorkgroupSize>(),
+      Bindings{first.tensor, rest.tensor...}, {nWorkgroups, 1, 1});
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_TYPED_H
@@ -0,0 +1,267 @@
+#ifndef GPU_CPP_VIEWS_H
+#define GPU_CPP_VIEWS_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+
+namespace gpu {
+
+/**
+ * Strided views. A StridedView is a tensor seen through a shape, a stride in
+ * elements per dimension and an element offset, so that slicing, transposing
+ * and broadcasting only change the view and never copy:
+ *
+ * @code
+ * StridedView x = view(qkv);                    // (T, 3C)
+ * StridedView q = slice(x, 1, 0, C);            // (T, C), row stride 3C
+ * StridedView kT = transpose(slice(x, 1, C, 2 * C)); // (C, T)
+ * StridedView bias = broadcastTo(view(b), {T, C});     // row stride 0
+ * @endcode
+ *
+ * Kernels read through a view with the index function generated by
+ * viewIndexFunction(), see fusion::input(const StridedView &) and
+ * createCopy().
+ */
+struct StridedView {
+  Tensor data;       // non-owning, the viewed tensor
+  Shape shape;       // logical shape of the view
+  Shape strides;     // in elements per dimension, 0 broadcasts the dimension
+  size_t offset = 0; // in elements
+};
+
+/**
+ * @brief Row-major strides of a contiguous tensor of the given shape.
+ */
+inline Shape contiguousStrides(const Shape &shape) {
+  Shape strides = shape;
+  size_t stride = 1;
+  for (size_t i = shape.rank; i-- > 0;) {
+    strides[i] = stride;
+    stride *= shape[i];
+  }
+  return strides;
+}
+
+/**
+ * @brief Contiguous view of a whole tensor.
+ */
+inline StridedView view(const Tensor &tensor) {
+  return {tensor, tensor.shape, contiguousStrides(tensor.shape), 0};
+}
+
+/**
+ * @brief Whether element i of the view, in row-major order, is element i of
+ * the tensor storage, i.e. the view can be bound and read as a plain tensor.
+ */
+inline bool isContiguous(const StridedView &v) {
+  if (v.offset != 0) {
+    return false;
+  }
+  const Shape strides = contiguousStrides(v.shape);
+  for (size_t i = 0; i < v.shape.rank; ++i) {
+    if (v.shape[i] > 1 && v.strides[i] != strides[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Elements [start, end) of dimension dim, every step-th element.
+ */
+inline StridedView slice(const StridedView &v, size_t dim, size_t start,
+                         size_t end, size_t step = 1) {
+  check(dim < v.shape.rank && start <= end && end <= v.shape[dim] && step > 0,
+        "Slice within the view", __FILE__, __LINE__);
+  StridedView result = v;
+  result.offset += start * v.strides[dim];
+  result.shape[dim] = cdiv(end - start, step);
+  result.strides[dim] *= step;
+  return result;
+}
+
+/**
+ * @brief Reorders the dimensions, dimension i of the result is dimension
+ * order[i] of v.
+ *
+ * @code
+ * // (T, nHeads, hs) -> (nHeads, T, hs)
+ * StridedView heads = permute(x, {1, 0, 2});
+ * @endcode
+ */
+inline StridedView permute(const StridedView &v, const Shape &order) {
+  check(order.rank == v.shape.rank, "Permutation of all dimensions", __FILE__,
+        __LINE__);
+  StridedView result = v;
+  for (size_t i = 0; i < order.rank; ++i) {
+    check(order[i] < v.shape.rank, "Permutation dimension in range", __FILE__,
+          __LINE__);
+    result.shape[i] = v.shape[order[i]];
+    result.strides[i] = v.strides[order[i]];
+  }
+  return result;
+}
+
+/**
+ * @brief Swaps two dimensions, by default the first two (a matrix transpose).
+ */
+inline StridedView transpose(const StridedView &v, size_t dim0 = 0,
+                             size_t dim1 = 1) {
+  check(dim0 < v.shape.rank && dim1 < v.shape.rank,
+        "Transposed dimensions in range", __FILE__, __LINE__);
+  StridedView result = v;
+  std::swap(result.shape[dim0], result.shape[dim1]);
+  std::swap(result.strides[dim0], result.strides[dim1]);
+  return result;
+}
+
+/**
+ * @brief Broadcasts a view to shape with the numpy rules: dimensions are
+ * aligned from the last one, missing leading dimensions and dimensions of
+ * size 1 are repeated with stride 0.
+ */
+inline StridedView broadcastTo(const StridedView &v, const Shape &shape) {
+  check(v.shape.rank <= shape.rank, "Broadcast to a larger rank", __FILE__,
+        __LINE__);
+  StridedView result = v;
+  result.shape = shape;
+  result.strides = shape;
+  const size_t lead = shape.rank - v.shape.rank;
+  for (size_t i = 0; i < shape.rank; ++i) {
+    if (i < lead || v.shape[i - lead] == 1) {
+      result.strides[i] = 0;
+    } else {
+      check(v.shape[i - lead] == shape[i], "Broadcast dimensions match",
+            __FILE__, __LINE__);
+      result.strides[i] = v.strides[i - lead];
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief Identifies the index mapping of a view, independently of the bound
+ * buffer, e.g. for kernel code caches.
+ */
+inline std::string viewSignature(const StridedView &v) {
+  std::string signature = "[" + toString(v.shape) + "|";
+  for (size_t i = 0; i < v.strides.rank; ++i) {
+    signature += (i > 0 ? "," : "") + std::to_string(v.strides[i]);
+  }
+  return signature + "+" + std::to_string(v.offset) + "]";
+}
+
+/**
+ * @brief Generates a WGSL function `fn name(i: u32) -> u32` returning the
+ * storage index of element i (in row-major order over the view shape) of the
+ * view. Dimensions of size 1 are dropped and adjacent dimensions which are
+ * contiguous with each other merged, so a column slice of a matrix costs one
+ * division and a contiguous view none.
+ *
+ * @code
+ * viewIndexFunction("aIndex", transpose(view(a))); // a is (4, 6)
+ * // fn aIndex(i: u32) -> u32 {
+ * //     var r: u32 = i;
+ * //     var s: u32 = 0u;
+ * //     s = s + (r % 4u) * 6u;
+ * //     r = r / 4u;
+ * //     s = s + r * 1u;
+ * //     return s;
+ * // }
+ * @endcode
+ */
+inline std::string viewIndexFunction(const std::string &name,
+                                     const StridedView &v) {
+  // Merge dimensions from the last one: (d0, s0), (d1, s1) with
+  // s0 == d1 * s1 index like a single dimension (d0 * d1, s1)
+  std::vector<std::pair<size_t, size_t>> dims; // (size, stride), last first
+  for (size_t i = v.shape.rank; i-- > 0;) {
+    if (v.shape[i] == 1) {
+      continue;
+    }
+    if (!dims.empty() &&
+        v.strides[i] == dims.back().first * dims.back().second) {
+      dims.back().first *= v.shape[i];
+    } else {
+      dims.push_back({v.shape[i], v.strides[i]});
+    }
+  }
+  // Broadcast outer dimensions do not contribute to the index, but the
+  // remaining outermost dimension then needs its modulo
+  bool outerBroadcast = false;
+  while (!dims.empty() && dims.back().second == 0) {
+    dims.pop_back();
+    outerBroadcast = true;
+  }
+  std::string code = "fn " + name + "(i: u32) -> u32 {\n";
+  code += "    var r: u32 = i;\n";
+  code += "    var s: u32 = " + std::to_string(v.offset) + "u;\n";
+  for (size_t d = 0; d < dims.size(); ++d) {
+    const std::string size = std::to_string(dims[d].first) + "u";
+    const std::string stride = std::to_string(dims[d].second) + "u";
+    const bool last = d + 1 == dims.size();
+    if (dims[d].second != 0) {
+      code += last && !outerBroadcast
+                  ? "    s = s + r * " + stride + ";\n"
+                  : "    s = s + (r % " + size + ") * " + stride + ";\n";
+    }
+    if (!last) {
+      code += "    r = r / " + size + ";\n";
+    }
+  }
+  code += "    return s;\n}\n";
+  return code;
+}
+
+/* Strided copy
+ * - Materializes a strided view into a contiguous tensor, one thread per
+ *   output element reading through the generated index function.
+ * - 2D grid so that large tensors are not limited by 65535 workgroups in x.
+ */
+static const char *kShaderStridedCopy = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{precision}}>;
+{{INDEX_FN}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID : vec3<u32>) {
+    let i: u32 = globalID.x + globalID.y * {{X_THREADS}};
+    if (i < {{N}}) {
+        out[i] = inp[srcIndex(i)];
+    }
+}
+)";
+
+/**
+ * @brief Creates a kernel copying the elements of a view, in row-major order,
+ * to a contiguous tensor. Only needed where a consumer cannot read through a
+ * view, e.g. before a host readback.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] src View to copy
+ * @param[out] dst Contiguous tensor of size(src.shape) elements
+ * @param[in] precision Element type of src and dst
+ * @return Kernel instance, dispatched with dispatchKernel()
+ */
+inline Kernel createCopy(Context &ctx, const StridedView &src, Tensor &dst,
+                         NumType precision = kf32) {
+  const size_t numel = size(src.shape);
+  check(size(dst.shape) == numel, "Copy destination matches the view size",
+        __FILE__, __LINE__);
+  static constexpr size_t wgSize = 256;
+  const size_t nWorkgroups = cdiv(numel, wgSize);
+  const size_t wgX = std::min<size_t>(nWorkgroups, 65535);
+  std::string code = kShaderStridedCopy;
+  replaceAll(code, {{"{{INDEX_FN}}", viewIndexFunction("srcIndex", src)},
+                    {"{{X_THREADS}}", toString(wgX * wgSize)},
+                    {"{{N}}", toString(numel) + "u"}});
+  return createKernel(ctx, {code, wgSize, precision},
+                      Bindings{src.data, dst},
+                      {wgX, cdiv(nWorkgroups, wgX), 1});
+}
+
+} // namespace gpu
+
+#endif // GPU_CPP_VIEWS_H
@@ -1,82 +1,443 @@
 #ifndef GPU_CPP_WGSL_H
 #define GPU_CPP_WGSL_H
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <string>
-#include <regex>
-#include "utils/logging.h"        // LOG
+#include <utility>
+#include <vector>
+
+#include "utils/logging.h" // LOG
 
 namespace gpu {
 
-// Loop-unrolling optimization with regex
-//
-// Note: Be cautious, as it does not correctly recognize comments or lexical tokens.
-std::string loopUnrolling(const std::string& code, int threshold = 32) {
-  // This regex pattern matches a for loop with the following structure:
-  // for (var <varName>: u32 = <start>; <varName> < <end>; <varName>++) { <loopBody> }
-  std::regex forLoopPattern(R"(for\s*\(\s*var\s+(\w+):\s*u32\s*=\s*(\d+)\s*;\s*\1\s*<\s*(\d+)\s*;\s*\1\+\+\s*\)\s*\{\s*([^{}]*)\})");
-  // Explanation of the regex:
-  // for\s*\(                        : Matches 'for (' with optional whitespace
-  // \s*var\s+                       : Matches 'var ' with optional whitespace
-  // (\w+)                           : Captures the variable name (alphanumeric characters and underscores)
-  // :\s*u32\s*=\s*                  : Matches ': u32 = ' with optional whitespace
-  // (\d+)                           : Captures the start value (one or more digits)
-  // \s*;\s*                         : Matches ';' with optional whitespace
-  // \1\s*<\s*                       : Matches the captured variable name followed by '<' with optional whitespace
-  // (\d+)                           : Captures the end value (one or more digits)
-  // \s*;\s*                         : Matches ';' with optional whitespace
-  // \1\+\+\s*                       : Matches the captured variable name followed by '++' with optional whitespace
-  // \)\s*\{\s*                      : Matches ')' followed by '{' with optional whitespace
-  // ([^{}]*)                        : Captures the loop body (anything except '{' or '}')
-  // \}                              : Matches the closing '}'
-
-  // Example:
-  //
-  // Input code:
-  // for (var i: u32 = 0; i < 3; i++) { std::cout << i << std::endl; }
-  //
-  // Matches:
-  //   varName = "i"
-  //   start = "0"
-  //   end = "3"
-  //   loopBody = "std::cout << i << std::endl;"
-  //
-  // Unrolled:
-  // std::cout << 0 << std::endl;
-  // std::cout << 1 << std::endl;
-  // std::cout << 2 << std::endl;  
-  //
-  std::smatch match;
-  std::string unrolledCode = code;
-  while (std::regex_search(unrolledCode, match, forLoopPattern)) {
-    std::string varName = match[1];
-    int start = std::stoi(match[2]);
-    int end = std::stoi(match[3]);
-    std::string loopBody = match[4];
-
-    if (end - start > threshold ) {
-      std::string skippedLoop =
-	"for (var " +
-	std::string(match[1]) + ": u32 = " + std::string(match[2]) + ";"+
-	std::string(match[1]) + " < " + std::string(match[3]) + ";"+
-	std::string(match[1]) + "++) /* Skipped */ {"+
-	std::string(match[4]) +
-	"}";
-      // LOG(kDefLog, kInfo, "Roll loop:%s", skippedLoop.c_str());
-      unrolledCode = unrolledCode.substr(0, match.position()) + skippedLoop + unrolledCode.substr(match.position() + match.length());
+/**
+ * @brief A lexical token of WGSL source. Tokens keep their exact source text,
+ * including whitespace and comments, so that concatenating the tokens of a
+ * source gives back the source.
+ */
+struct WgslToken {
+  enum Kind { kIdent, kNumber, kPunct, kSpace, kComment };
+  Kind kind;
+  std::string text;
+};
+
+/**
+ * @brief Splits WGSL source into tokens. Block comments may nest, as in WGSL.
+ */
+inline std::vector<WgslToken> tokenizeWgsl(const std::string &code) {
+  static const char *kTwoCharOps[] = {"++", "--", "+=", "-=", "*=", "/=",
+                                      "%=", "&=", "|=", "^=", "<=", ">=",
+                                      "==", "!=", "&&", "||", "->", "<<",
+                                      ">>"};
+  std::vector<WgslToken> tokens;
+  size_t pos = 0;
+  const size_t n = code.size();
+  auto isIdent = [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  };
+  while (pos < n) {
+    const size_t start = pos;
+    const char c = code[pos];
+    WgslToken::Kind kind = WgslToken::kPunct;
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      while (pos < n && std::isspace(static_cast<unsigned char>(code[pos]))) {
+        ++pos;
+      }
+      kind = WgslToken::kSpace;
+    } else if (code.compare(pos, 2, "//") == 0) {
+      while (pos < n && code[pos] != '\n') {
+        ++pos;
+      }
+      kind = WgslToken::kComment;
+    } else if (code.compare(pos, 2, "/*") == 0) {
+      int depth = 0;
+      do {
+        if (code.compare(pos, 2, "/*") == 0) {
+          ++depth;
+          pos += 2;
+        } else if (code.compare(pos, 2, "*/") == 0) {
+          --depth;
+          pos += 2;
+        } else {
+          ++pos;
+        }
+      } while (pos < n && depth > 0);
+      kind = WgslToken::kComment;
+    } else if (std::isdigit(static_cast<unsigned char>(c)) ||
+               (c == '.' && pos + 1 < n &&
+                std::isdigit(static_cast<unsigned char>(code[pos + 1])))) {
+      // Numbers including hex, floats, exponents and suffixes
+      while (pos < n &&
+             (isIdent(code[pos]) || code[pos] == '.' ||
+              ((code[pos] == '+' || code[pos] == '-') &&
+               (code[pos - 1] == 'e' || code[pos - 1] == 'E' ||
+                code[pos - 1] == 'p' || code[pos - 1] == 'P') &&
+               !(code[start] == '0' && pos > start + 1 &&
+                 (code[start + 1] == 'x' || code[start + 1] == 'X') &&
+                 (code[pos - 1] == 'e' || code[pos - 1] == 'E'))))) {
+        ++pos;
+      }
+      kind = WgslToken::kNumber;
+    } else if (isIdent(c)) {
+      while (pos < n && isIdent(code[pos])) {
+        ++pos;
+      }
+      kind = WgslToken::kIdent;
     } else {
-      // LOG(kDefLog, kInfo, "Unroll loop(var: %s, start:%d, end:%d, body:%s)", varName.c_str(), start, end, loopBody.c_str());
-      std::string unrolledLoop;
-      for (int i = start; i < end; ++i) {
-        std::string unrolledIteration = loopBody;
-        std::regex varPattern(varName);
-        unrolledIteration = std::regex_replace(unrolledIteration, varPattern, std::to_string(i));
-        unrolledLoop += unrolledIteration;
+      pos += 1;
+      for (const char *op : kTwoCharOps) {
+        if (code.compare(start, 2, op) == 0) {
+          pos = start + 2;
+          break;
+        }
       }
-      unrolledCode = unrolledCode.substr(0, match.position()) + unrolledLoop + unrolledCode.substr(match.position() + match.length());
     }
+    tokens.push_back({kind, code.substr(start, pos - start)});
+  }
+  return tokens;
+}
+
+/**
+ * @brief Parses an integer literal such as 4, 4u, 4i or 0x10u.
+ * @return True if text is an integer literal, with its value in value
+ */
+inline bool parseWgslInt(const std::string &text, int64_t &value) {
+  std::string digits = text;
+  if (!digits.empty() && (digits.back() == 'u' || digits.back() == 'i')) {
+    digits.pop_back();
+  }
+  if (digits.empty()) {
+    return false;
+  }
+  const bool hex = digits.size() > 2 && digits[0] == '0' &&
+                   (digits[1] == 'x' || digits[1] == 'X');
+  const size_t first = hex ? 2 : 0;
+  value = 0;
+  for (size_t i = first; i < digits.size(); ++i) {
+    const char c = static_cast<char>(std::tolower(digits[i]));
+    int digit = 0;
+    if (std::isdigit(static_cast<unsigned char>(c))) {
+      digit = c - '0';
+    } else if (hex && c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    value = value * (hex ? 16 : 10) + digit;
+    if (value > (int64_t(1) << 32)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief A counted for loop recognized by the unroller:
+ * for (var i[: T] = start; i < end (or <=); i++ / i += step / i = i + step)
+ */
+struct WgslCountedLoop {
+  std::string var;
+  std::string suffix; // "u" or "i", the literal suffix of the loop type
+  int64_t start = 0;
+  int64_t end = 0; // exclusive
+  int64_t step = 1;
+  size_t bodyBegin = 0; // first token after '{'
+  size_t bodyEnd = 0;   // index of the matching '}'
+};
+
+/**
+ * @brief Matches a counted loop whose for keyword is tokens[forIndex].
+ * @return True if the header matched, with the loop in loop
+ */
+inline bool matchCountedLoop(const std::vector<WgslToken> &tokens,
+                             size_t forIndex, WgslCountedLoop &loop) {
+  size_t pos = forIndex + 1;
+  // Next significant token, skipping whitespace and comments
+  auto next = [&]() -> const WgslToken * {
+    while (pos < tokens.size() && (tokens[pos].kind == WgslToken::kSpace ||
+                                   tokens[pos].kind == WgslToken::kComment)) {
+      ++pos;
+    }
+    return pos < tokens.size() ? &tokens[pos++] : nullptr;
+  };
+  auto expect = [&](const char *text) {
+    const WgslToken *t = next();
+    return t && t->text == text;
+  };
+  auto number = [&](int64_t &value, std::string *suffix = nullptr) {
+    const WgslToken *t = next();
+    if (!t || t->kind != WgslToken::kNumber || !parseWgslInt(t->text, value)) {
+      return false;
+    }
+    if (suffix && (t->text.back() == 'u' || t->text.back() == 'i')) {
+      *suffix = t->text.back();
+    }
+    return true;
+  };
+
+  if (!expect("(") || !expect("var")) {
+    return false;
+  }
+  const WgslToken *var = next();
+  if (!var || var->kind != WgslToken::kIdent) {
+    return false;
+  }
+  loop.var = var->text;
+  loop.suffix = "i"; // abstract integers concretize to i32
+  const WgslToken *t = next();
+  if (t && t->text == ":") {
+    const WgslToken *type = next();
+    if (!type || (type->text != "u32" && type->text != "i32")) {
+      return false;
+    }
+    loop.suffix = type->text == "u32" ? "u" : "i";
+    t = next();
+  }
+  std::string initSuffix;
+  if (!t || t->text != "=" || !number(loop.start, &initSuffix) ||
+      !expect(";") || !expect(loop.var.c_str())) {
+    return false;
+  }
+  if (!initSuffix.empty()) {
+    loop.suffix = initSuffix;
+  }
+  const WgslToken *cmp = next();
+  if (!cmp || (cmp->text != "<" && cmp->text != "<=") ||
+      !number(loop.end) || !expect(";") || !expect(loop.var.c_str())) {
+    return false;
+  }
+  loop.end += cmp->text == "<=" ? 1 : 0;
+  const WgslToken *op = next();
+  if (!op) {
+    return false;
   }
+  if (op->text == "++") {
+    loop.step = 1;
+  } else if (op->text == "+=") {
+    if (!number(loop.step)) {
+      return false;
+    }
+  } else if (op->text == "=") {
+    if (!expect(loop.var.c_str()) || !expect("+") || !number(loop.step)) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  if (loop.step <= 0 || !expect(")") || !expect("{")) {
+    return false;
+  }
+  loop.bodyBegin = pos;
+  int depth = 1;
+  for (; pos < tokens.size(); ++pos) {
+    if (tokens[pos].text == "{") {
+      ++depth;
+    } else if (tokens[pos].text == "}" && --depth == 0) {
+      loop.bodyEnd = pos;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Whether the body of a loop can be duplicated per iteration with the
+ * loop variable replaced by a constant: the body must not write the loop
+ * variable, declare a variable of the same name, or break / continue this
+ * loop.
+ */
+inline bool isUnrollableBody(const std::vector<WgslToken> &tokens,
+                             const WgslCountedLoop &loop) {
+  int nestedLoops = 0;
+  std::vector<int> loopDepths; // brace depth at which nested loops end
+  int depth = 0;
+  const WgslToken *prev = nullptr;
+  const WgslToken *prevPrev = nullptr;
+  for (size_t i = loop.bodyBegin; i < loop.bodyEnd; ++i) {
+    const WgslToken &t = tokens[i];
+    if (t.kind == WgslToken::kSpace || t.kind == WgslToken::kComment) {
+      continue;
+    }
+    if (t.text == "for" || t.text == "loop" || t.text == "while") {
+      loopDepths.push_back(depth);
+      ++nestedLoops;
+    } else if (t.text == "{") {
+      ++depth;
+    } else if (t.text == "}") {
+      --depth;
+      if (!loopDepths.empty() && depth == loopDepths.back()) {
+        loopDepths.pop_back();
+        --nestedLoops;
+      }
+    } else if ((t.text == "break" || t.text == "continue") &&
+               nestedLoops == 0) {
+      return false;
+    } else if (t.text == loop.var && prev &&
+               (prev->text == "var" || prev->text == "let" ||
+                prev->text == "const")) {
+      return false;
+    } else if (prev && prev->text == loop.var &&
+               !(prevPrev && prevPrev->text == ".") &&
+               (t.text == "=" || t.text == "++" || t.text == "--" ||
+                (t.text.size() == 2 && t.text[1] == '=' && t.text != "==" &&
+                 t.text != "<=" && t.text != ">=" && t.text != "!="))) {
+      return false;
+    }
+    prevPrev = prev;
+    prev = &t;
+  }
+  return true;
+}
+
+/**
+ * @brief Loop variables of the enclosing unrolled iterations and the literals
+ * replacing them.
+ */
+using WgslSubstitutions = std::vector<std::pair<std::string, std::string>>;
+
+/**
+ * @brief Number of iterations of a counted loop.
+ */
+inline int64_t tripCount(const WgslCountedLoop &loop) {
+  return loop.end > loop.start
+             ? (loop.end - loop.start + loop.step - 1) / loop.step
+             : 0;
+}
+
+/**
+ * @brief Largest number of copies the unroller makes of any statement in
+ * tokens [begin, end), 1 when nothing is unrolled.
+ *
+ * Inner loops are decided first: a loop is unrolled when its trip count
+ * times the copies made inside its body stays within threshold, so the
+ * threshold bounds the total code growth of a loop nest rather than of each
+ * loop.
+ */
+inline int64_t unrolledCopies(const std::vector<WgslToken> &tokens,
+                              size_t begin, size_t end, int threshold) {
+  int64_t copies = 1;
+  for (size_t i = begin; i < end; ++i) {
+    WgslCountedLoop loop;
+    if (tokens[i].kind == WgslToken::kIdent && tokens[i].text == "for" &&
+        matchCountedLoop(tokens, i, loop) && loop.bodyEnd < end) {
+      const int64_t inner =
+          unrolledCopies(tokens, loop.bodyBegin, loop.bodyEnd, threshold);
+      const int64_t trips = tripCount(loop);
+      const bool unroll =
+          trips * inner <= threshold && isUnrollableBody(tokens, loop);
+      copies = std::max(copies, unroll ? std::max<int64_t>(trips, 1) * inner
+                                       : inner);
+      i = loop.bodyEnd;
+    }
+  }
+  return copies;
+}
+
+/**
+ * @brief Appends tokens [begin, end) to out, unrolling counted loops as
+ * decided by unrolledCopies() and applying subs to identifiers. Loops which
+ * stay rolled still have their inner loops unrolled.
+ */
+inline void unrollTokens(const std::vector<WgslToken> &tokens, size_t begin,
+                         size_t end, int threshold, std::string &out,
+                         WgslSubstitutions &subs) {
+  auto emit = [&](const WgslToken &t, const WgslToken *prev) {
+    // Substitute whole identifiers only, and not struct members (a.i)
+    if (t.kind == WgslToken::kIdent && !(prev && prev->text == ".")) {
+      for (auto it = subs.rbegin(); it != subs.rend(); ++it) {
+        if (it->first == t.text) {
+          out += it->second;
+          return;
+        }
+      }
+    }
+    out += t.text;
+  };
+  const WgslToken *prev = nullptr;
+  for (size_t i = begin; i < end; ++i) {
+    const WgslToken &t = tokens[i];
+    WgslCountedLoop loop;
+    if (t.kind == WgslToken::kIdent && t.text == "for" &&
+        matchCountedLoop(tokens, i, loop) && loop.bodyEnd < end) {
+      const int64_t trips = tripCount(loop);
+      if (trips * unrolledCopies(tokens, loop.bodyBegin, loop.bodyEnd,
+                                 threshold) <=
+              threshold &&
+          isUnrollableBody(tokens, loop)) {
+        // Indentation of the line holding the for keyword
+        std::string indent = "\n";
+        if (i > 0 && tokens[i - 1].kind == WgslToken::kSpace) {
+          const std::string &space = tokens[i - 1].text;
+          const size_t newline = space.rfind('\n');
+          indent += space.substr(newline == std::string::npos ? 0
+                                                               : newline + 1);
+        }
+        for (int64_t k = 0; k < trips; ++k) {
+          if (k > 0) {
+            out += indent;
+          }
+          // A block per iteration keeps declarations in the body scoped
+          out += "{";
+          subs.push_back({loop.var, std::to_string(loop.start + k * loop.step) +
+                                        loop.suffix});
+          unrollTokens(tokens, loop.bodyBegin, loop.bodyEnd, threshold, out,
+                       subs);
+          subs.pop_back();
+          out += "}";
+        }
+      } else {
+        // The rolled loop variable shadows enclosing substitutions
+        subs.push_back({loop.var, loop.var});
+        for (size_t j = i; j < loop.bodyBegin; ++j) {
+          emit(tokens[j], nullptr);
+        }
+        unrollTokens(tokens, loop.bodyBegin, loop.bodyEnd, threshold, out,
+                     subs);
+        subs.pop_back();
+        out += "}";
+      }
+      i = loop.bodyEnd;
+      prev = &tokens[i];
+      continue;
+    }
+    emit(t, prev);
+    if (t.kind != WgslToken::kSpace && t.kind != WgslToken::kComment) {
+      prev = &t;
+    }
+  }
+}
 
-  return unrolledCode;
+/**
+ * @brief Loop-unrolling optimization on WGSL tokens.
+ *
+ * Unrolls counted loops of the form
+ * for (var i[: u32|i32] = start; i < end; i++) with constant bounds, also
+ * with <= and steps written i += step or i = i + step, when the number of
+ * iterations is at most threshold. Nested loops are handled innermost first,
+ * with threshold bounding the copies made of the innermost body, so the
+ * default fully unrolls an 8 x 8 register tile but only the inner loop of a
+ * 16 x 8 nest. Each iteration becomes a block with the loop variable replaced by a typed
+ * literal on identifier boundaries, and comments are skipped. Loops whose
+ * body writes the loop variable, shadows it, or contains break or continue
+ * are left as is.
+ *
+ * @param[in] code WGSL code, with template placeholders already substituted
+ * @param[in] threshold Maximum number of copies made of a loop body
+ * @return Code with the loops unrolled
+ *
+ * @code
+ * std::string unrolled = loopUnrolling(codeString, 16);
+ * @endcode
+ */
+inline std::string loopUnrolling(const std::string &code, int threshold = 64) {
+  const std::vector<WgslToken> tokens = tokenizeWgsl(code);
+  std::string out;
+  out.reserve(code.size() * 2);
+  WgslSubstitutions subs;
+  unrollTokens(tokens, 0, tokens.size(), threshold, out, subs);
+  return out;
 }
 
 } // namespace gpu
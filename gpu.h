@@ -1,12 +1,15 @@
 #ifndef GPU_H
 #define GPU_H
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cctype>
 #include <cstring>
 #include <future>
 #include <initializer_list>
 #include <memory>
+#include <numeric>
 #include <set>
 #include <string>
 #include <tuple>
@@ -17,11 +20,33 @@
 
 #include "webgpu/webgpu.h"
 
+#include "numeric_types/bf16.h"
 #include "numeric_types/half.h"
 #include "utils/logging.h"
+#include "utils/trace.h"
 
 namespace gpu {
 
+/**
+ * @brief Checks a condition and logs an error message if the condition is
+ * false. In debug mode, it will also exit the program with an error code.
+ * @param[in] condition The condition to check.
+ * @param[in] message The error message to log if the condition is false.
+ * @param[in] file The source file where the check is performed.
+ * @param[in] line The line number in the source file where the check is
+ * performed.
+ */
+inline void check(bool condition, const char *message,
+                  const char *file = "unkown", int line = -1) {
+  if (!condition) {
+    LOG(kDefLog, kError, "Error in file %s line %d:\n%s", file, line, message);
+    exit(1);
+  } else {
+    LOG(kDefLog, kTrace, "Success in file %s line %d:\n%s", file, line,
+        message);
+  }
+}
+
 /**
  * @brief Represents a buffer of values on the GPU.
  */
@@ -160,6 +185,15 @@ template <typename... Args> Bindings(Args...) -> Bindings<sizeof...(Args)>;
 struct Context; // Forward declaration so that TensorPool can have a pointer to
                 // Context
 
+/**
+ * @brief One buffer of a tensor too large for a single storage binding, see
+ * createTensor(Context &, const Shape &, NumType).
+ */
+struct TensorChunk {
+  Tensor tensor;     // the chunk's own buffer, shape (rows, last dimension)
+  size_t offset = 0; // of the chunk's first element in the whole tensor
+};
+
 /**
  * @brief Represents a pool of tensors to manage GPU resources. The pool is
  * responsible for managing the lifetime of the tensors and freeing them when
@@ -173,29 +207,73 @@ struct TensorPool {
   inline TensorPool(Context *ctx) : ctx(ctx), data() {};
   Context *ctx;
   std::unordered_map<WGPUBuffer, Tensor> data;
+  // Chunks of the tensors backed by several buffers, keyed by the buffer of
+  // the first chunk which is the tensor's data.buffer. Only the first chunk
+  // is in data.
+  std::unordered_map<WGPUBuffer, std::vector<TensorChunk>> chunks;
   ~TensorPool();
 };
 
 enum NumType {
   kf16, // (experimental)
-  kf32
+  kf32,
+  kq8,   // int8 quantized, 4 values packed per u32
+  kq4,   // int4 quantized, 8 values packed per u32
+  kbf16, // bfloat16, 2 values packed per u32, see kPackedTypeHelpers
+  ki32,
+  ku32,
+  ku8 // 4 values packed per u32, see kPackedTypeHelpers
 };
 
 /**
  * @brief Returns the number of bytes of a number type.
+ *
+ * kq4 packs two values per byte and has no whole-byte element size, use
+ * sizeBytes(type, numElements) for packed types.
  */
 inline size_t sizeBytes(const NumType &type) {
   switch (type) {
   case kf16:
+  case kbf16:
     return sizeof(uint16_t);
   case kf32:
     return sizeof(float);
+  case ki32:
+    return sizeof(int32_t);
+  case ku32:
+    return sizeof(uint32_t);
+  case kq8:
+  case ku8:
+    return sizeof(uint8_t);
   default:
     LOG(kDefLog, kError, "Invalid NumType in size calculation.");
     return 0;
   }
 }
 
+/**
+ * @brief Returns the number of bytes needed to store numElements values of a
+ * number type. Packed types are rounded up to a whole number of u32 words.
+ *
+ * @code
+ * sizeBytes(kq4, 4096); // 2048
+ * @endcode
+ */
+inline size_t sizeBytes(const NumType &type, size_t numElements) {
+  switch (type) {
+  case kf16:
+  case kbf16:
+    return (numElements + 1) / 2 * sizeof(uint32_t);
+  case kq8:
+  case ku8:
+    return (numElements + 3) / 4 * sizeof(uint32_t);
+  case kq4:
+    return (numElements + 7) / 8 * sizeof(uint32_t);
+  default:
+    return sizeBytes(type) * numElements;
+  }
+}
+
 /**
  * @brief Converts NumType to string.
  */
@@ -205,12 +283,53 @@ inline std::string toString(NumType type) {
     return "f16";
   case kf32:
     return "f32";
+  case ki32:
+    return "i32";
+  case ku32:
+    return "u32";
+  case kq8:
+  case kq4:
+  case kbf16:
+  case ku8:
+    return "u32"; // packed storage type in WGSL
   default:
     LOG(kDefLog, kError, "Invalid NumType in string conversion.");
     return "unknown";
   }
 }
 
+/**
+ * @brief WGSL functions converting between the u32 storage words of kbf16 and
+ * ku8 tensors and vectors of their values, to be prepended to shader code
+ * using those types. Value i of a word is in its i-th lowest 16 or 8 bits.
+ *
+ * @code
+ * std::string code = std::string(kPackedTypeHelpers) + kShaderScaleBf16;
+ * @endcode
+ */
+static const char *const kPackedTypeHelpers = R"(
+fn unpackBf16(word: u32) -> vec2<f32> {
+  return vec2<f32>(bitcast<f32>(word << 16u), bitcast<f32>(word & 0xffff0000u));
+}
+
+// Rounds to nearest even
+fn packBf16(v: vec2<f32>) -> u32 {
+  let bits = bitcast<vec2<u32>>(v);
+  let rounded = (bits + 0x7fffu + ((bits >> vec2<u32>(16u)) & vec2<u32>(1u))) >> vec2<u32>(16u);
+  return (rounded.x & 0xffffu) | (rounded.y << 16u);
+}
+
+fn unpackU8(word: u32) -> vec4<u32> {
+  return (vec4<u32>(word) >> vec4<u32>(0u, 8u, 16u, 24u)) & vec4<u32>(0xffu);
+}
+
+// Saturates values above 255
+fn packU8(v: vec4<u32>) -> u32 {
+  let c = min(v, vec4<u32>(255u));
+  return c.x | (c.y << 8u) | (c.z << 16u) | (c.w << 24u);
+}
+)";
+
 /**
  * @brief Converts Shape to string. The string formatting is meant to be
  * slotted into WGSL code (hence no additional parentheses or brackets).
@@ -258,6 +377,131 @@ inline void replaceAll(std::string &str, const std::string &from,
   }
 }
 
+/**
+ * @brief A WGSL template parsed once into literal segments and {{name}}
+ * placeholders, so that each instantiation is a single linear pass instead of
+ * one replaceAll scan per placeholder.
+ *
+ * literals[i] precedes placeholders[i], and the last literal follows the last
+ * placeholder. Placeholder names are alphanumeric or underscores, any other
+ * use of braces is literal text.
+ *
+ * @code
+ * static const ShaderTemplate tmpl = parseTemplate(kShaderMatmul);
+ * std::string code;
+ * renderTemplate(tmpl, {{"M", toString(M)}, {"K", toString(K)}}, code);
+ * @endcode
+ */
+struct ShaderTemplate {
+  std::vector<std::string> literals;
+  std::vector<std::string> placeholders; // names, without braces
+  size_t literalBytes = 0;
+};
+
+using TemplateValues = std::unordered_map<std::string, std::string>;
+
+/**
+ * @brief Parses a template string into a ShaderTemplate.
+ */
+inline ShaderTemplate parseTemplate(const std::string &source) {
+  ShaderTemplate tmpl;
+  std::string literal;
+  size_t pos = 0;
+  while (pos < source.size()) {
+    const size_t open = source.find("{{", pos);
+    if (open == std::string::npos) {
+      break;
+    }
+    size_t end = open + 2;
+    while (end < source.size() &&
+           (std::isalnum(static_cast<unsigned char>(source[end])) ||
+            source[end] == '_')) {
+      ++end;
+    }
+    if (end == open + 2 || source.compare(end, 2, "}}") != 0) {
+      // Not a placeholder, keep the first brace and rescan after it
+      literal.append(source, pos, open + 1 - pos);
+      pos = open + 1;
+      continue;
+    }
+    literal.append(source, pos, open - pos);
+    tmpl.literalBytes += literal.size();
+    tmpl.literals.push_back(std::move(literal));
+    literal.clear();
+    tmpl.placeholders.push_back(source.substr(open + 2, end - open - 2));
+    pos = end + 2;
+  }
+  literal.append(source, pos, std::string::npos);
+  tmpl.literalBytes += literal.size();
+  tmpl.literals.push_back(std::move(literal));
+  return tmpl;
+}
+
+/**
+ * @brief Returns the parsed template of a static template string, parsing it
+ * on first use. Templates are keyed by address, so this is meant for string
+ * literals such as the kShader* constants. Not thread-safe.
+ */
+inline const ShaderTemplate &cachedTemplate(const char *source) {
+  static std::unordered_map<const char *, ShaderTemplate> cache;
+  auto it = cache.find(source);
+  if (it == cache.end()) {
+    it = cache.emplace(source, parseTemplate(source)).first;
+  }
+  return it->second;
+}
+
+/**
+ * @brief Renders a template in a single pass into out, which is cleared but
+ * keeps its capacity so that a buffer can be reused across instantiations.
+ *
+ * Placeholders without a value are kept verbatim so that a later stage can
+ * fill them (e.g. {{workgroupSize}} and {{precision}} by KernelCode).
+ *
+ * @param[in] tmpl Parsed template
+ * @param[in] values Placeholder names (without braces) to values
+ * @param[out] out Rendered code
+ * @param[out] unfilled If not null, receives the placeholders without a value
+ * @param[out] unknown If not null, receives the values whose name does not
+ * occur in the template
+ * @return True if every placeholder was filled
+ */
+inline bool renderTemplate(const ShaderTemplate &tmpl,
+                           const TemplateValues &values, std::string &out,
+                           std::vector<std::string> *unfilled = nullptr,
+                           std::vector<std::string> *unknown = nullptr) {
+  out.clear();
+  out.reserve(tmpl.literalBytes + 8 * tmpl.placeholders.size());
+  bool filled = true;
+  for (size_t i = 0; i < tmpl.placeholders.size(); ++i) {
+    out += tmpl.literals[i];
+    const std::string &name = tmpl.placeholders[i];
+    auto value = values.find(name);
+    if (value != values.end()) {
+      out += value->second;
+      continue;
+    }
+    filled = false;
+    out += "{{";
+    out += name;
+    out += "}}";
+    if (unfilled && std::find(unfilled->begin(), unfilled->end(), name) ==
+                        unfilled->end()) {
+      unfilled->push_back(name);
+    }
+  }
+  out += tmpl.literals.back();
+  if (unknown) {
+    for (const auto &value : values) {
+      if (std::find(tmpl.placeholders.begin(), tmpl.placeholders.end(),
+                    value.first) == tmpl.placeholders.end()) {
+        unknown->push_back(value.first);
+      }
+    }
+  }
+  return filled;
+}
+
 /**
  * @brief KernelCode is the representation of WGSL GPU code with template
  * substitutions applied. It is a type around the code string with additional
@@ -316,13 +560,42 @@ struct KernelCode {
       : data(pData), workgroupSize(workgroupSize), precision(precision) {
     replaceAll(data, "{{workgroupSize}}", toString(workgroupSize));
     replaceAll(data, "{{precision}}", toString(precision));
-    LOG(kDefLog, kInfo, "Shader code:\n%s", data.c_str());
+    LOG(kDefLog, kTrace, "Shader code:\n%s", data.c_str());
+  }
+  /**
+   * @brief Overload of the constructor rendering a parsed template, filling
+   * {{workgroupSize}} and {{precision}} in the same pass as the other values.
+   * Placeholders left unfilled are logged as errors.
+   *
+   * @code
+   * KernelCode code = {cachedTemplate(kShaderMatmul1),
+   *                    {{"M", toString(M)}, {"K", toString(K)}}, {256, 1, 1}};
+   * @endcode
+   */
+  inline KernelCode(const ShaderTemplate &tmpl, TemplateValues values,
+                    const Shape &workgroupSize = {256, 1, 1},
+                    NumType precision = kf32)
+      : workgroupSize(workgroupSize), precision(precision) {
+    values.emplace("workgroupSize", toString(workgroupSize));
+    values.emplace("precision", toString(precision));
+    std::vector<std::string> unfilled;
+    if (!renderTemplate(tmpl, values, data, &unfilled)) {
+      for (const std::string &name : unfilled) {
+        LOG(kDefLog, kError, "Unfilled shader template placeholder {{%s}}",
+            name.c_str());
+      }
+    }
+    LOG(kDefLog, kTrace, "Shader code:\n%s", data.c_str());
   }
+
   std::string data;
   Shape workgroupSize;
   NumType precision = kf32;
   std::string label = "kernel";
   std::string entryPoint = "main";
+  // Values of WGSL override constants, set when the pipeline is created.
+  // Kernels whose code differs only in these values share a shader module.
+  std::vector<std::pair<std::string, double>> constants;
 };
 
 /**
@@ -412,12 +685,26 @@ struct KernelPool {
   }
 };
 
+/**
+ * @brief A cache of compiled shader modules keyed by their WGSL code, so that
+ * kernels sharing code (e.g. a shader specialized per shape through override
+ * constants) compile it once. Instantiated as a member of the Context struct.
+ */
+struct ShaderModulePool {
+  std::unordered_map<std::string, WGPUShaderModule> data;
+  inline ~ShaderModulePool() {
+    for (auto &pair : data) {
+      wgpuShaderModuleRelease(pair.second);
+    }
+  }
+};
+
 /**
  * @brief Represents a GPU context, aggregates WebGPU API handles to interact
  * with the GPU including the instance, adapter, device, and queue.
  *
- * Additionally contains a TensorPool and KernelPool for managing GPU resources
- * to simplify lifetime management of GPU resources.
+ * Additionally contains a TensorPool, KernelPool and ShaderModulePool for
+ * managing GPU resources to simplify lifetime management of GPU resources.
  */
 struct Context {
   WGPUInstance instance;
@@ -426,6 +713,13 @@ struct Context {
   WGPUQueue queue;
   TensorPool pool = TensorPool(this);
   KernelPool kernelPool = KernelPool(this);
+  ShaderModulePool modulePool;
+  // Whether the device was created with subgroup operations. Kernel builders
+  // use their subgroup variants when set, clearing it forces the portable
+  // variants.
+  bool subgroups = false;
+  // Limits of the device, as obtained rather than as requested
+  WGPULimits limits = {};
   ~Context() {
     LOG(kDefLog, kTrace, "Destroying context");
     if (queue) {
@@ -484,7 +778,7 @@ createTensor(TensorPool &pool, WGPUDevice &device, const Shape &shape,
                                           WGPUBufferUsage_CopySrc) {
   LOG(kDefLog, kTrace, "Creating tensor");
   size_t numElements = size(shape);
-  size_t size = sizeBytes(dtype) * numElements;
+  size_t size = sizeBytes(dtype, numElements);
   WGPUBufferDescriptor bufferDesc = {
       .usage = usage,
       .size = size,
@@ -497,10 +791,31 @@ createTensor(TensorPool &pool, WGPUDevice &device, const Shape &shape,
   return pool.data[buffer];
 }
 
+/**
+ * @brief Largest buffer a tensor can occupy while still being bound whole to
+ * a kernel, the smaller of the storage binding and buffer size limits of the
+ * device.
+ */
+inline size_t maxBindingBytes(const Context &ctx) {
+  // WebGPU defaults, for contexts without recorded limits
+  const size_t bindingSize = ctx.limits.maxStorageBufferBindingSize > 0
+                                 ? ctx.limits.maxStorageBufferBindingSize
+                                 : size_t(128) << 20;
+  const size_t bufferSize = ctx.limits.maxBufferSize > 0
+                                ? ctx.limits.maxBufferSize
+                                : size_t(256) << 20;
+  return std::min(bindingSize, bufferSize);
+}
+
 /**
  * @brief Overload of the tensor factory function to instantiate a tensor on
  * the GPU with a given shape and data type.
  *
+ * Tensors larger than maxBindingBytes() are transparently backed by several
+ * buffers of whole rows, see tensorChunks(). They are transferred with
+ * toCPU() / toGPU() like any tensor, kernels bind their chunks separately
+ * (see experimental/chunked.h).
+ *
  * Instead of taking the TensoPool and raw WebGPU API WGPUDevice and
  * WGPUBufferUsageFlags arguments, this is a convenience wrapper around the
  * core createTensor function which has default usage flags for a storage
@@ -517,7 +832,127 @@ createTensor(TensorPool &pool, WGPUDevice &device, const Shape &shape,
  * @endcode
  */
 inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype) {
-  return createTensor(ctx.pool, ctx.device, shape, dtype);
+  const size_t numel = size(shape);
+  const size_t maxBytes = maxBindingBytes(ctx);
+  if (sizeBytes(dtype, numel) <= maxBytes) {
+    return createTensor(ctx.pool, ctx.device, shape, dtype);
+  }
+  // Too large for one binding: split into chunks of whole rows (of the last
+  // dimension), each a multiple of 256 bytes so that chunk boundaries fall on
+  // packed words and storage offset alignments
+  const size_t rowElements = shape.rank >= 2 ? shape[shape.rank - 1] : 1;
+  const size_t rows = numel / rowElements;
+  const size_t alignElements = 2048 * 256 / sizeBytes(dtype, 2048);
+  const size_t rowStep = alignElements / std::gcd(rowElements, alignElements);
+  const size_t chunkRows =
+      (maxBytes / 256 * alignElements / rowElements) / rowStep * rowStep;
+  check(chunkRows > 0, "Tensor rows fit in a storage buffer binding",
+        __FILE__, __LINE__);
+  LOG(kDefLog, kInfo, "Creating tensor of %zu bytes in %zu chunks",
+      sizeBytes(dtype, numel), (rows + chunkRows - 1) / chunkRows);
+  std::vector<TensorChunk> chunks;
+  for (size_t row = 0; row < rows; row += chunkRows) {
+    const size_t nRows = std::min(chunkRows, rows - row);
+    const Shape chunkShape =
+        shape.rank >= 2 ? Shape{nRows, rowElements} : Shape{nRows};
+    const size_t chunkBytes = sizeBytes(dtype, nRows * rowElements);
+    const WGPUBufferUsageFlags usage = WGPUBufferUsage_Storage |
+                                       WGPUBufferUsage_CopyDst |
+                                       WGPUBufferUsage_CopySrc;
+    WGPUBufferDescriptor bufferDesc = {
+        .usage = usage,
+        .size = chunkBytes,
+    };
+    WGPUBuffer buffer = wgpuDeviceCreateBuffer(ctx.device, &bufferDesc);
+    chunks.push_back(
+        {Tensor{Array{buffer, usage, chunkBytes}, chunkShape},
+         row * rowElements});
+  }
+  Tensor tensor = {chunks[0].tensor.data, shape};
+  ctx.pool.data[tensor.data.buffer] = tensor;
+  ctx.pool.chunks[tensor.data.buffer] = std::move(chunks);
+  return tensor;
+}
+
+/**
+ * @brief The chunks of a tensor, a single chunk covering the whole tensor
+ * unless it was created larger than a storage binding.
+ *
+ * @code
+ * for (const TensorChunk &chunk : tensorChunks(ctx, weights)) {
+ *   // chunk.tensor holds elements [chunk.offset,
+ *   //   chunk.offset + size(chunk.tensor.shape)) of weights
+ * }
+ * @endcode
+ */
+inline std::vector<TensorChunk> tensorChunks(const Context &ctx,
+                                             const Tensor &tensor) {
+  auto chunks = ctx.pool.chunks.find(tensor.data.buffer);
+  if (chunks == ctx.pool.chunks.end()) {
+    return {TensorChunk{tensor, 0}};
+  }
+  return chunks->second;
+}
+
+/**
+ * @brief Size in bytes of all buffers of a tensor.
+ */
+inline size_t tensorBytes(const Context &ctx, const Tensor &tensor) {
+  auto chunks = ctx.pool.chunks.find(tensor.data.buffer);
+  if (chunks == ctx.pool.chunks.end()) {
+    return tensor.data.size;
+  }
+  size_t bytes = 0;
+  for (const TensorChunk &chunk : chunks->second) {
+    bytes += chunk.tensor.data.size;
+  }
+  return bytes;
+}
+
+/**
+ * @brief Writes numBytes of host data to the start of a buffer of a packed
+ * type. Queue writes must be a whole number of u32 words, so a trailing
+ * partial word is zero-padded in a copy rather than reading past the end of
+ * the host data.
+ */
+inline void writePacked(WGPUQueue queue, WGPUBuffer buffer, const void *data,
+                        size_t numBytes) {
+  GPU_TRACE_SCOPE("toGPU");
+  const size_t wholeBytes = numBytes / 4 * 4;
+  if (wholeBytes > 0) {
+    wgpuQueueWriteBuffer(queue, buffer, 0, data, wholeBytes);
+  }
+  if (wholeBytes < numBytes) {
+    uint32_t tail = 0;
+    memcpy(&tail, static_cast<const uint8_t *>(data) + wholeBytes,
+           numBytes - wholeBytes);
+    wgpuQueueWriteBuffer(queue, buffer, wholeBytes, &tail, sizeof(tail));
+  }
+}
+
+/**
+ * @brief Writes numBytes of host data to the start of a tensor, chunk by chunk
+ * for tensors backed by several buffers.
+ */
+inline void writeTensor(Context &ctx, const Tensor &tensor, const void *data,
+                        size_t numBytes) {
+  auto chunks = ctx.pool.chunks.find(tensor.data.buffer);
+  if (chunks == ctx.pool.chunks.end()) {
+    writePacked(ctx.queue, tensor.data.buffer, data, numBytes);
+    return;
+  }
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  size_t written = 0;
+  for (const TensorChunk &chunk : chunks->second) {
+    if (written >= numBytes) {
+      break;
+    }
+    const size_t chunkBytes =
+        std::min<size_t>(chunk.tensor.data.size, numBytes - written);
+    writePacked(ctx.queue, chunk.tensor.data.buffer, bytes + written,
+                chunkBytes);
+    written += chunkBytes;
+  }
 }
 
 /**
@@ -526,7 +961,8 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype) {
  * float* data to populate the tensor with.
  *
  * The data is assumed to be of size equal to the product of the dimensions in
- * the shape, and is copied to the GPU buffer.
+ * the shape, and is copied to the GPU buffer. For kf16 tensors the data is
+ * converted with the bulk floatToHalf converter before upload.
  *
  * @param[in] ctx Context instance to manage the tensor
  * @param[in] shape Shape of the tensor
@@ -540,13 +976,15 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype) {
  */
 inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
                            float *data) {
-  assert(dtype == kf32);
-  Tensor tensor =
-      createTensor(ctx.pool, ctx.device, shape, dtype,
-                   WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst |
-                       WGPUBufferUsage_CopySrc);
-  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
-                       tensor.data.size);
+  assert(dtype == kf32 || dtype == kf16);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  if (dtype == kf16) {
+    std::vector<half> halves(size(shape));
+    floatToHalf(data, halves.data(), halves.size());
+    writeTensor(ctx, tensor, halves.data(), halves.size() * sizeof(half));
+  } else {
+    writeTensor(ctx, tensor, data, size(shape) * sizeof(float));
+  }
   return tensor;
 }
 
@@ -571,12 +1009,105 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
 inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
                            half *data) {
   assert(dtype == kf16);
-  Tensor tensor =
-      createTensor(ctx.pool, ctx.device, shape, dtype,
-                   WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst |
-                       WGPUBufferUsage_CopySrc);
-  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
-                       tensor.data.size);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  writeTensor(ctx, tensor, data, size(shape) * sizeof(half));
+  return tensor;
+}
+
+/**
+ * @brief Overload of the tensor factory function to instantiate a tensor on
+ * the GPU with a given shape, data type. This overload takes initial
+ * uint32_t* data, either u32 values for ku32 or packed words for the
+ * quantized types kq8 and kq4.
+ *
+ * For the quantized types the shape is the logical shape of the unpacked
+ * values, the data is assumed to hold sizeBytes(dtype, size(shape)) bytes of
+ * packed words.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Logical shape of the tensor
+ * @param[in] dtype Data type of the tensor (ku32, kq8 or kq4)
+ * @param[in] data Data to populate the tensor with
+ * @return Tensor instance representing the created tensor
+ *
+ * @code
+ * Tensor tensor = createTensor(ctx, {N, K}, kq4, packed);
+ * @endcode
+ */
+inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
+                           uint32_t *data) {
+  assert(dtype == ku32 || dtype == kq8 || dtype == kq4);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  writeTensor(ctx, tensor, data, sizeBytes(dtype, size(shape)));
+  return tensor;
+}
+
+/**
+ * @brief Overload of the tensor factory function to instantiate a tensor on
+ * the GPU with a given shape, data type. This overload also takes initial
+ * int32_t* data to populate the tensor with.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (ki32)
+ * @param[in] data Initial data to populate the tensor with
+ * @return Tensor instance representing the created tensor
+ *
+ * @code
+ * Tensor tensor = createTensor(ctx, {N}, ki32, data);
+ * @endcode
+ */
+inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
+                           int32_t *data) {
+  assert(dtype == ki32);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  writeTensor(ctx, tensor, data, size(shape) * sizeof(int32_t));
+  return tensor;
+}
+
+/**
+ * @brief Overload of the tensor factory function to instantiate a tensor on
+ * the GPU with a given shape, data type. This overload also takes initial
+ * bf16* data to populate the tensor with, packed two values per u32 word.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (kbf16)
+ * @param[in] data Initial data to populate the tensor with
+ * @return Tensor instance representing the created tensor
+ *
+ * @code
+ * Tensor tensor = createTensor(ctx, {256, 256}, kbf16, data);
+ * @endcode
+ */
+inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
+                           bf16 *data) {
+  assert(dtype == kbf16);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  writeTensor(ctx, tensor, data, size(shape) * sizeof(bf16));
+  return tensor;
+}
+
+/**
+ * @brief Overload of the tensor factory function to instantiate a tensor on
+ * the GPU with a given shape, data type. This overload also takes initial
+ * uint8_t* data to populate the tensor with, packed four values per u32 word.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (ku8)
+ * @param[in] data Initial data to populate the tensor with
+ * @return Tensor instance representing the created tensor
+ *
+ * @code
+ * Tensor tensor = createTensor(ctx, {H, W, 4}, ku8, pixels);
+ * @endcode
+ */
+inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
+                           uint8_t *data) {
+  assert(dtype == ku8);
+  Tensor tensor = createTensor(ctx, shape, dtype);
+  writeTensor(ctx, tensor, data, size(shape));
   return tensor;
 }
 
@@ -595,6 +1126,14 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
  * @endcode
  */
 inline void FreeTensor(TensorPool &pool, Tensor tensor) {
+  auto chunks = pool.chunks.find(tensor.data.buffer);
+  if (chunks != pool.chunks.end()) {
+    // The first chunk is the tensor's own buffer, released below
+    for (size_t i = 1; i < chunks->second.size(); ++i) {
+      wgpuBufferRelease(chunks->second[i].tensor.data.buffer);
+    }
+    pool.chunks.erase(chunks);
+  }
   if (tensor.data.buffer) {
     wgpuBufferRelease(tensor.data.buffer);
   } else {
@@ -623,26 +1162,6 @@ inline TensorPool::~TensorPool() {
   }
 }
 
-/**
- * @brief Checks a condition and logs an error message if the condition is
- * false. In debug mode, it will also exit the program with an error code.
- * @param[in] condition The condition to check.
- * @param[in] message The error message to log if the condition is false.
- * @param[in] file The source file where the check is performed.
- * @param[in] line The line number in the source file where the check is
- * performed.
- */
-inline void check(bool condition, const char *message,
-                  const char *file = "unkown", int line = -1) {
-  if (!condition) {
-    LOG(kDefLog, kError, "Error in file %s line %d:\n%s", file, line, message);
-    exit(1);
-  } else {
-    LOG(kDefLog, kTrace, "Success in file %s line %d:\n%s", file, line,
-        message);
-  }
-}
-
 /**
  * @brief Factory function to create a GPU context, which aggregates WebGPU API
  * handles to interact with the GPU including the instance, adapter, device, and
@@ -654,10 +1173,15 @@ inline void check(bool condition, const char *message,
  *
  * If dawn is used, it also sets up an error callback for device loss.
  *
+ * Subgroup operations are requested in addition to the required features of
+ * devDescriptor when the adapter supports them, see Context::subgroups.
+ *
  * @param[in] desc Instance descriptor for the WebGPU instance (optional)
  * @param[in] adapterOpts Adapter request options for the WebGPU adapter
  * (optional)
  * @param[in] devDescriptor Device descriptor for the WebGPU device (optional)
+ * @param[in] requestMaxLimits If set and devDescriptor has no required
+ * limits, requests the maximum limits of the adapter instead of the defaults
  * @return Context instance representing the created GPU context
  *
  * @code
@@ -666,7 +1190,8 @@ inline void check(bool condition, const char *message,
  */
 inline Context createContext(const WGPUInstanceDescriptor &desc = {},
                              const WGPURequestAdapterOptions &adapterOpts = {},
-                             const WGPUDeviceDescriptor &devDescriptor = {}) {
+                             const WGPUDeviceDescriptor &devDescriptor = {},
+                             bool requestMaxLimits = false) {
   Context context;
   {
     context.instance = wgpuCreateInstance(&desc);
@@ -700,20 +1225,46 @@ inline Context createContext(const WGPUInstanceDescriptor &desc = {},
       bool requestEnded = false;
     };
     DeviceData devData;
+    WGPUDeviceDescriptor descriptor = devDescriptor;
+    std::vector<WGPUFeatureName> features(
+        devDescriptor.requiredFeatures,
+        devDescriptor.requiredFeatures + devDescriptor.requiredFeatureCount);
+    for (WGPUFeatureName feature : features) {
+      check(wgpuAdapterHasFeature(context.adapter, feature),
+            "Adapter supports required feature", __FILE__, __LINE__);
+    }
+    if (wgpuAdapterHasFeature(context.adapter,
+                              WGPUFeatureName_ChromiumExperimentalSubgroups) &&
+        std::find(features.begin(), features.end(),
+                  WGPUFeatureName_ChromiumExperimentalSubgroups) ==
+            features.end()) {
+      features.push_back(WGPUFeatureName_ChromiumExperimentalSubgroups);
+    }
+    descriptor.requiredFeatureCount = features.size();
+    descriptor.requiredFeatures = features.data();
+    WGPURequiredLimits requiredLimits = {};
+    if (requestMaxLimits && descriptor.requiredLimits == nullptr) {
+      WGPUSupportedLimits adapterLimits = {};
+      check(wgpuAdapterGetLimits(context.adapter, &adapterLimits) ==
+                WGPUStatus_Success,
+            "Get adapter limits", __FILE__, __LINE__);
+      requiredLimits.limits = adapterLimits.limits;
+      descriptor.requiredLimits = &requiredLimits;
+    }
     auto onDeviceRequestEnded = [](WGPURequestDeviceStatus status,
                                    WGPUDevice device, char const *message,
                                    void *pUserData) {
       DeviceData &devData = *reinterpret_cast<DeviceData *>(pUserData);
       check(status == WGPURequestDeviceStatus_Success,
             "Could not get WebGPU device.", __FILE__, __LINE__);
-      LOG(kDefLog, kTrace, "Device Request succeeded %x",
+      LOG(kDefLog, kTrace, "Device Request succeeded %p",
           static_cast<void *>(device));
       devData.device = device;
       devData.requestEnded = true;
     };
 
 #ifdef WEBGPU_BACKEND_DAWN
-    devDescriptor.deviceLostCallbackInfo = {
+    descriptor.deviceLostCallbackInfo = {
         .callback =
             [](WGPUDevice const *device, WGPUDeviceLostReason reason,
                char const *message, void *userdata) {
@@ -727,10 +1278,27 @@ inline Context createContext(const WGPUInstanceDescriptor &desc = {},
     };
 #endif
 
-    wgpuAdapterRequestDevice(context.adapter, &devDescriptor,
+    wgpuAdapterRequestDevice(context.adapter, &descriptor,
                              onDeviceRequestEnded, (void *)&devData);
     assert(devData.requestEnded);
     context.device = devData.device;
+    context.subgroups = wgpuDeviceHasFeature(
+        context.device, WGPUFeatureName_ChromiumExperimentalSubgroups);
+    LOG(kDefLog, kInfo, "Subgroups %s",
+        context.subgroups ? "enabled" : "not supported");
+    WGPUSupportedLimits deviceLimits = {};
+    check(wgpuDeviceGetLimits(context.device, &deviceLimits) ==
+              WGPUStatus_Success,
+          "Get device limits", __FILE__, __LINE__);
+    context.limits = deviceLimits.limits;
+    LOG(kDefLog, kInfo,
+        "Device limits: storage binding %llu MB, buffer %llu MB, workgroup "
+        "storage %u KB, %u invocations per workgroup",
+        static_cast<unsigned long long>(
+            context.limits.maxStorageBufferBindingSize >> 20),
+        static_cast<unsigned long long>(context.limits.maxBufferSize >> 20),
+        context.limits.maxComputeWorkgroupStorageSize >> 10,
+        context.limits.maxComputeInvocationsPerWorkgroup);
     wgpuDeviceSetUncapturedErrorCallback(
         context.device,
         [](WGPUErrorType type, char const *message, void *devData) {
@@ -743,6 +1311,79 @@ inline Context createContext(const WGPUInstanceDescriptor &desc = {},
   return context;
 }
 
+/**
+ * @brief Options for createContext(const ContextOptions &), covering what
+ * compute workloads usually want instead of the WebGPU defaults: the
+ * adapter's maximum limits (the default maxStorageBufferBindingSize is
+ * 128 MB), the high performance adapter and optionally Dawn toggles trading
+ * safety checks for speed.
+ *
+ * @code
+ * ContextOptions options;
+ * options.features = {WGPUFeatureName_ShaderF16};
+ * Context ctx = createContext(options);
+ * @endcode
+ */
+struct ContextOptions {
+  WGPUPowerPreference powerPreference = WGPUPowerPreference_HighPerformance;
+  // Request the adapter's maximum limits, see Context::limits for the result
+  bool maxLimits = true;
+  // Required features, checked against the adapter
+  std::vector<WGPUFeatureName> features;
+  // Dawn "skip_validation": skips WebGPU API validation
+  bool skipValidation = false;
+  // Dawn "disable_robustness": removes bounds checks from shaders, only for
+  // trusted kernels which never index out of bounds
+  bool disableRobustness = false;
+  // Additional Dawn toggles by name
+  std::vector<std::string> enabledToggles;
+  std::vector<std::string> disabledToggles;
+};
+
+/**
+ * @brief Overload of createContext() taking ContextOptions.
+ *
+ * @param[in] options Adapter, limit, feature and toggle options
+ * @return Context instance representing the created GPU context
+ */
+inline Context createContext(const ContextOptions &options) {
+  WGPURequestAdapterOptions adapterOpts = {};
+  adapterOpts.powerPreference = options.powerPreference;
+  WGPUDeviceDescriptor devDescriptor = {};
+  devDescriptor.requiredFeatureCount = options.features.size();
+  devDescriptor.requiredFeatures = options.features.data();
+  std::vector<std::string> enabled = options.enabledToggles;
+  if (options.skipValidation) {
+    enabled.push_back("skip_validation");
+  }
+  if (options.disableRobustness) {
+    enabled.push_back("disable_robustness");
+  }
+#ifdef WEBGPU_BACKEND_DAWN
+  std::vector<const char *> enabledNames, disabledNames;
+  for (const std::string &toggle : enabled) {
+    enabledNames.push_back(toggle.c_str());
+  }
+  for (const std::string &toggle : options.disabledToggles) {
+    disabledNames.push_back(toggle.c_str());
+  }
+  WGPUDawnTogglesDescriptor toggles = {};
+  toggles.chain.sType = WGPUSType_DawnTogglesDescriptor;
+  toggles.enabledToggleCount = enabledNames.size();
+  toggles.enabledToggles = enabledNames.data();
+  toggles.disabledToggleCount = disabledNames.size();
+  toggles.disabledToggles = disabledNames.data();
+  if (!enabledNames.empty() || !disabledNames.empty()) {
+    devDescriptor.nextInChain = &toggles.chain;
+  }
+#else
+  if (!enabled.empty() || !options.disabledToggles.empty()) {
+    LOG(kDefLog, kWarn, "Dawn toggles are ignored by this WebGPU backend");
+  }
+#endif
+  return createContext({}, adapterOpts, devDescriptor, options.maxLimits);
+}
+
 inline void wait(Context &ctx, std::future<void> &future) {
   while (future.wait_for(std::chrono::seconds(0)) !=
          std::future_status::ready) {
@@ -764,7 +1405,10 @@ inline void wait(Context &ctx, std::future<void> &future) {
  */
 inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize,
                   CopyData &op) {
+  GPU_TRACE_SCOPE("toCPU");
   wgpuQueueSubmit(ctx.queue, 1, &op.commandBuffer);
+  // Async spans are keyed by the future, reachable from the callbacks
+  GPU_TRACE_ASYNC_BEGIN("copy", &op.future);
   CallbackData callbackData = {op.readbackBuffer, bufferSize, data, &op.promise,
                                &op.future};
   wgpuQueueOnSubmittedWorkDone(
@@ -773,6 +1417,8 @@ inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize,
         check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
               __FILE__, __LINE__);
         const auto *data = static_cast<CallbackData *>(callbackData);
+        GPU_TRACE_ASYNC_END("copy", data->future);
+        GPU_TRACE_ASYNC_BEGIN("map", data->future);
         wgpuBufferMapAsync(
             data->buffer, WGPUMapMode_Read, 0, data->bufferSize,
             [](WGPUBufferMapAsyncStatus status, void *captureData) {
@@ -784,6 +1430,7 @@ inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize,
               check(mappedData, "Get mapped range", __FILE__, __LINE__);
               memcpy(data->output, mappedData, data->bufferSize);
               wgpuBufferUnmap(data->buffer);
+              GPU_TRACE_ASYNC_END("map", data->future);
               data->promise->set_value();
             },
             callbackData);
@@ -793,20 +1440,12 @@ inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize,
 }
 
 /**
- * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
- * but initializes a staging buffer and promise/future for the operation for
- * you.
- *
- * For simple use cases, this overload is recommended as it abstracts away the
- * staging buffer and promise/future management. For more custom use cases where
- * the staging buffer is initialized ahead of time, use the other overload.
- *
- * @param[in] ctx Context instance to manage the operation
- * @param[in] tensor Tensor instance representing the GPU buffer to copy from
- * @param[in] bufferSize Size of the data buffer in bytes
- * @param[out] data Pointer to the CPU memory to copy the data to
+ * @brief Copies bufferSize bytes of a single GPU buffer to CPU memory through
+ * a new staging buffer. Used by toCPU() for whole tensors and for each chunk
+ * of a chunked tensor.
  */
-inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize) {
+inline void readBuffer(Context &ctx, Tensor &tensor, void *data,
+                       size_t bufferSize) {
   CopyData op;
   op.future = op.promise.get_future();
   {
@@ -829,6 +1468,42 @@ inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize) {
   toCPU(ctx, tensor, data, bufferSize, op);
 }
 
+/**
+ * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
+ * but initializes a staging buffer and promise/future for the operation for
+ * you.
+ *
+ * For simple use cases, this overload is recommended as it abstracts away the
+ * staging buffer and promise/future management. For more custom use cases where
+ * the staging buffer is initialized ahead of time, use the other overload.
+ *
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * @param[in] bufferSize Size of the data buffer in bytes
+ * @param[out] data Pointer to the CPU memory to copy the data to
+ */
+inline void toCPU(Context &ctx, Tensor &tensor, void *data, size_t bufferSize) {
+  auto chunks = ctx.pool.chunks.find(tensor.data.buffer);
+  if (chunks == ctx.pool.chunks.end()) {
+    readBuffer(ctx, tensor, data, bufferSize);
+    return;
+  }
+  // Read chunk by chunk, the copies of a chunk never exceed its buffer. Chunk
+  // 0 shares its buffer with the tensor handle, so chunks are read with
+  // readBuffer() rather than toCPU().
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  size_t read = 0;
+  for (TensorChunk chunk : chunks->second) {
+    if (read >= bufferSize) {
+      break;
+    }
+    const size_t chunkBytes =
+        std::min<size_t>(chunk.tensor.data.size, bufferSize - read);
+    readBuffer(ctx, chunk.tensor, bytes + read, chunkBytes);
+    read += chunkBytes;
+  }
+}
+
 /**
  * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
  * memory for an array of floats instead of a pointer to a float buffer.
@@ -845,6 +1520,48 @@ void toCPU(Context &ctx, Tensor &tensor, std::array<float, N> &data) {
   toCPU(ctx, tensor, data.data(), sizeof(data));
 }
 
+/**
+ * @brief Overloads of the toCPU function copying the size(tensor.shape) values
+ * of a tensor to typed CPU memory. For the 8- and 16-bit types the
+ * readback is rounded up to whole u32 words and the padding dropped.
+ *
+ * @code
+ * std::vector<bf16> data(size(tensor.shape));
+ * toCPU(ctx, tensor, data.data());
+ * @endcode
+ */
+inline void toCPUPacked(Context &ctx, Tensor &tensor, void *data,
+                        size_t numBytes) {
+  const size_t paddedBytes = (numBytes + 3) / 4 * 4;
+  if (paddedBytes == numBytes) {
+    toCPU(ctx, tensor, data, numBytes);
+    return;
+  }
+  std::vector<uint8_t> padded(paddedBytes);
+  toCPU(ctx, tensor, padded.data(), paddedBytes);
+  memcpy(data, padded.data(), numBytes);
+}
+
+inline void toCPU(Context &ctx, Tensor &tensor, half *data) {
+  toCPUPacked(ctx, tensor, data, size(tensor.shape) * sizeof(half));
+}
+
+inline void toCPU(Context &ctx, Tensor &tensor, bf16 *data) {
+  toCPUPacked(ctx, tensor, data, size(tensor.shape) * sizeof(bf16));
+}
+
+inline void toCPU(Context &ctx, Tensor &tensor, uint8_t *data) {
+  toCPUPacked(ctx, tensor, data, size(tensor.shape));
+}
+
+inline void toCPU(Context &ctx, Tensor &tensor, int32_t *data) {
+  toCPU(ctx, tensor, data, size(tensor.shape) * sizeof(int32_t));
+}
+
+inline void toCPU(Context &ctx, Tensor &tensor, uint32_t *data) {
+  toCPU(ctx, tensor, data, size(tensor.shape) * sizeof(uint32_t));
+}
+
 /**
  * @brief Copies data from CPU memory to a GPU buffer. The toGPU overloads are
  * effectively a convenience wrapper around the WebGPU API call
@@ -861,6 +1578,7 @@ void toCPU(Context &ctx, Tensor &tensor, std::array<float, N> &data) {
  */
 inline void toGPU(Context &ctx, const void *data, WGPUBuffer buffer,
                   size_t size) {
+  GPU_TRACE_SCOPE("toGPU");
   wgpuQueueWriteBuffer(ctx.queue, buffer, 0, data, size);
 }
 
@@ -876,13 +1594,32 @@ inline void toGPU(Context &ctx, const void *data, WGPUBuffer buffer,
  * @endcode
  */
 inline void toGPU(Context &ctx, const float *data, Tensor &tensor) {
-  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
-                       tensor.data.size);
+  writeTensor(ctx, tensor, data, tensorBytes(ctx, tensor));
 }
 
 inline void toGPU(Context &ctx, const half *data, Tensor &tensor) {
-  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
-                       tensor.data.size);
+  writeTensor(ctx, tensor, data, size(tensor.shape) * sizeof(half));
+}
+
+inline void toGPU(Context &ctx, const int32_t *data, Tensor &tensor) {
+  writeTensor(ctx, tensor, data, tensorBytes(ctx, tensor));
+}
+
+inline void toGPU(Context &ctx, const uint32_t *data, Tensor &tensor) {
+  writeTensor(ctx, tensor, data, tensorBytes(ctx, tensor));
+}
+
+/**
+ * @brief Overloads of the toGPU function for the packed kbf16 and ku8 types,
+ * copying size(tensor.shape) values. As for kf16, a trailing partial u32 word
+ * is zero-padded.
+ */
+inline void toGPU(Context &ctx, const bf16 *data, Tensor &tensor) {
+  writeTensor(ctx, tensor, data, size(tensor.shape) * sizeof(bf16));
+}
+
+inline void toGPU(Context &ctx, const uint8_t *data, Tensor &tensor) {
+  writeTensor(ctx, tensor, data, size(tensor.shape));
 }
 
 template <typename Params>
@@ -935,7 +1672,7 @@ template <typename T> constexpr bool IsNoParam = std::is_same_v<T, NoParam>;
 /**
  * @brief Ceiling division.
  */
-inline size_t cdiv(size_t n, size_t d) { return (n + d - 1) / d; }
+constexpr size_t cdiv(size_t n, size_t d) { return (n + d - 1) / d; }
 
 /**
  * @brief cdiv for shape specification. Mostly useful for evenly dividing total
@@ -971,6 +1708,9 @@ inline Shape cdiv(Shape total, Shape group) {
  * have any parameters, use NoParam. This is cast as void* to allow for
  * arbitrary types to be passed as parameters.
  * @param[in] paramsSize Size of the parameters buffer in bytes.
+ * @param[in] viewSpans Optional pointer to an array of view sizes in bytes for
+ * the input tensors. If null, or for a span of 0, a binding extends from its
+ * view offset to the end of the buffer.
  * @return Kernel instance representing the created kernel
  *
  * @code
@@ -982,7 +1722,9 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
                            const Tensor *dataBindings, size_t numTensors,
                            const size_t *viewOffsets, const Shape &nWorkgroups,
                            const void *params = nullptr,
-                           size_t paramsSize = 0) {
+                           size_t paramsSize = 0,
+                           const size_t *viewSpans = nullptr) {
+  GPU_TRACE_SCOPE("createKernel");
   assert(nWorkgroups.rank == 3);
   WGPUDevice device = ctx.device;
   WGPUQueue queue = ctx.queue;
@@ -1002,6 +1744,22 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
   op.buffers = std::make_unique<WGPUBuffer[]>(numBindings);
   op.bufferSizes = std::make_unique<size_t[]>(numBindings);
   op.numBindings = numBindings;
+  for (size_t i = 0; i < numTensors; ++i) {
+    op.buffers[i] = dataBindings[i].data.buffer;
+    op.bufferSizes[i] = viewSpans != nullptr && viewSpans[i] > 0
+                            ? viewSpans[i]
+                            : dataBindings[i].data.size - viewOffsets[i];
+    assert(viewOffsets[i] + op.bufferSizes[i] <= dataBindings[i].data.size);
+    // A chunked tensor's handle binds its first buffer only
+    check(ctx.pool.chunks.empty() ||
+              ctx.pool.chunks.find(dataBindings[i].data.buffer) ==
+                  ctx.pool.chunks.end() ||
+              size(dataBindings[i].shape) <=
+                  size(ctx.pool.chunks[dataBindings[i].data.buffer][0]
+                           .tensor.shape),
+          "Chunked tensors are bound per chunk, see experimental/chunked.h",
+          __FILE__, __LINE__);
+  }
   std::vector<WGPUBindGroupLayoutEntry> bgLayoutEntries(numBindings);
   // Create layout entries for input buffers
   for (size_t i = 0; i < numTensors; ++i) {
@@ -1011,7 +1769,7 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
         .buffer =
             WGPUBufferBindingLayout{
                 .type = WGPUBufferBindingType_Storage,
-                .minBindingSize = dataBindings[i].data.size,
+                .minBindingSize = op.bufferSizes[i],
             },
     };
   }
@@ -1034,10 +1792,6 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
   };
   WGPUBindGroupLayout bgLayout =
       wgpuDeviceCreateBindGroupLayout(device, &bgLayoutDesc);
-  for (size_t i = 0; i < numTensors; ++i) {
-    op.buffers[i] = dataBindings[i].data.buffer;
-    op.bufferSizes[i] = dataBindings[i].data.size;
-  }
   // Create a buffer for the Params struct
   if (paramsSize > 0) {
     WGPUBufferDescriptor paramsBufferDesc = {
@@ -1063,7 +1817,7 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
   }
   if (paramsSize > 0) {
     LOG(kDefLog, kInfo, "Create bind group entry for the params buffer");
-    LOG(kDefLog, kInfo, "paramIndex: %d", paramIndex);
+    LOG(kDefLog, kInfo, "paramIndex: %zu", paramIndex);
     bindGroupEntries[paramIndex] = WGPUBindGroupEntry{
         .binding = static_cast<uint32_t>(paramIndex),
         .buffer = op.buffers[paramIndex],
@@ -1071,7 +1825,7 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
         .size = paramsSize,
     };
   }
-  LOG(kDefLog, kTrace, "BG Entries Size: %d", numBindings);
+  LOG(kDefLog, kTrace, "BG Entries Size: %zu", numBindings);
   WGPUBindGroupDescriptor bindGroupDesc = {
       .layout = bgLayout,
       .entryCount = static_cast<uint32_t>(numBindings),
@@ -1085,21 +1839,37 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
     };
     WGPUPipelineLayout pipelineLayout =
         wgpuDeviceCreatePipelineLayout(device, &pipelineLayoutDesc);
-    WGPUShaderModuleWGSLDescriptor wgslDesc = {
-        .code = code.data.c_str(),
-    };
-    wgslDesc.chain.sType = WGPUSType_ShaderModuleWGSLDescriptor;
-    WGPUShaderModuleDescriptor shaderModuleDesc = {};
-    shaderModuleDesc.nextInChain = &wgslDesc.chain;
-    shaderModuleDesc.label = code.label.c_str();
+    WGPUShaderModule &module = ctx.modulePool.data[code.data];
+    if (module == nullptr) {
+      GPU_TRACE_SCOPE("compileShader");
+      WGPUShaderModuleWGSLDescriptor wgslDesc = {
+          .code = code.data.c_str(),
+      };
+      wgslDesc.chain.sType = WGPUSType_ShaderModuleWGSLDescriptor;
+      WGPUShaderModuleDescriptor shaderModuleDesc = {};
+      shaderModuleDesc.nextInChain = &wgslDesc.chain;
+      shaderModuleDesc.label = code.label.c_str();
+      module = wgpuDeviceCreateShaderModule(device, &shaderModuleDesc);
+    } else {
+      LOG(kDefLog, kTrace, "Reusing shader module for %s", code.label.c_str());
+    }
+    // Override constants specialize the shared module for this pipeline
+    std::vector<WGPUConstantEntry> constants(code.constants.size());
+    for (size_t i = 0; i < code.constants.size(); ++i) {
+      constants[i].key = code.constants[i].first.c_str();
+      constants[i].value = code.constants[i].second;
+    }
     WGPUComputePipelineDescriptor computePipelineDesc = {};
     computePipelineDesc.layout = pipelineLayout;
-    computePipelineDesc.compute.module =
-        wgpuDeviceCreateShaderModule(device, &shaderModuleDesc);
+    computePipelineDesc.compute.module = module;
     computePipelineDesc.compute.entryPoint = code.entryPoint.c_str();
+    computePipelineDesc.compute.constantCount = constants.size();
+    computePipelineDesc.compute.constants = constants.data();
     computePipelineDesc.label = code.label.c_str();
+    GPU_TRACE_BEGIN("createPipeline");
     op.computePipeline =
         wgpuDeviceCreateComputePipeline(device, &computePipelineDesc);
+    GPU_TRACE_END("createPipeline");
   }
   /*
   op.nWorkgroups = {cdiv(nThreads[0], code.workgroupSize[0]),
@@ -1144,12 +1914,12 @@ Kernel createKernel(Context &ctx, const KernelCode &code,
     return createKernel(ctx, code, dataBindings.data.data(), numInputs,
                         dataBindings.viewOffsets.data(), nWorkgroups,
                         reinterpret_cast<const void *>(&params),
-                        sizeof(ParamsType));
+                        sizeof(ParamsType), dataBindings.viewSpans.data());
   } else {
     // LOG(kDefLog, kTrace , "No params");
     return createKernel(ctx, code, dataBindings.data.data(), numInputs,
                         dataBindings.viewOffsets.data(), nWorkgroups, nullptr,
-                        0);
+                        0, dataBindings.viewSpans.data());
   }
 }
 
@@ -1173,14 +1943,18 @@ Kernel createKernel(Context &ctx, const KernelCode &code,
  */
 inline void dispatchKernel(Context &ctx, Kernel &kernel,
                            std::promise<void> &promise) {
+  GPU_TRACE_SCOPE("dispatchKernel");
   // Submit the command buffer
   wgpuQueueSubmit(ctx.queue, 1, &kernel.commandBuffer);
+  // Spans from submission to the done callback
+  GPU_TRACE_ASYNC_BEGIN("kernel", &promise);
   wgpuQueueOnSubmittedWorkDone(
       ctx.queue,
       [](WGPUQueueWorkDoneStatus status, void *data) {
         check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
               __FILE__, __LINE__);
         auto *promise = static_cast<std::promise<void> *>(data);
+        GPU_TRACE_ASYNC_END("kernel", promise);
         promise->set_value();
       },
       &promise);
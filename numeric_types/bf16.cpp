@@ -0,0 +1,109 @@
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "gpu.h"
+#include "numeric_types/bf16.h"
+
+using namespace gpu;
+
+#define COLOR_RESET "\033[0m"
+#define COLOR_RED "\033[31m"
+#define COLOR_GREEN "\033[32m"
+
+void printResult(bool passed, const char *message) {
+  if (passed) {
+    printf("[" COLOR_GREEN "PASSED" COLOR_RESET "]" " : %s\n", message);
+  } else {
+    printf("[" COLOR_RED "FAILED" COLOR_RESET "]" " : %s\n", message);
+  }
+}
+
+float fromBits(uint32_t bits) {
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+void testSpecialCases() {
+  printResult(bf16(0.0f).data == 0x0000, "0.0f converts to 0x0000");
+  printResult(bf16(-0.0f).data == 0x8000, "-0.0f converts to 0x8000");
+  printResult(bf16(1.0f).data == 0x3f80, "1.0f converts to 0x3f80");
+  printResult(bf16(INFINITY).data == 0x7f80, "Infinity converts to 0x7f80");
+  printResult(bf16(-INFINITY).data == 0xff80,
+              "Negative infinity converts to 0xff80");
+  printResult(std::isnan(static_cast<float>(bf16(NAN))),
+              "NaN converts to NaN");
+  // A NaN payload in the low bits only must not round into infinity
+  printResult(std::isnan(static_cast<float>(bf16(fromBits(0x7f800001u)))),
+              "Low-payload NaN stays NaN");
+  printResult(bf16(FLT_MAX).data == 0x7f80,
+              "FLT_MAX rounds to infinity");
+  printResult(bf16(fromBits(0x00000001u)).data == 0x0000,
+              "Smallest denormal rounds to zero");
+}
+
+void testRoundToNearestEven() {
+  // 1 + 2^-8 is halfway between 1 and 1 + 2^-7, ties go to the even 1
+  printResult(bf16(fromBits(0x3f808000u)).data == 0x3f80,
+              "Tie rounds down to even");
+  // 1 + 3 * 2^-8 is halfway between 1 + 2^-7 and 1 + 2^-6, ties go up
+  printResult(bf16(fromBits(0x3f818000u)).data == 0x3f82,
+              "Tie rounds up to even");
+  printResult(bf16(fromBits(0x3f808001u)).data == 0x3f81,
+              "Above the tie rounds up");
+  printResult(bf16(fromBits(0x3f807fffu)).data == 0x3f80,
+              "Below the tie rounds down");
+}
+
+void testRoundTrips() {
+  bool passed = true;
+  for (uint32_t bits = 0; bits < 0x10000; ++bits) {
+    bf16 b(static_cast<uint16_t>(bits));
+    const float f = static_cast<float>(b);
+    passed &= std::isnan(f) || bf16(f).data == b.data;
+  }
+  printResult(passed, "All 65536 bf16 values round trip exactly");
+
+  std::mt19937 gen(314159);
+  std::normal_distribution<float> dist(0.0f, 100.0f);
+  passed = true;
+  for (int i = 0; i < 100000; ++i) {
+    const float f = dist(gen);
+    const float error = std::fabs(static_cast<float>(bf16(f)) - f);
+    // Half an ulp of an 8-bit significand
+    passed &= error <= std::ldexp(std::fabs(f), -8);
+  }
+  printResult(passed, "Float to bf16 error is within half an ulp");
+}
+
+void testPacking() {
+  // Value i of a u32 word is in bits [16 * i, 16 * i + 16)
+  std::vector<bf16> values = {bf16(1.0f), bf16(-2.0f), bf16(0.5f)};
+  std::vector<uint32_t> words(sizeBytes(kbf16, values.size()) / 4, 0);
+  memcpy(words.data(), values.data(), values.size() * sizeof(bf16));
+  printResult(words.size() == 2 && words[0] == 0xc0003f80u &&
+                  words[1] == 0x00003f00u,
+              "bf16 arrays have the packed u32 layout");
+  printResult(sizeBytes(kbf16, 3) == 8 && sizeBytes(kf16, 3) == 8 &&
+                  sizeBytes(ku8, 5) == 8 &&
+                  sizeBytes(ki32, 3) == 12 && sizeBytes(ku32, 3) == 12,
+              "Packed sizes round up to whole u32 words");
+  printResult(toString(kbf16) == "u32" && toString(ku8) == "u32" &&
+                  toString(ki32) == "i32" && toString(ku32) == "u32",
+              "WGSL storage types");
+}
+
+int main() {
+  printf("\nbfloat16 conversions\n\n");
+  testSpecialCases();
+  testRoundToNearestEven();
+  testRoundTrips();
+  testPacking();
+  printf("\nTests completed.\n");
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef BF16_H
+#define BF16_H
+
+#include <cstdint>
+#include <cstring>
+
+struct bf16;
+inline bf16 bf16FromFloat(float f);
+inline float bf16ToFloat(bf16 b);
+
+/**
+ * bfloat16: the upper 16 bits of an IEEE 754 binary32 float, with the same
+ * 8-bit exponent range as f32 and an 8-bit significand.
+ *
+ * WGSL has no bf16 type, so kbf16 tensors are stored as u32 words with two
+ * values per word, value i of a word in bits [16 * i, 16 * i + 16). On a
+ * little-endian host this is the memory layout of a contiguous bf16 array,
+ * so host arrays are uploaded and read back as is.
+ */
+struct bf16 {
+  uint16_t data;
+
+  // Default constructor
+  bf16() : data(0) {}
+
+  // Constructor from float, rounding to nearest even
+  bf16(float f) { *this = bf16FromFloat(f); }
+
+  // Constructor from the raw bits
+  explicit bf16(uint16_t value) : data(value) {}
+
+  operator float() const { return bf16ToFloat(*this); }
+};
+
+/**
+ * @brief Converts a 32-bit float to bfloat16, rounding to nearest even.
+ * NaNs stay NaNs (quiet, with the sign preserved) rather than being rounded
+ * into infinity.
+ */
+inline bf16 bf16FromFloat(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    return bf16(static_cast<uint16_t>((bits >> 16) | 0x0040u));
+  }
+  const uint32_t roundingBias = 0x7fffu + ((bits >> 16) & 1u);
+  return bf16(static_cast<uint16_t>((bits + roundingBias) >> 16));
+}
+
+/**
+ * @brief Converts a bfloat16 to a 32-bit float. The conversion is exact.
+ */
+inline float bf16ToFloat(bf16 b) {
+  const uint32_t bits = static_cast<uint32_t>(b.data) << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+#endif // BF16_H
@@ -4,6 +4,8 @@
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <vector>
 
 #include "gpu.h"
 #include "numeric_types/half.h"
@@ -176,6 +178,67 @@ void testSpecialCases() {
   printResult(h.data == 0x0001, message, 5.96046e-08f, h.data);
 }
 
+void testBulkConversion() {
+  char message[256];
+
+  // Every half value
+  std::vector<half> halves(1 << 16);
+  for (size_t i = 0; i < halves.size(); ++i) {
+    halves[i].data = static_cast<uint16_t>(i);
+  }
+  // Every 997th float bit pattern, plus the odd length exercises the tails
+  std::vector<float> floats;
+  for (uint64_t bits = 0; bits <= UINT32_MAX; bits += 997) {
+    const uint32_t u = static_cast<uint32_t>(bits);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    floats.push_back(f);
+  }
+
+  std::vector<float> floatsRef(halves.size()), floatsOut(halves.size());
+  std::vector<half> halvesRef(floats.size()), halvesOut(floats.size());
+  for (size_t i = 0; i < halves.size(); ++i) {
+    floatsRef[i] = halfToFloat(halves[i]);
+  }
+  for (size_t i = 0; i < floats.size(); ++i) {
+    halvesRef[i] = halfFromFloat(floats[i]);
+  }
+  auto check = [&](const char *name) {
+    const bool floatsMatch =
+        memcmp(floatsOut.data(), floatsRef.data(),
+               floatsOut.size() * sizeof(float)) == 0;
+    const bool halvesMatch =
+        memcmp(halvesOut.data(), halvesRef.data(),
+               halvesOut.size() * sizeof(half)) == 0;
+    sprintf(message, "Bulk conversions (%s) bit-exact with scalar", name);
+    printResult(floatsMatch && halvesMatch, message, 0.0f, 0.0f);
+    std::fill(floatsOut.begin(), floatsOut.end(), 0.0f);
+    std::fill(halvesOut.begin(), halvesOut.end(), half());
+  };
+  const char *names[] = {"scalar", "F16C", "NEON"};
+  for (HalfConversionPath path :
+       {kHalfScalar, kHalfF16C, kHalfNEON}) {
+    if (supportsHalfConversionPath(path)) {
+      halfToFloat(path, halves.data(), floatsOut.data(), halves.size());
+      floatToHalf(path, floats.data(), halvesOut.data(), floats.size());
+      check(names[path]);
+    }
+  }
+  halfToFloat(halves.data(), floatsOut.data(), halves.size(), 4);
+  floatToHalf(floats.data(), halvesOut.data(), floats.size(), 4);
+  check("4 threads");
+
+  // Ties round to even
+  half h = halfFromFloat(1.0f + 1.0f / 2048.0f);
+  printResult(h.data == 0x3c00, "1 + 2^-11 rounds to even 0x3c00",
+              1.0f + 1.0f / 2048.0f, h.data);
+  h = halfFromFloat(1.0f + 3.0f / 2048.0f);
+  printResult(h.data == 0x3c02, "1 + 3 * 2^-11 rounds to even 0x3c02",
+              1.0f + 3.0f / 2048.0f, h.data);
+  h = halfFromFloat(65520.0f);
+  printResult(h.data == 0x7c00, "65520 rounds to infinity", 65520.0f, h.data);
+}
+
 void testContainers() {
   {
     std::array<half, 4> h = {0.0f, -0.0f, INFINITY, NAN};
@@ -267,6 +330,9 @@ int main() {
   printf("\nSpecial half values\n\n");
   testSpecialCases();
 
+  printf("\nBulk conversions\n\n");
+  testBulkConversion();
+
   printf("\nContainers and CPU/GPU round trip\n\n");
   testContainers();
 
@@ -1,11 +1,23 @@
 #ifndef HALF_H
 #define HALF_H
 
+#include <algorithm>
 #include <cfloat>
 #include <climits>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HALF_X86_DISPATCH
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HALF_NEON
+#endif
 
 struct half;
 half halfFromFloat(float f);
@@ -53,120 +65,49 @@ struct half {
 /**
  * @brief Converts a 32-bit float to a 16-bit half-precision float.
  *
- * Based on Mike Acton's half.c implementation.
+ * Rounds to nearest even like the F16C instructions and GPU f16 conversions,
+ * so that the bulk converters below give the same bits on every code path.
+ * NaNs are quieted, keeping the upper bits of the payload.
  */
 half halfFromFloat(float f) {
-  union {
-    float f;
-    uint32_t u;
-  } floatUnion = {f};
+  uint32_t float32;
+  memcpy(&float32, &f, sizeof(float32));
 
-  uint32_t float32 = floatUnion.u;
+  const uint16_t halfSign = static_cast<uint16_t>((float32 >> 16) & 0x8000);
+  const uint32_t floatAbs = float32 & 0x7fffffff;
+  half result;
 
-  // Constants for bit masks, shifts, and biases
-  const uint16_t ONE = 0x0001;
-  const uint32_t FLOAT_SIGN_MASK = 0x80000000;
-  const uint32_t FLOAT_EXP_MASK = 0x7f800000;
-  const uint32_t FLOAT_MANTISSA_MASK = 0x007fffff;
-  const uint32_t FLOAT_HIDDEN_BIT = 0x00800000;
-  const uint32_t FLOAT_ROUND_BIT = 0x00001000;
-  const uint16_t FLOAT_EXP_BIAS = 0x007f;
-  const uint16_t HALF_EXP_BIAS = 0x000f;
-  const uint16_t FLOAT_SIGN_POS = 0x001f;
-  const uint16_t HALF_SIGN_POS = 0x000f;
-  const uint16_t FLOAT_EXP_POS = 0x0017;
-  const uint16_t HALF_EXP_POS = 0x000a;
-  const uint16_t HALF_EXP_MASK = 0x7c00;
-  const uint16_t FLOAT_EXP_FLAGGED_VALUE = 0x00ff;
-  const uint16_t HALF_EXP_MASK_VALUE = HALF_EXP_MASK >> HALF_EXP_POS;
-  const uint16_t HALF_EXP_MAX_VALUE = HALF_EXP_MASK_VALUE - ONE;
-  const uint16_t FLOAT_HALF_SIGN_POS_OFFSET = FLOAT_SIGN_POS - HALF_SIGN_POS;
-  const uint16_t FLOAT_HALF_BIAS_OFFSET = FLOAT_EXP_BIAS - HALF_EXP_BIAS;
-  const uint16_t FLOAT_HALF_MANTISSA_POS_OFFSET = FLOAT_EXP_POS - HALF_EXP_POS;
-  const uint16_t HALF_NAN_MIN = HALF_EXP_MASK | ONE;
-
-  // Extracting the sign, exponent, and mantissa from the 32-bit float
-  const uint32_t floatSignMasked = float32 & FLOAT_SIGN_MASK;
-  const uint32_t floatExpMasked = float32 & FLOAT_EXP_MASK;
-  const uint16_t halfSign =
-      static_cast<uint16_t>(floatSignMasked >> FLOAT_HALF_SIGN_POS_OFFSET);
-  const uint16_t floatExp =
-      static_cast<uint16_t>(floatExpMasked >> FLOAT_EXP_POS);
-  const uint32_t floatMantissa = float32 & FLOAT_MANTISSA_MASK;
-
-  // Check for NaN
-  if ((floatExpMasked == FLOAT_EXP_MASK) && (floatMantissa != 0)) {
-    half result;
+  if (floatAbs > 0x7f800000) {
+    // NaN
     result.data =
-        HALF_EXP_MASK | (floatMantissa >> FLOAT_HALF_MANTISSA_POS_OFFSET);
-    return result;
+        halfSign | 0x7e00 | static_cast<uint16_t>((floatAbs >> 13) & 0x03ff);
+  } else if (floatAbs >= 0x47800000) {
+    // Infinity, or at least 2^16 which overflows after rounding
+    result.data = halfSign | 0x7c00;
+  } else if (floatAbs >= 0x38800000) {
+    // Normal half: rebias the exponent from 127 to 15 and round the 13
+    // dropped mantissa bits, a carry into the exponent (up to infinity) is
+    // the correctly rounded result
+    const uint32_t roundingBias = 0x0fff + ((floatAbs >> 13) & 1);
+    result.data = halfSign | static_cast<uint16_t>(
+                                 (floatAbs - 0x38000000 + roundingBias) >> 13);
+  } else {
+    // Denormal half or zero: the value is mantissa * 2^-24, shift the float
+    // mantissa with its hidden bit into place and round
+    const uint32_t floatExp = floatAbs >> 23;
+    const uint32_t shift = 126 - floatExp;
+    if (shift > 24) {
+      result.data = halfSign;
+    } else {
+      const uint32_t mantissa = (floatAbs & 0x007fffff) | 0x00800000;
+      const uint32_t truncated = mantissa >> shift;
+      const uint32_t remainder = mantissa & ((1u << shift) - 1);
+      const uint32_t halfway = 1u << (shift - 1);
+      const uint32_t roundUp =
+          remainder > halfway || (remainder == halfway && (truncated & 1));
+      result.data = halfSign | static_cast<uint16_t>(truncated + roundUp);
+    }
   }
-
-  // Adjusting the exponent and rounding the mantissa
-  const uint16_t floatExpHalfBias = floatExp - FLOAT_HALF_BIAS_OFFSET;
-  const uint32_t floatMantissaRoundMask = floatMantissa & FLOAT_ROUND_BIT;
-  const uint32_t floatMantissaRoundOffset = floatMantissaRoundMask << ONE;
-  const uint32_t floatMantissaRounded =
-      floatMantissa + floatMantissaRoundOffset;
-
-  // Handling denormalized numbers
-  const uint32_t floatMantissaDenormShiftAmount = ONE - floatExpHalfBias;
-  const uint32_t floatMantissaWithHidden =
-      floatMantissaRounded | FLOAT_HIDDEN_BIT;
-  const uint32_t floatMantissaDenorm =
-      floatMantissaWithHidden >> floatMantissaDenormShiftAmount;
-  const uint16_t halfMantissaDenorm = static_cast<uint16_t>(
-      floatMantissaDenorm >> FLOAT_HALF_MANTISSA_POS_OFFSET);
-  const uint16_t halfDenorm = halfSign | halfMantissaDenorm;
-
-  // Handling special cases: infinity and NaN
-  const uint16_t halfInf = halfSign | HALF_EXP_MASK;
-  const uint16_t mantissaNan =
-      static_cast<uint16_t>(floatMantissa >> FLOAT_HALF_MANTISSA_POS_OFFSET);
-  const uint16_t halfNan = halfSign | HALF_EXP_MASK | mantissaNan;
-  const uint16_t halfNanNotInf = halfSign | HALF_NAN_MIN;
-
-  // Handling overflow
-  const uint16_t halfExpNormOverflowOffset = floatExpHalfBias + ONE;
-  const uint16_t halfExpNormOverflow = halfExpNormOverflowOffset
-                                       << HALF_EXP_POS;
-  const uint16_t halfNormOverflow = halfSign | halfExpNormOverflow;
-
-  // Handling normalized numbers
-  const uint16_t halfExpNorm = floatExpHalfBias << HALF_EXP_POS;
-  const uint16_t halfMantissaNorm = static_cast<uint16_t>(
-      floatMantissaRounded >> FLOAT_HALF_MANTISSA_POS_OFFSET);
-  const uint16_t halfNorm = halfSign | halfExpNorm | halfMantissaNorm;
-
-  // Checks and conditions
-  const uint16_t halfIsDenorm = FLOAT_HALF_BIAS_OFFSET >= floatExp;
-  const uint16_t floatHalfExpBiasedFlag =
-      FLOAT_EXP_FLAGGED_VALUE - FLOAT_HALF_BIAS_OFFSET;
-  const uint16_t floatExpIsFlagged = floatExpHalfBias == floatHalfExpBiasedFlag;
-  const uint16_t isFloatMantissaZero = floatMantissa == 0;
-  const uint16_t isHalfNanZero = mantissaNan == 0;
-  const uint16_t floatIsInf = floatExpIsFlagged && isFloatMantissaZero;
-  const uint16_t floatIsNanUnderflow = floatExpIsFlagged && isHalfNanZero;
-  const uint16_t floatIsNan = floatExpIsFlagged;
-  const uint16_t expIsOverflow = floatExpHalfBias > HALF_EXP_MAX_VALUE;
-  const uint32_t floatMantissaRoundedOverflow =
-      floatMantissaRounded & FLOAT_HIDDEN_BIT;
-  const uint32_t mantissaNormIsOverflow = floatMantissaRoundedOverflow != 0;
-  const uint16_t halfIsInf = expIsOverflow || floatIsInf;
-
-  // Selecting final result based on conditions
-  const uint16_t checkOverflowResult =
-      mantissaNormIsOverflow ? halfNormOverflow : halfNorm;
-  const uint16_t checkNanResult = floatIsNan ? halfNan : checkOverflowResult;
-  const uint16_t checkNanUnderflowResult =
-      floatIsNanUnderflow ? halfNanNotInf : checkNanResult;
-  const uint16_t checkInfResult = halfIsInf ? halfInf : checkNanUnderflowResult;
-  const uint16_t checkDenormResult = halfIsDenorm ? halfDenorm : checkInfResult;
-
-  // Final result after all checks
-  half result;
-  result.data = checkDenormResult;
-
   return result;
 }
 
@@ -237,7 +178,9 @@ float halfToFloat(half h) {
 
   // Handling special cases: infinity and NaN
   const uint32_t floatInf = floatSign | FLOAT_EXP_MASK;
-  const uint32_t floatNan = floatSign | FLOAT_EXP_MASK | floatMantissa;
+  const uint32_t FLOAT_QUIET_BIT = 0x00400000;
+  const uint32_t floatNan =
+      floatSign | FLOAT_EXP_MASK | FLOAT_QUIET_BIT | floatMantissa;
 
   // Handling zero
   const uint32_t floatZero = floatSign;
@@ -265,4 +208,218 @@ float halfToFloat(half h) {
   return floatUnion.f;
 }
 
+/**
+ * Bulk conversion between float and half arrays, e.g. for uploading kf16
+ * tensors and reading them back.
+ *
+ * On x86 the converters dispatch at runtime to F16C when the CPU supports it,
+ * on aarch64 they use NEON, and otherwise fall back to the scalar
+ * halfFromFloat / halfToFloat. All paths round to nearest even and
+ * quiet NaNs the same way, so results are bit-exact across paths. Large
+ * arrays are split across threads.
+ *
+ * @code
+ * std::vector<half> h(n);
+ * floatToHalf(data.data(), h.data(), n);
+ * @endcode
+ */
+
+// Arrays with fewer values are converted on the calling thread
+static constexpr size_t kHalfParallelThreshold = 1 << 20;
+
+inline void floatToHalfScalar(const float *in, half *out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = halfFromFloat(in[i]);
+  }
+}
+
+inline void halfToFloatScalar(const half *in, float *out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = halfToFloat(in[i]);
+  }
+}
+
+#if defined(HALF_X86_DISPATCH)
+
+__attribute__((target("avx,f16c"))) inline void
+floatToHalfF16C(const float *in, half *out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i h =
+        _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), h);
+  }
+  floatToHalfScalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx,f16c"))) inline void
+halfToFloatF16C(const half *in, float *out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i h =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+  }
+  halfToFloatScalar(in + i, out + i, n - i);
+}
+
+#elif defined(HALF_NEON)
+
+inline void floatToHalfNEON(const float *in, half *out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float16x4_t h = vcvt_f16_f32(vld1q_f32(in + i));
+    vst1_u16(reinterpret_cast<uint16_t *>(out + i), vreinterpret_u16_f16(h));
+  }
+  floatToHalfScalar(in + i, out + i, n - i);
+}
+
+inline void halfToFloatNEON(const half *in, float *out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const uint16x4_t h = vld1_u16(reinterpret_cast<const uint16_t *>(in + i));
+    vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(h)));
+  }
+  halfToFloatScalar(in + i, out + i, n - i);
+}
+
+#endif
+
+/**
+ * @brief Instruction set used by the bulk converters.
+ */
+enum HalfConversionPath { kHalfScalar, kHalfF16C, kHalfNEON };
+
+/**
+ * @brief Whether the CPU supports a conversion path.
+ */
+inline bool supportsHalfConversionPath(HalfConversionPath path) {
+  switch (path) {
+  case kHalfScalar:
+    return true;
+#if defined(HALF_X86_DISPATCH)
+  case kHalfF16C:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#elif defined(HALF_NEON)
+  case kHalfNEON:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Returns the fastest conversion path supported by the CPU.
+ */
+inline HalfConversionPath bestHalfConversionPath() {
+  static const HalfConversionPath path = [] {
+    for (HalfConversionPath candidate : {kHalfF16C, kHalfNEON}) {
+      if (supportsHalfConversionPath(candidate)) {
+        return candidate;
+      }
+    }
+    return kHalfScalar;
+  }();
+  return path;
+}
+
+/**
+ * @brief Converts n values on the calling thread using the given path, which
+ * must be supported by the CPU.
+ */
+inline void floatToHalf(HalfConversionPath path, const float *in, half *out,
+                        size_t n) {
+  switch (path) {
+#if defined(HALF_X86_DISPATCH)
+  case kHalfF16C:
+    floatToHalfF16C(in, out, n);
+    return;
+#elif defined(HALF_NEON)
+  case kHalfNEON:
+    floatToHalfNEON(in, out, n);
+    return;
+#endif
+  default:
+    floatToHalfScalar(in, out, n);
+  }
+}
+
+inline void halfToFloat(HalfConversionPath path, const half *in, float *out,
+                        size_t n) {
+  switch (path) {
+#if defined(HALF_X86_DISPATCH)
+  case kHalfF16C:
+    halfToFloatF16C(in, out, n);
+    return;
+#elif defined(HALF_NEON)
+  case kHalfNEON:
+    halfToFloatNEON(in, out, n);
+    return;
+#endif
+  default:
+    halfToFloatScalar(in, out, n);
+  }
+}
+
+/**
+ * @brief Runs convert(begin, end) over [0, n) in contiguous chunks, on up to
+ * numThreads threads (0 picks one per hardware thread for large arrays).
+ */
+template <typename F>
+inline void parallelConvert(size_t n, size_t numThreads, F convert) {
+  if (numThreads == 0) {
+    numThreads = n < kHalfParallelThreshold
+                     ? 1
+                     : std::max(1u, std::thread::hardware_concurrency());
+  }
+  // Keep chunks a multiple of 16 values so that only the last one has a tail
+  const size_t chunk = (n / numThreads + 15) / 16 * 16;
+  if (numThreads <= 1 || chunk == 0) {
+    convert(0, n);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (size_t begin = chunk; begin < n; begin += chunk) {
+    threads.emplace_back(convert, begin, std::min(n, begin + chunk));
+  }
+  convert(0, std::min(n, chunk));
+  for (std::thread &t : threads) {
+    t.join();
+  }
+}
+
+/**
+ * @brief Converts n floats to halves, rounding to nearest even.
+ *
+ * @param[in] in n floats
+ * @param[out] out n halves
+ * @param[in] n Number of values
+ * @param[in] numThreads Threads to use, 0 to decide based on n
+ */
+inline void floatToHalf(const float *in, half *out, size_t n,
+                        size_t numThreads = 0) {
+  const HalfConversionPath path = bestHalfConversionPath();
+  parallelConvert(n, numThreads, [=](size_t begin, size_t end) {
+    floatToHalf(path, in + begin, out + begin, end - begin);
+  });
+}
+
+/**
+ * @brief Converts n halves to floats. The conversion is exact.
+ *
+ * @param[in] in n halves
+ * @param[out] out n floats
+ * @param[in] n Number of values
+ * @param[in] numThreads Threads to use, 0 to decide based on n
+ */
+inline void halfToFloat(const half *in, float *out, size_t n,
+                        size_t numThreads = 0) {
+  const HalfConversionPath path = bestHalfConversionPath();
+  parallelConvert(n, numThreads, [=](size_t begin, size_t end) {
+    halfToFloat(path, in + begin, out + begin, end - begin);
+  });
+}
+
 #endif // HALF_H
@@ -0,0 +1,80 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "numeric_types/half.h"
+
+/**
+ * Benchmark of the bulk float <-> half converters, per conversion path on one
+ * thread and with the default threading.
+ */
+
+static constexpr size_t kN = 1 << 24; // 16M values, 64 MB of floats
+static constexpr int kRepeats = 5;
+
+/**
+ * @brief Best time in seconds over kRepeats runs of f.
+ */
+template <typename F> double bestTime(F f) {
+  double best = 1e9;
+  for (int i = 0; i < kRepeats; ++i) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  return best;
+}
+
+void report(const char *name, double toHalf, double toFloat,
+            double toHalfScalar, double toFloatScalar) {
+  // Bytes read and written per value: 4 + 2
+  const double gb = kN * 6.0 / 1e9;
+  printf("  %-22s float->half %7.2f GB/s (%5.1fx)   half->float %7.2f GB/s "
+         "(%5.1fx)\n",
+         name, gb / toHalf, toHalfScalar / toHalf, gb / toFloat,
+         toFloatScalar / toFloat);
+}
+
+int main() {
+  std::mt19937 gen(314159);
+  std::normal_distribution<float> dist(0.0f, 10.0f);
+  std::vector<float> floats(kN), floatsOut(kN);
+  std::vector<half> halves(kN);
+  for (float &f : floats) {
+    f = dist(gen);
+  }
+
+  printf("\nBulk half conversion, %zu values\n\n", kN);
+  const char *names[] = {"scalar", "F16C", "NEON"};
+  double toHalfScalar = 0.0, toFloatScalar = 0.0;
+  for (HalfConversionPath path :
+       {kHalfScalar, kHalfF16C, kHalfNEON}) {
+    if (!supportsHalfConversionPath(path)) {
+      continue;
+    }
+    const double toHalf = bestTime(
+        [&] { floatToHalf(path, floats.data(), halves.data(), kN); });
+    const double toFloat = bestTime(
+        [&] { halfToFloat(path, halves.data(), floatsOut.data(), kN); });
+    if (path == kHalfScalar) {
+      toHalfScalar = toHalf;
+      toFloatScalar = toFloat;
+    }
+    report(names[path], toHalf, toFloat, toHalfScalar, toFloatScalar);
+  }
+
+  const double toHalf =
+      bestTime([&] { floatToHalf(floats.data(), halves.data(), kN); });
+  const double toFloat =
+      bestTime([&] { halfToFloat(halves.data(), floatsOut.data(), kN); });
+  char name[64];
+  snprintf(name, sizeof(name), "%s, %u threads",
+           names[bestHalfConversionPath()],
+           std::max(1u, std::thread::hardware_concurrency()));
+  report(name, toHalf, toFloat, toHalfScalar, toFloatScalar);
+  printf("\n");
+  return 0;
+}
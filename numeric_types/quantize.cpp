@@ -0,0 +1,101 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "numeric_types/quantize.h"
+
+#define COLOR_RESET "\033[0m"
+#define COLOR_RED "\033[31m"
+#define COLOR_GREEN "\033[32m"
+
+void printResult(bool passed, const char *message, float error, float bound) {
+  if (passed) {
+    printf("[" COLOR_GREEN "PASSED" COLOR_RESET "]"
+           " : %s (max error: %.6f, bound: %.6f)\n",
+           message, error, bound);
+  } else {
+    printf("[" COLOR_RED "FAILED" COLOR_RESET "]"
+           " : %s (max error: %.6f, bound: %.6f)\n",
+           message, error, bound);
+  }
+}
+
+void testInt8(size_t rows, size_t cols) {
+  std::mt19937 gen(314159);
+  std::normal_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> weights(rows * cols);
+  for (float &w : weights) {
+    w = dist(gen);
+  }
+  std::vector<uint32_t> packed(rows * cols / 4);
+  std::vector<float> scales(rows);
+  std::vector<float> result(rows * cols);
+  quantizeInt8(weights.data(), rows, cols, packed.data(), scales.data());
+  dequantizeInt8(packed.data(), scales.data(), rows, cols, result.data());
+  // Rounding to the nearest level is off by at most half a step
+  bool passed = true;
+  float maxError = 0.0f, maxBound = 0.0f;
+  for (size_t i = 0; i < rows * cols; ++i) {
+    const float error = std::fabs(result[i] - weights[i]);
+    const float bound = 0.5f * scales[i / cols] + 1e-6f;
+    passed &= error <= bound;
+    maxError = std::max(maxError, error);
+    maxBound = std::max(maxBound, bound);
+  }
+  printResult(passed, "int8 per-channel round trip", maxError, maxBound);
+}
+
+void testInt4(size_t rows, size_t cols, size_t groupSize) {
+  std::mt19937 gen(271828);
+  std::normal_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> weights(rows * cols);
+  for (float &w : weights) {
+    w = dist(gen);
+  }
+  const size_t nGroups = rows * cols / groupSize;
+  std::vector<uint32_t> packed(rows * cols / 8);
+  std::vector<float> scales(nGroups);
+  std::vector<uint32_t> zeros((nGroups + 7) / 8);
+  std::vector<float> result(rows * cols);
+  quantizeInt4(weights.data(), rows, cols, groupSize, packed.data(),
+               scales.data(), zeros.data());
+  dequantizeInt4(packed.data(), scales.data(), zeros.data(), rows, cols,
+                 groupSize, result.data());
+  // Rounding the zero point shifts the grid by up to half a step on top of
+  // the rounding of the value itself
+  bool passed = true;
+  float maxError = 0.0f, maxBound = 0.0f;
+  for (size_t i = 0; i < rows * cols; ++i) {
+    const float error = std::fabs(result[i] - weights[i]);
+    const float bound = scales[i / groupSize] + 1e-6f;
+    passed &= error <= bound;
+    maxError = std::max(maxError, error);
+    maxBound = std::max(maxBound, bound);
+  }
+  printResult(passed, "int4 group-wise round trip", maxError, maxBound);
+
+  // Zero is exactly representable in every group
+  std::vector<float> zerosIn(groupSize, 0.0f);
+  zerosIn[0] = 1.0f;
+  zerosIn[1] = -2.0f;
+  uint32_t zeroPacked[16], zeroPoint[1];
+  float zeroScale[1];
+  std::vector<float> zerosOut(groupSize);
+  quantizeInt4(zerosIn.data(), 1, groupSize, groupSize, zeroPacked, zeroScale,
+               zeroPoint);
+  dequantizeInt4(zeroPacked, zeroScale, zeroPoint, 1, groupSize, groupSize,
+                 zerosOut.data());
+  printResult(zerosOut[groupSize - 1] == 0.0f, "int4 exact zero",
+              std::fabs(zerosOut[groupSize - 1]), 0.0f);
+}
+
+int main() {
+  printf("\nQuantization round trips\n\n");
+  testInt8(64, 256);
+  testInt4(64, 256, 32);
+  testInt4(64, 256, 128);
+  printf("\nTests completed.\n");
+  return 0;
+}
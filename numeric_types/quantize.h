@@ -0,0 +1,133 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Host-side quantizers for the packed kq8 / kq4 weight formats.
+ *
+ * Weights are (rows, cols) row-major with rows being output channels and cols
+ * the reduction dimension, matching the (N, K) weight layout used by the
+ * matmul kernels.
+ *
+ * int8: symmetric per-channel quantization, w ~= scale[row] * q with q in
+ * [-127, 127]. Four values are packed per u32, value i of a word in bits
+ * [8 * i, 8 * i + 8) as two's complement.
+ *
+ * int4: asymmetric group-wise quantization over groups of groupSize
+ * consecutive values of a row, w ~= scale[g] * (q - zero[g]) with q and zero
+ * in [0, 15]. Eight values are packed per u32, value i of a word in bits
+ * [4 * i, 4 * i + 4). Zero points are packed the same way, eight groups per
+ * u32.
+ */
+
+/**
+ * @brief Quantizes weights to int8 with one scale per row.
+ *
+ * @param[in] weights Weights, rows * cols values
+ * @param[in] rows Number of rows (output channels)
+ * @param[in] cols Number of columns, must be a multiple of 4
+ * @param[out] packed rows * cols / 4 packed words
+ * @param[out] scales rows scales
+ */
+inline void quantizeInt8(const float *weights, size_t rows, size_t cols,
+                         uint32_t *packed, float *scales) {
+  assert(cols % 4 == 0);
+  for (size_t r = 0; r < rows; ++r) {
+    const float *row = weights + r * cols;
+    float maxAbs = 0.0f;
+    for (size_t c = 0; c < cols; ++c) {
+      maxAbs = std::max(maxAbs, std::fabs(row[c]));
+    }
+    const float scale = maxAbs > 0.0f ? maxAbs / 127.0f : 1.0f;
+    scales[r] = scale;
+    for (size_t c = 0; c < cols; c += 4) {
+      uint32_t word = 0;
+      for (size_t i = 0; i < 4; ++i) {
+        const float q =
+            std::min(127.0f, std::max(-127.0f, std::round(row[c + i] / scale)));
+        word |= (static_cast<uint32_t>(static_cast<int32_t>(q)) & 0xFFu)
+                << (8 * i);
+      }
+      packed[(r * cols + c) / 4] = word;
+    }
+  }
+}
+
+/**
+ * @brief Reconstructs float weights from int8 weights, the inverse of
+ * quantizeInt8() up to rounding.
+ */
+inline void dequantizeInt8(const uint32_t *packed, const float *scales,
+                           size_t rows, size_t cols, float *weights) {
+  for (size_t idx = 0; idx < rows * cols; ++idx) {
+    const uint32_t word = packed[idx / 4];
+    const int8_t q = static_cast<int8_t>((word >> (8 * (idx % 4))) & 0xFFu);
+    weights[idx] = scales[idx / cols] * static_cast<float>(q);
+  }
+}
+
+/**
+ * @brief Quantizes weights to int4 with a scale and zero point per group of
+ * groupSize consecutive values in a row.
+ *
+ * @param[in] weights Weights, rows * cols values
+ * @param[in] rows Number of rows (output channels)
+ * @param[in] cols Number of columns, must be a multiple of groupSize
+ * @param[in] groupSize Values per group, must be a multiple of 8
+ * @param[out] packed rows * cols / 8 packed words
+ * @param[out] scales rows * cols / groupSize scales
+ * @param[out] zeros (rows * cols / groupSize + 7) / 8 packed zero points
+ */
+inline void quantizeInt4(const float *weights, size_t rows, size_t cols,
+                         size_t groupSize, uint32_t *packed, float *scales,
+                         uint32_t *zeros) {
+  assert(groupSize % 8 == 0);
+  assert(cols % groupSize == 0);
+  const size_t nGroups = rows * cols / groupSize;
+  std::fill(zeros, zeros + (nGroups + 7) / 8, 0u);
+  for (size_t g = 0; g < nGroups; ++g) {
+    const float *group = weights + g * groupSize;
+    float minVal = 0.0f; // include 0 so that it is exactly representable
+    float maxVal = 0.0f;
+    for (size_t i = 0; i < groupSize; ++i) {
+      minVal = std::min(minVal, group[i]);
+      maxVal = std::max(maxVal, group[i]);
+    }
+    const float scale = maxVal > minVal ? (maxVal - minVal) / 15.0f : 1.0f;
+    const uint32_t zero = static_cast<uint32_t>(
+        std::min(15.0f, std::max(0.0f, std::round(-minVal / scale))));
+    scales[g] = scale;
+    zeros[g / 8] |= zero << (4 * (g % 8));
+    for (size_t i = 0; i < groupSize; i += 8) {
+      uint32_t word = 0;
+      for (size_t j = 0; j < 8; ++j) {
+        const float q = std::min(
+            15.0f, std::max(0.0f, std::round(group[i + j] / scale) + zero));
+        word |= static_cast<uint32_t>(q) << (4 * j);
+      }
+      packed[(g * groupSize + i) / 8] = word;
+    }
+  }
+}
+
+/**
+ * @brief Reconstructs float weights from int4 weights, the inverse of
+ * quantizeInt4() up to rounding.
+ */
+inline void dequantizeInt4(const uint32_t *packed, const float *scales,
+                           const uint32_t *zeros, size_t rows, size_t cols,
+                           size_t groupSize, float *weights) {
+  for (size_t idx = 0; idx < rows * cols; ++idx) {
+    const size_t g = idx / groupSize;
+    const uint32_t q = (packed[idx / 8] >> (4 * (idx % 8))) & 0xFu;
+    const uint32_t zero = (zeros[g / 8] >> (4 * (g % 8))) & 0xFu;
+    weights[idx] = scales[g] * (static_cast<float>(q) - static_cast<float>(zero));
+  }
+}
+
+#endif // QUANTIZE_H
@@ -1,8 +1,10 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
-#include <cstdio>
+#include <algorithm>
 #include <cstdarg>
+#include <cstdio>
+#include <string>
 
 namespace gpu {
 
@@ -10,58 +12,107 @@ enum LogLevel { kError = 0, kWarn = 1, kInfo = 2, kTrace = 3 };
 
 static const char *kLevelStr[] = {"error", "warn", "info", "trace"};
 
+/**
+ * @brief Compile-time minimum log level. LOG calls above it are removed at
+ * compile time, including the evaluation of their arguments. Defaults to
+ * kTrace, or to no logging at all when NDEBUG is defined. Can be set as a
+ * compiler flag, e.g. -DGPU_CPP_LOG_LEVEL=1 to keep errors and warnings in a
+ * release build.
+ */
+#ifndef GPU_CPP_LOG_LEVEL
+#ifdef NDEBUG
+#define GPU_CPP_LOG_LEVEL -1
+#else
+#define GPU_CPP_LOG_LEVEL 3
+#endif
+#endif
+
 /**
  * @brief Logger struct for logging messages.
  * stream: The stream to log to.
- * buffer: A buffer to store the formatted message.
- * level: The log level to log messages at.
+ * level: The log level to log messages at, checked at runtime.
  */
 struct Logger {
   FILE *stream;
-  char buffer[32768]; // TODO(avh): Expand as needed or fail gracefully.
   int level;
 };
 
-#ifndef NDEBUG
 /**
- * @brief Log a message to the logger. If NDEBUG is defined in a source or as a
- * compiler flag, this is a no-op.
- *
- * @param logger The logger to log to.
- * @param level The log level of the message.
- * @param message The message to log.
+ * @brief Lets GCC and clang check LOG arguments against the format string.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define GPU_CPP_PRINTF_FORMAT(fmt, args)                                       \
+  __attribute__((format(printf, fmt, args)))
+#else
+#define GPU_CPP_PRINTF_FORMAT(fmt, args)
+#endif
+
+/**
+ * @brief Formats and writes a log message, called by the LOG macro once the
+ * level checks passed. Messages are printf-style format strings.
  */
-inline void LOG(Logger& logger, int level, const char *message, ...) {
+GPU_CPP_PRINTF_FORMAT(3, 4)
+inline void logMessage(Logger &logger, int level, const char *message, ...) {
   static const char *orange = "\033[0;33m";
   static const char *red = "\033[0;31m";
   static const char *white = "\033[0;37m";
   static const char *gray = "\033[0;90m";
   static const char *reset = "\033[0m";
   static const char *logColors[] = {red, red, orange, gray};
-  if (level <= logger.level) {
-    va_list(args);
-    va_start(args, message);
-    snprintf(logger.buffer, sizeof(logger.buffer), message, args);
-    // Brackets and messages are white.
-    // Log levels are red for error and warning, orange for info, and grey for trace.
-    // Then the color is reset.
-    fprintf(logger.stream, "%s[%s%s%s] ", white, logColors[level], kLevelStr[level],
-            white);
-    vfprintf(logger.stream, message, args);
-    fprintf(logger.stream, "%s\n", reset);
-    va_end(args);
+  // Brackets and messages are white.
+  // Log levels are red for error and warning, orange for info, and grey for
+  // trace. Then the color is reset.
+  char prefix[64];
+  const int prefixSize = snprintf(prefix, sizeof(prefix), "%s[%s%s%s] ", white,
+                                  logColors[level], kLevelStr[level], white);
+  // Format into a stack buffer, with a second pass only for long messages
+  char buffer[512];
+  va_list args;
+  va_start(args, message);
+  va_list argsCopy;
+  va_copy(argsCopy, args);
+  const int messageSize =
+      std::max(vsnprintf(buffer, sizeof(buffer), message, args), 0);
+  va_end(args);
+  std::string line;
+  line.reserve(prefixSize + messageSize + 8);
+  line.append(prefix, prefixSize);
+  if (messageSize < static_cast<int>(sizeof(buffer))) {
+    line.append(buffer, messageSize);
+  } else {
+    line.resize(prefixSize + messageSize);
+    vsnprintf(&line[prefixSize], messageSize + 1, message, argsCopy);
   }
+  va_end(argsCopy);
+  line += reset;
+  line += '\n';
+  fputs(line.c_str(), logger.stream);
 }
-#else
-#define LOG(logger, level, message, ...) ((void)0)
-#endif
+
+/**
+ * @brief Logs a printf-style message to a logger if level passes both the
+ * compile-time minimum GPU_CPP_LOG_LEVEL and the runtime logger.level. The
+ * message arguments are only evaluated when the message is logged.
+ *
+ * @code
+ * LOG(kDefLog, kInfo, "Dispatching %zu workgroups", n);
+ * @endcode
+ */
+#define LOG(logger, logLevel, ...)                                             \
+  do {                                                                         \
+    if constexpr ((logLevel) <= GPU_CPP_LOG_LEVEL) {                           \
+      if ((logLevel) <= (logger).level) {                                      \
+        ::gpu::logMessage((logger), (logLevel), __VA_ARGS__);                  \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
 
 /**
  * @brief Default logger for logging messages to stdout at the info level.
  * Output stream and logging level for the default logger can be globally
  * changed on a per-program basis.
  */
-static Logger kDefLog = {stdout, "", kInfo};
+static Logger kDefLog = {stdout, kInfo};
 
 } // namespace gpu
 
@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// Compile out trace level messages, keep the others
+#define GPU_CPP_LOG_LEVEL 2
+#include "utils/logging.h"
+
+using namespace gpu;
+
+/**
+ * Benchmark of the LOG macro: messages filtered at compile time, filtered at
+ * runtime, and written.
+ */
+
+static constexpr int kN = 10000000;
+static constexpr int kNWritten = 100000;
+
+static int evaluations = 0;
+
+/**
+ * @brief Argument with a side effect, to check that filtered messages do not
+ * evaluate their arguments.
+ */
+std::string expensiveArgument() {
+  ++evaluations;
+  return std::string(64, 'x');
+}
+
+template <typename F> double nsPerCall(int n, F f) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < n; ++i) {
+    f(i);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+int main() {
+  // Line buffered like stdout on a terminal, one write per message
+  FILE *devNull = fopen("/dev/null", "w");
+  setvbuf(devNull, nullptr, _IOLBF, 4096);
+  Logger logger = {devNull, kWarn};
+  volatile int sink = 0;
+
+  const double baseline = nsPerCall(kN, [&](int i) { sink = i; });
+  const double compileTime = nsPerCall(kN, [&](int i) {
+    sink = i;
+    LOG(logger, kTrace, "%d %s", i, expensiveArgument().c_str());
+  });
+  const double runtime = nsPerCall(kN, [&](int i) {
+    sink = i;
+    LOG(logger, kInfo, "%d %s", i, expensiveArgument().c_str());
+  });
+  const double written = nsPerCall(kNWritten, [&](int i) {
+    LOG(logger, kWarn, "message %d of %d", i, kNWritten);
+  });
+
+  printf("\nLOG cost per call (ns), writing to /dev/null\n\n");
+  printf("  loop baseline                   %8.2f\n", baseline);
+  printf("  below GPU_CPP_LOG_LEVEL         %8.2f\n", compileTime);
+  printf("  below logger.level              %8.2f\n", runtime);
+  printf("  written                         %8.2f\n", written);
+  printf("\nArguments of filtered messages evaluated %d times\n\n",
+         evaluations);
+  fclose(devNull);
+  return evaluations == 0 ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdio>
+
+#ifdef GPU_CPP_TRACE
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#endif
+
+namespace gpu {
+
+/**
+ * Tracing of timestamped begin / end events, exported in the Chrome trace
+ * event (JSON) format read by chrome://tracing and https://ui.perfetto.dev.
+ *
+ * Tracing is compiled in only when GPU_CPP_TRACE is defined (e.g.
+ * -DGPU_CPP_TRACE), otherwise the GPU_TRACE_* macros expand to nothing and
+ * dumpTrace() writes no file.
+ *
+ * Each thread records into its own fixed-size ring buffer, so recording an
+ * event is a clock read and a few stores without locks or formatting. Event
+ * names must be string literals (or otherwise outlive the trace). When a
+ * buffer is full the oldest events are overwritten.
+ *
+ * @code
+ * {
+ *   GPU_TRACE_SCOPE("forward");
+ *   dispatchKernel(ctx, op, promise);
+ *   wait(ctx, future);
+ * }
+ * dumpTrace("trace.json");
+ * @endcode
+ */
+
+#ifdef GPU_CPP_TRACE
+
+/**
+ * @brief A trace event. Phases follow the Chrome trace format: 'B' / 'E'
+ * begin and end a synchronous span on the recording thread, 'b' / 'e' begin
+ * and end an asynchronous span matched by id, which may end on another
+ * thread (e.g. a GPU completion callback).
+ */
+struct TraceEvent {
+  const char *name;
+  uint64_t timestampNs;
+  uint64_t id;
+  char phase;
+};
+
+static constexpr size_t kTraceBufferSize = 1 << 16; // events per thread
+
+/**
+ * @brief Ring buffer of the events of one thread. Only the owning thread
+ * writes to it, publishing events through the head counter.
+ */
+struct TraceBuffer {
+  std::array<TraceEvent, kTraceBufferSize> events;
+  std::atomic<uint64_t> head{0}; // number of events ever recorded
+  uint32_t threadId = 0;
+};
+
+/**
+ * @brief The trace buffers of all threads that recorded events. Buffers are
+ * owned here rather than by their threads so that the events of threads that
+ * have exited are still dumped.
+ */
+struct TraceRegistry {
+  std::mutex mutex; // taken once per thread and by dumpTrace()
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+};
+
+inline TraceRegistry &traceRegistry() {
+  static TraceRegistry registry;
+  return registry;
+}
+
+/**
+ * @brief Returns the calling thread's trace buffer, registering it on the
+ * first call from the thread.
+ */
+inline TraceBuffer &threadTraceBuffer() {
+  thread_local TraceBuffer *buffer = nullptr;
+  if (buffer == nullptr) {
+    TraceRegistry &registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffers.push_back(std::make_unique<TraceBuffer>());
+    buffer = registry.buffers.back().get();
+    buffer->threadId = static_cast<uint32_t>(registry.buffers.size());
+  }
+  return *buffer;
+}
+
+/**
+ * @brief Records an event in the calling thread's ring buffer.
+ */
+inline void traceEvent(const char *name, char phase, uint64_t id = 0) {
+  TraceBuffer &buffer = threadTraceBuffer();
+  const uint64_t timestampNs =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - traceRegistry().start)
+          .count();
+  const uint64_t head = buffer.head.load(std::memory_order_relaxed);
+  buffer.events[head % kTraceBufferSize] = {name, timestampNs, id, phase};
+  buffer.head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Records a 'B' event on construction and the matching 'E' event on
+ * destruction.
+ */
+struct TraceScope {
+  const char *name;
+  inline explicit TraceScope(const char *name) : name(name) {
+    traceEvent(name, 'B');
+  }
+  inline ~TraceScope() { traceEvent(name, 'E'); }
+};
+
+#define GPU_TRACE_CONCAT_(a, b) a##b
+#define GPU_TRACE_CONCAT(a, b) GPU_TRACE_CONCAT_(a, b)
+#define GPU_TRACE_SCOPE(name)                                                  \
+  ::gpu::TraceScope GPU_TRACE_CONCAT(gpuTraceScope, __LINE__)(name)
+#define GPU_TRACE_BEGIN(name) ::gpu::traceEvent(name, 'B')
+#define GPU_TRACE_END(name) ::gpu::traceEvent(name, 'E')
+#define GPU_TRACE_ASYNC_BEGIN(name, id)                                        \
+  ::gpu::traceEvent(name, 'b', reinterpret_cast<uint64_t>(id))
+#define GPU_TRACE_ASYNC_END(name, id)                                          \
+  ::gpu::traceEvent(name, 'e', reinterpret_cast<uint64_t>(id))
+
+/**
+ * @brief Writes the recorded events of all threads to path in the Chrome
+ * trace event format. Call it while no other thread is recording, e.g. at
+ * the end of a run.
+ *
+ * @param[in] path Output file, e.g. "trace.json"
+ * @return True if the trace was written
+ *
+ * @code
+ * dumpTrace("trace.json"); // open in https://ui.perfetto.dev
+ * @endcode
+ */
+inline bool dumpTrace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == nullptr) {
+    return false;
+  }
+  TraceRegistry &registry = traceRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  bool first = true;
+  for (const std::unique_ptr<TraceBuffer> &buffer : registry.buffers) {
+    const uint64_t head = buffer->head.load(std::memory_order_acquire);
+    const uint64_t begin = head > kTraceBufferSize ? head - kTraceBufferSize : 0;
+    for (uint64_t i = begin; i < head; ++i) {
+      const TraceEvent &event = buffer->events[i % kTraceBufferSize];
+      // Timestamps are in microseconds, with nanosecond decimals
+      fprintf(file,
+              "%s\n{\"name\": \"%s\", \"cat\": \"gpu\", \"ph\": \"%c\", "
+              "\"ts\": %llu.%03llu, \"pid\": 1, \"tid\": %u",
+              first ? "" : ",", event.name, event.phase,
+              static_cast<unsigned long long>(event.timestampNs / 1000),
+              static_cast<unsigned long long>(event.timestampNs % 1000),
+              buffer->threadId);
+      if (event.phase == 'b' || event.phase == 'e') {
+        fprintf(file, ", \"id\": \"0x%llx\"",
+                static_cast<unsigned long long>(event.id));
+      }
+      fprintf(file, "}");
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}
+
+#else
+
+#define GPU_TRACE_SCOPE(name) ((void)0)
+#define GPU_TRACE_BEGIN(name) ((void)0)
+#define GPU_TRACE_END(name) ((void)0)
+#define GPU_TRACE_ASYNC_BEGIN(name, id) ((void)0)
+#define GPU_TRACE_ASYNC_END(name, id) ((void)0)
+
+inline bool dumpTrace(const char *path) {
+  fprintf(stderr, "dumpTrace(%s): tracing is disabled, build with "
+                  "-DGPU_CPP_TRACE\n",
+          path);
+  return false;
+}
+
+#endif // GPU_CPP_TRACE
+
+} // namespace gpu
+
+#endif // TRACE_H